@@ -0,0 +1,272 @@
+// parsers of the batches the esp32 sends, shared by echo.js and coap_receiver.js, and the encoder
+// bench.js and fleet.js build batches with
+
+// read a varint at pos, returns [value, next pos]
+function readVarint(buf, pos) {
+  let value = 0n;
+  for (let shift = 0n; shift < 64n; shift += 7n) {
+    if (pos >= buf.length) {
+      throw new Error('truncated varint');
+    }
+    const byte = buf[pos++];
+    value |= BigInt(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return [value, pos];
+    }
+  }
+  throw new Error('varint too long');
+}
+
+// decode one binary record (see main/frame.h), unknown fields are skipped
+function decodeFrame(buf) {
+  const record = {};
+  let pos = 0;
+  while (pos < buf.length) {
+    let key;
+    let value;
+    [key, pos] = readVarint(buf, pos);
+    [value, pos] = readVarint(buf, pos);
+    const field = Number(key >> 3n);
+    const wire = Number(key & 7n);
+    if (wire === 0) {
+      if (field === 2) record.boot = Number(value);
+      if (field === 3) record.seq = Number(value);
+      if (field === 4) record.ts = Number(value);
+    } else if (wire === 2) {
+      const end = pos + Number(value);
+      if (end > buf.length) {
+        throw new Error('truncated field');
+      }
+      if (field === 1) record.dev = buf.subarray(pos, end).toString('hex');
+      if (field === 5) record.msg = buf.subarray(pos, end).toString();
+      pos = end;
+    } else {
+      throw new Error(`unknown wire type ${wire}`);
+    }
+  }
+  return record;
+}
+
+// a varint of a non-negative number below 2^53
+function writeVarint(value) {
+  const bytes = [];
+  do {
+    let byte = value % 128;
+    value = Math.floor(value / 128);
+    if (value > 0) byte |= 0x80;
+    bytes.push(byte);
+  } while (value > 0);
+  return Buffer.from(bytes);
+}
+
+// field key of main/frame.h, wire type 0 is a varint, 2 is length delimited
+function writeField(number, wire, value) {
+  const key = writeVarint(number * 8 + wire);
+  if (wire === 0) {
+    return Buffer.concat([key, writeVarint(value)]);
+  }
+  return Buffer.concat([key, writeVarint(value.length), value]);
+}
+
+// encode a record like main/frame.c (dev a Buffer, msg a string), length prefixed like in a batch
+function encodeFrame(record) {
+  const frame = Buffer.concat([
+    writeField(1, 2, record.dev),
+    writeField(2, 0, record.boot),
+    writeField(3, 0, record.seq),
+    writeField(4, 0, record.ts),
+    writeField(5, 2, Buffer.from(record.msg)),
+  ]);
+  return Buffer.concat([writeVarint(frame.length), frame]);
+}
+
+// the next varint length prefixed binary record at pos, returns [record or null, next pos],
+// or null if buf ends before the record does
+function nextFrame(buf, pos) {
+  let len = 0;
+  for (let shift = 0; shift < 35; shift += 7) {
+    if (pos >= buf.length) {
+      return null;
+    }
+    const byte = buf[pos++];
+    len += (byte & 0x7f) * 2 ** shift;
+    if (!(byte & 0x80)) {
+      const end = pos + len;
+      return end > buf.length ? null : [buf.subarray(pos, end), end];
+    }
+  }
+  throw new Error('record length too long');
+}
+
+// the next newline terminated record at pos, empty lines are skipped
+function nextLine(buf, pos) {
+  const end = buf.indexOf(0x0a, pos);
+  if (end < 0) {
+    return null;
+  }
+  return [end > pos ? buf.subarray(pos, end) : null, end + 1];
+}
+
+// how the records of a batch are delimited and decoded, by content type
+// rest is what is left at the end of the body, it has to be a complete record (or nothing)
+const batchFormats = {
+  'application/x-ndjson': {
+    next: nextLine,
+    decode: (buf) => JSON.parse(buf.toString()),
+    rest: (buf) => buf,
+  },
+  'application/x-esp-frames': {
+    next: nextFrame,
+    decode: decodeFrame,
+    rest: () => {
+      throw new Error('truncated record');
+    },
+  },
+};
+
+// decode the complete records in buf, returns them with the offset of the first incomplete one
+function takeRecords(format, buf) {
+  const records = [];
+  let pos = 0;
+  let next;
+  while ((next = format.next(buf, pos)) !== null) {
+    const record = next[0];
+    pos = next[1];
+    if (record) {
+      records.push(format.decode(record));
+    }
+  }
+  return [records, pos];
+}
+
+// end a body with the left over bytes, returns the last record (if any)
+function restRecords(format, rest) {
+  return rest.length > 0 ? [format.decode(format.rest(rest))] : [];
+}
+
+// split a whole batch into its records
+function splitRecords(format, body) {
+  const [records, pos] = takeRecords(format, body);
+  return records.concat(restRecords(format, body.subarray(pos)));
+}
+
+// yield the records of a batch as its chunks arrive, only an incomplete record is kept between chunks
+// the records come in arrays, one per chunk, an await per record would cost more than decoding it
+async function* streamRecords(format, chunks) {
+  let pending = Buffer.alloc(0);
+  for await (const chunk of chunks) {
+    pending = pending.length > 0 ? Buffer.concat([pending, chunk]) : chunk;
+    const [records, pos] = takeRecords(format, pending);
+    yield records;
+    pending = pending.subarray(pos);
+  }
+  yield restRecords(format, pending);
+}
+
+// seq numbers of one device boot that were seen already: all up to floor, and the ones above it
+class SeqWindow {
+  constructor() {
+    this.floor = 0;
+    this.above = new Set();
+  }
+
+  // remember seq, returns false if it was seen before
+  add(seq) {
+    if (seq <= this.floor || this.above.has(seq)) {
+      return false;
+    }
+    this.above.add(seq);
+    while (this.above.delete(this.floor + 1)) {
+      this.floor++;
+    }
+    // a gap that never fills (a record that was lost for good) mustn't grow the set forever
+    if (this.above.size > SeqWindow.MAX_ABOVE) {
+      this.floor = Math.min(...this.above);
+      this.above.delete(this.floor);
+    }
+    return true;
+  }
+}
+SeqWindow.MAX_ABOVE = 1024;
+
+// drops records that were received before, by device, boot and seq
+// the windows are kept in memory, so an instance only knows the records it got itself
+class Deduplicator {
+  constructor(maxStreams = 10000) {
+    this.maxStreams = maxStreams;
+    this.windows = new Map();
+  }
+
+  // returns false if the record is a retransmission, records without seq always pass
+  add(record) {
+    if (record.dev === undefined || record.seq === undefined) {
+      return true;
+    }
+    const key = `${record.dev}/${record.boot}`;
+    let window = this.windows.get(key);
+    if (window) {
+      // keep the map in order of last use, so the least recently heard from boot is forgotten first
+      this.windows.delete(key);
+    } else {
+      window = new SeqWindow();
+      if (this.windows.size >= this.maxStreams) {
+        this.windows.delete(this.windows.keys().next().value);
+      }
+    }
+    this.windows.set(key, window);
+    return window.add(record.seq);
+  }
+}
+
+// collects the seq numbers of a batch for the response
+class Acks {
+  constructor() {
+    this.seqs = new Map();
+    this.count = 0;
+    this.duplicates = 0;
+  }
+
+  add(record, duplicate) {
+    this.count++;
+    if (duplicate) {
+      this.duplicates++;
+    }
+    if (record.seq === undefined) {
+      return;
+    }
+    const key = `${record.dev}/${record.boot}`;
+    if (!this.seqs.has(key)) {
+      this.seqs.set(key, []);
+    }
+    this.seqs.get(key).push(record.seq);
+  }
+
+  // e.g. "Ack 3: a1b2c3/77:12-13,15 dup 1", seq ranges per device boot, duplicates are acknowledged as well
+  toString() {
+    const streams = [];
+    for (const [key, seqs] of this.seqs) {
+      seqs.sort((a, b) => a - b);
+      const ranges = [];
+      for (let i = 0; i < seqs.length; i++) {
+        const first = seqs[i];
+        while (i + 1 < seqs.length && seqs[i + 1] <= seqs[i] + 1) {
+          i++;
+        }
+        ranges.push(first === seqs[i] ? `${first}` : `${first}-${seqs[i]}`);
+      }
+      streams.push(`${key}:${ranges.join(',')}`);
+    }
+    let text = `Ack ${this.count}`;
+    if (streams.length > 0) {
+      text += `: ${streams.join(' ')}`;
+    }
+    if (this.duplicates > 0) {
+      text += ` dup ${this.duplicates}`;
+    }
+    return text;
+  }
+}
+
+module.exports = {
+  batchFormats, splitRecords, streamRecords, readVarint, writeVarint, encodeFrame, Deduplicator, Acks,
+};
@@ -0,0 +1,234 @@
+// local load test of the ingest endpoints, like autocannon: keeps connections busy with batch posts and
+// reports records/s, latency percentiles and the memory the server needs per request in flight
+// usage: node bench.js [--targets ingest,buffered,echo] [--connections 20] [--duration 10]
+//                      [--records 8,2000,20000] [--compress 1]
+// ingest is ingest_server.js, buffered the same handler behind a server that reads the whole body first
+// like functions-framework does, echo is the cloud function itself (skipped if functions-framework isn't
+// installed); every target runs in a child process of its own, which samples its memory while it serves
+const http = require('http');
+const zlib = require('zlib');
+const { fork } = require('child_process');
+const { encodeFrame } = require('./batch');
+
+function parseArgs(argv) {
+  const options = {
+    targets: ['ingest', 'buffered', 'echo'],
+    connections: 20,
+    duration: 10,
+    records: [8, 2000, 20000],
+    compress: 1,
+  };
+  for (let i = 0; i < argv.length; i++) {
+    const name = argv[i].slice(2);
+    if (!argv[i].startsWith('--') || !(name in options)) {
+      throw new Error(`unknown option ${argv[i]}`);
+    }
+    const value = argv[++i];
+    options[name] = Array.isArray(options[name]) ? value.split(',').map((v) => (name === 'records' ? Number(v) : v)) : Number(value);
+  }
+  return options;
+}
+
+// --- the server side, in the child process
+
+const MEMORY_SAMPLE_MS = 10;
+
+function memory() {
+  const m = process.memoryUsage();
+  // bodies are buffers, which live outside of the js heap
+  return { rss: m.rss, heap: m.heapUsed, buffers: m.arrayBuffers };
+}
+
+// ingest_server.js, but with the body read and inflated as a whole before it is parsed
+function bufferedServer() {
+  const { batchFormats } = require('./batch');
+  const { ingestBatch } = require('./ingest');
+  return http.createServer((req, res) => {
+    const chunks = [];
+    req.on('data', (chunk) => chunks.push(chunk));
+    req.on('end', async () => {
+      let body = Buffer.concat(chunks);
+      if (req.headers['content-encoding'] === 'deflate') {
+        body = zlib.inflateSync(body);
+      }
+      const format = batchFormats[req.headers['content-type']];
+      const { status, text } = await ingestBatch(format, [body], (name) => req.headers[name.toLowerCase()]);
+      res.writeHead(status, { 'Content-Type': 'text/plain' });
+      res.end(text);
+    });
+  });
+}
+
+function serve(target) {
+  // printing every message would be most of the work, for both targets alike
+  console.log = () => {};
+  let server;
+  try {
+    if (target === 'echo') {
+      require('./echo');
+      server = require('@google-cloud/functions-framework/testing').getTestServer('echoRequest');
+    } else if (target === 'buffered') {
+      server = bufferedServer();
+    } else {
+      server = require('./ingest_server').createServer();
+    }
+  } catch (err) {
+    process.send({ error: err.message.split('\n')[0] });
+    return;
+  }
+  let baseline;
+  let peak;
+  let timer;
+  process.on('message', (message) => {
+    if (message === 'start') {
+      global.gc();
+      baseline = memory();
+      peak = { ...baseline };
+      timer = setInterval(() => {
+        const now = memory();
+        peak.rss = Math.max(peak.rss, now.rss);
+        peak.heap = Math.max(peak.heap, now.heap);
+        peak.buffers = Math.max(peak.buffers, now.buffers);
+      }, MEMORY_SAMPLE_MS);
+    } else if (message === 'stop') {
+      clearInterval(timer);
+      process.send({ baseline, peak });
+      process.exit(0);
+    }
+  });
+  server.listen(0, '127.0.0.1', () => process.send({ port: server.address().port }));
+}
+
+// --- the clients
+
+// a batch of binary records of one device, seqs first to first + count - 1
+function batch(device, first, count) {
+  const records = [];
+  for (let seq = first; seq < first + count; seq++) {
+    records.push(encodeFrame({
+      dev: device, boot: 1, seq, ts: seq * 10, msg: `temp=${20 + (seq % 10)}.${seq % 7}`,
+    }));
+  }
+  return Buffer.concat(records);
+}
+
+function post(agent, port, body, headers) {
+  return new Promise((resolve, reject) => {
+    const req = http.request({
+      host: '127.0.0.1', port, method: 'POST', agent, headers: { ...headers, 'Content-Length': body.length },
+    }, (res) => {
+      res.resume();
+      res.on('end', () => resolve(res.statusCode));
+      res.on('error', reject);
+    });
+    req.on('error', reject);
+    req.end(body);
+  });
+}
+
+// one connection posting the batches of its own device back to back until end
+async function connection(index, port, options, records, end, stats) {
+  const agent = new http.Agent({ keepAlive: true, maxSockets: 1 });
+  const device = Buffer.from([0xbe, 0x9c, 0, 0, index >> 8, index & 0xff]);
+  let seq = 1;
+  while (Date.now() < end) {
+    let body = batch(device, seq, records);
+    const headers = { 'Content-Type': 'application/x-esp-frames' };
+    if (options.compress) {
+      body = zlib.deflateSync(body);
+      headers['Content-Encoding'] = 'deflate';
+    }
+    const started = process.hrtime.bigint();
+    try {
+      const status = await post(agent, port, body, headers);
+      stats.latencies.push(Number(process.hrtime.bigint() - started) / 1e6);
+      if (status === 200) {
+        stats.requests++;
+        stats.records += records;
+      } else {
+        stats.errors++;
+      }
+    } catch (err) {
+      stats.errors++;
+    }
+    stats.bytes += body.length;
+    seq += records;
+  }
+  agent.destroy();
+}
+
+function percentile(sorted, p) {
+  if (sorted.length === 0) return NaN;
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+const KIB = 1024;
+
+// start a server for target, returns its child process and port (null if it can't run here)
+function startServer(target) {
+  const child = fork(__filename, ['--serve', target], { execArgv: ['--expose-gc'] });
+  return new Promise((resolve) => {
+    child.once('message', (message) => {
+      if (message.error) {
+        console.log(`${target.padEnd(8)} skipped: ${message.error}`);
+        resolve(null);
+      } else {
+        resolve({ child, port: message.port });
+      }
+    });
+  });
+}
+
+async function run(target, records, options) {
+  const server = await startServer(target);
+  if (!server) {
+    return;
+  }
+  const stats = {
+    requests: 0, records: 0, bytes: 0, errors: 0, latencies: [],
+  };
+  server.child.send('start');
+  const started = Date.now();
+  const end = started + options.duration * 1000;
+  const clients = [];
+  for (let i = 0; i < options.connections; i++) {
+    clients.push(connection(i, server.port, options, records, end, stats));
+  }
+  await Promise.all(clients);
+  const seconds = (Date.now() - started) / 1000;
+  server.child.send('stop');
+  const { baseline, peak } = await new Promise((resolve) => server.child.once('message', resolve));
+  const sorted = stats.latencies.sort((a, b) => a - b);
+  console.log([
+    `${target.padEnd(8)} ${String(records).padStart(5)} records/batch`,
+    `${(stats.records / seconds).toFixed(0).padStart(8)} records/s`,
+    `${(stats.requests / seconds).toFixed(0).padStart(6)} req/s`,
+    `${(stats.bytes / stats.latencies.length / KIB).toFixed(1).padStart(6)} KiB/req`,
+    `p50 ${percentile(sorted, 0.5).toFixed(1)}ms p99 ${percentile(sorted, 0.99).toFixed(1)}ms`,
+    // every connection has a request in flight all the time
+    `heap +${((peak.heap - baseline.heap) / options.connections / KIB).toFixed(0).padStart(5)} KiB/req`,
+    `buffers +${((peak.buffers - baseline.buffers) / options.connections / KIB).toFixed(0).padStart(5)} KiB/req`,
+    `rss peak ${(peak.rss / KIB / KIB).toFixed(0)} MiB`,
+    `errors ${stats.errors}`,
+  ].join('  '));
+}
+
+async function main() {
+  const options = parseArgs(process.argv.slice(2));
+  console.log(`${options.connections} connections, ${options.duration}s per run, `
+    + `${options.compress ? 'deflated' : 'uncompressed'} binary batches, heap is the peak above idle per request in flight`);
+  for (const records of options.records) {
+    for (const target of options.targets) {
+      await run(target, records, options);
+    }
+  }
+}
+
+if (process.argv[2] === '--serve') {
+  serve(process.argv[3]);
+} else {
+  main().catch((err) => {
+    console.error(err);
+    process.exit(1);
+  });
+}
@@ -0,0 +1,136 @@
+// local receiver for the coap transport of the esp32 (see main/transport_coap.c), answers like echo.js
+// usage: node coap_receiver.js [port]
+const dgram = require('dgram');
+const {
+  batchFormats, splitRecords, Deduplicator, Acks,
+} = require('./batch');
+
+const PORT = Number(process.argv[2] || 5683);
+
+const TYPE_CON = 0;
+const TYPE_ACK = 2;
+const CODE_POST = 0x02;
+const OPTION_URI_PATH = 11;
+// response codes, class << 5 | detail
+const CODE_CHANGED = (2 << 5) | 4;
+const CODE_BAD_REQUEST = (4 << 5) | 0;
+const CODE_NOT_FOUND = (4 << 5) | 4;
+const CODE_METHOD_NOT_ALLOWED = (4 << 5) | 5;
+
+// the resources the esp32 posts to, by batch format
+const resources = {
+  frames: batchFormats['application/x-esp-frames'],
+  ndjson: batchFormats['application/x-ndjson'],
+};
+
+// records seen so far, like in echo.js
+const seen = new Deduplicator();
+
+// answers to recently seen confirmable messages, so retransmissions aren't processed twice
+const EXCHANGE_LIFETIME_MS = 247000;
+const answered = new Map();
+
+// read the extended delta or length of an option nibble, returns [value, next pos]
+function optionValue(nibble, buf, pos) {
+  if (nibble < 13) return [nibble, pos];
+  if (nibble === 13) return [13 + buf[pos], pos + 1];
+  if (nibble === 14) return [269 + buf.readUInt16BE(pos), pos + 2];
+  throw new Error('invalid option');
+}
+
+function parseMessage(buf) {
+  if (buf.length < 4 || buf[0] >> 6 !== 1) {
+    throw new Error('not a coap message');
+  }
+  const tokenLength = buf[0] & 0x0f;
+  const message = {
+    type: (buf[0] >> 4) & 0x03,
+    code: buf[1],
+    id: buf.readUInt16BE(2),
+    token: buf.subarray(4, 4 + tokenLength),
+    path: [],
+    payload: Buffer.alloc(0),
+  };
+  let pos = 4 + tokenLength;
+  let number = 0;
+  while (pos < buf.length && buf[pos] !== 0xff) {
+    const head = buf[pos++];
+    let delta;
+    let length;
+    [delta, pos] = optionValue(head >> 4, buf, pos);
+    [length, pos] = optionValue(head & 0x0f, buf, pos);
+    number += delta;
+    if (pos + length > buf.length) {
+      throw new Error('truncated option');
+    }
+    if (number === OPTION_URI_PATH) {
+      message.path.push(buf.subarray(pos, pos + length).toString());
+    }
+    pos += length;
+  }
+  if (pos < buf.length) {
+    message.payload = buf.subarray(pos + 1);
+  }
+  return message;
+}
+
+// piggybacked response in the ack of a confirmable request
+function response(request, code, text) {
+  const head = Buffer.from([(1 << 6) | (TYPE_ACK << 4) | request.token.length, code, request.id >> 8, request.id & 0xff]);
+  return Buffer.concat([head, request.token, Buffer.from([0xff]), Buffer.from(text)]);
+}
+
+function handle(request) {
+  if (request.code !== CODE_POST) {
+    return response(request, CODE_METHOD_NOT_ALLOWED, 'Only POST is supported');
+  }
+  const format = resources[request.path.join('/')];
+  if (!format) {
+    return response(request, CODE_NOT_FOUND, `Unknown resource ${request.path.join('/')}`);
+  }
+  let records;
+  try {
+    records = splitRecords(format, request.payload);
+  } catch (err) {
+    return response(request, CODE_BAD_REQUEST, `Invalid batch: ${err.message}`);
+  }
+  const acks = new Acks();
+  for (const r of records) {
+    const fresh = seen.add(r);
+    if (fresh) {
+      console.log(`Message ${r.dev}/${r.boot}/${r.seq} at ${r.ts}: ${r.msg}`);
+    }
+    acks.add(r, !fresh);
+  }
+  return response(request, CODE_CHANGED, `${acks}`);
+}
+
+const socket = dgram.createSocket('udp4');
+
+socket.on('message', (buf, remote) => {
+  let request;
+  try {
+    request = parseMessage(buf);
+  } catch (err) {
+    console.log(`Ignoring datagram from ${remote.address}: ${err.message}`);
+    return;
+  }
+  // the esp32 only sends confirmable requests, everything else needs no answer
+  if (request.type !== TYPE_CON) {
+    return;
+  }
+  const key = `${remote.address}:${remote.port}/${request.id}`;
+  let answer = answered.get(key);
+  if (answer) {
+    console.log(`Retransmission ${request.id} from ${remote.address}`);
+  } else {
+    answer = handle(request);
+    console.log(`Datagram of ${buf.length} bytes from ${remote.address}, ${request.payload.length} bytes payload`);
+    answered.set(key, answer);
+    setTimeout(() => answered.delete(key), EXCHANGE_LIFETIME_MS).unref();
+  }
+  socket.send(answer, remote.port, remote.address);
+});
+
+socket.on('listening', () => console.log(`Listening for coap on udp port ${socket.address().port}`));
+socket.bind(PORT);
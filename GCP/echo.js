@@ -1,7 +1,17 @@
 const functions = require('@google-cloud/functions-framework');
+const { batchFormats } = require('./batch');
+const { ingestBatch } = require('./ingest');
 
-functions.http('echoRequest', (req, res) => {
-  if (req.get('Content-Type') === 'application/json') {
+functions.http('echoRequest', async (req, res) => {
+  const format = batchFormats[req.get('Content-Type')];
+  if (format) {
+    // batch of messages sent by the esp32
+    // functions-framework reads every body before the function runs (types it doesn't parse end up
+    // in req.rawBody) and inflates it, so the batch arrives here as one decompressed chunk
+    // ingest_server.js handles the same batches while they stream in
+    const { status, text } = await ingestBatch(format, [req.rawBody], (name) => req.get(name));
+    res.status(status).send(text);
+  } else if (req.get('Content-Type') === 'application/json') {
     // parse received json body to string
     res.send(`Echo: ${JSON.stringify(req.body)}`);
   } else if (req.get('Content-Type') === 'text/plain') {
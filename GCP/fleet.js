@@ -0,0 +1,277 @@
+// simulates a fleet of esp32s posting to the uplink endpoint, to see where it saturates
+// usage: node fleet.js [url] [--devices 10,100,1000] [--step 30] [--interval 1000] [--batch 8]
+//                      [--drop-every 10] [--drop-fraction 0.2] [--offline 2000]
+// every device behaves like main/uplink.c and main/transport_http.c: one kept-alive connection, batches of
+// binary records (deflate compressed from 256 bytes on), an X-Latency header once a minute, one retry
+// on a fresh connection, and failed batches kept (like the spool) and sent again first
+const http = require('http');
+const https = require('https');
+const crypto = require('crypto');
+const zlib = require('zlib');
+const { writeVarint, encodeFrame } = require('./batch');
+
+function parseArgs(argv) {
+  const options = {
+    url: 'http://localhost:8080/',
+    devices: [10, 100, 1000],
+    step: 30,
+    interval: 1000,
+    batch: 8,
+    dropEvery: 10,
+    dropFraction: 0.2,
+    offline: 2000,
+  };
+  for (let i = 0; i < argv.length; i++) {
+    const arg = argv[i];
+    if (!arg.startsWith('--')) {
+      options.url = arg;
+      continue;
+    }
+    const name = arg.slice(2).replace(/-(\w)/g, (_, c) => c.toUpperCase());
+    if (!(name in options)) {
+      throw new Error(`unknown option ${arg}`);
+    }
+    const value = argv[++i];
+    options[name] = name === 'devices' ? value.split(',').map(Number) : Number(value);
+  }
+  return options;
+}
+
+const options = parseArgs(process.argv.slice(2));
+const target = new URL(options.url);
+const client = target.protocol === 'https:' ? https : http;
+
+// like UPLINK_COMPRESS_MIN_BYTES, UPLINK_COMPRESS_MAX_BYTES and UPLINK_LATENCY_REPORT_MS
+const COMPRESS_MIN_BYTES = 256;
+const COMPRESS_MAX_BYTES = 4096;
+const LATENCY_REPORT_MS = 60000;
+const MAX_ATTEMPTS = 2;
+const TIMEOUT_MS = 10000;
+// like the spool, batches that failed wait here, the oldest are dropped first
+const SPOOL_BATCHES = 32;
+const LATENCY_STAGES = 7;
+const LATENCY_TOTAL = 6;
+const LATENCY_BUCKETS = 16;
+
+// one binary record of the device, length prefixed like in a batch
+function frame(device, seq, msg) {
+  return encodeFrame({
+    dev: device.id, boot: device.boot, seq, ts: Date.now() - device.bootedAt, msg,
+  });
+}
+
+// power of two ms buckets of main/latency.c, the last one is open
+function bucket(ms) {
+  let b = 0;
+  while (b < LATENCY_BUCKETS - 1 && ms > 2 ** b) b++;
+  return b;
+}
+
+// the histograms as hex of varints (see latency_encode), the simulator only measures the total
+function encodeLatency(hist) {
+  const parts = [];
+  for (let stage = 0; stage < LATENCY_STAGES; stage++) {
+    const h = stage === LATENCY_TOTAL ? hist : { count: 0, max: 0, buckets: new Array(LATENCY_BUCKETS).fill(0) };
+    parts.push(writeVarint(h.count), writeVarint(h.max), ...h.buckets.map((b) => writeVarint(b)));
+  }
+  return Buffer.concat(parts).toString('hex');
+}
+
+// results of the current step, over all devices
+let stats;
+function resetStats() {
+  stats = {
+    started: Date.now(), requests: 0, records: 0, bytes: 0, latencies: [],
+    statusErrors: 0, networkErrors: 0, retries: 0, duplicates: 0, spoolDrops: 0,
+  };
+}
+
+class Device {
+  constructor(index) {
+    this.index = index;
+    this.id = crypto.randomBytes(6);
+    this.boot = crypto.randomInt(2 ** 31);
+    this.bootedAt = Date.now();
+    this.seq = 0;
+    this.spool = [];
+    this.hist = { count: 0, max: 0, buckets: new Array(LATENCY_BUCKETS).fill(0) };
+    this.reportedAt = -Infinity;
+    this.online = true;
+    this.stopped = false;
+    this.agent = this.newAgent();
+  }
+
+  // the esp32 keeps one connection open
+  newAgent() {
+    return new client.Agent({ keepAlive: true, maxSockets: 1 });
+  }
+
+  start() {
+    // spread the first posts over an interval, so the devices don't all post in lockstep
+    this.timer = setTimeout(() => this.tick(), Math.random() * options.interval);
+  }
+
+  stop() {
+    this.stopped = true;
+    clearTimeout(this.timer);
+    this.agent.destroy();
+  }
+
+  // wifi loss: the connection is gone, the device comes back (with everyone else) after offline ms
+  drop() {
+    this.online = false;
+    this.agent.destroy();
+    this.agent = this.newAgent();
+    setTimeout(() => {
+      this.online = true;
+    }, options.offline);
+  }
+
+  async tick() {
+    const records = [];
+    for (let i = 0; i < options.batch; i++) {
+      records.push(frame(this, ++this.seq, `device ${this.index} message ${this.seq}`));
+    }
+    this.spool.push({ body: Buffer.concat(records), count: records.length });
+    if (this.spool.length > SPOOL_BATCHES) {
+      this.spool.shift();
+      stats.spoolDrops++;
+    }
+    // like the uplink task, spooled batches are sent first and the rest waits for the next round on failure
+    while (this.online && !this.stopped && this.spool.length > 0) {
+      if (!await this.post(this.spool[0])) {
+        break;
+      }
+      this.spool.shift();
+    }
+    if (!this.stopped) {
+      this.timer = setTimeout(() => this.tick(), options.interval);
+    }
+  }
+
+  async post(batch) {
+    let body = batch.body;
+    const headers = { 'Content-Type': 'application/x-esp-frames' };
+    if (body.length >= COMPRESS_MIN_BYTES && body.length <= COMPRESS_MAX_BYTES) {
+      const compressed = zlib.deflateSync(body);
+      if (compressed.length < body.length) {
+        body = compressed;
+        headers['Content-Encoding'] = 'deflate';
+      }
+    }
+    const reporting = Date.now() - this.reportedAt >= LATENCY_REPORT_MS;
+    if (reporting) {
+      headers['X-Latency'] = encodeLatency(this.hist);
+    }
+    for (let attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+      if (!this.online) {
+        return false;
+      }
+      if (attempt > 0) {
+        stats.retries++;
+        this.agent.destroy();
+        this.agent = this.newAgent();
+      }
+      const started = Date.now();
+      let response;
+      try {
+        response = await this.request(body, headers);
+      } catch (err) {
+        stats.networkErrors++;
+        continue;
+      }
+      const ms = Date.now() - started;
+      stats.requests++;
+      stats.bytes += body.length;
+      stats.latencies.push(ms);
+      this.hist.count++;
+      this.hist.max = Math.max(this.hist.max, ms);
+      this.hist.buckets[bucket(ms)]++;
+      if (reporting) {
+        this.reportedAt = Date.now();
+      }
+      if (response.status < 200 || response.status >= 300) {
+        // the device counts a batch as sent once there is a response, whatever its status
+        stats.statusErrors++;
+      } else {
+        stats.records += batch.count;
+        const dup = / dup (\d+)/.exec(response.text);
+        if (dup) stats.duplicates += Number(dup[1]);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  request(body, headers) {
+    return new Promise((resolve, reject) => {
+      const req = client.request(target, {
+        method: 'POST',
+        agent: this.agent,
+        timeout: TIMEOUT_MS,
+        headers: { ...headers, 'Content-Length': body.length },
+      }, (res) => {
+        const chunks = [];
+        res.on('data', (chunk) => chunks.push(chunk));
+        res.on('end', () => resolve({ status: res.statusCode, text: Buffer.concat(chunks).toString() }));
+        res.on('error', reject);
+      });
+      req.on('timeout', () => req.destroy(new Error('timeout')));
+      req.on('error', reject);
+      req.end(body);
+    });
+  }
+}
+
+function percentile(sorted, p) {
+  if (sorted.length === 0) return NaN;
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function report(count) {
+  const seconds = (Date.now() - stats.started) / 1000;
+  const sorted = stats.latencies.sort((a, b) => a - b);
+  const attempts = stats.requests + stats.networkErrors;
+  const errorRate = attempts > 0 ? (stats.statusErrors + stats.networkErrors) / attempts : 0;
+  console.log([
+    `${String(count).padStart(6)} devices`,
+    `${(stats.requests / seconds).toFixed(1).padStart(8)} req/s`,
+    `${(stats.records / seconds).toFixed(1).padStart(9)} records/s`,
+    `${(stats.bytes / seconds / 1024).toFixed(1).padStart(8)} KiB/s`,
+    `p50 ${percentile(sorted, 0.5)}ms p90 ${percentile(sorted, 0.9)}ms p99 ${percentile(sorted, 0.99)}ms max ${sorted[sorted.length - 1]}ms`,
+    `errors ${(errorRate * 100).toFixed(2)}% (${stats.statusErrors} status, ${stats.networkErrors} network)`,
+    `retries ${stats.retries} dup ${stats.duplicates} spool drops ${stats.spoolDrops}`,
+  ].join('  '));
+}
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+async function main() {
+  console.log(`Simulating up to ${Math.max(...options.devices)} devices against ${target.href}, `
+    + `${options.step}s per step, a batch of ${options.batch} records every ${options.interval}ms`);
+  const devices = [];
+  for (const count of options.devices) {
+    while (devices.length < count) {
+      const device = new Device(devices.length);
+      devices.push(device);
+      device.start();
+    }
+    resetStats();
+    const stepEnd = Date.now() + options.step * 1000;
+    while (Date.now() < stepEnd) {
+      const wait = Math.min(stepEnd - Date.now(), options.dropEvery > 0 ? options.dropEvery * 1000 : Infinity);
+      await sleep(wait);
+      if (options.dropEvery > 0 && Date.now() < stepEnd) {
+        // a reconnect storm: the dropped devices all come back at the same time
+        devices.filter(() => Math.random() < options.dropFraction).forEach((d) => d.drop());
+      }
+    }
+    report(count);
+  }
+  devices.forEach((d) => d.stop());
+}
+
+main().catch((err) => {
+  console.error(err);
+  process.exit(1);
+});
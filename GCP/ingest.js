@@ -0,0 +1,135 @@
+// handling of the batches the esp32 posts, shared by echo.js and ingest_server.js
+const { streamRecords, readVarint, Deduplicator, Acks } = require('./batch');
+
+// stages of the latency histograms, in the order of latency_stage_t (see main/latency.h)
+const latencyStages = ['queue', 'device', 'wifi', 'connect', 'request', 'response', 'total'];
+const LATENCY_BUCKETS = 16;
+
+// upper bound of a bucket in ms, the last one is open
+function bucketLimit(bucket) {
+  return bucket === LATENCY_BUCKETS - 1 ? Infinity : 2 ** bucket;
+}
+
+// decode the latency histograms some posts carry in the X-Latency header (hex of varints)
+function decodeLatency(hex) {
+  const buf = Buffer.from(hex, 'hex');
+  let pos = 0;
+  const next = () => {
+    let value;
+    [value, pos] = readVarint(buf, pos);
+    return Number(value);
+  };
+  const stages = {};
+  for (const stage of latencyStages) {
+    if (pos >= buf.length) {
+      break;
+    }
+    const count = next();
+    const max = next();
+    const buckets = [];
+    for (let b = 0; b < LATENCY_BUCKETS; b++) {
+      buckets.push(next());
+    }
+    stages[stage] = { count, max, buckets };
+  }
+  return stages;
+}
+
+// upper bound of the bucket the p-th quantile falls into
+function percentile({ count, buckets }, p) {
+  let seen = 0;
+  for (let b = 0; b < buckets.length; b++) {
+    seen += buckets[b];
+    if (seen >= count * p) {
+      return bucketLimit(b);
+    }
+  }
+  return Infinity;
+}
+
+function logLatency(hex) {
+  let stages;
+  try {
+    stages = decodeLatency(hex);
+  } catch (err) {
+    console.log(`Invalid latency report: ${err.message}`);
+    return;
+  }
+  for (const [stage, hist] of Object.entries(stages)) {
+    if (hist.count > 0) {
+      console.log(`Latency ${stage}: n=${hist.count} p50<=${percentile(hist, 0.5)}ms `
+        + `p90<=${percentile(hist, 0.9)}ms p99<=${percentile(hist, 0.99)}ms max=${hist.max}ms`);
+    }
+  }
+}
+
+// stages of the memory minima, in the order of memstat_stage_t (see main/memstat.h)
+const memoryStages = ['ble write', 'wifi connect', 'tls handshake', 'post'];
+
+// decode the memory minima some posts carry in the X-Memory header (hex of varints)
+function decodeMemory(hex) {
+  const buf = Buffer.from(hex, 'hex');
+  let pos = 0;
+  const next = () => {
+    let value;
+    [value, pos] = readVarint(buf, pos);
+    return Number(value);
+  };
+  const stages = {};
+  for (const stage of memoryStages) {
+    stages[stage] = {
+      samples: next(), free: next(), largest: next(), stack: next(), newLows: next(),
+    };
+  }
+  return { stages, lowest: next() };
+}
+
+function logMemory(hex) {
+  let memory;
+  try {
+    memory = decodeMemory(hex);
+  } catch (err) {
+    console.log(`Invalid memory report: ${err.message}`);
+    return;
+  }
+  for (const [stage, m] of Object.entries(memory.stages)) {
+    if (m.samples > 0) {
+      console.log(`Memory ${stage}: n=${m.samples} free>=${m.free} largest block>=${m.largest} `
+        + `stack left>=${m.stack} new lows=${m.newLows}`);
+    }
+  }
+  console.log(`Memory lowest free heap since boot: ${memory.lowest}`);
+}
+
+// records seen by this instance, a retried batch is acknowledged again but not processed twice
+const seen = new Deduplicator();
+
+// handle a batch record by record as its (decompressed) chunks arrive, header(name) gives a request header
+// returns the status and text of the response
+async function ingestBatch(format, chunks, header) {
+  const acks = new Acks();
+  try {
+    for await (const records of streamRecords(format, chunks)) {
+      for (const r of records) {
+        const fresh = seen.add(r);
+        if (fresh) {
+          console.log(`Message ${r.dev}/${r.boot}/${r.seq} at ${r.ts}: ${r.msg}`);
+        }
+        acks.add(r, !fresh);
+      }
+    }
+  } catch (err) {
+    // the records of the chunks before the error are kept, the device can send the batch again
+    return { status: 400, text: `Invalid batch: ${err.message}; ${acks}` };
+  }
+  console.log(`Batch of ${acks.count} messages (${acks.duplicates} duplicates), ${header('Content-Length') || 'chunked'} bytes body`);
+  if (header('X-Latency')) {
+    logLatency(header('X-Latency'));
+  }
+  if (header('X-Memory')) {
+    logMemory(header('X-Memory'));
+  }
+  return { status: 200, text: `${acks}` };
+}
+
+module.exports = { ingestBatch };
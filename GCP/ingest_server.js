@@ -0,0 +1,71 @@
+// ingest endpoint for the batches of the esp32 on a plain http server, answers like echo.js but parses
+// the records while the body streams in, so a request only holds the chunk it is at
+// usage: node ingest_server.js [port]
+const http = require('http');
+const zlib = require('zlib');
+const { batchFormats } = require('./batch');
+const { ingestBatch } = require('./ingest');
+
+// decoders for the Content-Encoding of the body
+const decoders = {
+  deflate: zlib.createInflate,
+  gzip: zlib.createGunzip,
+};
+
+// the body as stream of decompressed chunks
+function bodyChunks(req) {
+  const encoding = (req.headers['content-encoding'] || 'identity').toLowerCase();
+  if (encoding === 'identity') {
+    return req;
+  }
+  const decoder = decoders[encoding];
+  if (!decoder) {
+    throw new Error(`unsupported encoding ${encoding}`);
+  }
+  const stream = req.pipe(decoder());
+  req.on('error', (err) => stream.destroy(err));
+  return stream;
+}
+
+function reply(res, status, text) {
+  res.writeHead(status, { 'Content-Type': 'text/plain' });
+  res.end(text);
+}
+
+async function handle(req, res) {
+  if (req.method !== 'POST') {
+    reply(res, 405, 'Only POST is supported');
+    return;
+  }
+  const format = batchFormats[req.headers['content-type']];
+  if (!format) {
+    reply(res, 415, `Unsupported content type ${req.headers['content-type']}`);
+    return;
+  }
+  let chunks;
+  try {
+    chunks = bodyChunks(req);
+  } catch (err) {
+    reply(res, 415, err.message);
+    return;
+  }
+  const { status, text } = await ingestBatch(format, chunks, (name) => req.headers[name.toLowerCase()]);
+  // an error before the end of the body leaves the rest unread, the connection can't be reused then
+  if (!req.complete) {
+    res.setHeader('Connection', 'close');
+  }
+  reply(res, status, text);
+}
+
+function createServer() {
+  return http.createServer((req, res) => {
+    handle(req, res).catch((err) => reply(res, 500, err.message));
+  });
+}
+
+if (require.main === module) {
+  const port = Number(process.argv[2] || 8080);
+  createServer().listen(port, () => console.log(`Listening for batches on http port ${port}`));
+}
+
+module.exports = { createServer };
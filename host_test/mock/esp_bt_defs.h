@@ -0,0 +1,11 @@
+#pragma once
+#include <stdint.h>
+
+typedef uint8_t esp_bd_addr_t[6];
+
+typedef enum {
+    ESP_BT_STATUS_SUCCESS = 0,
+    ESP_BT_STATUS_FAIL = 1,
+} esp_bt_status_t;
+
+#define ESP_UUID_LEN_16 2
@@ -0,0 +1,11 @@
+#pragma once
+#include <stdbool.h>
+#include "esp_err.h"
+
+typedef struct {
+    bool ssp_en;
+} esp_bluedroid_config_t;
+#define BT_BLUEDROID_INIT_CONFIG_DEFAULT() {0}
+
+esp_err_t esp_bluedroid_init_with_cfg(esp_bluedroid_config_t* config);
+esp_err_t esp_bluedroid_enable(void);
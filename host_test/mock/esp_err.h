@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// The error codes of ESP-IDF the firmware uses, with their values from esp_err.h
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_NOT_SUPPORTED 0x106
+#define ESP_ERR_TIMEOUT 0x107
+#define ESP_ERR_INVALID_RESPONSE 0x108
+#define ESP_ERR_INVALID_CRC 0x109
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+#define ESP_ERR_NVS_INVALID_LENGTH 0x110c
+#define ESP_ERR_NVS_NO_FREE_PAGES 0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND 0x1110
+#define ESP_ERR_WIFI_NOT_STARTED 0x3002
+#define ESP_ERR_HTTP_CONNECT 0x7003
+#define ESP_ERR_HTTP_WRITE_DATA 0x7004
+#define ESP_ERR_HTTP_FETCH_HEADER 0x7005
+#define ESP_ERR_HTTP_CONNECTION_CLOSED 0x7009
+
+const char* esp_err_to_name(esp_err_t err);
+
+#define ESP_ERROR_CHECK(x) do { \
+        esp_err_t err_ = (x); \
+        if (err_ != ESP_OK) { \
+            printf("ESP_ERROR_CHECK failed: %s at %s:%d\n", esp_err_to_name(err_), __FILE__, __LINE__); \
+            abort(); \
+        } \
+    } while (0)
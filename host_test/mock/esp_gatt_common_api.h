@@ -0,0 +1,5 @@
+#pragma once
+#include "esp_err.h"
+#include "esp_gatt_defs.h"
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu);
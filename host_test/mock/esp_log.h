@@ -0,0 +1,2 @@
+#pragma once
+// main/ logs with printf and dlog, nothing of esp_log is used
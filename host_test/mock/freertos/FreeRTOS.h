@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include <pthread.h>
+
+// the part of FreeRTOS main/ uses; tasks, queues, semaphores and event groups are played by
+// pthreads in host_test/sim/freertos.c
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFFu
+// ticks are milliseconds on the host
+#define configTICK_RATE_HZ 1000
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+#define portNUM_PROCESSORS 2
+
+// critical sections become mutexes, they nest like the ESP-IDF spinlocks
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(mux)
@@ -0,0 +1,7 @@
+#pragma once
+#include <netdb.h>
+
+// like lwip with LWIP_COMPAT_SOCKETS, getaddrinfo is lwip_getaddrinfo; the sim resolves the coap host
+// to its own server with it (see sim/coap_server.c)
+int lwip_getaddrinfo(const char* nodename, const char* servname, const struct addrinfo* hints, struct addrinfo** res);
+#define getaddrinfo(nodename, servname, hints, res) lwip_getaddrinfo(nodename, servname, hints, res)
@@ -0,0 +1,6 @@
+#pragma once
+// lwip offers the bsd socket api, on the host it is the real one
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <unistd.h>
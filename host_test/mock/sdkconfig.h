@@ -0,0 +1,10 @@
+#pragma once
+// the options main/ reads, with the values of sdkconfig.defaults
+#define CONFIG_BTDM_CTRL_BLE_MAX_CONN 3
+#define CONFIG_UPLINK_POST_URL "http://127.0.0.1:8080/"
+#define CONFIG_UPLINK_COAP_HOST "127.0.0.1"
+#define CONFIG_UPLINK_COAP_PORT 5683
+#define CONFIG_LINK_WIFI_IDLE_MS 30000
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ 160
+#define CONFIG_AGGREGATE_WINDOW_MS 0
+#define CONFIG_AGGREGATE_PANES 1
@@ -0,0 +1,560 @@
+// Bluedroid as the firmware sees it: the callbacks run on one worker like on the BTC task, and the
+// centrals of sim_main.c send requests and wait for the responses of the firmware
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "esp_timer.h"
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatts_api.h"
+#include "esp_gatt_common_api.h"
+#include "sim.h"
+
+#define SIM_CENTRALS 8
+#define SIM_GATTS_IF 3
+// handle of the first attribute, bluedroid starts somewhere above its own services
+#define SIM_BASE_HANDLE 40
+#define SIM_HANDLES_MAX 64
+// a request without response fails the connection after this (the att timeout)
+#define SIM_ATT_TIMEOUT_S 30
+
+typedef struct {
+    bool connected;
+    uint16_t mtu;
+    // of the request waiting for its response, 0 if none is
+    uint32_t trans_id;
+    bool answered;
+    esp_gatt_status_t status;
+    esp_gatt_rsp_t rsp;
+} central_t;
+
+typedef struct {
+    esp_gatts_cb_event_t event;
+    esp_ble_gatts_cb_param_t param;
+    // the written value or the handles of the table, param points into it
+    union {
+        uint8_t value[ESP_GATT_MAX_MTU_SIZE];
+        uint16_t handles[SIM_HANDLES_MAX];
+    };
+} gatts_job_t;
+
+typedef struct {
+    esp_gap_ble_cb_event_t event;
+    esp_ble_gap_cb_param_t param;
+} gap_job_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;
+static sim_worker_t* btc = NULL;
+static esp_gatts_cb_t gatts_callback = NULL;
+static esp_gap_ble_cb_t gap_callback = NULL;
+static sim_notify_cb_t notify_handler = NULL;
+static central_t centrals[SIM_CENTRALS];
+static uint32_t next_trans_id = 1;
+static uint16_t local_mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+static const esp_gatts_attr_db_t* attr_table = NULL;
+static uint16_t attr_count = 0;
+static bool service_started = false;
+static sim_callback_time_t gatts_time;
+static bool advertising = false;
+// a call of the firmware is answered this long after the stack answered the one before (see sim_ble_set_call_delay)
+static int64_t call_delay_us = 0;
+static int64_t stack_busy_until_us = 0;
+// events the firmware got until it advertised its started service the first time
+static uint32_t bringup_events = 0;
+static bool brought_up = false;
+
+__attribute__((constructor)) static void init_changed(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadline_after_ms(int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long) (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// Count the events of the bring-up, until the started service is advertised
+static void count_event(void) {
+    pthread_mutex_lock(&lock);
+    if (!brought_up) {
+        bringup_events++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// The flags of the central side change when the firmware gets the event for them
+static void set_flag(bool* flag, bool value) {
+    pthread_mutex_lock(&lock);
+    *flag = value;
+    brought_up |= service_started && advertising;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+static void run_gatts(void* data) {
+    gatts_job_t* job = data;
+    count_event();
+    if (job->event == ESP_GATTS_START_EVT) {
+        set_flag(&service_started, true);
+    }
+    if (job->event == ESP_GATTS_WRITE_EVT) {
+        job->param.write.value = job->value;
+    } else if (job->event == ESP_GATTS_CREAT_ATTR_TAB_EVT) {
+        job->param.add_attr_tab.handles = job->handles;
+    }
+    int64_t started_ns = sim_monotonic_ns();
+    gatts_callback(job->event, SIM_GATTS_IF, &job->param);
+    pthread_mutex_lock(&lock);
+    sim_callback_time_add(&gatts_time, started_ns);
+    pthread_mutex_unlock(&lock);
+}
+
+static void run_gap(void* data) {
+    gap_job_t* job = data;
+    count_event();
+    if (job->event == ESP_GAP_BLE_ADV_START_COMPLETE_EVT) {
+        set_flag(&advertising, true);
+    }
+    gap_callback(job->event, &job->param);
+}
+
+// Delay of the answer to a call of the firmware, the stack answers one call after the other
+static int64_t answer_delay_us(void) {
+    pthread_mutex_lock(&lock);
+    int64_t now = esp_timer_get_time();
+    stack_busy_until_us = (stack_busy_until_us > now ? stack_busy_until_us : now) + call_delay_us;
+    int64_t delay = stack_busy_until_us - now;
+    pthread_mutex_unlock(&lock);
+    return delay;
+}
+
+// Events of the centrals come right away
+static void post_gatts(const gatts_job_t* job) {
+    sim_worker_post(btc, 0, run_gatts, job, sizeof(gatts_job_t));
+}
+
+// Events answering a call of the firmware
+static void answer_gatts(const gatts_job_t* job) {
+    sim_worker_post(btc, answer_delay_us(), run_gatts, job, sizeof(gatts_job_t));
+}
+
+static void answer_gap(esp_gap_ble_cb_event_t event, const esp_ble_gap_cb_param_t* param) {
+    gap_job_t job = {.event = event, .param = *param};
+    sim_worker_post(btc, answer_delay_us(), run_gap, &job, sizeof(job));
+}
+
+// --- the api of the firmware
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t* config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_init_with_cfg(esp_bluedroid_config_t* config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_enable(void) {
+    if (btc == NULL) {
+        btc = sim_worker_start("BTC_TASK");
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t callback) {
+    gatts_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback) {
+    gap_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu) {
+    if (mtu < ESP_GATT_DEF_BLE_MTU_SIZE || mtu > ESP_GATT_MAX_MTU_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    local_mtu = mtu;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_app_register(uint16_t app_id) {
+    gatts_job_t job = {.event = ESP_GATTS_REG_EVT};
+    job.param.reg.status = ESP_GATT_OK;
+    job.param.reg.app_id = app_id;
+    answer_gatts(&job);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t* table, esp_gatt_if_t gatts_if, uint16_t count, uint8_t instance) {
+    if (count > SIM_HANDLES_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    attr_table = table;
+    attr_count = count;
+    pthread_mutex_unlock(&lock);
+    gatts_job_t job = {.event = ESP_GATTS_CREAT_ATTR_TAB_EVT};
+    job.param.add_attr_tab.status = ESP_GATT_OK;
+    job.param.add_attr_tab.num_handle = count;
+    for (uint16_t i = 0; i < count; i++) {
+        job.handles[i] = SIM_BASE_HANDLE + i;
+    }
+    answer_gatts(&job);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle) {
+    gatts_job_t job = {.event = ESP_GATTS_START_EVT};
+    job.param.start.status = ESP_GATT_OK;
+    job.param.start.service_handle = service_handle;
+    answer_gatts(&job);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_device_name(const char* name) {
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_config_adv_data(esp_ble_adv_data_t* adv_data) {
+    esp_ble_gap_cb_param_t param = {0};
+    answer_gap(adv_data->set_scan_rsp ? ESP_GAP_BLE_SCAN_RSP_DATA_SET_COMPLETE_EVT : ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t* adv_params) {
+    esp_ble_gap_cb_param_t param = {0};
+    param.adv_start_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    answer_gap(ESP_GAP_BLE_ADV_START_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_stop_advertising(void) {
+    pthread_mutex_lock(&lock);
+    advertising = false;
+    pthread_mutex_unlock(&lock);
+    esp_ble_gap_cb_param_t param = {0};
+    answer_gap(ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+// centrals accept whatever the firmware asks for
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t* params) {
+    esp_ble_gap_cb_param_t param = {0};
+    param.update_conn_params.status = ESP_BT_STATUS_SUCCESS;
+    memcpy(param.update_conn_params.bda, params->bda, sizeof(esp_bd_addr_t));
+    param.update_conn_params.min_int = params->min_int;
+    param.update_conn_params.max_int = params->max_int;
+    param.update_conn_params.latency = params->latency;
+    param.update_conn_params.conn_int = params->max_int;
+    param.update_conn_params.timeout = params->timeout;
+    answer_gap(ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remote_device, uint16_t tx_data_length) {
+    esp_ble_gap_cb_param_t param = {0};
+    param.pkt_data_length_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    param.pkt_data_length_cmpl.params.rx_len = tx_data_length;
+    param.pkt_data_length_cmpl.params.tx_len = tx_data_length;
+    answer_gap(ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT, &param);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_send_response(esp_gatt_if_t gatts_if, uint16_t conn_id, uint32_t trans_id, esp_gatt_status_t status, esp_gatt_rsp_t* rsp) {
+    if (conn_id >= SIM_CENTRALS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    central_t* central = &centrals[conn_id];
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (central->connected && central->trans_id == trans_id && !central->answered) {
+        central->answered = true;
+        central->status = status;
+        if (rsp != NULL) {
+            central->rsp = *rsp;
+        } else {
+            memset(&central->rsp, 0, sizeof(central->rsp));
+        }
+        pthread_cond_broadcast(&changed);
+        err = ESP_OK;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+// notifications go straight to the central, the stack would truncate them to the mtu
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t handle, uint16_t len, uint8_t* value, bool need_confirm) {
+    if (conn_id >= SIM_CENTRALS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    bool connected = centrals[conn_id].connected;
+    uint16_t max = centrals[conn_id].mtu - 3;
+    sim_notify_cb_t handler = notify_handler;
+    pthread_mutex_unlock(&lock);
+    if (!connected) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (handler != NULL) {
+        handler(conn_id, value, len < max ? len : max);
+    }
+    return ESP_OK;
+}
+
+// --- the centrals
+
+void sim_ble_set_call_delay(int call_delay_ms) {
+    pthread_mutex_lock(&lock);
+    call_delay_us = (int64_t) call_delay_ms * 1000;
+    pthread_mutex_unlock(&lock);
+}
+
+uint32_t sim_ble_bringup_events(void) {
+    pthread_mutex_lock(&lock);
+    uint32_t events = bringup_events;
+    pthread_mutex_unlock(&lock);
+    return events;
+}
+
+void sim_ble_set_notify_handler(sim_notify_cb_t handler) {
+    pthread_mutex_lock(&lock);
+    notify_handler = handler;
+    pthread_mutex_unlock(&lock);
+}
+
+bool sim_ble_wait_advertising(int timeout_ms) {
+    struct timespec deadline = deadline_after_ms(timeout_ms);
+    pthread_mutex_lock(&lock);
+    while (!(service_started && advertising)) {
+        if (pthread_cond_timedwait(&changed, &lock, &deadline) != 0) {
+            break;
+        }
+    }
+    bool ready = service_started && advertising;
+    pthread_mutex_unlock(&lock);
+    return ready;
+}
+
+uint16_t sim_ble_handle(uint16_t uuid) {
+    uint16_t handle = 0;
+    pthread_mutex_lock(&lock);
+    for (uint16_t i = 0; i < attr_count && handle == 0; i++) {
+        const esp_attr_desc_t* desc = &attr_table[i].att_desc;
+        if (desc->uuid_length == ESP_UUID_LEN_16 && (desc->uuid_p[0] | desc->uuid_p[1] << 8) == uuid) {
+            handle = SIM_BASE_HANDLE + i;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return handle;
+}
+
+bool sim_ble_connect(uint16_t conn_id) {
+    if (conn_id >= SIM_CENTRALS) {
+        return false;
+    }
+    pthread_mutex_lock(&lock);
+    if (!advertising || centrals[conn_id].connected) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    // the controller stops advertising with every connection
+    advertising = false;
+    centrals[conn_id] = (central_t) {.connected = true, .mtu = ESP_GATT_DEF_BLE_MTU_SIZE};
+    pthread_mutex_unlock(&lock);
+    gatts_job_t job = {.event = ESP_GATTS_CONNECT_EVT};
+    job.param.connect.conn_id = conn_id;
+    uint8_t bda[6] = {0xc0, 0xff, 0xee, 0, 0, conn_id};
+    memcpy(job.param.connect.remote_bda, bda, sizeof(bda));
+    post_gatts(&job);
+    return true;
+}
+
+void sim_ble_disconnect(uint16_t conn_id) {
+    pthread_mutex_lock(&lock);
+    bool connected = centrals[conn_id].connected;
+    centrals[conn_id].connected = false;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    if (connected) {
+        gatts_job_t job = {.event = ESP_GATTS_DISCONNECT_EVT};
+        job.param.disconnect.conn_id = conn_id;
+        // remote user terminated connection
+        job.param.disconnect.reason = 0x13;
+        post_gatts(&job);
+    }
+}
+
+void sim_ble_set_mtu(uint16_t conn_id, uint16_t mtu) {
+    pthread_mutex_lock(&lock);
+    uint16_t agreed = mtu < local_mtu ? mtu : local_mtu;
+    centrals[conn_id].mtu = agreed;
+    pthread_mutex_unlock(&lock);
+    gatts_job_t job = {.event = ESP_GATTS_MTU_EVT};
+    job.param.mtu.conn_id = conn_id;
+    job.param.mtu.mtu = agreed;
+    post_gatts(&job);
+}
+
+uint16_t sim_ble_mtu(uint16_t conn_id) {
+    pthread_mutex_lock(&lock);
+    uint16_t mtu = centrals[conn_id].mtu;
+    pthread_mutex_unlock(&lock);
+    return mtu;
+}
+
+static bool rsp_by_app(uint16_t handle) {
+    uint16_t index = handle - SIM_BASE_HANDLE;
+    pthread_mutex_lock(&lock);
+    bool by_app = index < attr_count && attr_table[index].attr_control.auto_rsp == ESP_GATT_RSP_BY_APP;
+    pthread_mutex_unlock(&lock);
+    return by_app;
+}
+
+// Post the request of a central and wait for its response, the central's lock isn't held while posting
+static esp_gatt_status_t request(uint16_t conn_id, gatts_job_t* job, uint32_t* trans_id, esp_gatt_rsp_t* rsp) {
+    pthread_mutex_lock(&lock);
+    central_t* central = &centrals[conn_id];
+    if (!central->connected) {
+        pthread_mutex_unlock(&lock);
+        return ESP_GATT_ERROR;
+    }
+    central->trans_id = next_trans_id++;
+    central->answered = false;
+    *trans_id = central->trans_id;
+    pthread_mutex_unlock(&lock);
+    post_gatts(job);
+
+    struct timespec deadline = deadline_after_ms(SIM_ATT_TIMEOUT_S * 1000);
+    pthread_mutex_lock(&lock);
+    while (central->connected && !central->answered) {
+        if (pthread_cond_timedwait(&changed, &lock, &deadline) != 0) {
+            printf("Request %u of connection %d got no response\n", *trans_id, conn_id);
+            break;
+        }
+    }
+    esp_gatt_status_t status = central->answered ? central->status : ESP_GATT_ERROR;
+    if (rsp != NULL) {
+        *rsp = central->rsp;
+    }
+    central->trans_id = 0;
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+esp_gatt_status_t sim_ble_write(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool need_rsp) {
+    if (len > sim_ble_mtu(conn_id) - 3) {
+        return ESP_GATT_INVALID_ATTR_LEN;
+    }
+    gatts_job_t job = {.event = ESP_GATTS_WRITE_EVT};
+    job.param.write.conn_id = conn_id;
+    job.param.write.handle = handle;
+    job.param.write.len = len;
+    memcpy(job.value, value, len);
+    // attributes the stack answers never ask for a response
+    job.param.write.need_rsp = need_rsp && rsp_by_app(handle);
+    if (!job.param.write.need_rsp) {
+        post_gatts(&job);
+        return ESP_GATT_OK;
+    }
+    return request(conn_id, &job, &job.param.write.trans_id, NULL);
+}
+
+esp_gatt_status_t sim_ble_write_long(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len) {
+    // the prepare write request carries the handle and offset besides its opcode
+    uint16_t chunk = sim_ble_mtu(conn_id) - 5;
+    for (uint16_t offset = 0; offset < len; offset += chunk) {
+        uint16_t n = len - offset < chunk ? len - offset : chunk;
+        gatts_job_t job = {.event = ESP_GATTS_WRITE_EVT};
+        job.param.write.conn_id = conn_id;
+        job.param.write.handle = handle;
+        job.param.write.offset = offset;
+        job.param.write.len = n;
+        job.param.write.need_rsp = true;
+        job.param.write.is_prep = true;
+        memcpy(job.value, value + offset, n);
+        esp_gatt_rsp_t rsp;
+        esp_gatt_status_t status = request(conn_id, &job, &job.param.write.trans_id, &rsp);
+        if (status != ESP_GATT_OK) {
+            return status;
+        }
+        // the echo has to match what was sent
+        if (rsp.attr_value.len != n || rsp.attr_value.offset != offset || memcmp(rsp.attr_value.value, value + offset, n) != 0) {
+            return ESP_GATT_INVALID_PDU;
+        }
+    }
+    gatts_job_t job = {.event = ESP_GATTS_EXEC_WRITE_EVT};
+    job.param.exec_write.conn_id = conn_id;
+    job.param.exec_write.exec_write_flag = ESP_GATT_PREP_WRITE_EXEC;
+    return request(conn_id, &job, &job.param.exec_write.trans_id, NULL);
+}
+
+esp_gatt_status_t sim_ble_read(uint16_t conn_id, uint16_t handle, uint8_t* value, uint16_t* len) {
+    uint16_t room = *len;
+    uint16_t index = handle - SIM_BASE_HANDLE;
+    *len = 0;
+    if (!rsp_by_app(handle)) {
+        // answered by the stack from the table
+        pthread_mutex_lock(&lock);
+        esp_gatt_status_t status = ESP_GATT_INVALID_HANDLE;
+        if (index < attr_count) {
+            const esp_attr_desc_t* desc = &attr_table[index].att_desc;
+            *len = desc->length < room ? desc->length : room;
+            if (*len > 0) {
+                memcpy(value, desc->value, *len);
+            }
+            status = ESP_GATT_OK;
+        }
+        pthread_mutex_unlock(&lock);
+        return status;
+    }
+    // a response filling the whole mtu is continued with a read blob request
+    uint16_t max = sim_ble_mtu(conn_id) - 1;
+    while (true) {
+        gatts_job_t job = {.event = ESP_GATTS_READ_EVT};
+        job.param.read.conn_id = conn_id;
+        job.param.read.handle = handle;
+        job.param.read.offset = *len;
+        job.param.read.is_long = *len > 0;
+        job.param.read.need_rsp = true;
+        esp_gatt_rsp_t rsp;
+        esp_gatt_status_t status = request(conn_id, &job, &job.param.read.trans_id, &rsp);
+        if (status != ESP_GATT_OK) {
+            return status;
+        }
+        uint16_t n = rsp.attr_value.len < room - *len ? rsp.attr_value.len : room - *len;
+        memcpy(value + *len, rsp.attr_value.value, n);
+        *len += n;
+        if (rsp.attr_value.len < max || *len == room) {
+            return ESP_GATT_OK;
+        }
+    }
+}
+
+void sim_ble_gatts_time(sim_callback_time_t* time) {
+    pthread_mutex_lock(&lock);
+    *time = gatts_time;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,163 @@
+// The CoAP server the uplink posts to once that transport is selected, answers like GCP/coap_receiver.js:
+// confirmable POSTs to frames or ndjson are counted by http_server.c and acknowledged with a piggybacked
+// 2.04 and the number of records. The firmware finds it through lwip_getaddrinfo below.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "sim.h"
+
+#define COAP_HEADER_LEN 4
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_ACK 2
+#define COAP_CODE_POST 0x02
+#define COAP_OPTION_URI_PATH 11
+#define COAP_PAYLOAD_MARKER 0xFF
+#define COAP_TOKEN_MAX 8
+#define COAP_RESPONSE_MAX 64
+
+static int server_port = 0;
+static int answer_delay_ms = 0;
+
+// the firmware's getaddrinfo (see mock/lwip/netdb.h): no dns without an ip, and the coap port is the
+// one of this server
+int lwip_getaddrinfo(const char* nodename, const char* servname, const struct addrinfo* hints, struct addrinfo** res) {
+    if (!sim_wifi_has_ip()) {
+        return EAI_AGAIN;
+    }
+    char port[8];
+    if (server_port > 0) {
+        snprintf(port, sizeof(port), "%d", server_port);
+        servname = port;
+    }
+    return getaddrinfo(nodename, servname, hints, res);
+}
+
+// Read the 0, 1 or 2 extra bytes of an option delta or length nibble, false if the message ends early
+static bool option_value(uint8_t nibble, const uint8_t** pos, const uint8_t* end, uint32_t* value) {
+    if (nibble < 13) {
+        *value = nibble;
+    } else if (nibble == 13 && *pos < end) {
+        *value = 13 + *(*pos)++;
+    } else if (nibble == 14 && *pos + 1 < end) {
+        *value = 269 + ((*pos)[0] << 8 | (*pos)[1]);
+        *pos += 2;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Find the uri path (its last segment) and the payload of a request, false if it is malformed
+static bool parse(const uint8_t* msg, size_t len, char* path, size_t path_size, const uint8_t** payload, size_t* payload_len) {
+    const uint8_t* pos = msg + COAP_HEADER_LEN + (msg[0] & 0x0F);
+    const uint8_t* end = msg + len;
+    uint32_t number = 0;
+    path[0] = '\0';
+    while (pos < end && *pos != COAP_PAYLOAD_MARKER) {
+        uint8_t head = *pos++;
+        uint32_t delta, option_len;
+        if (!option_value(head >> 4, &pos, end, &delta) || !option_value(head & 0x0F, &pos, end, &option_len) || option_len > (size_t) (end - pos)) {
+            return false;
+        }
+        number += delta;
+        if (number == COAP_OPTION_URI_PATH && option_len < path_size) {
+            memcpy(path, pos, option_len);
+            path[option_len] = '\0';
+        }
+        pos += option_len;
+    }
+    if (pos < end) {
+        pos++;
+    }
+    *payload = pos;
+    *payload_len = end - pos;
+    return true;
+}
+
+static void sleep_ms(int ms) {
+    if (ms > 0) {
+        usleep(ms * 1000);
+    }
+}
+
+static void* serve(void* arg) {
+    int fd = (int) (intptr_t) arg;
+    uint8_t* request = malloc(SIM_SERVER_BODY_MAX);
+    uint8_t* inflated = malloc(SIM_SERVER_BODY_MAX);
+    uint8_t response[COAP_HEADER_LEN + COAP_TOKEN_MAX + 1 + COAP_RESPONSE_MAX];
+    // the answer to the last request, sent again if it is retransmitted
+    size_t response_len = 0;
+    uint16_t answered_id = 0;
+    while (true) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(fd, request, SIM_SERVER_BODY_MAX, 0, (struct sockaddr*) &from, &from_len);
+        if (n < COAP_HEADER_LEN) {
+            continue;
+        }
+        sim_server_count_wire(n, true);
+        uint8_t type = (request[0] >> 4) & 0x03;
+        uint8_t token_len = request[0] & 0x0F;
+        uint16_t id = request[2] << 8 | request[3];
+        // the firmware only sends confirmable requests, the rest (acks of separate responses) needs no answer
+        if (type != COAP_TYPE_CON || token_len > COAP_TOKEN_MAX || n < COAP_HEADER_LEN + token_len) {
+            continue;
+        }
+        if (response_len == 0 || id != answered_id) {
+            char path[16];
+            const uint8_t* payload;
+            size_t payload_len;
+            uint32_t count = 0;
+            int status;
+            if (request[1] != COAP_CODE_POST) {
+                status = 405;
+            } else if (!parse(request, n, path, sizeof(path), &payload, &payload_len)) {
+                status = 400;
+            } else if (strcmp(path, "frames") != 0 && strcmp(path, "ndjson") != 0) {
+                status = 404;
+            } else {
+                status = sim_server_take(payload, payload_len, false, strcmp(path, "frames") == 0, inflated, &count);
+            }
+            // 2.04 for a post that was taken, the http status as class.detail otherwise
+            uint8_t code = status == 200 ? (2 << 5 | 4) : (status / 100) << 5 | status % 100;
+            response[0] = (1 << 6) | (COAP_TYPE_ACK << 4) | token_len;
+            response[1] = code;
+            response[2] = id >> 8;
+            response[3] = id & 0xFF;
+            memcpy(response + COAP_HEADER_LEN, request + COAP_HEADER_LEN, token_len);
+            response_len = COAP_HEADER_LEN + token_len;
+            response[response_len++] = COAP_PAYLOAD_MARKER;
+            response_len += snprintf((char*) response + response_len, COAP_RESPONSE_MAX, status == 200 ? "Ack %u" : "Status %u", status == 200 ? count : (uint32_t) status);
+            answered_id = id;
+        }
+        sleep_ms(answer_delay_ms);
+        sim_server_count_wire(response_len, true);
+        sendto(fd, response, response_len, 0, (struct sockaddr*) &from, from_len);
+    }
+    return NULL;
+}
+
+int sim_coap_server_start(int port, int rtt_ms) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || getsockname(fd, (struct sockaddr*) &addr, &addr_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    server_port = ntohs(addr.sin_port);
+    answer_delay_ms = rtt_ms;
+    sim_thread_start("coap_server", serve, (void*) (intptr_t) fd, false);
+    return server_port;
+}
@@ -0,0 +1,334 @@
+// The small parts of ESP-IDF: time since boot (and the clock of the callback times), esp_timer, random,
+// mac, power management, nvs in memory and the spool partition as a flash in memory
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_mac.h"
+#include "esp_pm.h"
+#include "esp_partition.h"
+#include "nvs_flash.h"
+#include "sim.h"
+
+#define NVS_ENTRIES 16
+#define NVS_VALUE_MAX 1024
+#define SPOOL_PARTITION_SIZE (64 * 1024)
+
+struct sim_timer {
+    esp_timer_cb_t callback;
+    void* arg;
+    // a stopped or restarted timer ignores the jobs posted before
+    uint32_t generation;
+    bool active;
+};
+
+typedef struct {
+    esp_timer_handle_t timer;
+    uint32_t generation;
+} timer_job_t;
+
+typedef struct {
+    bool used;
+    char name[16];
+    char key[16];
+    uint8_t value[NVS_VALUE_MAX];
+    size_t len;
+} nvs_entry_t;
+
+static int64_t boot_us;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_worker_t* timer_worker = NULL;
+static uint64_t random_state = 0x2545F4914F6CDD1Dull;
+
+static const char* nvs_names[8];
+static nvs_entry_t nvs_entries[NVS_ENTRIES];
+
+static esp_partition_t spool_partition = {
+    .type = ESP_PARTITION_TYPE_DATA,
+    .subtype = 0x40,
+    .size = SPOOL_PARTITION_SIZE,
+    .label = "spool",
+};
+static uint8_t spool_flash[SPOOL_PARTITION_SIZE];
+static bool spool_present = true;
+
+static int64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+__attribute__((constructor)) static void boot(void) {
+    boot_us = monotonic_us();
+    // a new chip comes with its flash erased
+    memset(spool_flash, 0xFF, sizeof(spool_flash));
+}
+
+int64_t esp_timer_get_time(void) {
+    return monotonic_us() - boot_us;
+}
+
+int64_t sim_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sim_callback_time_add(sim_callback_time_t* time, int64_t started_ns) {
+    uint64_t ns = sim_monotonic_ns() - started_ns;
+    time->calls++;
+    time->total_ns += ns;
+    time->max_ns = ns > time->max_ns ? ns : time->max_ns;
+}
+
+const char* esp_err_to_name(esp_err_t err) {
+    switch (err) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_NVS_NO_FREE_PAGES: return "ESP_ERR_NVS_NO_FREE_PAGES";
+    case ESP_ERR_NVS_NEW_VERSION_FOUND: return "ESP_ERR_NVS_NEW_VERSION_FOUND";
+    case ESP_ERR_WIFI_NOT_STARTED: return "ESP_ERR_WIFI_NOT_STARTED";
+    case ESP_ERR_HTTP_CONNECT: return "ESP_ERR_HTTP_CONNECT";
+    case ESP_ERR_HTTP_WRITE_DATA: return "ESP_ERR_HTTP_WRITE_DATA";
+    case ESP_ERR_HTTP_FETCH_HEADER: return "ESP_ERR_HTTP_FETCH_HEADER";
+    case ESP_ERR_HTTP_CONNECTION_CLOSED: return "ESP_ERR_HTTP_CONNECTION_CLOSED";
+    default: return "UNKNOWN ERROR";
+    }
+}
+
+// --- esp_timer
+
+static void run_timer(void* data) {
+    timer_job_t* job = data;
+    pthread_mutex_lock(&lock);
+    bool due = job->timer->active && job->timer->generation == job->generation;
+    if (due) {
+        job->timer->active = false;
+    }
+    pthread_mutex_unlock(&lock);
+    if (due) {
+        job->timer->callback(job->timer->arg);
+    }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* args, esp_timer_handle_t* timer) {
+    pthread_mutex_lock(&lock);
+    if (timer_worker == NULL) {
+        timer_worker = sim_worker_start("esp_timer");
+    }
+    pthread_mutex_unlock(&lock);
+    esp_timer_handle_t t = calloc(1, sizeof(struct sim_timer));
+    if (t == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    t->callback = args->callback;
+    t->arg = args->arg;
+    *timer = t;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    pthread_mutex_lock(&lock);
+    if (timer->active) {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->active = true;
+    timer_job_t job = {.timer = timer, .generation = ++timer->generation};
+    pthread_mutex_unlock(&lock);
+    sim_worker_post(timer_worker, timeout_us, run_timer, &job, sizeof(job));
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&lock);
+    bool active = timer->active;
+    timer->active = false;
+    timer->generation++;
+    pthread_mutex_unlock(&lock);
+    return active ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&lock);
+    bool active = timer->active;
+    pthread_mutex_unlock(&lock);
+    return active;
+}
+
+// --- random, mac, power management
+
+// xorshift64*, the same numbers every run so traces replay alike
+uint32_t esp_random(void) {
+    pthread_mutex_lock(&lock);
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    uint32_t value = (uint32_t) ((random_state * 0x2545F4914F6CDD1Dull) >> 32);
+    pthread_mutex_unlock(&lock);
+    return value;
+}
+
+esp_err_t esp_read_mac(uint8_t* mac, esp_mac_type_t type) {
+    static const uint8_t base[6] = {0x24, 0x0a, 0xc4, 0x51, 0x6d, 0x80};
+    memcpy(mac, base, sizeof(base));
+    mac[5] += type;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_configure(const void* config) {
+    return ESP_OK;
+}
+
+// --- nvs: a handle is the index of its namespace plus one
+
+esp_err_t nvs_flash_init(void) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void) {
+    pthread_mutex_lock(&lock);
+    memset(nvs_entries, 0, sizeof(nvs_entries));
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t mode, nvs_handle_t* handle) {
+    pthread_mutex_lock(&lock);
+    size_t i = 0;
+    while (i < sizeof(nvs_names) / sizeof(nvs_names[0]) && nvs_names[i] != NULL && strcmp(nvs_names[i], name) != 0) {
+        i++;
+    }
+    if (i == sizeof(nvs_names) / sizeof(nvs_names[0])) {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_NO_MEM;
+    }
+    nvs_names[i] = nvs_names[i] != NULL ? nvs_names[i] : strdup(name);
+    pthread_mutex_unlock(&lock);
+    *handle = i + 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+static nvs_entry_t* nvs_find(nvs_handle_t handle, const char* key) {
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+        if (nvs_entries[i].used && strcmp(nvs_entries[i].name, nvs_names[handle - 1]) == 0 && strcmp(nvs_entries[i].key, key) == 0) {
+            return &nvs_entries[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out, size_t* len) {
+    pthread_mutex_lock(&lock);
+    nvs_entry_t* entry = nvs_find(handle, key);
+    esp_err_t err = ESP_OK;
+    if (entry == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (out == NULL) {
+        *len = entry->len;
+    } else if (*len < entry->len) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(out, entry->value, entry->len);
+        *len = entry->len;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+// strings are stored as blobs with their terminator
+esp_err_t nvs_get_str(nvs_handle_t handle, const char* key, char* out, size_t* len) {
+    return nvs_get_blob(handle, key, out, len);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t len) {
+    if (len > NVS_VALUE_MAX || strlen(key) >= sizeof(nvs_entries[0].key)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&lock);
+    nvs_entry_t* entry = nvs_find(handle, key);
+    for (int i = 0; entry == NULL && i < NVS_ENTRIES; i++) {
+        if (!nvs_entries[i].used) {
+            entry = &nvs_entries[i];
+            entry->used = true;
+            snprintf(entry->name, sizeof(entry->name), "%s", nvs_names[handle - 1]);
+            snprintf(entry->key, sizeof(entry->key), "%s", key);
+        }
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_NVS_NO_FREE_PAGES;
+    }
+    memcpy(entry->value, value, len);
+    entry->len = len;
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+// --- the spool partition, writes clear bits like NOR flash does
+
+void sim_spool_set_present(bool present) {
+    spool_present = present;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label) {
+    if (!spool_present || type != spool_partition.type || subtype != spool_partition.subtype || (label != NULL && strcmp(label, spool_partition.label) != 0)) {
+        return NULL;
+    }
+    return &spool_partition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t len) {
+    if (offset + len > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&lock);
+    memcpy(dst, spool_flash + offset, len);
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t len) {
+    if (offset + len > partition->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < len; i++) {
+        spool_flash[offset + i] &= ((const uint8_t*) src)[i];
+    }
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t len) {
+    if (offset + len > partition->size || offset % 4096 != 0 || len % 4096 != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    memset(spool_flash + offset, 0xFF, len);
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
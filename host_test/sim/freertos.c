@@ -0,0 +1,265 @@
+// FreeRTOS on pthreads: tasks are threads, a tick is a millisecond of esp_timer_get_time, queues,
+// semaphores and event groups wait on a condition each
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_timer.h"
+#include "sim.h"
+
+typedef struct {
+    TaskFunction_t task;
+    void* arg;
+    uint32_t stack_depth;
+    BaseType_t core;
+} sim_task_t;
+
+struct sim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t items[];
+};
+
+struct sim_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+struct sim_event_group {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    EventBits_t bits;
+};
+
+static __thread sim_task_t* current_task = NULL;
+
+static void init_waitable(pthread_mutex_t* lock, pthread_cond_t* changed) {
+    pthread_condattr_t attr;
+    pthread_mutex_init(lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(changed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadline_after(TickType_t ticks) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ticks / 1000;
+    ts.tv_nsec += (long) (ticks % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// Wait for a change until deadline (none for portMAX_DELAY), returns false once it passed
+static bool wait_changed(pthread_cond_t* changed, pthread_mutex_t* lock, TickType_t wait, const struct timespec* deadline) {
+    if (wait == 0) {
+        return false;
+    }
+    if (wait == portMAX_DELAY) {
+        pthread_cond_wait(changed, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(changed, lock, deadline) == 0;
+}
+
+static void* task_main(void* arg) {
+    current_task = arg;
+    sim_thread_set_firmware(true);
+    current_task->task(current_task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stack_depth, void* arg, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core) {
+    // the tcb, allocated like FreeRTOS does
+    sim_task_t* t = malloc(sizeof(sim_task_t));
+    t->task = task;
+    t->arg = arg;
+    t->stack_depth = stack_depth;
+    t->core = core;
+    if (handle != NULL) {
+        *handle = t;
+    }
+    sim_thread_start(name, task_main, t, true);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char* name, uint32_t stack_depth, void* arg, UBaseType_t priority, TaskHandle_t* handle) {
+    return xTaskCreatePinnedToCore(task, name, stack_depth, arg, priority, handle, 0);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    free(current_task);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = {.tv_sec = ticks / 1000, .tv_nsec = (long) (ticks % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t) (esp_timer_get_time() / 1000);
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return current_task != NULL ? current_task->stack_depth : 0;
+}
+
+BaseType_t xPortGetCoreID(void) {
+    return current_task != NULL ? current_task->core : 0;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = calloc(1, sizeof(struct sim_queue) + length * item_size);
+    init_waitable(&queue->lock, &queue->changed);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length) {
+        if (!wait_changed(&queue->changed, &queue->lock, wait, &deadline)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFALSE;
+        }
+    }
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (!wait_changed(&queue->changed, &queue->lock, wait, &deadline)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFALSE;
+        }
+    }
+    memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) {
+    SemaphoreHandle_t semaphore = calloc(1, sizeof(struct sim_semaphore));
+    init_waitable(&semaphore->lock, &semaphore->changed);
+    semaphore->count = initial;
+    semaphore->max = max;
+    return semaphore;
+}
+
+// not recursive and without priority inheritance, main/ needs neither
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+    pthread_mutex_lock(&semaphore->lock);
+    while (semaphore->count == 0) {
+        if (!wait_changed(&semaphore->changed, &semaphore->lock, wait, &deadline)) {
+            pthread_mutex_unlock(&semaphore->lock);
+            return pdFALSE;
+        }
+    }
+    semaphore->count--;
+    pthread_mutex_unlock(&semaphore->lock);
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    BaseType_t given = pdFALSE;
+    pthread_mutex_lock(&semaphore->lock);
+    if (semaphore->count < semaphore->max) {
+        semaphore->count++;
+        given = pdTRUE;
+        pthread_cond_signal(&semaphore->changed);
+    }
+    pthread_mutex_unlock(&semaphore->lock);
+    return given;
+}
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    EventGroupHandle_t group = calloc(1, sizeof(struct sim_event_group));
+    init_waitable(&group->lock, &group->changed);
+    return group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    EventBits_t now = group->bits;
+    pthread_cond_broadcast(&group->changed);
+    pthread_mutex_unlock(&group->lock);
+    return now;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t before = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t bits = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t wait) {
+    struct timespec deadline = deadline_after(wait);
+    pthread_mutex_lock(&group->lock);
+    while (true) {
+        EventBits_t set = group->bits & bits;
+        if (all ? set == bits : set != 0) {
+            EventBits_t now = group->bits;
+            if (clear) {
+                group->bits &= ~bits;
+            }
+            pthread_mutex_unlock(&group->lock);
+            return now;
+        }
+        if (!wait_changed(&group->changed, &group->lock, wait, &deadline)) {
+            EventBits_t now = group->bits;
+            pthread_mutex_unlock(&group->lock);
+            return now;
+        }
+    }
+}
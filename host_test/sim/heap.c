@@ -0,0 +1,80 @@
+// The heap as ESP-IDF reports it: a fixed size minus what the process took since boot, and the
+// allocations of firmware tasks, counted by wrapping malloc
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <malloc.h>
+
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "sim.h"
+
+// internal ram an ESP32 has left for the heap with bluetooth and wifi running
+#define SIM_HEAP_BYTES (160 * 1024)
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+static __thread bool firmware_thread = false;
+static atomic_uint_fast64_t allocations = 0;
+static size_t baseline = 0;
+static size_t minimum_free = SIM_HEAP_BYTES;
+
+void* malloc(size_t size) {
+    if (firmware_thread) {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    }
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    if (firmware_thread) {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    }
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (firmware_thread) {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+static size_t in_use(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+__attribute__((constructor)) static void take_baseline(void) {
+    baseline = in_use();
+}
+
+void sim_thread_set_firmware(bool firmware) {
+    firmware_thread = firmware;
+}
+
+uint64_t sim_heap_allocations(void) {
+    return atomic_load(&allocations);
+}
+
+// the whole process counts, the threads of the simulation included, so this is an upper bound of
+// what the firmware uses
+size_t heap_caps_get_free_size(uint32_t caps) {
+    size_t used = in_use() - baseline;
+    size_t free = used < SIM_HEAP_BYTES ? SIM_HEAP_BYTES - used : 0;
+    if (free < minimum_free) {
+        minimum_free = free;
+    }
+    return free;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return heap_caps_get_free_size(caps);
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+    heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    return minimum_free;
+}
@@ -0,0 +1,345 @@
+// esp_http_client on a posix socket: plain http/1.1 with keep-alive, the events the firmware
+// handles, and the failures of a connection that died with the wifi or was closed by the server.
+// With delays set, round trips and tls handshakes are slept instead of run (see sim_http_set_delays).
+// Nothing is allocated per request, so the allocations counted are those of main/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "esp_http_client.h"
+#include "sim.h"
+
+#define SIM_HTTP_HEADERS 8
+// X-Latency and X-Memory carry hex snapshots of up to 512 bytes
+#define SIM_HTTP_HEADER_VALUE 1100
+#define SIM_HTTP_RESPONSE_HEAD 2048
+#define SIM_HTTP_BODY_CHUNK 512
+
+typedef struct {
+    bool used;
+    char key[32];
+    char value[SIM_HTTP_HEADER_VALUE];
+} header_t;
+
+struct sim_http_client {
+    char host[64];
+    int port;
+    char path[128];
+    int timeout_ms;
+    bool keep_alive;
+    bool save_session;
+    // a tls session to resume, saved by the first full handshake
+    bool has_session;
+    http_event_handle_cb event_handler;
+    void* user_data;
+    header_t headers[SIM_HTTP_HEADERS];
+    const char* post_data;
+    int post_len;
+    int fd;
+    // the ip session the socket was opened in
+    uint32_t session;
+    int status_code;
+    char request[SIM_HTTP_HEADERS * (SIM_HTTP_HEADER_VALUE + 40) + 512];
+    char response[SIM_HTTP_RESPONSE_HEAD + SIM_HTTP_BODY_CHUNK];
+};
+
+static int port_override = 0;
+static int rtt_ms = 0;
+static int handshake_ms = 0;
+static bool resume = true;
+static uint32_t full_handshakes = 0;
+static uint32_t resumed_handshakes = 0;
+
+void sim_http_set_port(int port) {
+    port_override = port;
+}
+
+void sim_http_set_delays(int rtt, int handshake, bool resume_sessions) {
+    rtt_ms = rtt;
+    handshake_ms = handshake;
+    resume = resume_sessions;
+}
+
+void sim_http_handshakes(uint32_t* full, uint32_t* resumed) {
+    *full = __atomic_load_n(&full_handshakes, __ATOMIC_RELAXED);
+    *resumed = __atomic_load_n(&resumed_handshakes, __ATOMIC_RELAXED);
+}
+
+static void sleep_ms(int ms) {
+    if (ms > 0) {
+        usleep(ms * 1000);
+    }
+}
+
+// the tls handshake after the tcp one: two round trips and the key exchange, or one round trip
+// with a session ticket the client kept
+static void handshake(esp_http_client_handle_t client) {
+    if (client->has_session && resume) {
+        sleep_ms(rtt_ms);
+        __atomic_fetch_add(&resumed_handshakes, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    sleep_ms(2 * rtt_ms + handshake_ms);
+    __atomic_fetch_add(&full_handshakes, 1, __ATOMIC_RELAXED);
+    client->has_session = client->save_session;
+}
+
+static void emit(esp_http_client_handle_t client, esp_http_client_event_id_t id, void* data, int len) {
+    if (client->event_handler == NULL) {
+        return;
+    }
+    esp_http_client_event_t event = {
+        .event_id = id,
+        .client = client,
+        .data = data,
+        .data_len = len,
+        .user_data = client->user_data,
+    };
+    client->event_handler(&event);
+}
+
+static void disconnect(esp_http_client_handle_t client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+        client->fd = -1;
+        emit(client, HTTP_EVENT_DISCONNECTED, NULL, 0);
+    }
+}
+
+static bool open_socket(esp_http_client_handle_t client) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(client->port)};
+    if (inet_pton(AF_INET, client->host, &addr.sin_addr) != 1) {
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+        struct addrinfo* result;
+        if (getaddrinfo(client->host, NULL, &hints, &result) != 0) {
+            return false;
+        }
+        addr.sin_addr = ((struct sockaddr_in*) result->ai_addr)->sin_addr;
+        freeaddrinfo(result);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct timeval timeout = {.tv_sec = client->timeout_ms / 1000, .tv_usec = (client->timeout_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    sleep_ms(rtt_ms);
+    if (rtt_ms > 0 || handshake_ms > 0) {
+        handshake(client);
+    }
+    client->fd = fd;
+    client->session = sim_wifi_ip_session();
+    return true;
+}
+
+static bool send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Value of header in the response head, NULL if it isn't there
+static const char* find_header(const char* head, const char* header) {
+    size_t len = strlen(header);
+    for (const char* line = strstr(head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, header, len) == 0 && line[2 + len] == ':') {
+            const char* value = line + 3 + len;
+            while (*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t* config) {
+    esp_http_client_handle_t client = calloc(1, sizeof(struct sim_http_client));
+    if (client == NULL) {
+        return NULL;
+    }
+    // http://host[:port][/path], a port in the url wins over the one of the config
+    const char* host = strstr(config->url, "://");
+    host = host != NULL ? host + 3 : config->url;
+    size_t host_len = strcspn(host, ":/");
+    snprintf(client->host, sizeof(client->host), "%.*s", (int) host_len, host);
+    client->port = host[host_len] == ':' ? atoi(host + host_len + 1) : config->port;
+    if (port_override != 0) {
+        client->port = port_override;
+    }
+    const char* path = strchr(host, '/');
+    snprintf(client->path, sizeof(client->path), "%s", path != NULL ? path : "/");
+    client->timeout_ms = config->timeout_ms > 0 ? config->timeout_ms : 5000;
+    client->keep_alive = config->keep_alive_enable;
+    client->save_session = config->save_client_session;
+    client->event_handler = config->event_handler;
+    client->user_data = config->user_data;
+    client->fd = -1;
+    return client;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char* key, const char* value) {
+    header_t* free_header = NULL;
+    for (int i = 0; i < SIM_HTTP_HEADERS; i++) {
+        header_t* header = &client->headers[i];
+        if (header->used && strcasecmp(header->key, key) == 0) {
+            free_header = header;
+            break;
+        }
+        if (!header->used && free_header == NULL) {
+            free_header = header;
+        }
+    }
+    if (free_header == NULL || strlen(key) >= sizeof(free_header->key) || strlen(value) >= sizeof(free_header->value)) {
+        return ESP_ERR_NO_MEM;
+    }
+    free_header->used = true;
+    strcpy(free_header->key, key);
+    strcpy(free_header->value, value);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char* key) {
+    for (int i = 0; i < SIM_HTTP_HEADERS; i++) {
+        if (client->headers[i].used && strcasecmp(client->headers[i].key, key) == 0) {
+            client->headers[i].used = false;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_post_field(esp_http_client_handle_t client, const char* data, int len) {
+    client->post_data = data;
+    client->post_len = len;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_perform(esp_http_client_handle_t client) {
+    client->status_code = -1;
+    if (!sim_wifi_has_ip()) {
+        return ESP_ERR_HTTP_CONNECT;
+    }
+    // the socket didn't survive the wifi going away, the firmware learns it like on the device
+    if (client->fd >= 0 && client->session != sim_wifi_ip_session()) {
+        disconnect(client);
+        return ESP_ERR_HTTP_FETCH_HEADER;
+    }
+    bool reused = client->fd >= 0;
+    if (!reused) {
+        if (!open_socket(client)) {
+            return ESP_ERR_HTTP_CONNECT;
+        }
+        emit(client, HTTP_EVENT_ON_CONNECTED, NULL, 0);
+    }
+
+    int len = snprintf(client->request, sizeof(client->request), "POST %s HTTP/1.1\r\nHost: %s:%d\r\nContent-Length: %d\r\n",
+                       client->path, client->host, client->port, client->post_len);
+    for (int i = 0; i < SIM_HTTP_HEADERS; i++) {
+        if (client->headers[i].used) {
+            len += snprintf(client->request + len, sizeof(client->request) - len, "%s: %s\r\n", client->headers[i].key, client->headers[i].value);
+        }
+    }
+    len += snprintf(client->request + len, sizeof(client->request) - len, "%s\r\n", client->keep_alive ? "" : "Connection: close\r\n");
+    if (!send_all(client->fd, client->request, len)) {
+        disconnect(client);
+        return ESP_ERR_HTTP_WRITE_DATA;
+    }
+    emit(client, HTTP_EVENT_HEADERS_SENT, NULL, 0);
+    if (!send_all(client->fd, client->post_data, client->post_len)) {
+        disconnect(client);
+        return ESP_ERR_HTTP_WRITE_DATA;
+    }
+
+    // the request goes out and the response comes back
+    sleep_ms(rtt_ms);
+    // the head, and whatever of the body came with it
+    size_t received = 0;
+    char* body = NULL;
+    while (body == NULL) {
+        if (received == SIM_HTTP_RESPONSE_HEAD) {
+            disconnect(client);
+            return ESP_ERR_HTTP_FETCH_HEADER;
+        }
+        ssize_t n = recv(client->fd, client->response + received, SIM_HTTP_RESPONSE_HEAD - received, 0);
+        if (n <= 0) {
+            // a kept-alive connection the server closed in the meantime ends up here
+            disconnect(client);
+            return ESP_ERR_HTTP_FETCH_HEADER;
+        }
+        received += n;
+        client->response[received] = '\0';
+        body = strstr(client->response, "\r\n\r\n");
+    }
+    body += 4;
+    *(body - 2) = '\0';
+    if (sscanf(client->response, "HTTP/1.%*d %d", &client->status_code) != 1) {
+        disconnect(client);
+        return ESP_ERR_HTTP_FETCH_HEADER;
+    }
+    const char* length_header = find_header(client->response, "Content-Length");
+    const char* connection_header = find_header(client->response, "Connection");
+    // without a length the body ends with the connection
+    long remaining = length_header != NULL ? atol(length_header) : -1;
+    bool closing = remaining < 0 || (connection_header != NULL && strncasecmp(connection_header, "close", 5) == 0);
+
+    size_t in_head = client->response + received - body;
+    if (in_head > 0) {
+        emit(client, HTTP_EVENT_ON_DATA, body, in_head);
+        remaining -= remaining >= 0 ? (long) in_head : 0;
+    }
+    while (remaining != 0) {
+        size_t want = remaining > 0 && remaining < SIM_HTTP_BODY_CHUNK ? remaining : SIM_HTTP_BODY_CHUNK;
+        ssize_t n = recv(client->fd, client->response, want, 0);
+        if (n <= 0) {
+            if (remaining < 0 && n == 0) {
+                break;
+            }
+            disconnect(client);
+            return ESP_ERR_HTTP_CONNECTION_CLOSED;
+        }
+        emit(client, HTTP_EVENT_ON_DATA, client->response, n);
+        remaining -= remaining > 0 ? n : 0;
+    }
+    emit(client, HTTP_EVENT_ON_FINISH, NULL, 0);
+    if (closing || !client->keep_alive) {
+        disconnect(client);
+    }
+    return ESP_OK;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) {
+    return client->status_code;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+    disconnect(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client) {
+    disconnect(client);
+    free(client);
+    return ESP_OK;
+}
+
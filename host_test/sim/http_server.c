@@ -0,0 +1,249 @@
+// The server the uplink posts to: takes batches of frames (deflated or not), counts their records
+// and repeated sequence numbers, and answers like GCP/echo.js with the number of records. The CoAP
+// server (coap_server.c) hands its bodies to the same counting
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "frame.h"
+#include "sim.h"
+
+#define SERVER_HEAD_MAX 8192
+// what an ip packet on a 1500 byte mtu link carries behind its header
+#define SERVER_IP_PAYLOAD (1500 - 20)
+// sequence numbers the duplicate check remembers
+#define SERVER_SEQ_MAX (1 << 20)
+
+typedef struct {
+    int fd;
+} connection_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_server_stats_t stats;
+static bool keep_alive = true;
+// answered to every request instead of 200, see sim_server_set_status
+static int forced_status = 200;
+static uint8_t seen[SERVER_SEQ_MAX / 8];
+
+// Count the records of a body and the ones seen before, frames are varint length prefixed, anything
+// else is taken for ndjson
+static uint32_t count_records(const uint8_t* body, size_t len, bool frames) {
+    uint32_t records = 0;
+    if (!frames) {
+        for (size_t i = 0; i < len; i++) {
+            records += body[i] == '\n';
+        }
+        pthread_mutex_lock(&lock);
+        stats.records += records;
+        pthread_mutex_unlock(&lock);
+        return records;
+    }
+    size_t pos = 0;
+    uint64_t record_len;
+    pthread_mutex_lock(&lock);
+    while (pos < len && frame_get_varint(body, len, &pos, &record_len) && record_len <= len - pos) {
+        frame_t frame;
+        if (frame_decode(body + pos, record_len, &frame)) {
+            records++;
+            uint32_t seq = frame.seq % SERVER_SEQ_MAX;
+            if (seen[seq / 8] & (1 << seq % 8)) {
+                stats.duplicates++;
+            }
+            seen[seq / 8] |= 1 << seq % 8;
+        }
+        pos += record_len;
+    }
+    stats.records += records;
+    pthread_mutex_unlock(&lock);
+    return records;
+}
+
+int sim_server_take(const uint8_t* body, size_t len, bool deflated, bool frames, uint8_t* inflated, uint32_t* count) {
+    const uint8_t* records = body;
+    uLongf records_len = len;
+    int status = 200;
+    if (deflated) {
+        records_len = SIM_SERVER_BODY_MAX;
+        if (uncompress(inflated, &records_len, body, len) != Z_OK) {
+            status = 400;
+            records_len = 0;
+        }
+        records = inflated;
+    }
+    pthread_mutex_lock(&lock);
+    if (status == 200) {
+        status = forced_status;
+    }
+    pthread_mutex_unlock(&lock);
+    *count = status == 200 ? count_records(records, records_len, frames) : 0;
+    pthread_mutex_lock(&lock);
+    stats.requests++;
+    stats.rejected += status != 200;
+    stats.bytes += len;
+    stats.inflated_bytes += records_len;
+    pthread_mutex_unlock(&lock);
+    return status;
+}
+
+void sim_server_count_wire(size_t bytes, bool datagram) {
+    pthread_mutex_lock(&lock);
+    stats.wire_bytes += bytes;
+    if (datagram) {
+        // ip carries the udp header and payload in fragments of up to SERVER_IP_PAYLOAD bytes
+        uint32_t fragments = (bytes + 8 + SERVER_IP_PAYLOAD - 1) / SERVER_IP_PAYLOAD;
+        stats.datagrams++;
+        stats.fragmented += fragments > 1;
+        stats.ip_fragments += fragments;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static const char* find_header(const char* head, const char* header) {
+    size_t len = strlen(header);
+    for (const char* line = strstr(head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, header, len) == 0 && line[2 + len] == ':') {
+            const char* value = line + 3 + len;
+            while (*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+static void* serve(void* arg) {
+    connection_t* connection = arg;
+    int fd = connection->fd;
+    free(connection);
+    char* head = malloc(SERVER_HEAD_MAX + 1);
+    uint8_t* body = malloc(SIM_SERVER_BODY_MAX);
+    uint8_t* inflated = malloc(SIM_SERVER_BODY_MAX);
+    size_t received = 0;
+    head[0] = '\0';
+    while (true) {
+        // the head, and whatever of the body (or the next request) came with it
+        char* end = NULL;
+        while ((end = strstr(head, "\r\n\r\n")) == NULL) {
+            if (received == SERVER_HEAD_MAX) {
+                goto done;
+            }
+            ssize_t n = recv(fd, head + received, SERVER_HEAD_MAX - received, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            received += n;
+            head[received] = '\0';
+        }
+        *(end + 2) = '\0';
+        size_t head_len = end + 4 - head;
+        const char* length_header = find_header(head, "Content-Length");
+        const char* encoding_header = find_header(head, "Content-Encoding");
+        const char* type_header = find_header(head, "Content-Type");
+        size_t len = length_header != NULL ? strtoul(length_header, NULL, 10) : 0;
+        if (len > SIM_SERVER_BODY_MAX) {
+            goto done;
+        }
+        size_t in_head = received - head_len;
+        size_t take = in_head < len ? in_head : len;
+        memcpy(body, end + 4, take);
+        while (take < len) {
+            ssize_t n = recv(fd, body + take, len - take, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            take += n;
+        }
+        // keep what belongs to the next request
+        size_t rest = in_head - (in_head < len ? in_head : len);
+        memmove(head, end + 4 + (in_head < len ? in_head : len), rest);
+        received = rest;
+        head[received] = '\0';
+
+        bool deflated = encoding_header != NULL && strncasecmp(encoding_header, "deflate", 7) == 0;
+        bool frames = type_header != NULL && strncasecmp(type_header, "application/x-esp-frames", 24) == 0;
+        uint32_t count;
+        int status = sim_server_take(body, len, deflated, frames, inflated, &count);
+        pthread_mutex_lock(&lock);
+        bool keep = keep_alive;
+        pthread_mutex_unlock(&lock);
+
+        char response[256];
+        char text[32];
+        const char* reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : "Service Unavailable";
+        int text_len = status == 200 ? snprintf(text, sizeof(text), "Ack %u", count) : snprintf(text, sizeof(text), "%s", reason);
+        int response_len = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n%s\r\n%s",
+                                    status, reason, text_len, keep ? "" : "Connection: close\r\n", text);
+        sim_server_count_wire(head_len + len + response_len, false);
+        if (send(fd, response, response_len, MSG_NOSIGNAL) != response_len || !keep) {
+            goto done;
+        }
+    }
+done:
+    close(fd);
+    free(head);
+    free(body);
+    free(inflated);
+    return NULL;
+}
+
+static void* accept_connections(void* arg) {
+    int listener = (int) (intptr_t) arg;
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&lock);
+        stats.connections++;
+        pthread_mutex_unlock(&lock);
+        connection_t* connection = malloc(sizeof(connection_t));
+        connection->fd = fd;
+        sim_thread_start("http_conn", serve, connection, false);
+    }
+    return NULL;
+}
+
+int sim_server_start(int port) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listener, 16) != 0 ||
+        getsockname(listener, (struct sockaddr*) &addr, &addr_len) != 0) {
+        close(listener);
+        return -1;
+    }
+    sim_thread_start("http_server", accept_connections, (void*) (intptr_t) listener, false);
+    return ntohs(addr.sin_port);
+}
+
+void sim_server_set_keep_alive(bool keep) {
+    pthread_mutex_lock(&lock);
+    keep_alive = keep;
+    pthread_mutex_unlock(&lock);
+}
+
+void sim_server_set_status(int status) {
+    pthread_mutex_lock(&lock);
+    forced_status = status;
+    pthread_mutex_unlock(&lock);
+}
+
+void sim_server_stats(sim_server_stats_t* out) {
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_gatt_defs.h"
+
+// Host simulation of the firmware: the ESP-IDF and FreeRTOS calls of main/ are played by pthreads in
+// the files of this directory, sim_main.c plays the centrals and the access point and runs a local
+// http server the uplink posts to
+
+// --- workers: a thread running jobs at their due time, the bluetooth task, the esp_timer task and
+// the event loop are workers
+
+typedef struct sim_worker sim_worker_t;
+typedef void (*sim_job_t)(void* data);
+// bytes of data a job can carry, enough for a written value
+#define SIM_JOB_DATA 1100
+
+sim_worker_t* sim_worker_start(const char* name);
+// Run job on the worker after delay_us with a copy of len bytes of data, blocks while all job slots are taken
+void sim_worker_post(sim_worker_t* worker, int64_t delay_us, sim_job_t job, const void* data, size_t len);
+
+// --- threads and heap
+
+// Start a thread that counts as firmware task, its allocations are counted (see sim_heap_allocations)
+void sim_thread_start(const char* name, void* (*run)(void*), void* arg, bool firmware);
+// Mark the calling thread as firmware task (or not)
+void sim_thread_set_firmware(bool firmware);
+// malloc, calloc and realloc calls of firmware tasks since start
+uint64_t sim_heap_allocations(void);
+
+// --- callbacks
+
+// Wall time the firmware spent in the callbacks of one kind, time blocked on stdout included (see sim_uart_start)
+typedef struct {
+    uint32_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} sim_callback_time_t;
+// monotonic clock for the callback times
+int64_t sim_monotonic_ns(void);
+void sim_callback_time_add(sim_callback_time_t* time, int64_t started_ns);
+// Make stdout a console uart of baud bits/s writing to file: a write only returns once its bytes fit into
+// the 128 byte fifo, which empties at the baud rate, like the blocking console of ESP-IDF
+bool sim_uart_start(FILE* file, int baud);
+
+// --- bluetooth, seen from the centrals
+
+// Called for every notification, on the task that sent it
+typedef void (*sim_notify_cb_t)(uint16_t conn_id, const uint8_t* value, uint16_t len);
+void sim_ble_set_notify_handler(sim_notify_cb_t handler);
+// Wait until the service is started and advertised, returns false on timeout
+bool sim_ble_wait_advertising(int timeout_ms);
+// Handle of the attribute with the 16 bit uuid (the value of a characteristic), 0 if there is none
+uint16_t sim_ble_handle(uint16_t uuid);
+// Connect a central as conn_id, returns false if nobody is advertising
+bool sim_ble_connect(uint16_t conn_id);
+void sim_ble_disconnect(uint16_t conn_id);
+void sim_ble_set_mtu(uint16_t conn_id, uint16_t mtu);
+// Write a value, waits for the response unless it is a write without response
+esp_gatt_status_t sim_ble_write(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len, bool need_rsp);
+// Write a value longer than the mtu with prepared writes and execute it
+esp_gatt_status_t sim_ble_write_long(uint16_t conn_id, uint16_t handle, const uint8_t* value, uint16_t len);
+// Read a value, with long reads if it doesn't fit into the mtu; *len is the room before and the length after
+esp_gatt_status_t sim_ble_read(uint16_t conn_id, uint16_t handle, uint8_t* value, uint16_t* len);
+uint16_t sim_ble_mtu(uint16_t conn_id);
+// Answer every call of the firmware call_delay_ms after the stack answered the one before, like the round
+// trips to bluedroid and the controller; 0, the default, answers right away
+void sim_ble_set_call_delay(int call_delay_ms);
+// Events the firmware got from the stack until its service was started and advertised
+uint32_t sim_ble_bringup_events(void);
+// Time spent in the gatts callback (gatts_event_handler)
+void sim_ble_gatts_time(sim_callback_time_t* time);
+
+// --- flash
+
+// Leave the spool partition out of the partition table (call before app_main), like a device
+// flashed without it
+void sim_spool_set_present(bool present);
+
+// --- wifi, seen from the access point
+
+// The access point is there with ssid and password (NULL for an open network), or gone with ssid NULL;
+// a connected station loses it
+void sim_wifi_set_ap(const char* ssid, const char* password);
+bool sim_wifi_has_ip(void);
+// counts the ips the station got, sockets of an earlier one are dead
+uint32_t sim_wifi_ip_session(void);
+// Time spent in the handlers of the default event loop (wifi_event_handler)
+void sim_event_handler_time(sim_callback_time_t* time);
+
+// --- http
+
+// Send the requests of the uplink to this port on the url's host instead (0: the port of the url)
+void sim_http_set_port(int port);
+// Make the connection an https one far away: a round trip takes rtt_ms, a full tls handshake two of
+// them and handshake_ms of key exchange, one with a saved session a single round trip (never resumed
+// unless resume_sessions); all 0, the default, is plain http on localhost
+void sim_http_set_delays(int rtt_ms, int handshake_ms, bool resume_sessions);
+// tls handshakes since start, full and resumed ones
+void sim_http_handshakes(uint32_t* full, uint32_t* resumed);
+
+typedef struct {
+    uint32_t connections;
+    uint32_t requests;
+    // body bytes as sent and after decompressing
+    uint64_t bytes;
+    uint64_t inflated_bytes;
+    uint32_t records;
+    // records with a sequence number seen before
+    uint32_t duplicates;
+    // requests answered with another status than 200, their records aren't counted
+    uint32_t rejected;
+    // requests and responses as sent, http heads and coap headers included (tcp, udp and ip headers not)
+    uint64_t wire_bytes;
+    // coap only: datagrams both ways, those too large for a 1500 byte mtu and the ip fragments of all
+    uint32_t datagrams;
+    uint32_t fragmented;
+    uint32_t ip_fragments;
+} sim_server_stats_t;
+
+// largest body the servers take
+#define SIM_SERVER_BODY_MAX (64 * 1024)
+
+// Serve on 127.0.0.1:port (0 picks a free one), returns the port or -1
+int sim_server_start(int port);
+// Keep connections open after a response (the default), or close them like an overloaded server would
+void sim_server_set_keep_alive(bool keep_alive);
+// Answer every request with status instead of 200 (like an overloaded server with 503), 200 to take them again
+void sim_server_set_status(int status);
+void sim_server_stats(sim_server_stats_t* stats);
+// Take a body either server received: inflates it into inflated (SIM_SERVER_BODY_MAX bytes) if it is
+// deflated, counts its records in the stats, returns the status to answer with and the records in *count
+int sim_server_take(const uint8_t* body, size_t len, bool deflated, bool frames, uint8_t* inflated, uint32_t* count);
+// Count a request or response of bytes as sent, a coap one as a datagram
+void sim_server_count_wire(size_t bytes, bool datagram);
+
+// --- coap
+
+// Serve coap on 127.0.0.1:port (0 picks a free one) and resolve CONFIG_UPLINK_COAP_HOST to it (see
+// lwip_getaddrinfo in coap_server.c), returns the port or -1; posts are answered after rtt_ms
+int sim_coap_server_start(int port, int rtt_ms);
@@ -0,0 +1,748 @@
+// Runs the firmware of main/ on the host: plays the centrals, the access point and the server, either
+// along a trace file or as benchmark of centrals writing messages as fast as the firmware takes them
+//   sim_run [--log file] [--url host:port] [--ble-call ms] [--no-spool] [--uart baud] trace_file
+//   sim_run [--log file] [--url host:port] [--ble-call ms] [--no-spool] [--uart baud] --bench [--centrals n] [--messages n] [--size bytes] [--server close]
+//           [--rtt ms] [--handshake ms] [--cold] [--transport coap]
+// --rtt and --handshake make the uplink an https connection far away (see sim_http_set_delays), --cold
+// has the server close every connection and no tls session resumed, like a new client for every post;
+// --ble-call delays the answer to every bluetooth call (see sim_ble_set_call_delay), for boot to advertising;
+// --no-spool runs the firmware without its spool partition; --transport coap has the bench post over CoAP
+// to the server of coap_server.c instead of http (with --url, CoAP goes to CONFIG_UPLINK_COAP_PORT);
+// --uart writes the log like the console uart at that baud rate (see sim_uart_start), for the time
+// the callbacks spend logging, reported at the end
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "esp_timer.h"
+#include "sim.h"
+#include "bulk.h"
+#include "status.h"
+
+#define CENTRALS 8
+// sequence numbers the centrals keep track of
+#define SEQ_MAX (1 << 18)
+#define RESPONSE_KEEP 256
+#define EXPECT_TIMEOUT_MS 5000
+#define BENCH_MTU 247
+#define BENCH_BACKOFF_MS 5
+
+void app_main(void);
+
+typedef struct {
+    uint32_t notifications;
+    uint32_t queued;
+    // the sequence number of the last message the firmware queued
+    uint32_t last_queued;
+    uint32_t dropped;
+    uint32_t sent;
+    uint32_t spooled;
+    uint32_t failed;
+    // http status of the last STATUS_FAILED
+    uint16_t failed_status;
+    uint32_t lost;
+    char response[RESPONSE_KEEP + 1];
+    uint16_t bulk_seq;
+} central_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static central_t centrals[CENTRALS];
+// by sequence number: the central that wrote it (plus one) and when it was queued, 0 once it is sent
+static uint8_t seq_central[SEQ_MAX];
+static int64_t seq_queued_us[SEQ_MAX];
+static uint32_t latencies_us[SEQ_MAX];
+static uint32_t latency_count = 0;
+static int64_t last_sent_us = 0;
+static FILE* report;
+
+static uint32_t get_le(const uint8_t* in, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint32_t) in[i] << (8 * i);
+    }
+    return value;
+}
+
+// A message of the central counts as sent once a status range of its own covers it
+static void mark_sent(uint16_t conn_id, uint32_t first, uint32_t last) {
+    int64_t now = esp_timer_get_time();
+    for (uint32_t seq = first; seq <= last && seq < SEQ_MAX; seq++) {
+        if (seq_central[seq] == conn_id + 1 && seq_queued_us[seq] != 0) {
+            latencies_us[latency_count++] = now - seq_queued_us[seq];
+            seq_queued_us[seq] = 0;
+            centrals[conn_id].sent++;
+            last_sent_us = now;
+        }
+    }
+}
+
+// Runs on the firmware task that sent the notification
+static void on_notify(uint16_t conn_id, const uint8_t* value, uint16_t len) {
+    if (conn_id >= CENTRALS || len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    central_t* central = &centrals[conn_id];
+    central->notifications++;
+    switch (value[0]) {
+        case STATUS_QUEUED:
+            central->queued++;
+            central->last_queued = get_le(value + 1, 4);
+            if (central->last_queued < SEQ_MAX) {
+                seq_central[central->last_queued] = conn_id + 1;
+                seq_queued_us[central->last_queued] = esp_timer_get_time();
+            }
+            break;
+        case STATUS_DROPPED:
+            central->dropped++;
+            break;
+        case STATUS_SENT:
+            mark_sent(conn_id, get_le(value + 1, 4), get_le(value + 5, 4));
+            break;
+        case STATUS_SPOOLED:
+            central->spooled++;
+            break;
+        case STATUS_FAILED:
+            central->failed++;
+            central->failed_status = len >= 11 ? get_le(value + 9, 2) : 0;
+            break;
+        case STATUS_RESPONSE: {
+            // keep the end of what came in
+            size_t have = strlen(central->response);
+            size_t add = len - 1 < RESPONSE_KEEP ? len - 1 : RESPONSE_KEEP;
+            if (have + add > RESPONSE_KEEP) {
+                memmove(central->response, central->response + have + add - RESPONSE_KEEP, RESPONSE_KEEP - add);
+                have = RESPONSE_KEEP - add;
+            }
+            memcpy(central->response + have, value + 1 + (len - 1 - add), add);
+            central->response[have + add] = '\0';
+            break;
+        }
+        case STATUS_LOST:
+            central->lost++;
+            break;
+        default:
+            break;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long) (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+// Wait until done says so or timeout_ms passed, returns what done said last
+static bool wait_for(bool (*done)(const void* arg), const void* arg, int timeout_ms) {
+    int64_t deadline = esp_timer_get_time() + (int64_t) timeout_ms * 1000;
+    while (true) {
+        pthread_mutex_lock(&lock);
+        bool ok = done(arg);
+        pthread_mutex_unlock(&lock);
+        if (ok || esp_timer_get_time() >= deadline) {
+            return ok;
+        }
+        sleep_ms(10);
+    }
+}
+
+// --- traces
+
+typedef struct {
+    int conn;
+    uint32_t count;
+    const char* text;
+} expectation_t;
+
+static bool sent_reached(const void* arg) {
+    const expectation_t* e = arg;
+    return centrals[e->conn].sent >= e->count;
+}
+
+static bool response_seen(const void* arg) {
+    const expectation_t* e = arg;
+    return strstr(centrals[e->conn].response, e->text) != NULL;
+}
+
+static bool status_seen(const void* arg) {
+    const expectation_t* e = arg;
+    const central_t* central = &centrals[e->conn];
+    return strcmp(e->text, "spooled") == 0 ? central->spooled > 0 :
+           strcmp(e->text, "dropped") == 0 ? central->dropped > 0 :
+           strcmp(e->text, "lost") == 0 ? central->lost > 0 :
+           strcmp(e->text, "failed") == 0 ? central->failed > 0 && central->failed_status == e->count : false;
+}
+
+static bool records_reached(const void* arg) {
+    const expectation_t* e = arg;
+    sim_server_stats_t stats;
+    sim_server_stats(&stats);
+    return stats.records >= e->count;
+}
+
+static bool rejected_reached(const void* arg) {
+    const expectation_t* e = arg;
+    sim_server_stats_t stats;
+    sim_server_stats(&stats);
+    return stats.rejected >= e->count;
+}
+
+static bool has_ip(const void* arg) {
+    return sim_wifi_has_ip();
+}
+
+static uint16_t attr_uuid(const char* name) {
+    static const struct {
+        const char* name;
+        uint16_t uuid;
+    } attrs[] = {
+        {"ssid", 0xAA01}, {"pass", 0xBB01}, {"msg", 0xCC01}, {"bulk", 0xCC02}, {"conn", 0xDD01},
+        {"transport", 0xDD02}, {"config", 0x2902}, {"latency", 0xEE02}, {"memory", 0xEE03},
+    };
+    for (size_t i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+        if (strcmp(attrs[i].name, name) == 0) {
+            return attrs[i].uuid;
+        }
+    }
+    return 0;
+}
+
+// Send a message of len bytes over the bulk characteristic in packets of the mtu
+static esp_gatt_status_t write_bulk(int conn, const uint8_t* message, uint16_t len) {
+    uint8_t packet[BULK_HEADER_LEN + 512];
+    uint16_t payload = sim_ble_mtu(conn) - 3 - BULK_HEADER_LEN;
+    uint16_t handle = sim_ble_handle(attr_uuid("bulk"));
+    for (uint16_t offset = 0; offset < len; offset += payload) {
+        uint16_t n = len - offset < payload ? len - offset : payload;
+        pthread_mutex_lock(&lock);
+        uint16_t seq = centrals[conn].bulk_seq++;
+        pthread_mutex_unlock(&lock);
+        packet[0] = seq & 0xFF;
+        packet[1] = seq >> 8;
+        packet[2] = (offset == 0 ? BULK_FLAG_START : 0) | (offset + n == len ? BULK_FLAG_END : 0);
+        memcpy(packet + BULK_HEADER_LEN, message + offset, n);
+        esp_gatt_status_t status = sim_ble_write(conn, handle, packet, BULK_HEADER_LEN + n, false);
+        if (status != ESP_GATT_OK) {
+            return status;
+        }
+    }
+    return ESP_GATT_OK;
+}
+
+// The next word of *rest, NULL at the end of the line; *rest is left at the word after it
+static char* next_word(char** rest) {
+    char* word = *rest + strspn(*rest, " \t");
+    if (*word == '\0') {
+        return NULL;
+    }
+    size_t len = strcspn(word, " \t");
+    *rest = word + len;
+    if (**rest != '\0') {
+        *(*rest)++ = '\0';
+        *rest += strspn(*rest, " \t");
+    }
+    return word;
+}
+
+static bool check_status(const char* what, esp_gatt_status_t status) {
+    if (status != ESP_GATT_OK) {
+        printf("%s failed with status 0x%02x\n", what, status);
+    }
+    return status == ESP_GATT_OK;
+}
+
+// Fill message with len bytes of the alphabet
+static void make_message(uint8_t* message, int len) {
+    for (int i = 0; i < len; i++) {
+        message[i] = 'a' + i % 26;
+    }
+}
+
+static bool run_expect(char* rest) {
+    char* what = next_word(&rest);
+    expectation_t e = {0};
+    if (what == NULL) {
+        return false;
+    }
+    if (strcmp(what, "ip") == 0) {
+        return wait_for(has_ip, NULL, EXPECT_TIMEOUT_MS * 4) || (printf("no ip\n"), false);
+    }
+    if (strcmp(what, "rejected") == 0) {
+        // at least that many posts got an error status
+        e.count = atoi(rest);
+        return wait_for(rejected_reached, &e, EXPECT_TIMEOUT_MS * 4) || (printf("too few posts rejected\n"), false);
+    }
+    if (strcmp(what, "fragmented") == 0) {
+        // at least that many coap datagrams didn't fit into one ip packet
+        sim_server_stats_t stats;
+        sim_server_stats(&stats);
+        return stats.fragmented >= (uint32_t) atoi(rest) || (printf("%u datagrams fragmented\n", stats.fragmented), false);
+    }
+    if (strcmp(what, "records") == 0 || strcmp(what, "duplicates") == 0) {
+        e.count = atoi(rest);
+        sim_server_stats_t stats;
+        bool ok = what[0] == 'r' ? wait_for(records_reached, &e, EXPECT_TIMEOUT_MS * 4) : true;
+        sim_server_stats(&stats);
+        ok = ok && (what[0] == 'r' || stats.duplicates == e.count);
+        if (!ok) {
+            printf("server got %u records and %u duplicates\n", stats.records, stats.duplicates);
+        }
+        return ok;
+    }
+    char* conn = next_word(&rest);
+    if (conn == NULL || atoi(conn) < 0 || atoi(conn) >= CENTRALS) {
+        return false;
+    }
+    e.conn = atoi(conn);
+    central_t* central = &centrals[e.conn];
+    if (strcmp(what, "sent") == 0) {
+        e.count = atoi(rest);
+        if (!wait_for(sent_reached, &e, EXPECT_TIMEOUT_MS * 6)) {
+            printf("connection %d got %u of its messages reported sent, not %u\n", e.conn, central->sent, e.count);
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(what, "unsent") == 0) {
+        // exactly that many of the queued messages aren't reported sent (yet)
+        pthread_mutex_lock(&lock);
+        uint32_t unsent = central->queued - central->sent;
+        pthread_mutex_unlock(&lock);
+        return unsent == (uint32_t) atoi(rest) || (printf("connection %d has %u messages unsent\n", e.conn, unsent), false);
+    }
+    if (strcmp(what, "response") == 0) {
+        e.text = rest;
+        if (!wait_for(response_seen, &e, EXPECT_TIMEOUT_MS)) {
+            printf("connection %d got no response \"%s\", the last was \"%s\"\n", e.conn, e.text, central->response);
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(what, "quiet") == 0) {
+        pthread_mutex_lock(&lock);
+        uint32_t notifications = central->notifications;
+        pthread_mutex_unlock(&lock);
+        return notifications == 0 || (printf("connection %d got %u notifications\n", e.conn, notifications), false);
+    }
+    // at least one status of the kind, the spool only gets to work once the wifi wait is over; failed
+    // takes the http status it has to come with
+    e.text = what;
+    e.count = atoi(rest);
+    return wait_for(status_seen, &e, EXPECT_TIMEOUT_MS * 4) || (printf("connection %d got no %s status\n", e.conn, what), false);
+}
+
+static void report_callback(const char* name, const sim_callback_time_t* time) {
+    if (time->calls > 0) {
+        fprintf(report, "  %s: %u calls, mean %.1f us, max %.1f us\n", name, time->calls, time->total_ns / 1e3 / time->calls, time->max_ns / 1e3);
+    }
+}
+
+// Time the firmware spent in its bluetooth and wifi callbacks, logging included
+static void report_callbacks(void) {
+    sim_callback_time_t gatts;
+    sim_callback_time_t events;
+    sim_ble_gatts_time(&gatts);
+    sim_event_handler_time(&events);
+    report_callback("gatts_event_handler", &gatts);
+    report_callback("wifi_event_handler", &events);
+}
+
+// Run one line of a trace, returns false (after saying why) if it failed
+static bool run_line(char* line) {
+    char* rest = line;
+    char* cmd = next_word(&rest);
+    if (cmd == NULL) {
+        return true;
+    }
+    if (strcmp(cmd, "ap") == 0) {
+        char* ssid = next_word(&rest);
+        char* password = next_word(&rest);
+        sim_wifi_set_ap(ssid, password != NULL && strcmp(password, "-") != 0 ? password : NULL);
+        return true;
+    }
+    if (strcmp(cmd, "server") == 0) {
+        // server close | keep_alive | status <code>
+        char* what = next_word(&rest);
+        if (what != NULL && strcmp(what, "status") == 0) {
+            sim_server_set_status(atoi(rest));
+        } else {
+            sim_server_set_keep_alive(what == NULL || strcmp(what, "close") != 0);
+        }
+        return true;
+    }
+    if (strcmp(cmd, "wait") == 0) {
+        sleep_ms(atoi(rest));
+        return true;
+    }
+    if (strcmp(cmd, "expect") == 0) {
+        return run_expect(rest);
+    }
+
+    // the rest are done by a central
+    char* conn_word = next_word(&rest);
+    int conn = conn_word != NULL ? atoi(conn_word) : -1;
+    if (conn < 0 || conn >= CENTRALS) {
+        printf("no such central\n");
+        return false;
+    }
+    if (strcmp(cmd, "connect") == 0) {
+        // the firmware restarts advertising after every connection
+        if (!sim_ble_wait_advertising(EXPECT_TIMEOUT_MS) || !sim_ble_connect(conn)) {
+            printf("nobody is advertising\n");
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(cmd, "disconnect") == 0) {
+        sim_ble_disconnect(conn);
+        return true;
+    }
+    if (strcmp(cmd, "mtu") == 0) {
+        sim_ble_set_mtu(conn, atoi(rest));
+        return true;
+    }
+    if (strcmp(cmd, "subscribe") == 0) {
+        const uint8_t value[] = {0x01, 0x00};
+        return check_status(cmd, sim_ble_write(conn, sim_ble_handle(attr_uuid("config")), value, sizeof(value), true));
+    }
+    if (strcmp(cmd, "send") == 0) {
+        // a message without response, the status notifications tell what became of it
+        return check_status(cmd, sim_ble_write(conn, sim_ble_handle(attr_uuid("msg")), (const uint8_t*) rest, strlen(rest), false));
+    }
+    if (strcmp(cmd, "write") == 0) {
+        char* attr = next_word(&rest);
+        uint16_t uuid = attr != NULL ? attr_uuid(attr) : 0;
+        uint8_t value[1] = {atoi(rest)};
+        if (uuid == 0) {
+            printf("no such attribute\n");
+            return false;
+        }
+        // the transport is selected with its number in a single byte
+        if (strcmp(attr, "transport") == 0) {
+            return check_status(cmd, sim_ble_write(conn, sim_ble_handle(uuid), value, 1, true));
+        }
+        return check_status(cmd, sim_ble_write(conn, sim_ble_handle(uuid), (const uint8_t*) rest, strlen(rest), true));
+    }
+    if (strcmp(cmd, "long") == 0 || strcmp(cmd, "bulk") == 0) {
+        // a message of n bytes, too long for a single write
+        uint8_t message[1024];
+        int len = atoi(rest);
+        if (len <= 0 || len > (int) sizeof(message)) {
+            printf("length out of range\n");
+            return false;
+        }
+        make_message(message, len);
+        if (cmd[0] == 'l') {
+            return check_status(cmd, sim_ble_write_long(conn, sim_ble_handle(attr_uuid("msg")), message, len));
+        }
+        return check_status(cmd, write_bulk(conn, message, len));
+    }
+    if (strcmp(cmd, "burst") == 0) {
+        // burst <c> <count> <gap_ms>: numbered messages without response, text so they aren't aggregated
+        int n = atoi(next_word(&rest) ?: "0");
+        int gap_ms = atoi(rest);
+        uint16_t handle = sim_ble_handle(attr_uuid("msg"));
+        for (int i = 0; i < n; i++) {
+            char text[32];
+            int len = snprintf(text, sizeof(text), "burst %d of %d", i + 1, n);
+            if (!check_status(cmd, sim_ble_write(conn, handle, (const uint8_t*) text, len, false))) {
+                return false;
+            }
+            if (gap_ms > 0) {
+                sleep_ms(gap_ms);
+            }
+        }
+        return true;
+    }
+    if (strcmp(cmd, "read") == 0) {
+        uint8_t value[512];
+        uint16_t len = sizeof(value);
+        uint16_t uuid = attr_uuid(rest);
+        if (uuid == 0 || !check_status(cmd, sim_ble_read(conn, sim_ble_handle(uuid), value, &len))) {
+            return false;
+        }
+        printf("%s: %u bytes\n", rest, len);
+        return len > 0;
+    }
+    printf("unknown command\n");
+    return false;
+}
+
+static int run_trace(const char* path) {
+    FILE* trace = fopen(path, "r");
+    if (trace == NULL) {
+        fprintf(report, "Can't open %s\n", path);
+        return 1;
+    }
+    char line[600];
+    int number = 0;
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        number++;
+        line[strcspn(line, "\r\n#")] = '\0';
+        char copy[sizeof(line)];
+        strcpy(copy, line);
+        if (line[strspn(line, " \t")] != '\0') {
+            printf("trace %d: %s\n", number, line);
+        }
+        if (!run_line(line)) {
+            fflush(stdout);
+            fprintf(report, "%s:%d: failed: %s (see the log)\n", path, number, copy);
+            fclose(trace);
+            return 1;
+        }
+    }
+    fclose(trace);
+    sim_server_stats_t stats;
+    sim_server_stats(&stats);
+    fprintf(report, "%s: passed, %u records in %u posts over %u connections\n", path, stats.records, stats.requests, stats.connections);
+    report_callbacks();
+    return 0;
+}
+
+// --- benchmark
+
+typedef struct {
+    int conn;
+    int messages;
+    int size;
+    uint32_t retries;
+} bench_central_t;
+
+static void* bench_central(void* arg) {
+    bench_central_t* b = arg;
+    uint8_t message[512];
+    uint16_t handle = sim_ble_handle(attr_uuid("msg"));
+    for (int i = 0; i < b->messages; i++) {
+        // text, so the aggregator leaves it alone
+        int len = snprintf((char*) message, sizeof(message), "central %d message %d ", b->conn, i);
+        while (len < b->size) {
+            message[len++] = 'x';
+        }
+        while (true) {
+            esp_gatt_status_t status = sim_ble_write(b->conn, handle, message, b->size, true);
+            if (status == ESP_GATT_OK) {
+                break;
+            }
+            // the firmware is out of buffers (or the queue of this connection is full), try again a bit later
+            b->retries++;
+            sleep_ms(BENCH_BACKOFF_MS);
+        }
+    }
+    return NULL;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    uint32_t count;
+} all_sent_t;
+
+static bool all_sent(const void* arg) {
+    return latency_count >= ((const all_sent_t*) arg)->count;
+}
+
+static int run_bench(int centrals_n, int messages, int size, bool keep_alive, bool coap) {
+    if (centrals_n < 1 || centrals_n > CENTRALS || messages < 1 || (uint32_t) (centrals_n * messages) >= SEQ_MAX || size < 24 || size > BENCH_MTU - 3) {
+        fprintf(report, "Benchmark parameters out of range\n");
+        return 1;
+    }
+    sim_server_set_keep_alive(keep_alive);
+    sim_wifi_set_ap("bench", "benchpass");
+    for (int c = 0; c < centrals_n; c++) {
+        if (!sim_ble_wait_advertising(EXPECT_TIMEOUT_MS) || !sim_ble_connect(c)) {
+            fprintf(report, "Couldn't connect central %d\n", c);
+            return 1;
+        }
+        sim_ble_set_mtu(c, BENCH_MTU);
+        const uint8_t config[] = {0x01, 0x00};
+        sim_ble_write(c, sim_ble_handle(attr_uuid("config")), config, sizeof(config), true);
+    }
+    char setup[][32] = {"write 0 ssid bench", "write 0 pass benchpass", "write 0 conn 1"};
+    for (size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); i++) {
+        run_line(setup[i]);
+    }
+    if (coap) {
+        char select[] = "write 0 transport 1";
+        run_line(select);
+    }
+    if (!wait_for(has_ip, NULL, EXPECT_TIMEOUT_MS * 4)) {
+        fprintf(report, "The firmware didn't connect to the access point\n");
+        return 1;
+    }
+
+    static bench_central_t bench[CENTRALS];
+    pthread_t threads[CENTRALS];
+    sim_server_stats_t before;
+    sim_server_stats(&before);
+    uint64_t allocations = sim_heap_allocations();
+    int64_t started_us = esp_timer_get_time();
+    for (int c = 0; c < centrals_n; c++) {
+        bench[c] = (bench_central_t) {.conn = c, .messages = messages, .size = size};
+        pthread_create(&threads[c], NULL, bench_central, &bench[c]);
+    }
+    uint32_t retries = 0;
+    for (int c = 0; c < centrals_n; c++) {
+        pthread_join(threads[c], NULL);
+        retries += bench[c].retries;
+    }
+    all_sent_t total = {.count = centrals_n * messages};
+    bool complete = wait_for(all_sent, &total, 30000);
+    pthread_mutex_lock(&lock);
+    uint32_t sent = latency_count;
+    double seconds = (last_sent_us - started_us) / 1e6;
+    qsort(latencies_us, latency_count, sizeof(latencies_us[0]), compare_u32);
+    pthread_mutex_unlock(&lock);
+    allocations = sim_heap_allocations() - allocations;
+    sim_server_stats_t after;
+    sim_server_stats(&after);
+    uint32_t posts = after.requests - before.requests;
+
+    if (coap) {
+        fprintf(report, "%d centrals x %d messages of %d bytes, coap\n", centrals_n, messages, size);
+    } else {
+        fprintf(report, "%d centrals x %d messages of %d bytes, http, server %s\n", centrals_n, messages, size, keep_alive ? "keeping connections alive" : "closing connections");
+    }
+    fprintf(report, "  %u of %u messages sent in %.2f s: %.0f messages/s, %u writes retried\n", sent, total.count, seconds, sent / seconds, retries);
+    if (sent > 0) {
+        fprintf(report, "  latency from queued to sent (ms): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+                latencies_us[sent / 2] / 1e3, latencies_us[sent * 9 / 10] / 1e3, latencies_us[sent * 99 / 100] / 1e3, latencies_us[sent - 1] / 1e3);
+    }
+    fprintf(report, "  %u posts over %u connections, %.1f messages and %.0f body bytes per post (%.0f before inflating)\n",
+            posts, after.connections - before.connections, (double) sent / posts, (double) (after.bytes - before.bytes) / posts,
+            (double) (after.inflated_bytes - before.inflated_bytes) / posts);
+    fprintf(report, "  %.0f bytes on the wire per post and %.1f per message, requests and responses with their headers\n",
+            (double) (after.wire_bytes - before.wire_bytes) / posts, (double) (after.wire_bytes - before.wire_bytes) / sent);
+    if (after.datagrams > before.datagrams) {
+        // the posts aren't deflated, a datagram above the mtu is only delivered if all of its fragments are
+        fprintf(report, "  %u datagrams, %u of them fragmented by ip (1500 byte mtu) into %u fragments in all\n", after.datagrams - before.datagrams,
+                after.fragmented - before.fragmented, after.ip_fragments - before.ip_fragments);
+    }
+    fprintf(report, "  %.2f allocations per message (%llu since boot), %u duplicates\n", (double) allocations / sent,
+            (unsigned long long) sim_heap_allocations(), after.duplicates);
+    uint32_t full_handshakes;
+    uint32_t resumed_handshakes;
+    sim_http_handshakes(&full_handshakes, &resumed_handshakes);
+    if (full_handshakes + resumed_handshakes > 0) {
+        fprintf(report, "  %u full and %u resumed tls handshakes\n", full_handshakes, resumed_handshakes);
+    }
+    report_callbacks();
+    return complete && after.duplicates == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    const char* log_path = "sim.log";
+    const char* trace = NULL;
+    const char* url = NULL;
+    bool bench = false;
+    bool keep_alive = true;
+    int centrals_n = 3;
+    int messages = 1000;
+    int size = 40;
+    int rtt_ms = 0;
+    int handshake_ms = 0;
+    bool cold = false;
+    bool spool = true;
+    int ble_call_ms = 0;
+    bool coap = false;
+    int uart_baud = 0;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--log") == 0 && has_value) {
+            log_path = argv[++i];
+        } else if (strcmp(argv[i], "--url") == 0 && has_value) {
+            url = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--centrals") == 0 && has_value) {
+            centrals_n = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--messages") == 0 && has_value) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && has_value) {
+            size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && has_value) {
+            keep_alive = strcmp(argv[++i], "close") != 0;
+        } else if (strcmp(argv[i], "--rtt") == 0 && has_value) {
+            rtt_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--handshake") == 0 && has_value) {
+            handshake_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cold") == 0) {
+            cold = true;
+            keep_alive = false;
+        } else if (strcmp(argv[i], "--no-spool") == 0) {
+            spool = false;
+        } else if (strcmp(argv[i], "--ble-call") == 0 && has_value) {
+            ble_call_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--uart") == 0 && has_value) {
+            uart_baud = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--transport") == 0 && has_value) {
+            coap = strcmp(argv[++i], "coap") == 0;
+        } else if (argv[i][0] != '-') {
+            trace = argv[i];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (trace == NULL && !bench) {
+        fprintf(stderr, "usage: %s [--log file] [--url host:port] [--ble-call ms] [--no-spool] [--uart baud] (trace | --bench [--centrals n] [--messages n] [--size bytes] [--server close] [--rtt ms] [--handshake ms] [--cold] [--transport coap])\n", argv[0]);
+        return 2;
+    }
+
+    // the firmware prints to stdout, the report goes where stdout went
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    setvbuf(report, NULL, _IOLBF, 0);
+    if (uart_baud > 0) {
+        FILE* log = fopen(log_path, "w");
+        if (log == NULL || !sim_uart_start(log, uart_baud)) {
+            fprintf(report, "Can't write %s\n", log_path);
+            return 1;
+        }
+    } else if (freopen(log_path, "w", stdout) == NULL) {
+        fprintf(report, "Can't write %s\n", log_path);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (url != NULL) {
+        // the host of the url is the one of CONFIG_UPLINK_POST_URL, only the port can be changed
+        const char* port = strrchr(url, ':');
+        sim_http_set_port(atoi(port != NULL ? port + 1 : url));
+    } else {
+        int port = sim_server_start(0);
+        if (port < 0) {
+            fprintf(report, "Can't start the server\n");
+            return 1;
+        }
+        sim_http_set_port(port);
+        // the coap round trip is the server answering rtt_ms late, there is no handshake
+        if (sim_coap_server_start(0, rtt_ms) < 0) {
+            fprintf(report, "Can't start the coap server\n");
+            return 1;
+        }
+    }
+    sim_http_set_delays(rtt_ms, handshake_ms, !cold);
+    sim_ble_set_notify_handler(on_notify);
+    sim_ble_set_call_delay(ble_call_ms);
+    sim_spool_set_present(spool);
+
+    // app_main runs on the main task
+    sim_thread_set_firmware(true);
+    app_main();
+    sim_thread_set_firmware(false);
+    if (!sim_ble_wait_advertising(EXPECT_TIMEOUT_MS)) {
+        fprintf(report, "The firmware isn't advertising\n");
+        return 1;
+    }
+    fprintf(report, "boot to advertising: %.1f ms, %u bluetooth events\n", esp_timer_get_time() / 1e3, sim_ble_bringup_events());
+    int result = bench ? run_bench(centrals_n, messages, size, keep_alive, coap) : run_trace(trace);
+    fflush(stdout);
+    // the firmware tasks never end
+    _exit(result);
+}
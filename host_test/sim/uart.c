@@ -0,0 +1,48 @@
+// stdout as the console uart of the chip: the log still goes to a file, but a write blocks like the
+// uart's blocking write does once its fifo is full, so logging costs the task that logs what it would
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "sim.h"
+
+#define UART_FIFO_BYTES 128
+// a start bit, 8 data bits and a stop bit
+#define UART_BITS_PER_BYTE 10
+
+static FILE* out;
+static int64_t byte_ns;
+// when the fifo has sent everything written so far
+static int64_t drained_ns = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ssize_t uart_write(void* cookie, const char* data, size_t len) {
+    fwrite(data, 1, len, out);
+    fflush(out);
+    pthread_mutex_lock(&lock);
+    int64_t now = sim_monotonic_ns();
+    int64_t queued_ns = drained_ns > now ? drained_ns - now : 0;
+    // the bytes that don't fit into the fifo yet are waited for
+    int64_t wait_ns = queued_ns + (int64_t) len * byte_ns - UART_FIFO_BYTES * byte_ns;
+    drained_ns = now + queued_ns + (int64_t) len * byte_ns;
+    pthread_mutex_unlock(&lock);
+    if (wait_ns > 0) {
+        usleep(wait_ns / 1000);
+    }
+    return len;
+}
+
+bool sim_uart_start(FILE* file, int baud) {
+    if (baud <= 0) {
+        return false;
+    }
+    out = file;
+    byte_ns = 1000000000LL * UART_BITS_PER_BYTE / baud;
+    FILE* uart = fopencookie(NULL, "w", (cookie_io_functions_t) {.write = uart_write});
+    if (uart == NULL) {
+        return false;
+    }
+    setvbuf(uart, NULL, _IOLBF, 0);
+    stdout = uart;
+    return true;
+}
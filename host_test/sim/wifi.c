@@ -0,0 +1,269 @@
+// The wifi station and the default event loop: connecting takes a scan (or a fast connect to the
+// cached access point) and dhcp, and fails like the driver does when the access point isn't there
+// or the password is wrong
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "sim.h"
+
+#define SIM_EVENT_HANDLERS 8
+#define SIM_SCAN_US 200000
+#define SIM_FAST_CONNECT_US 30000
+#define SIM_DHCP_US 20000
+#define SIM_AP_CHANNEL 6
+
+// reasons of wifi_err_reason_t
+#define REASON_ASSOC_LEAVE 8
+#define REASON_4WAY_HANDSHAKE_TIMEOUT 15
+#define REASON_BEACON_TIMEOUT 200
+#define REASON_NO_AP_FOUND 201
+
+esp_event_base_t const WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+typedef enum {
+    STA_OFF,
+    STA_IDLE,
+    STA_CONNECTING,
+    STA_CONNECTED,
+    STA_GOT_IP,
+} sta_state_t;
+
+typedef struct {
+    esp_event_base_t base;
+    int32_t id;
+    esp_event_handler_t handler;
+    void* arg;
+} handler_t;
+
+typedef struct {
+    esp_event_base_t base;
+    int32_t id;
+    union {
+        wifi_event_sta_connected_t connected;
+        wifi_event_sta_disconnected_t disconnected;
+    } data;
+} event_job_t;
+
+static const uint8_t ap_bssid[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_worker_t* event_loop = NULL;
+static sim_worker_t* wifi_task = NULL;
+static handler_t handlers[SIM_EVENT_HANDLERS];
+static int handler_count = 0;
+static struct sim_netif {
+    int unused;
+} netif;
+
+static sta_state_t state = STA_OFF;
+// a later attempt, disconnect or loss of the access point makes the jobs of an earlier one void
+static uint32_t attempt = 0;
+static wifi_sta_config_t sta_config;
+static bool ap_present = false;
+static char ap_ssid[33];
+static char ap_password[65];
+static uint32_t ip_session = 0;
+static sim_callback_time_t handler_time;
+
+static void run_event(void* data) {
+    event_job_t* job = data;
+    pthread_mutex_lock(&lock);
+    int count = handler_count;
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < count; i++) {
+        if (handlers[i].base == job->base && (handlers[i].id == ESP_EVENT_ANY_ID || handlers[i].id == job->id)) {
+            int64_t started_ns = sim_monotonic_ns();
+            handlers[i].handler(handlers[i].arg, job->base, job->id, &job->data);
+            pthread_mutex_lock(&lock);
+            sim_callback_time_add(&handler_time, started_ns);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+}
+
+static void post_event(esp_event_base_t base, int32_t id, const event_job_t* job) {
+    event_job_t copy = job != NULL ? *job : (event_job_t) {0};
+    copy.base = base;
+    copy.id = id;
+    sim_worker_post(event_loop, 0, run_event, &copy, sizeof(copy));
+}
+
+// Drop the station back to idle and tell the firmware why, with lock held
+static void lose_connection(uint8_t reason) {
+    state = STA_IDLE;
+    attempt++;
+    event_job_t job = {0};
+    size_t len = strnlen((const char*) sta_config.ssid, sizeof(sta_config.ssid));
+    memcpy(job.data.disconnected.ssid, sta_config.ssid, len);
+    job.data.disconnected.ssid_len = len;
+    job.data.disconnected.reason = reason;
+    post_event(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &job);
+}
+
+static void dhcp_done(void* data) {
+    uint32_t of = *(uint32_t*) data;
+    pthread_mutex_lock(&lock);
+    if (of == attempt && state == STA_CONNECTED) {
+        state = STA_GOT_IP;
+        ip_session++;
+        post_event(IP_EVENT, IP_EVENT_STA_GOT_IP, NULL);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void connect_done(void* data) {
+    uint32_t of = *(uint32_t*) data;
+    pthread_mutex_lock(&lock);
+    if (of != attempt || state != STA_CONNECTING) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    bool found = ap_present && strncmp(ap_ssid, (const char*) sta_config.ssid, sizeof(sta_config.ssid)) == 0;
+    // a fast connect only looks at the cached access point
+    if (sta_config.bssid_set && (memcmp(sta_config.bssid, ap_bssid, sizeof(ap_bssid)) != 0 || sta_config.channel != SIM_AP_CHANNEL)) {
+        found = false;
+    }
+    if (!found) {
+        lose_connection(REASON_NO_AP_FOUND);
+    } else if (strncmp(ap_password, (const char*) sta_config.password, sizeof(sta_config.password)) != 0) {
+        lose_connection(REASON_4WAY_HANDSHAKE_TIMEOUT);
+    } else {
+        state = STA_CONNECTED;
+        event_job_t job = {0};
+        size_t len = strlen(ap_ssid);
+        memcpy(job.data.connected.ssid, ap_ssid, len);
+        job.data.connected.ssid_len = len;
+        memcpy(job.data.connected.bssid, ap_bssid, sizeof(ap_bssid));
+        job.data.connected.channel = SIM_AP_CHANNEL;
+        post_event(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &job);
+        sim_worker_post(wifi_task, SIM_DHCP_US, dhcp_done, &of, sizeof(of));
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// --- the api of the firmware
+
+esp_err_t esp_netif_init(void) {
+    return ESP_OK;
+}
+
+esp_netif_t* esp_netif_create_default_wifi_sta(void) {
+    return &netif;
+}
+
+esp_err_t esp_event_loop_create_default(void) {
+    if (event_loop != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    event_loop = sim_worker_start("sys_evt");
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_instance_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void* arg, esp_event_handler_instance_t* instance) {
+    pthread_mutex_lock(&lock);
+    if (handler_count == SIM_EVENT_HANDLERS) {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_NO_MEM;
+    }
+    handlers[handler_count++] = (handler_t) {.base = base, .id = id, .handler = handler, .arg = arg};
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init(const wifi_init_config_t* config) {
+    wifi_task = sim_worker_start("wifi");
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface, wifi_config_t* config) {
+    pthread_mutex_lock(&lock);
+    sta_config = config->sta;
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    pthread_mutex_lock(&lock);
+    bool was_off = state == STA_OFF;
+    if (was_off) {
+        state = STA_IDLE;
+        post_event(WIFI_EVENT, WIFI_EVENT_STA_START, NULL);
+    }
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+// a connect while connecting or connected starts over with the current config
+esp_err_t esp_wifi_connect(void) {
+    pthread_mutex_lock(&lock);
+    if (state == STA_OFF) {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_WIFI_NOT_STARTED;
+    }
+    state = STA_CONNECTING;
+    uint32_t of = ++attempt;
+    int64_t delay_us = sta_config.bssid_set ? SIM_FAST_CONNECT_US : SIM_SCAN_US;
+    pthread_mutex_unlock(&lock);
+    sim_worker_post(wifi_task, delay_us, connect_done, &of, sizeof(of));
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_disconnect(void) {
+    pthread_mutex_lock(&lock);
+    if (state == STA_OFF) {
+        pthread_mutex_unlock(&lock);
+        return ESP_ERR_WIFI_NOT_STARTED;
+    }
+    if (state != STA_IDLE) {
+        lose_connection(REASON_ASSOC_LEAVE);
+    }
+    pthread_mutex_unlock(&lock);
+    return ESP_OK;
+}
+
+// --- the access point
+
+void sim_wifi_set_ap(const char* ssid, const char* password) {
+    pthread_mutex_lock(&lock);
+    ap_present = ssid != NULL;
+    snprintf(ap_ssid, sizeof(ap_ssid), "%s", ssid != NULL ? ssid : "");
+    snprintf(ap_password, sizeof(ap_password), "%s", password != NULL ? password : "");
+    // a station on the old access point loses it
+    if (state == STA_CONNECTED || state == STA_GOT_IP) {
+        lose_connection(REASON_BEACON_TIMEOUT);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+bool sim_wifi_has_ip(void) {
+    pthread_mutex_lock(&lock);
+    bool has_ip = state == STA_GOT_IP;
+    pthread_mutex_unlock(&lock);
+    return has_ip;
+}
+
+uint32_t sim_wifi_ip_session(void) {
+    pthread_mutex_lock(&lock);
+    uint32_t session = ip_session;
+    pthread_mutex_unlock(&lock);
+    return session;
+}
+
+void sim_event_handler_time(sim_callback_time_t* time) {
+    pthread_mutex_lock(&lock);
+    *time = handler_time;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,158 @@
+// Threads of the simulation and workers: a thread running posted jobs in the order they are due
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "esp_timer.h"
+#include "sim.h"
+
+// job slots per worker, the last SIM_WORKER_RESERVED are left to the worker posting to itself
+#define SIM_WORKER_JOBS 256
+#define SIM_WORKER_RESERVED 32
+#define SIM_WORKERS 6
+
+typedef struct {
+    bool used;
+    int64_t due_us;
+    // jobs due at the same time run in the order they were posted
+    uint64_t order;
+    sim_job_t job;
+    size_t len;
+    uint8_t data[SIM_JOB_DATA];
+} sim_job_slot_t;
+
+struct sim_worker {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int used;
+    uint64_t next_order;
+    sim_job_slot_t jobs[SIM_WORKER_JOBS];
+};
+
+typedef struct {
+    void* (*run)(void*);
+    void* arg;
+    bool firmware;
+} sim_thread_args_t;
+
+// static, so they don't count as allocations of the firmware
+static sim_worker_t workers[SIM_WORKERS];
+static int worker_count = 0;
+static __thread sim_worker_t* current_worker = NULL;
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* thread_main(void* arg) {
+    sim_thread_args_t args = *(sim_thread_args_t*) arg;
+    free(arg);
+    sim_thread_set_firmware(args.firmware);
+    return args.run(args.arg);
+}
+
+void sim_thread_start(const char* name, void* (*run)(void*), void* arg, bool firmware) {
+    sim_thread_args_t* args = malloc(sizeof(sim_thread_args_t));
+    args->run = run;
+    args->arg = arg;
+    args->firmware = firmware;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, thread_main, args) != 0) {
+        printf("Couldn't start thread %s\n", name);
+        abort();
+    }
+    pthread_setname_np(thread, name);
+    pthread_detach(thread);
+}
+
+static struct timespec monotonic_at(int64_t us) {
+    // esp_timer_get_time counts from the start of the process on CLOCK_MONOTONIC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t at = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000 + (us - esp_timer_get_time());
+    struct timespec ts = {.tv_sec = at / 1000000, .tv_nsec = (at % 1000000) * 1000};
+    return ts;
+}
+
+static void* worker_main(void* arg) {
+    sim_worker_t* worker = arg;
+    current_worker = worker;
+    static __thread uint8_t data[SIM_JOB_DATA];
+    pthread_mutex_lock(&worker->lock);
+    while (true) {
+        sim_job_slot_t* next = NULL;
+        for (int i = 0; i < SIM_WORKER_JOBS; i++) {
+            sim_job_slot_t* slot = &worker->jobs[i];
+            if (slot->used && (next == NULL || slot->due_us < next->due_us || (slot->due_us == next->due_us && slot->order < next->order))) {
+                next = slot;
+            }
+        }
+        if (next == NULL) {
+            pthread_cond_wait(&worker->changed, &worker->lock);
+            continue;
+        }
+        if (next->due_us > esp_timer_get_time()) {
+            struct timespec due = monotonic_at(next->due_us);
+            pthread_cond_timedwait(&worker->changed, &worker->lock, &due);
+            continue;
+        }
+        sim_job_t job = next->job;
+        memcpy(data, next->data, next->len);
+        next->used = false;
+        worker->used--;
+        pthread_cond_broadcast(&worker->changed);
+        pthread_mutex_unlock(&worker->lock);
+        job(data);
+        pthread_mutex_lock(&worker->lock);
+    }
+    return NULL;
+}
+
+sim_worker_t* sim_worker_start(const char* name) {
+    pthread_mutex_lock(&workers_lock);
+    if (worker_count == SIM_WORKERS) {
+        printf("Too many workers\n");
+        abort();
+    }
+    sim_worker_t* worker = &workers[worker_count++];
+    pthread_mutex_unlock(&workers_lock);
+    pthread_condattr_t attr;
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&worker->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    // the workers play tasks of ESP-IDF
+    sim_thread_start(name, worker_main, worker, true);
+    return worker;
+}
+
+void sim_worker_post(sim_worker_t* worker, int64_t delay_us, sim_job_t job, const void* data, size_t len) {
+    if (len > SIM_JOB_DATA) {
+        printf("Job data too long: %zu bytes\n", len);
+        abort();
+    }
+    int64_t due_us = esp_timer_get_time() + delay_us;
+    pthread_mutex_lock(&worker->lock);
+    bool own = current_worker == worker;
+    // others wait for room, so the worker itself never has to
+    while (worker->used >= SIM_WORKER_JOBS - (own ? 0 : SIM_WORKER_RESERVED)) {
+        if (own) {
+            printf("Worker posted too many jobs to itself\n");
+            abort();
+        }
+        pthread_cond_wait(&worker->changed, &worker->lock);
+    }
+    sim_job_slot_t* slot = worker->jobs;
+    while (slot->used) {
+        slot++;
+    }
+    slot->used = true;
+    slot->due_us = due_us;
+    slot->order = worker->next_order++;
+    slot->job = job;
+    slot->len = len;
+    memcpy(slot->data, data, len);
+    worker->used++;
+    pthread_cond_broadcast(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+}
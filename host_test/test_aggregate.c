@@ -0,0 +1,248 @@
+// Window aggregation: off by default, summaries, the status of folded samples, and samples/s and uplink
+// bytes per message with and without it
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "test.h"
+#include "aggregate.h"
+#include "batch.h"
+#include "conn.h"
+
+#define MESSAGES 20000
+#define STEP_MS 3
+
+static const uint8_t device_id[] = {1, 2, 3, 4, 5, 6};
+
+static void test_summary(void) {
+    agg_t agg;
+    agg_summary_t summary;
+    char text[AGG_SUMMARY_MAX];
+    agg_init(&agg, 1000, 1, 0, 1);
+    CHECK(agg_add(&agg, 0, (const uint8_t*) "temp=20", 7, 0, 1));
+    CHECK(agg_add(&agg, 0, (const uint8_t*) " temp: 22.5 ", 12, 1, 2));
+    CHECK(agg_add(&agg, 0, (const uint8_t*) "21", 2, 2, 3));
+    CHECK(!agg_add(&agg, 0, (const uint8_t*) "hello", 5, 3, 4));
+    CHECK(!agg_add(&agg, 0, (const uint8_t*) "temp=1x", 7, 4, 5));
+    CHECK(!agg_next_summary(&agg, 999, &summary));
+
+    // temp took the first stream, the unnamed one the second
+    CHECK(agg_next_summary(&agg, 1000, &summary));
+    CHECK(strcmp(summary.name, "temp") == 0);
+    CHECK_EQ(summary.count, 2);
+    CHECK(summary.min == 20 && summary.max == 22.5f && summary.last == 22.5f);
+    CHECK(fabsf(summary.mean - 21.25f) < 1e-5f);
+    CHECK_EQ(summary.last_seq, 2);
+    CHECK(summary.runs == NULL);
+    CHECK(agg_format(&summary, text, sizeof(text)) > 0);
+    CHECK(strncmp(text, "{\"agg\":\"temp\",\"n\":2,", 20) == 0);
+
+    // the last summary of the pane reports all of its samples: 1..3 of slot 0, one run
+    CHECK(agg_next_summary(&agg, 1000, &summary));
+    CHECK_EQ(summary.count, 1);
+    CHECK(summary.runs != NULL);
+    CHECK_EQ(summary.runs->count, 1);
+    CHECK_EQ(summary.runs->runs[0].first, 1);
+    CHECK_EQ(summary.runs->runs[0].last, 3);
+    CHECK(!agg_next_summary(&agg, 1000, &summary));
+    CHECK(!agg_next_summary(&agg, 1001, &summary));
+}
+
+static void test_runs_full(void) {
+    agg_t agg;
+    agg_summary_t summary;
+    agg_init(&agg, 1000, 1, 0, 1);
+    // every sample is followed by a text message that passes through, so each one needs its own run
+    uint32_t seq = 0;
+    int folded = 0;
+    for (int i = 0; i < AGG_RUNS + 5; i++) {
+        seq += 2;
+        folded += agg_add(&agg, 0, (const uint8_t*) "7", 1, seq - 1, seq);
+    }
+    CHECK_EQ(folded, AGG_RUNS);
+    CHECK(agg_next_summary(&agg, 1000, &summary));
+    CHECK_EQ(summary.count, AGG_RUNS);
+    CHECK_EQ(summary.runs->count, AGG_RUNS);
+}
+
+// Where every message ended up and how often a status reported it
+static int message_slot[MESSAGES + 1];
+static int message_batch[MESSAGES + 1];
+static int message_reported[MESSAGES + 1];
+static int batch_number = 1;
+static uint64_t uplink_bytes;
+static int uplink_records;
+
+static void flush(batch_t* batch) {
+    if (batch->count == 0) {
+        return;
+    }
+    for (int i = 0; i < batch->runs.count; i++) {
+        const seq_run_t* run = &batch->runs.runs[i];
+        for (uint32_t seq = run->first; seq <= run->last; seq++) {
+            if (message_slot[seq] == run->slot) {
+                // a sample is in the batch of the last summary of its pane, as far as its client can tell
+                CHECK(message_batch[seq] == batch_number || message_batch[seq] == 0);
+                message_reported[seq]++;
+            }
+        }
+    }
+    uplink_bytes += batch->len;
+    uplink_records += batch->count;
+    batch_number++;
+    batch_reset(batch);
+}
+
+// Like add_to_batch
+static void add(batch_t* batch, const frame_t* frame, const seq_runs_t* runs) {
+    if (runs != NULL && batch->runs.max - batch->runs.count < runs->count) {
+        flush(batch);
+    }
+    if (!batch_add(batch, frame)) {
+        flush(batch);
+        CHECK(batch_add(batch, frame));
+    }
+    if (runs != NULL) {
+        CHECK(seq_runs_merge(&batch->runs, runs));
+        if (runs->count == 1 && runs->runs[0].first == frame->seq) {
+            message_batch[frame->seq] = batch_number;
+        }
+    }
+    if (batch_full(batch)) {
+        flush(batch);
+    }
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Three connections writing two numeric streams each and now and then some text, a message every
+// STEP_MS, through the aggregator (window_ms 0: without it) and the batches like uplink_task does
+static void run(uint32_t window_ms, int panes) {
+    static agg_t agg;
+    static batch_t batch;
+    static const char* names[] = {"temp", "hum"};
+    uint32_t slot_last_seq[CONN_MAX] = {0};
+    char text[AGG_SUMMARY_MAX];
+    char message[32];
+    agg_init(&agg, window_ms, panes, 0, 1);
+    batch_reset(&batch);
+    memset(message_batch, 0, sizeof(message_batch));
+    memset(message_reported, 0, sizeof(message_reported));
+    batch_number = 1;
+    uplink_bytes = 0;
+    uplink_records = 0;
+    srand(3);
+    uint32_t now = 0;
+    for (uint32_t seq = 1; seq <= MESSAGES; seq++) {
+        now += STEP_MS;
+        int slot = rand() % CONN_MAX;
+        message_slot[seq] = slot;
+        int len;
+        if (rand() % 100 == 0) {
+            len = snprintf(message, sizeof(message), "button %d pressed", rand() % 4);
+        } else {
+            len = snprintf(message, sizeof(message), "%s=%.1f", names[rand() % 2], 20 + (rand() % 100) / 10.0);
+        }
+        uint32_t prev = slot_last_seq[slot];
+        slot_last_seq[slot] = seq;
+        if (!agg_add(&agg, slot, (const uint8_t*) message, len, prev, seq)) {
+            frame_t frame = {
+                .device_id = device_id,
+                .device_id_len = sizeof(device_id),
+                .boot = 1234567,
+                .seq = seq,
+                .timestamp_ms = 1700000000000ull + now,
+                .payload = (const uint8_t*) message,
+                .payload_len = len,
+            };
+            seq_run_t run;
+            seq_runs_t runs;
+            seq_runs_init(&runs, &run, 1);
+            seq_runs_add(&runs, slot, prev, seq);
+            add(&batch, &frame, &runs);
+        }
+        agg_summary_t summary;
+        while (agg_next_summary(&agg, now, &summary)) {
+            frame_t frame = {
+                .device_id = device_id,
+                .device_id_len = sizeof(device_id),
+                .boot = 1234567,
+                .seq = summary.last_seq,
+                .timestamp_ms = 1700000000000ull + now,
+                .payload = (const uint8_t*) text,
+                .payload_len = agg_format(&summary, text, sizeof(text)),
+            };
+            add(&batch, &frame, summary.runs);
+        }
+    }
+    // the samples of the pane still open are reported once it is over
+    agg_summary_t summary;
+    now += window_ms;
+    while (agg_next_summary(&agg, now, &summary)) {
+        frame_t frame = {.seq = summary.last_seq, .payload = (const uint8_t*) text};
+        frame.payload_len = agg_format(&summary, text, sizeof(text));
+        add(&batch, &frame, summary.runs);
+    }
+    flush(&batch);
+    for (uint32_t seq = 1; seq <= MESSAGES; seq++) {
+        CHECK_EQ(message_reported[seq], 1);
+    }
+}
+
+// Samples of one connection and stream the aggregator takes per second, parsing included
+static double samples_per_s(void) {
+    static agg_t agg;
+    agg_summary_t summary;
+    char message[16];
+    agg_init(&agg, 1000, 1, 0, 1);
+    double started = seconds();
+    for (uint32_t seq = 1; seq <= 1000000; seq++) {
+        int len = snprintf(message, sizeof(message), "temp=%u.%u", 20 + seq % 10, seq % 7);
+        CHECK(agg_add(&agg, 0, (const uint8_t*) message, len, seq - 1, seq));
+        while (agg_next_summary(&agg, seq / 1000, &summary)) {
+        }
+    }
+    return agg.samples / (seconds() - started);
+}
+
+static void test_uplink_bytes(void) {
+    run(0, 1);
+    uint64_t raw_bytes = uplink_bytes;
+    printf("without aggregation: %d records, %.1f bytes per message\n", uplink_records, (double) raw_bytes / MESSAGES);
+    static const uint32_t windows[] = {1000, 10000};
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        for (int panes = 1; panes <= AGG_MAX_PANES; panes *= 4) {
+            run(windows[w], panes);
+            printf("window %5u ms, %d panes: %d records, %.1f bytes per message (%.0fx less)\n",
+                   windows[w], panes, uplink_records, (double) uplink_bytes / MESSAGES, (double) raw_bytes / uplink_bytes);
+            // a sliding window sends a summary every pane, still well below a record per message
+            CHECK(uplink_bytes * 2 < raw_bytes);
+        }
+    }
+    printf("%.0f samples/s into the aggregator\n", samples_per_s());
+}
+
+// Off by default: numeric messages pass through like any other
+static void test_off(void) {
+    agg_t agg;
+    agg_summary_t summary;
+    CHECK_EQ(AGG_WINDOW_MS, 0);
+    agg_init(&agg, AGG_WINDOW_MS, AGG_PANES, 0, 1);
+    CHECK(!agg_add(&agg, 0, (const uint8_t*) "temp=20", 7, 0, 1));
+    CHECK(!agg_add(&agg, 0, (const uint8_t*) "21", 2, 1, 2));
+    CHECK_EQ(agg_due_in(&agg, 60000), UINT32_MAX);
+    CHECK(!agg_next_summary(&agg, 60000, &summary));
+}
+
+int main(void) {
+    test_off();
+    test_summary();
+    test_runs_full();
+    test_uplink_bytes();
+    return test_result("aggregate");
+}
@@ -0,0 +1,203 @@
+// Batches of several interleaved connections: the records come out in order and every status a
+// connection gets covers exactly its own messages, also across spooled batches
+#include <string.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "batch.h"
+#include "conn.h"
+
+#define MESSAGES 3000
+#define SPOOL_RUNS 64
+
+// the number of the batch (1, 2, ...) a message was posted or spooled with, by sequence number
+
+static int message_slot[MESSAGES + 1];
+static int message_batch[MESSAGES + 1];
+static int batch_number = 1;
+// how many statuses covered each message
+static int message_reported[MESSAGES + 1];
+
+static seq_run_t spool_run_storage[SPOOL_RUNS];
+static seq_runs_t spool_runs;
+// batches in the spool right now
+static int spool_first_batch = 0;
+static int spool_last_batch = 0;
+
+static const uint8_t device_id[] = {1, 2, 3, 4, 5, 6};
+
+// A status for run, as the connection of its slot sees it: every message of the slot from first to
+// last has to be in one of the batches first_batch..last_batch
+static void check_run(const seq_run_t* run, int first_batch, int last_batch) {
+    CHECK(run->first <= run->last);
+    for (uint32_t seq = run->first; seq <= run->last; seq++) {
+        if (message_slot[seq] != run->slot) {
+            continue;
+        }
+        CHECK(message_batch[seq] >= first_batch && message_batch[seq] <= last_batch);
+        message_reported[seq]++;
+    }
+}
+
+static void flush(batch_t* batch, bool spool) {
+    if (batch->count == 0) {
+        return;
+    }
+    // the records decode in the order they were added
+    size_t pos = 0;
+    int records = 0;
+    while (pos < batch->len) {
+        uint64_t len;
+        frame_t frame;
+        CHECK(frame_get_varint((const uint8_t*) batch->buf, batch->len, &pos, &len));
+        CHECK(frame_decode((const uint8_t*) batch->buf + pos, len, &frame));
+        CHECK_EQ(message_batch[frame.seq], batch_number);
+        pos += len;
+        records++;
+    }
+    CHECK_EQ(records, batch->count);
+    if (spool) {
+        if (spool_first_batch == 0) {
+            spool_first_batch = batch_number;
+        }
+        spool_last_batch = batch_number;
+        CHECK(seq_runs_merge(&spool_runs, &batch->runs));
+    } else {
+        for (int i = 0; i < batch->runs.count; i++) {
+            check_run(&batch->runs.runs[i], batch_number, batch_number);
+        }
+    }
+    batch_number++;
+    batch_reset(batch);
+}
+
+// The spool is drained, its runs are reported as sent at once
+static void drain(void) {
+    for (int i = 0; i < spool_runs.count; i++) {
+        check_run(&spool_runs.runs[i], spool_first_batch, spool_last_batch);
+    }
+    seq_runs_reset(&spool_runs);
+    spool_first_batch = 0;
+}
+
+static void test_interleaved(void) {
+    static batch_t batch;
+    // the queue of every slot, filled at different rates and served round-robin like uplink_task does
+    static uint32_t queues[CONN_MAX][MESSAGES];
+    int queued[CONN_MAX] = {0};
+    int taken[CONN_MAX] = {0};
+    uint32_t slot_last_seq[CONN_MAX] = {0};
+    uint8_t payload[100];
+    uint32_t seq = 0;
+    int next_slot = 0;
+    bool spooling = false;
+    memset(payload, 'x', sizeof(payload));
+    batch_reset(&batch);
+    seq_runs_init(&spool_runs, spool_run_storage, SPOOL_RUNS);
+    srand(7);
+
+    while (true) {
+        // slot 0 is chatty, the others write now and then
+        for (int s = 0; s < CONN_MAX && seq < MESSAGES; s++) {
+            if (rand() % (s == 0 ? 2 : 6) == 0) {
+                seq++;
+                message_slot[seq] = s;
+                queues[s][queued[s]++] = seq;
+            }
+        }
+        int slot = -1;
+        for (int i = 0; i < CONN_MAX; i++) {
+            int s = (next_slot + i) % CONN_MAX;
+            if (taken[s] < queued[s]) {
+                slot = s;
+                break;
+            }
+        }
+        if (slot < 0) {
+            if (seq == MESSAGES) {
+                break;
+            }
+            continue;
+        }
+        next_slot = (slot + 1) % CONN_MAX;
+        uint32_t item = queues[slot][taken[slot]++];
+        uint32_t prev = slot_last_seq[slot];
+        slot_last_seq[slot] = item;
+
+        // a message that doesn't fit is reported as failed on its own
+        if (rand() % 50 == 0) {
+            message_batch[item] = -1;
+            message_reported[item]++;
+            continue;
+        }
+        frame_t frame = {
+            .device_id = device_id,
+            .device_id_len = sizeof(device_id),
+            .seq = item,
+            .payload = payload,
+            .payload_len = 10 + item % 90,
+        };
+        if (!batch_add(&batch, &frame)) {
+            flush(&batch, spooling);
+            CHECK(batch_add(&batch, &frame));
+        }
+        message_batch[item] = batch_number;
+        CHECK(seq_runs_add(&batch.runs, slot, prev, item));
+        if (batch_full(&batch)) {
+            flush(&batch, spooling);
+            // wifi comes and goes every few batches
+            if (rand() % 4 == 0) {
+                if (spooling) {
+                    drain();
+                }
+                spooling = !spooling;
+            }
+        }
+    }
+    flush(&batch, spooling);
+    drain();
+    // every message got exactly one status
+    for (uint32_t i = 1; i <= MESSAGES; i++) {
+        CHECK_EQ(message_reported[i], 1);
+    }
+}
+
+static void test_runs(void) {
+    seq_run_t storage[2];
+    seq_runs_t runs;
+    seq_runs_init(&runs, storage, 2);
+    CHECK(seq_runs_add(&runs, 0, 0, 1));
+    CHECK(seq_runs_add(&runs, 1, 0, 2));
+    // continues the run of slot 0
+    CHECK(seq_runs_add(&runs, 0, 1, 3));
+    // slot 0 queued 4 in between, which went elsewhere, so this needs a run of its own
+    CHECK(!seq_runs_add(&runs, 0, 4, 5));
+    CHECK_EQ(runs.count, 2);
+    CHECK_EQ(runs.runs[0].last, 3);
+    CHECK_EQ(seq_runs_conns(&runs), 3);
+
+    // added later, 4 closes the gap: 1..3 and 5..6 become one run
+    seq_runs_init(&runs, storage, 2);
+    CHECK(seq_runs_add(&runs, 0, 0, 1));
+    CHECK(seq_runs_add(&runs, 0, 1, 3));
+    CHECK(seq_runs_add(&runs, 0, 4, 5));
+    CHECK(seq_runs_add(&runs, 0, 5, 6));
+    CHECK_EQ(runs.count, 2);
+    CHECK(seq_runs_add(&runs, 0, 3, 4));
+    CHECK_EQ(runs.count, 1);
+    CHECK_EQ(runs.runs[0].first, 1);
+    CHECK_EQ(runs.runs[0].last, 6);
+    // and a message in front of a run extends it backwards
+    CHECK(seq_runs_add(&runs, 1, 7, 8));
+    CHECK(seq_runs_add(&runs, 1, 2, 7));
+    CHECK_EQ(runs.count, 2);
+    CHECK_EQ(runs.runs[1].first, 7);
+    CHECK_EQ(runs.runs[1].prev, 2);
+    CHECK_EQ(runs.runs[1].last, 8);
+}
+
+int main(void) {
+    test_interleaved();
+    test_runs();
+    return test_result("batch");
+}
@@ -0,0 +1,240 @@
+// Bulk stream reassembly: loss, duplicates, sequence wraparound, a full pool, and the throughput
+// for different mtu and connection interval settings
+#include <string.h>
+#include <time.h>
+
+#include "test.h"
+#include "bulk.h"
+
+#define CONN 7
+
+static uint8_t message[MSG_BUF_SIZE];
+
+// Build the packet with seq and flags carrying len bytes of message from offset
+static uint16_t make_packet(uint8_t* packet, uint16_t seq, uint8_t flags, uint16_t offset, uint16_t len) {
+    packet[0] = seq & 0xFF;
+    packet[1] = seq >> 8;
+    packet[2] = flags;
+    memcpy(packet + BULK_HEADER_LEN, message + offset, len);
+    return BULK_HEADER_LEN + len;
+}
+
+// Send a message of len bytes in fragments of payload bytes from *seq on, returns the completed message
+static msg_buf_t* send_message(uint16_t* seq, uint16_t len, uint16_t payload) {
+    uint8_t packet[BULK_HEADER_LEN + MSG_BUF_SIZE];
+    msg_buf_t* complete = NULL;
+    for (uint16_t offset = 0; offset < len; offset += payload) {
+        uint16_t n = len - offset < payload ? len - offset : payload;
+        uint8_t flags = (offset == 0 ? BULK_FLAG_START : 0) | (offset + n == len ? BULK_FLAG_END : 0);
+        uint16_t lost;
+        CHECK(complete == NULL);
+        CHECK_EQ(bulk_receive(CONN, packet, make_packet(packet, (*seq)++, flags, offset, n), &complete, &lost), ESP_GATT_OK);
+        CHECK_EQ(lost, 0);
+    }
+    return complete;
+}
+
+static void test_messages(void) {
+    uint16_t seq = 100;
+    for (int i = 0; i < 20; i++) {
+        msg_buf_t* complete = send_message(&seq, 1 + i * 50, 20);
+        CHECK(complete != NULL);
+        CHECK_EQ(complete->len, 1 + i * 50);
+        CHECK(memcmp(complete->data, message, complete->len) == 0);
+        msg_buf_unref(complete);
+    }
+    CHECK_EQ(bulk_stream(CONN)->messages, 20);
+    CHECK_EQ(bulk_stream(CONN)->lost_packets, 0);
+    bulk_release_conn(CONN);
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+static void test_lost(void) {
+    uint8_t packet[64];
+    msg_buf_t* complete;
+    uint16_t lost;
+    bulk_receive(CONN, packet, make_packet(packet, 10, BULK_FLAG_START, 0, 20), &complete, &lost);
+    // 11 and 12 went missing, the message they belonged to is dropped
+    bulk_receive(CONN, packet, make_packet(packet, 13, BULK_FLAG_END, 60, 20), &complete, &lost);
+    CHECK_EQ(lost, 2);
+    CHECK(complete == NULL);
+    CHECK_EQ(msg_pool_in_use(), 0);
+    // the next message comes through
+    uint16_t seq = 14;
+    complete = send_message(&seq, 100, 20);
+    CHECK(complete != NULL);
+    msg_buf_unref(complete);
+    CHECK_EQ(bulk_stream(CONN)->lost_packets, 2);
+    bulk_release_conn(CONN);
+}
+
+static void test_duplicates(void) {
+    uint8_t packet[64];
+    msg_buf_t* complete;
+    uint16_t lost;
+    bulk_receive(CONN, packet, make_packet(packet, 50, BULK_FLAG_START, 0, 20), &complete, &lost);
+    bulk_receive(CONN, packet, make_packet(packet, 51, 0, 20, 20), &complete, &lost);
+    // retransmitted and late packets are neither counted as lost nor added to the message
+    CHECK_EQ(bulk_receive(CONN, packet, make_packet(packet, 51, 0, 20, 20), &complete, &lost), ESP_GATT_OK);
+    CHECK_EQ(lost, 0);
+    CHECK_EQ(bulk_receive(CONN, packet, make_packet(packet, 40, 0, 20, 20), &complete, &lost), ESP_GATT_OK);
+    CHECK_EQ(lost, 0);
+    bulk_receive(CONN, packet, make_packet(packet, 52, BULK_FLAG_END, 40, 20), &complete, &lost);
+    CHECK_EQ(lost, 0);
+    CHECK(complete != NULL);
+    CHECK_EQ(complete->len, 60);
+    CHECK(memcmp(complete->data, message, 60) == 0);
+    msg_buf_unref(complete);
+    CHECK_EQ(bulk_stream(CONN)->duplicate_packets, 2);
+    CHECK_EQ(bulk_stream(CONN)->lost_packets, 0);
+    bulk_release_conn(CONN);
+}
+
+static void test_wraparound(void) {
+    uint8_t packet[64];
+    msg_buf_t* complete;
+    uint16_t lost;
+    uint16_t seq = 65530;
+    complete = send_message(&seq, 200, 20);
+    CHECK(complete != NULL);
+    msg_buf_unref(complete);
+    CHECK_EQ(seq, 4);
+    // a late packet from before the wrap is a duplicate, a gap across it is counted right
+    CHECK_EQ(bulk_receive(CONN, packet, make_packet(packet, 65535, BULK_FLAG_START, 0, 20), &complete, &lost), ESP_GATT_OK);
+    CHECK_EQ(lost, 0);
+    CHECK_EQ(bulk_stream(CONN)->duplicate_packets, 1);
+    bulk_receive(CONN, packet, make_packet(packet, 7, BULK_FLAG_START | BULK_FLAG_END, 0, 20), &complete, &lost);
+    CHECK_EQ(lost, 3);
+    CHECK(complete != NULL);
+    msg_buf_unref(complete);
+    bulk_release_conn(CONN);
+}
+
+static void test_pool_exhausted(void) {
+    uint8_t packet[64];
+    msg_buf_t* complete;
+    uint16_t lost;
+    msg_buf_t* taken[MSG_POOL_SIZE];
+    for (int i = 0; i < MSG_POOL_SIZE; i++) {
+        taken[i] = msg_pool_alloc();
+    }
+    // the caller reports the dropped message, the rest of it is skipped quietly
+    CHECK_EQ(bulk_receive(CONN, packet, make_packet(packet, 1, BULK_FLAG_START, 0, 20), &complete, &lost), ESP_GATT_NO_RESOURCES);
+    msg_buf_unref(taken[0]);
+    CHECK_EQ(bulk_receive(CONN, packet, make_packet(packet, 2, BULK_FLAG_END, 20, 20), &complete, &lost), ESP_GATT_OK);
+    CHECK(complete == NULL);
+    CHECK_EQ(bulk_stream(CONN)->dropped_messages, 1);
+    uint16_t seq = 3;
+    complete = send_message(&seq, 100, 20);
+    CHECK(complete != NULL);
+    msg_buf_unref(complete);
+    for (int i = 1; i < MSG_POOL_SIZE; i++) {
+        msg_buf_unref(taken[i]);
+    }
+    bulk_release_conn(CONN);
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+static void test_too_long(void) {
+    uint8_t packet[BULK_HEADER_LEN + MSG_BUF_SIZE];
+    msg_buf_t* complete;
+    uint16_t lost;
+    bulk_receive(CONN, packet, make_packet(packet, 1, BULK_FLAG_START, 0, MSG_BUF_SIZE), &complete, &lost);
+    CHECK_EQ(bulk_receive(CONN, packet, make_packet(packet, 2, BULK_FLAG_END, 0, 1), &complete, &lost), ESP_GATT_INVALID_ATTR_LEN);
+    CHECK(complete == NULL);
+    CHECK_EQ(bulk_stream(CONN)->dropped_messages, 1);
+    CHECK_EQ(bulk_receive(CONN, packet, 2, &complete, &lost), ESP_GATT_INVALID_PDU);
+    bulk_release_conn(CONN);
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Air time (us) of a link layer data pdu with len bytes payload on the 1M phy and the empty pdu
+// acknowledging it: preamble, access address, header and crc are 10 bytes, two inter frame spaces
+static uint32_t pdu_air_us(uint16_t len) {
+    return (len + 10) * 8 + 150 + 10 * 8 + 150;
+}
+
+// Message payload per second the link carries with writes without response, if the controller keeps
+// sending for the whole connection event (an upper bound, real controllers stop earlier)
+static double link_bytes_per_s(uint16_t mtu, uint16_t data_len, uint16_t interval) {
+    uint16_t payload = mtu - 3 - BULK_HEADER_LEN;
+    // write command with its l2cap header, split into link layer pdus which may go out in different events
+    uint16_t att_len = mtu + 4;
+    uint32_t interval_us = interval * 1250;
+    // one second worth of connection events
+    uint32_t events = 1000000 / interval_us;
+    uint32_t packets = 0;
+    uint16_t sent = 0;
+    for (uint32_t event = 0; event < events; event++) {
+        uint32_t left_us = interval_us;
+        while (true) {
+            uint16_t len = att_len - sent < data_len ? att_len - sent : data_len;
+            if (pdu_air_us(len) > left_us) {
+                break;
+            }
+            left_us -= pdu_air_us(len);
+            sent += len;
+            if (sent == att_len) {
+                packets++;
+                sent = 0;
+            }
+        }
+    }
+    return (double) packets * payload * 1e6 / (events * interval_us);
+}
+
+// Reassembly speed of packets of mtu, messages of msg_len bytes
+static double ingest_bytes_per_s(uint16_t mtu, uint16_t msg_len) {
+    uint16_t payload = mtu - 3 - BULK_HEADER_LEN;
+    uint16_t seq = 0;
+    uint64_t bytes = 0;
+    double started = seconds();
+    for (int i = 0; i < 20000; i++) {
+        msg_buf_t* complete = send_message(&seq, msg_len, payload);
+        msg_buf_unref(complete);
+        bytes += msg_len;
+    }
+    double spent = seconds() - started;
+    bulk_release_conn(CONN);
+    return bytes / spent;
+}
+
+static void test_throughput(void) {
+    static const uint16_t mtus[] = {23, 185, 247, 517};
+    // connection intervals (units of 1.25 ms): fastest we ask for, slowest fast one, active and idle
+    static const uint16_t intervals[] = {CONN_FAST_MIN_INT, CONN_FAST_MAX_INT, CONN_ACTIVE_MAX_INT, CONN_IDLE_MAX_INT};
+    // without and with data length extension
+    static const uint16_t data_lens[] = {27, CONN_DATA_LEN};
+    printf("mtu  data len  interval  link (B/s)  reassembly of 512 byte messages (host, MB/s)\n");
+    for (size_t m = 0; m < sizeof(mtus) / sizeof(mtus[0]); m++) {
+        double ingest = ingest_bytes_per_s(mtus[m], 512);
+        for (size_t d = 0; d < sizeof(data_lens) / sizeof(data_lens[0]); d++) {
+            for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+                double link = link_bytes_per_s(mtus[m], data_lens[d], intervals[i]);
+                printf("%3u  %8u  %6.1f ms  %10.0f  %.0f\n", mtus[m], data_lens[d], intervals[i] * 1.25, link, ingest / 1e6);
+                // reassembly must never be what limits the stream
+                CHECK(ingest > link * 10);
+            }
+        }
+    }
+}
+
+int main(void) {
+    for (int i = 0; i < MSG_BUF_SIZE; i++) {
+        message[i] = (uint8_t) (i * 13 + 5);
+    }
+    test_messages();
+    test_lost();
+    test_duplicates();
+    test_wraparound();
+    test_pool_exhausted();
+    test_too_long();
+    test_throughput();
+    return test_result("bulk");
+}
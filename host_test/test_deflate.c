@@ -0,0 +1,222 @@
+// Deflate of uplink bodies: every output inflates with zlib to the input, and per typical payload the
+// compression ratio (zlib's default level for reference), encode us/KB and the stack deflate_compress needs
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "test.h"
+#include "deflate.h"
+#include "batch.h"
+
+// like UPLINK_COMPRESS_MIN_BYTES and UPLINK_COMPRESS_MAX_BYTES in transport_http.c
+#define COMPRESS_MIN_BYTES 256
+#define COMPRESS_MAX_BYTES 4096
+#define BENCH_BYTES (8 * 1024 * 1024)
+#define STACK_BYTES (64 * 1024)
+#define STACK_PAINT 0xA5
+
+static const uint8_t device_id[] = {0x24, 0x6f, 0x28, 0x1a, 0x2b, 0x3c};
+
+// A batch as uplink_task builds it, of messages made by message(seq, out)
+static size_t build_batch(int (*message)(uint32_t seq, char* out, size_t size), char* out) {
+    static batch_t batch;
+    char text[200];
+    batch_reset(&batch);
+    for (uint32_t seq = 1;; seq++) {
+        frame_t frame = {
+            .device_id = device_id,
+            .device_id_len = sizeof(device_id),
+            .boot = 271828,
+            .seq = 1000 + seq,
+            .timestamp_ms = 1715000000000ull + seq * 1234,
+            .payload = (const uint8_t*) text,
+            .payload_len = message(seq, text, sizeof(text)),
+        };
+        if (!batch_add(&batch, &frame) || batch_full(&batch)) {
+            break;
+        }
+    }
+    memcpy(out, batch.buf, batch.len);
+    return batch.len;
+}
+
+static int sensor_message(uint32_t seq, char* out, size_t size) {
+    return snprintf(out, size, "temp=%u.%u", 18 + seq * 7 % 9, seq * 3 % 10);
+}
+
+static int log_message(uint32_t seq, char* out, size_t size) {
+    static const char* levels[] = {"INFO", "INFO", "INFO", "WARN"};
+    static const char* events[] = {"motor started", "motor current 1.73 A", "door closed", "battery 3.71 V", "retrying sensor read"};
+    return snprintf(out, size, "2024-05-01 12:%02u:%02u %s [ctrl] %s (cycle %u)", seq / 60 % 60, seq % 60,
+                    levels[seq % 4], events[seq * 7 % 5], 4000 + seq);
+}
+
+static size_t log_text(char* out) {
+    size_t len = 0;
+    for (uint32_t seq = 1; len + 100 < COMPRESS_MAX_BYTES; seq++) {
+        len += log_message(seq, out + len, COMPRESS_MAX_BYTES - len);
+        out[len++] = '\n';
+    }
+    return len;
+}
+
+static size_t random_bytes(char* out) {
+    srand(5);
+    for (int i = 0; i < 1024; i++) {
+        out[i] = rand();
+    }
+    return 1024;
+}
+
+static size_t short_message(char* out) {
+    return log_message(1, out, COMPRESS_MAX_BYTES);
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compress in like uplink_compress does (only if it saves space) and inflate it again
+static size_t round_trip(const uint8_t* in, size_t len) {
+    static uint8_t out[COMPRESS_MAX_BYTES];
+    static uint8_t inflated[COMPRESS_MAX_BYTES];
+    size_t compressed = deflate_compress(in, len, out, len - 1);
+    if (compressed == 0) {
+        return 0;
+    }
+    uLongf inflated_len = sizeof(inflated);
+    CHECK_EQ(uncompress(inflated, &inflated_len, out, compressed), Z_OK);
+    CHECK_EQ(inflated_len, len);
+    CHECK(memcmp(inflated, in, len) == 0);
+    return compressed;
+}
+
+static void test_payloads(void) {
+    static char in[COMPRESS_MAX_BYTES];
+    static uint8_t out[COMPRESS_MAX_BYTES * 2];
+    struct {
+        const char* name;
+        size_t len;
+    } payloads[5];
+    static char storage[5][COMPRESS_MAX_BYTES];
+    payloads[0].name = "batch of sensor values";
+    payloads[0].len = build_batch(sensor_message, storage[0]);
+    payloads[1].name = "batch of log lines";
+    payloads[1].len = build_batch(log_message, storage[1]);
+    payloads[2].name = "4 KB of log text";
+    payloads[2].len = log_text(storage[2]);
+    payloads[3].name = "one log line";
+    payloads[3].len = short_message(storage[3]);
+    payloads[4].name = "random bytes";
+    payloads[4].len = random_bytes(storage[4]);
+
+    for (int p = 0; p < 5; p++) {
+        size_t len = payloads[p].len;
+        memcpy(in, storage[p], len);
+        size_t compressed = round_trip((const uint8_t*) in, len);
+        uLongf reference = sizeof(out);
+        CHECK_EQ(compress2(out, &reference, (const uint8_t*) in, len, Z_DEFAULT_COMPRESSION), Z_OK);
+        int rounds = BENCH_BYTES / len;
+        double started = seconds();
+        for (int r = 0; r < rounds; r++) {
+            deflate_compress((const uint8_t*) in, len, out, sizeof(out));
+        }
+        double us_per_kb = (seconds() - started) * 1e6 / rounds / (len / 1024.0);
+        printf("%-22s %5zu bytes: ", payloads[p].name, len);
+        if (compressed == 0) {
+            printf("sent as is (deflated %zu)", deflate_compress((const uint8_t*) in, len, out, sizeof(out)));
+        } else {
+            printf("%5zu bytes, ratio %.2f", compressed, (double) len / compressed);
+        }
+        printf(" (zlib -6: %.2f), %.1f us/KB%s\n", (double) len / reference, us_per_kb,
+               len < COMPRESS_MIN_BYTES ? ", below the threshold" : "");
+    }
+    // the threshold keeps the small ones out, the log batches have to pay off
+    CHECK(round_trip((const uint8_t*) storage[1], payloads[1].len) * 2 < payloads[1].len);
+    CHECK_EQ(round_trip((const uint8_t*) storage[4], payloads[4].len), 0);
+}
+
+// Edge cases of the bit writer: empty input, runs longer than a match, output exactly as large as needed
+static void test_edges(void) {
+    static uint8_t in[COMPRESS_MAX_BYTES];
+    static uint8_t out[COMPRESS_MAX_BYTES * 2];
+    uLongf inflated_len = sizeof(in);
+    size_t len = deflate_compress(in, 0, out, sizeof(out));
+    CHECK(len > 0);
+    CHECK_EQ(uncompress(in, &inflated_len, out, len), Z_OK);
+    CHECK_EQ(inflated_len, 0);
+
+    memset(in, 'a', sizeof(in));
+    CHECK(round_trip(in, sizeof(in)) > 0);
+    srand(11);
+    for (int i = 0; i < 2000; i++) {
+        size_t n = 1 + rand() % sizeof(in);
+        // text of few letters, so there are matches of every length and distance
+        for (size_t b = 0; b < n; b++) {
+            in[b] = 'a' + rand() % (1 + i % 6);
+        }
+        size_t needed = deflate_compress(in, n, out, sizeof(out));
+        CHECK(needed > 0);
+        CHECK_EQ(deflate_compress(in, n, out, needed), needed);
+        CHECK_EQ(deflate_compress(in, n, out, needed - 1), 0);
+        inflated_len = sizeof(in);
+        static uint8_t inflated[COMPRESS_MAX_BYTES];
+        CHECK_EQ(uncompress(inflated, &inflated_len, out, needed), Z_OK);
+        CHECK(inflated_len == n && memcmp(inflated, in, n) == 0);
+    }
+}
+
+typedef struct {
+    const uint8_t* in;
+    size_t len;
+} stack_job_t;
+
+static void* compress_on_stack(void* arg) {
+    static uint8_t out[COMPRESS_MAX_BYTES];
+    const stack_job_t* job = arg;
+    deflate_compress(job->in, job->len, out, sizeof(out));
+    return NULL;
+}
+
+// Bytes of a painted thread stack that got used by compressing job
+static size_t stack_used(stack_job_t* job) {
+    static uint8_t stack[STACK_BYTES] __attribute__((aligned(64)));
+    memset(stack, STACK_PAINT, sizeof(stack));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, sizeof(stack));
+    pthread_t thread;
+    pthread_create(&thread, &attr, compress_on_stack, job);
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+    size_t untouched = 0;
+    while (untouched < sizeof(stack) && stack[untouched] == STACK_PAINT) {
+        untouched++;
+    }
+    return sizeof(stack) - untouched;
+}
+
+// RAM: the static hash table, the output buffer of the caller, and the stack, measured on a painted
+// thread stack against a thread that compresses nothing
+static void test_ram(void) {
+    static char text[COMPRESS_MAX_BYTES];
+    stack_job_t nothing = {(const uint8_t*) text, 0};
+    stack_job_t log = {(const uint8_t*) text, log_text(text)};
+    size_t idle = stack_used(&nothing);
+    size_t used = stack_used(&log);
+    printf("RAM: %zu bytes static hash table, %d bytes output buffer (transport_http.c), %zu bytes stack on the host\n",
+           (size_t) DEFLATE_HASH_SIZE * 2, COMPRESS_MAX_BYTES, used > idle ? used - idle : 0);
+    // it has to fit easily into the stack of the uplink task
+    CHECK(used - idle < 512);
+}
+
+int main(void) {
+    test_payloads();
+    test_edges();
+    test_ram();
+    return test_result("deflate");
+}
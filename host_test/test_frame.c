@@ -0,0 +1,160 @@
+// Binary records: round trips of random frames, a fixed encoding, malformed input, and bytes per
+// message and records/s through batch_add compared with NDJSON (built twice, see CMakeLists.txt)
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "test.h"
+#include "frame.h"
+#include "batch.h"
+
+#define ROUND_TRIPS 20000
+#define BENCH_RECORDS 500000
+
+static void test_round_trip(void) {
+    static uint8_t out[512];
+    uint8_t device_id[FRAME_DEVICE_ID_LEN];
+    uint8_t payload[300];
+    srand(9);
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        for (size_t b = 0; b < sizeof(device_id); b++) {
+            device_id[b] = rand();
+        }
+        int payload_len = rand() % sizeof(payload);
+        for (int b = 0; b < payload_len; b++) {
+            payload[b] = rand();
+        }
+        // values of every varint length, up to a timestamp in ms of the distant future
+        frame_t frame = {
+            .device_id = device_id,
+            .device_id_len = rand() % 2 ? FRAME_DEVICE_ID_LEN : 0,
+            .boot = (uint32_t) rand() >> (rand() % 32),
+            .seq = (uint32_t) rand() >> (rand() % 32),
+            .timestamp_ms = ((uint64_t) rand() << 31 | rand()) >> (rand() % 62),
+            .payload = payload,
+            .payload_len = payload_len,
+        };
+        size_t len = frame_encode(&frame, out, sizeof(out));
+        CHECK(len > 0);
+        // one byte less doesn't fit
+        CHECK_EQ(frame_encode(&frame, out, len - 1), 0);
+        frame_t decoded;
+        CHECK(frame_decode(out, len, &decoded));
+        CHECK_EQ(decoded.device_id_len, frame.device_id_len);
+        CHECK(frame.device_id_len == 0 || memcmp(decoded.device_id, device_id, frame.device_id_len) == 0);
+        CHECK_EQ(decoded.boot, frame.boot);
+        CHECK_EQ(decoded.seq, frame.seq);
+        CHECK(decoded.timestamp_ms == frame.timestamp_ms);
+        CHECK_EQ(decoded.payload_len, frame.payload_len);
+        CHECK(memcmp(decoded.payload, payload, payload_len) == 0);
+        // the payload comes last, so no shorter prefix is a record
+        CHECK(!frame_decode(out, len - 1 - rand() % len, &decoded));
+    }
+}
+
+// The wire format GCP/batch.js decodes, field by field
+static void test_encoding(void) {
+    static const uint8_t device_id[] = {0xa1, 0xb2, 0xc3, 0xd4, 0xe5, 0xf6};
+    static const uint8_t expected[] = {
+        0x0a, 0x06, 0xa1, 0xb2, 0xc3, 0xd4, 0xe5, 0xf6,
+        0x10, 0x96, 0x01,
+        0x18, 0x2a,
+        0x20, 0xe8, 0x07,
+        0x2a, 0x02, 'h', 'i',
+    };
+    frame_t frame = {
+        .device_id = device_id,
+        .device_id_len = sizeof(device_id),
+        .boot = 150,
+        .seq = 42,
+        .timestamp_ms = 1000,
+        .payload = (const uint8_t*) "hi",
+        .payload_len = 2,
+    };
+    uint8_t out[64];
+    CHECK_EQ(frame_encode(&frame, out, sizeof(out)), sizeof(expected));
+    CHECK(memcmp(out, expected, sizeof(expected)) == 0);
+
+    // a client only needs to send the payload, fields it doesn't know about are skipped
+    static const uint8_t minimal[] = {0x2a, 0x01, 'x'};
+    static const uint8_t unknown[] = {0x30, 0x05, 0x3a, 0x01, 0xff, 0x2a, 0x01, 'x'};
+    frame_t decoded;
+    CHECK(frame_decode(minimal, sizeof(minimal), &decoded));
+    CHECK_EQ(decoded.payload_len, 1);
+    CHECK_EQ(decoded.device_id_len, 0);
+    CHECK_EQ(decoded.seq, 0);
+    CHECK(frame_decode(unknown, sizeof(unknown), &decoded));
+    CHECK_EQ(decoded.payload[0], 'x');
+}
+
+static void test_malformed(void) {
+    frame_t decoded;
+    // no payload
+    static const uint8_t no_payload[] = {0x18, 0x2a};
+    CHECK(!frame_decode(no_payload, sizeof(no_payload), &decoded));
+    // the payload is longer than the record
+    static const uint8_t too_long[] = {0x2a, 0x05, 'x'};
+    CHECK(!frame_decode(too_long, sizeof(too_long), &decoded));
+    // fixed 64 and 32 bit wire types aren't used
+    static const uint8_t fixed64[] = {0x31, 0, 0, 0, 0, 0, 0, 0, 0, 0x2a, 0x01, 'x'};
+    CHECK(!frame_decode(fixed64, sizeof(fixed64), &decoded));
+    // a varint of more than 10 bytes
+    static const uint8_t endless[] = {0x18, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, 0x2a, 0x01, 'x'};
+    CHECK(!frame_decode(endless, sizeof(endless), &decoded));
+    CHECK(!frame_decode(NULL, 0, &decoded));
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bytes per message and records/s of the uplink batches for typical messages
+static void bench_batches(void) {
+    static const char* messages[] = {
+        "temp=21.5",
+        "button 2 pressed",
+        "2024-05-01 12:00:03 motor current 1.73 A, speed 1480 rpm, ok",
+        // quotes and a line break, which json has to escape
+        "{\"sensor\":\"door\",\"state\":\"open\"}\nclosed again",
+    };
+    static const uint8_t device_id[] = {0xa1, 0xb2, 0xc3, 0xd4, 0xe5, 0xf6};
+    static batch_t batch;
+    for (size_t m = 0; m < sizeof(messages) / sizeof(messages[0]); m++) {
+        size_t len = strlen(messages[m]);
+        uint64_t bytes = 0;
+        uint32_t records = 0;
+        batch_reset(&batch);
+        double started = seconds();
+        for (uint32_t seq = 1; seq <= BENCH_RECORDS; seq++) {
+            frame_t frame = {
+                .device_id = device_id,
+                .device_id_len = sizeof(device_id),
+                .boot = 3141592653u,
+                .seq = seq,
+                .timestamp_ms = 1715000000000ull + seq * 37,
+                .payload = (const uint8_t*) messages[m],
+                .payload_len = len,
+            };
+            if (!batch_add(&batch, &frame)) {
+                bytes += batch.len;
+                records += batch.count;
+                batch_reset(&batch);
+                CHECK(batch_add(&batch, &frame));
+            }
+        }
+        double elapsed = seconds() - started;
+        printf("%s, %2zu byte message: %5.1f bytes per record (%4.1f overhead), %5.2f M records/s\n",
+               BATCH_BINARY ? "binary" : "ndjson", len, (double) bytes / records, (double) bytes / records - len,
+               BENCH_RECORDS / elapsed / 1e6);
+    }
+}
+
+int main(void) {
+    test_round_trip();
+    test_encoding();
+    test_malformed();
+    bench_batches();
+    return test_result(BATCH_BINARY ? "frame" : "frame (ndjson batches)");
+}
@@ -0,0 +1,74 @@
+// Latency snapshot: it decodes to what was recorded and always fits into a single attribute value
+#include <string.h>
+
+#include "test.h"
+#include "latency.h"
+#include "frame.h"
+
+// largest attribute value a client can read, also with offsets
+#define ATTR_MAX_LEN 512
+
+static int64_t now_us;
+
+int64_t esp_timer_get_time(void) {
+    return now_us;
+}
+
+static void decode(const uint8_t* in, size_t len, latency_hist_t* hists) {
+    size_t pos = 0;
+    uint64_t value;
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        CHECK(frame_get_varint(in, len, &pos, &value));
+        hists[i].count = value;
+        CHECK(frame_get_varint(in, len, &pos, &value));
+        hists[i].max_ms = value;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            CHECK(frame_get_varint(in, len, &pos, &value));
+            hists[i].buckets[b] = value;
+        }
+    }
+    CHECK_EQ(pos, len);
+}
+
+static void test_round_trip(void) {
+    uint8_t out[LATENCY_ENCODED_MAX];
+    latency_hist_t hists[LATENCY_STAGES];
+    now_us = 5000 * 1000;
+    latency_record(LATENCY_QUEUE, 0);
+    latency_record(LATENCY_QUEUE, 3);
+    latency_record_since(LATENCY_TOTAL, 4000);
+    size_t len = latency_encode(out, sizeof(out));
+    decode(out, len, hists);
+    CHECK_EQ(hists[LATENCY_QUEUE].count, 2);
+    CHECK_EQ(hists[LATENCY_QUEUE].max_ms, 3);
+    CHECK_EQ(hists[LATENCY_QUEUE].buckets[0], 1);
+    CHECK_EQ(hists[LATENCY_QUEUE].buckets[2], 1);
+    CHECK_EQ(hists[LATENCY_TOTAL].count, 1);
+    CHECK_EQ(hists[LATENCY_TOTAL].max_ms, 1000);
+    CHECK_EQ(hists[LATENCY_TOTAL].buckets[10], 1);
+    CHECK_EQ(hists[LATENCY_WIFI].count, 0);
+}
+
+static void test_saturated(void) {
+    uint8_t out[LATENCY_ENCODED_MAX + 64];
+    latency_hist_t hists[LATENCY_STAGES];
+    CHECK(LATENCY_ENCODED_MAX <= ATTR_MAX_LEN);
+    // a max beyond what 4 bytes hold in every stage, the counts are pushed up the same way
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        latency_record(i, UINT32_MAX);
+        for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+            latency_record(i, 1u << b);
+        }
+    }
+    size_t len = latency_encode(out, sizeof(out));
+    CHECK(len <= ATTR_MAX_LEN);
+    decode(out, len, hists);
+    CHECK_EQ(hists[LATENCY_QUEUE].max_ms, LATENCY_ENCODED_LIMIT);
+    CHECK_EQ(hists[LATENCY_QUEUE].buckets[LATENCY_BUCKETS - 1], 2);
+}
+
+int main(void) {
+    test_round_trip();
+    test_saturated();
+    return test_result("latency");
+}
@@ -0,0 +1,304 @@
+// Link policy: its decisions step by step (parking after the idle time, waking by queue depth, hold time
+// and spooled batches, the advertising and connection profiles), and the estimated energy per message for
+// traffic traces against wifi that is never parked
+#include <string.h>
+
+#include "test.h"
+#include "link_policy.h"
+
+// a round of the uplink task
+#define STEP_MS 100
+// from waking wifi to an ip: scan (or fast connect), association and dhcp
+#define WAKE_TO_IP_MS 2000
+#define TRACE_MS (60 * 60 * 1000)
+
+static link_inputs_t inputs(uint32_t now_ms) {
+    link_inputs_t in = {.now_ms = now_ms, .ip = true, .advertising = true};
+    return in;
+}
+
+static void test_park(void) {
+    link_policy_t policy;
+    link_policy_init(&policy, 30000, 0);
+    link_inputs_t in = inputs(10000);
+    in.delivered = 3;
+    link_decision_t decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && !decision.wifi_changed);
+    // idle counts from the last message, not from boot
+    in = inputs(39900);
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && !decision.wifi_changed);
+    // nothing is parked while messages wait or batches are spooled
+    in = inputs(40000);
+    in.waiting = 1;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && !decision.wifi_changed);
+    in = inputs(70000);
+    in.spooled = true;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && !decision.wifi_changed);
+    in = inputs(70000 + 30000);
+    decision = link_policy_update(&policy, &in);
+    CHECK(!decision.wifi && decision.wifi_changed);
+    CHECK(link_policy_holding(&policy));
+    CHECK_EQ(policy.parks, 1);
+    in.ip = false;
+    in.now_ms += STEP_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(!decision.wifi && !decision.wifi_changed);
+
+    // 0 keeps it up
+    link_policy_init(&policy, 0, 0);
+    in = inputs(24 * 60 * 60 * 1000);
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && !decision.wifi_changed);
+}
+
+// Park a policy at 1000 ms
+static void parked(link_policy_t* policy) {
+    link_policy_init(policy, 1000, 0);
+    link_inputs_t in = inputs(1000);
+    link_decision_t decision = link_policy_update(policy, &in);
+    CHECK(!decision.wifi && decision.wifi_changed);
+}
+
+static void test_wake(void) {
+    link_policy_t policy;
+    parked(&policy);
+    link_inputs_t in = inputs(2000);
+    in.ip = false;
+    in.waiting = LINK_WAKE_DEPTH - 1;
+    in.oldest_ms = LINK_WAKE_HOLD_MS - 1;
+    link_decision_t decision = link_policy_update(&policy, &in);
+    CHECK(!decision.wifi && !decision.wifi_changed);
+    // a full queue wakes it right away
+    in.waiting = LINK_WAKE_DEPTH;
+    in.oldest_ms = 0;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && decision.wifi_changed);
+    CHECK_EQ(policy.wakes, 1);
+
+    // a single message once it waited long enough
+    parked(&policy);
+    in = inputs(2000);
+    in.ip = false;
+    in.waiting = 1;
+    in.oldest_ms = LINK_WAKE_HOLD_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && decision.wifi_changed);
+
+    // spooled batches wait at most LINK_WAKE_HOLD_MS from parking
+    parked(&policy);
+    in = inputs(1000 + LINK_WAKE_HOLD_MS - STEP_MS);
+    in.ip = false;
+    in.spooled = true;
+    decision = link_policy_update(&policy, &in);
+    CHECK(!decision.wifi);
+    in.now_ms += STEP_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && decision.wifi_changed);
+
+    // connected without the policy (new credentials): wanted again, nothing for the caller to do
+    parked(&policy);
+    in = inputs(1500);
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.wifi && !decision.wifi_changed);
+    CHECK_EQ(policy.wakes, 0);
+}
+
+static void test_advertising(void) {
+    link_policy_t policy;
+    link_policy_init(&policy, 0, 0);
+    link_inputs_t in = inputs(LINK_ADV_ACTIVE_MS - STEP_MS);
+    link_decision_t decision = link_policy_update(&policy, &in);
+    CHECK(decision.adv == LINK_PROFILE_ACTIVE && !decision.adv_changed);
+    in.now_ms = LINK_ADV_ACTIVE_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.adv == LINK_PROFILE_IDLE && decision.adv_changed);
+    // a central coming doesn't change it, one leaving does
+    in.now_ms += STEP_MS;
+    in.centrals = 2;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.adv == LINK_PROFILE_IDLE && !decision.adv_changed);
+    in.now_ms += STEP_MS;
+    in.centrals = 1;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.adv == LINK_PROFILE_ACTIVE && decision.adv_changed);
+    uint32_t left_ms = in.now_ms;
+    in.now_ms = left_ms + LINK_ADV_ACTIVE_MS - STEP_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.adv == LINK_PROFILE_ACTIVE && !decision.adv_changed);
+    in.now_ms = left_ms + LINK_ADV_ACTIVE_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.adv == LINK_PROFILE_IDLE && decision.adv_changed);
+}
+
+static void test_connections(void) {
+    link_policy_t policy;
+    link_policy_init(&policy, 0, 0);
+    link_inputs_t in = inputs(LINK_CONN_ACTIVE_MS - STEP_MS);
+    in.centrals = 1;
+    link_decision_t decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_ACTIVE && !decision.conn_changed);
+    // quiet since the central connected
+    in.now_ms += LINK_CONN_ACTIVE_MS - STEP_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_ACTIVE && !decision.conn_changed);
+    in.now_ms += STEP_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_IDLE && decision.conn_changed);
+    // a message makes them active again, for LINK_CONN_ACTIVE_MS from the last one
+    in.now_ms += STEP_MS;
+    in.waiting = 1;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_ACTIVE && decision.conn_changed);
+    in.now_ms += STEP_MS;
+    in.waiting = 0;
+    in.delivered = 1;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_ACTIVE && !decision.conn_changed);
+    uint32_t last_ms = in.now_ms;
+    in.delivered = 0;
+    in.now_ms = last_ms + LINK_CONN_ACTIVE_MS - STEP_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_ACTIVE && !decision.conn_changed);
+    in.now_ms = last_ms + LINK_CONN_ACTIVE_MS;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_IDLE && decision.conn_changed);
+    // one leaving doesn't wake them, one coming does
+    in.now_ms += STEP_MS;
+    in.centrals = 0;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_IDLE && !decision.conn_changed);
+    in.now_ms += STEP_MS;
+    in.centrals = 1;
+    decision = link_policy_update(&policy, &in);
+    CHECK(decision.conn == LINK_PROFILE_ACTIVE && decision.conn_changed);
+
+    // a quiet central costs less on the idle interval
+    link_policy_t quiet;
+    link_policy_init(&policy, 0, 0);
+    link_policy_init(&quiet, 0, 0);
+    in = inputs(0);
+    in.centrals = 1;
+    for (in.now_ms = STEP_MS; in.now_ms <= 10 * LINK_CONN_ACTIVE_MS; in.now_ms += STEP_MS) {
+        link_inputs_t busy = in;
+        busy.delivered = 1;
+        link_policy_update(&policy, &busy);
+        link_policy_update(&quiet, &in);
+    }
+    // idle from LINK_CONN_ACTIVE_MS after the central connected in the first step
+    uint32_t idle_ms = 9 * LINK_CONN_ACTIVE_MS - STEP_MS;
+    CHECK_EQ(policy.energy_uj - quiet.energy_uj, (uint64_t) (LINK_MA_CENTRAL_ACTIVE - LINK_MA_CENTRAL_IDLE) * idle_ms * 33 / 10);
+}
+
+// Messages arriving in the step at now_ms and the centrals connected then
+typedef struct {
+    const char* name;
+    int (*arrivals)(uint32_t now_ms);
+    int centrals;
+} trace_t;
+
+static int steady(uint32_t now_ms) {
+    return now_ms % 10000 == 0;
+}
+
+// one every step for 5 s, every 10 minutes
+static int bursty(uint32_t now_ms) {
+    return now_ms % 600000 < 5000;
+}
+
+static int sparse(uint32_t now_ms) {
+    return now_ms % 300000 == 0;
+}
+
+typedef struct {
+    uint32_t per_message_uj;
+    uint32_t delivered;
+    uint32_t max_delay_ms;
+    uint32_t wakes;
+} trace_result_t;
+
+// Play the trace against the policy like the uplink task does: waiting messages are posted in the round
+// wifi has an ip and isn't held back, wifi gets its ip WAKE_TO_IP_MS after it was woken
+static trace_result_t run_trace(const trace_t* trace, uint32_t idle_ms) {
+    static uint32_t arrived_ms[TRACE_MS / STEP_MS];
+    int waiting = 0;
+    uint32_t delivered = 0;
+    uint32_t max_delay_ms = 0;
+    bool ip = true;
+    uint32_t ip_at_ms = 0;
+    link_policy_t policy;
+    link_policy_init(&policy, idle_ms, 0);
+    for (uint32_t now = STEP_MS; now <= TRACE_MS; now += STEP_MS) {
+        // nothing arrives in the last minute, so everything is delivered in the end
+        for (int n = now + 60000 <= TRACE_MS ? trace->arrivals(now) : 0; n > 0; n--) {
+            arrived_ms[waiting++] = now;
+        }
+        if (!ip && !link_policy_holding(&policy) && now >= ip_at_ms) {
+            ip = true;
+        }
+        uint32_t posted = 0;
+        if (ip && !link_policy_holding(&policy)) {
+            for (int i = 0; i < waiting; i++) {
+                max_delay_ms = now - arrived_ms[i] > max_delay_ms ? now - arrived_ms[i] : max_delay_ms;
+            }
+            posted = waiting;
+            waiting = 0;
+        }
+        link_inputs_t in = {
+            .now_ms = now,
+            .waiting = waiting,
+            .oldest_ms = waiting > 0 ? now - arrived_ms[0] : 0,
+            .delivered = posted,
+            .ip = ip,
+            .centrals = trace->centrals,
+            .advertising = true,
+        };
+        delivered += posted;
+        link_decision_t decision = link_policy_update(&policy, &in);
+        if (decision.wifi_changed) {
+            ip = false;
+            ip_at_ms = now + WAKE_TO_IP_MS;
+        }
+    }
+    trace_result_t result = {link_policy_energy_per_message(&policy), delivered, max_delay_ms, policy.wakes};
+    return result;
+}
+
+static void test_traces(void) {
+    static const trace_t traces[] = {
+        {"steady, every 10 s", steady, 1},
+        {"bursty, 10/s for 5 s every 10 min", bursty, 1},
+        {"sparse, every 5 min", sparse, 0},
+    };
+    static const uint32_t idle_ms[] = {0, 5000, LINK_WIFI_IDLE_MS};
+    for (size_t t = 0; t < sizeof(traces) / sizeof(traces[0]); t++) {
+        trace_result_t always_on = run_trace(&traces[t], 0);
+        for (size_t i = 0; i < sizeof(idle_ms) / sizeof(idle_ms[0]); i++) {
+            trace_result_t result = i == 0 ? always_on : run_trace(&traces[t], idle_ms[i]);
+            printf("%-34s idle %5u ms: %7u uJ per message (%3.0f%%), %4u messages, %3u wakes, max delay %5u ms\n",
+                   traces[t].name, idle_ms[i], result.per_message_uj, 100.0 * result.per_message_uj / always_on.per_message_uj,
+                   result.delivered, result.wakes, result.max_delay_ms);
+            CHECK(result.delivered > 0);
+            CHECK_EQ(result.delivered, always_on.delivered);
+            // nothing waits longer than the hold time, the way to an ip and a round
+            CHECK(result.max_delay_ms <= LINK_WAKE_HOLD_MS + WAKE_TO_IP_MS + STEP_MS);
+        }
+    }
+    // with the default idle time the burst and the sparse messages cost less, steady ones keep wifi up
+    // (it is only parked in the quiet last minute)
+    CHECK_EQ(run_trace(&traces[0], LINK_WIFI_IDLE_MS).wakes, 0);
+    CHECK(run_trace(&traces[0], LINK_WIFI_IDLE_MS).per_message_uj <= run_trace(&traces[0], 0).per_message_uj);
+    CHECK(run_trace(&traces[1], LINK_WIFI_IDLE_MS).per_message_uj < run_trace(&traces[1], 0).per_message_uj);
+    CHECK(run_trace(&traces[2], LINK_WIFI_IDLE_MS).per_message_uj < run_trace(&traces[2], 0).per_message_uj);
+}
+
+int main(void) {
+    test_park();
+    test_wake();
+    test_advertising();
+    test_connections();
+    test_traces();
+    return test_result("link_policy");
+}
@@ -0,0 +1,196 @@
+// Long writes replayed fragment by fragment: out of order, overlapping, oversize, gaps, cancelled ones and
+// ones dropped by a failed fragment
+#include <string.h>
+
+#include "test.h"
+#include "prep_write.h"
+
+#define GATTS_IF 3
+#define HANDLE 42
+
+static uint8_t value[PREPARE_BUF_MAX_SIZE];
+
+static void make_value(void) {
+    for (int i = 0; i < PREPARE_BUF_MAX_SIZE; i++) {
+        value[i] = (uint8_t) (i * 7 + 1);
+    }
+}
+
+// Replay the fragments of value[0..total) in the order given, each one len bytes long
+static void replay(prep_write_t* prep, const int* order, int fragments, uint16_t len, uint16_t total) {
+    for (int i = 0; i < fragments; i++) {
+        uint16_t offset = order[i] * len;
+        uint16_t n = offset + len > total ? total - offset : len;
+        CHECK_EQ(prep_write_add(prep, HANDLE, offset, value + offset, n), ESP_GATT_OK);
+    }
+}
+
+static void test_in_order(void) {
+    int order[] = {0, 1, 2, 3, 4};
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    CHECK(prep != NULL);
+    replay(prep, order, 5, 18, 80);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_OK);
+    CHECK_EQ(prep->buf->len, 80);
+    CHECK(memcmp(prep->buf->data, value, 80) == 0);
+    prep_write_release(prep);
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+static void test_out_of_order(void) {
+    int order[] = {4, 0, 3, 1, 2};
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    replay(prep, order, 5, 18, 80);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_OK);
+    CHECK_EQ(prep->buf->len, 80);
+    CHECK(memcmp(prep->buf->data, value, 80) == 0);
+    prep_write_release(prep);
+}
+
+static void test_overlapping(void) {
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    // retransmitted and overlapping fragments, the later bytes win
+    CHECK_EQ(prep_write_add(prep, HANDLE, 0, value, 30), ESP_GATT_OK);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 20, value + 20, 30), ESP_GATT_OK);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 0, value, 30), ESP_GATT_OK);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 45, value + 45, 15), ESP_GATT_OK);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_OK);
+    CHECK_EQ(prep->buf->len, 60);
+    CHECK(memcmp(prep->buf->data, value, 60) == 0);
+    prep_write_release(prep);
+}
+
+static void test_gap(void) {
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 0, value, 20), ESP_GATT_OK);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 21, value + 21, 20), ESP_GATT_OK);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_INVALID_OFFSET);
+    // the missing byte arrives late, then the value is complete
+    CHECK_EQ(prep_write_add(prep, HANDLE, 20, value + 20, 1), ESP_GATT_OK);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_OK);
+    prep_write_release(prep);
+}
+
+static void test_oversize(void) {
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep_write_add(prep, HANDLE, PREPARE_BUF_MAX_SIZE + 1, value, 1), ESP_GATT_INVALID_OFFSET);
+    CHECK(prep_write_get(1, GATTS_IF, false) == NULL);
+    prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep_write_add(prep, HANDLE, PREPARE_BUF_MAX_SIZE - 10, value, 11), ESP_GATT_INVALID_ATTR_LEN);
+    CHECK(prep_write_get(1, GATTS_IF, false) == NULL);
+    // a fragment ending at the last byte still fits, nothing of the rejected ones was kept
+    prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep_write_add(prep, HANDLE, PREPARE_BUF_MAX_SIZE - 10, value, 10), ESP_GATT_OK);
+    CHECK_EQ(prep->buf->len, PREPARE_BUF_MAX_SIZE);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_INVALID_OFFSET);
+    // the whole value in fragments of 18 bytes (mtu 23), backwards
+    int order[PREPARE_BUF_MAX_SIZE / 18 + 1];
+    int fragments = sizeof(order) / sizeof(order[0]);
+    for (int i = 0; i < fragments; i++) {
+        order[i] = fragments - 1 - i;
+    }
+    replay(prep, order, fragments, 18, PREPARE_BUF_MAX_SIZE);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_OK);
+    CHECK(memcmp(prep->buf->data, value, PREPARE_BUF_MAX_SIZE) == 0);
+    prep_write_release(prep);
+}
+
+static void test_other_handle(void) {
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 0, value, 10), ESP_GATT_OK);
+    CHECK_EQ(prep_write_add(prep, HANDLE + 1, 10, value, 10), ESP_GATT_PREPARE_Q_FULL);
+    // the long write is gone with the error, its buffer back in the pool
+    CHECK(prep_write_get(1, GATTS_IF, false) == NULL);
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+static void test_after_error(void) {
+    // a fragment fails, the client doesn't cancel; its next long write (of another attribute) starts
+    // empty instead of colliding with the old fragments
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 0, value, 20), ESP_GATT_OK);
+    CHECK_EQ(prep_write_add(prep, HANDLE, PREPARE_BUF_MAX_SIZE, value, 20), ESP_GATT_INVALID_ATTR_LEN);
+    prep = prep_write_get(1, GATTS_IF, true);
+    CHECK(prep != NULL);
+    CHECK_EQ(prep->buf->len, 0);
+    CHECK_EQ(prep_write_add(prep, HANDLE + 1, 18, value + 18, 12), ESP_GATT_OK);
+    CHECK_EQ(prep_write_add(prep, HANDLE + 1, 0, value, 18), ESP_GATT_OK);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_OK);
+    CHECK_EQ(prep->buf->len, 30);
+    CHECK(memcmp(prep->buf->data, value, 30) == 0);
+    prep_write_release(prep);
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+static void test_cancel(void) {
+    // exec write with the cancel flag: the fragments are dropped, the next long write starts empty
+    prep_write_t* prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 0, value, 50), ESP_GATT_OK);
+    prep_write_release(prep);
+    CHECK(prep_write_get(1, GATTS_IF, false) == NULL);
+    CHECK_EQ(msg_pool_in_use(), 0);
+
+    prep = prep_write_get(1, GATTS_IF, true);
+    CHECK_EQ(prep->buf->len, 0);
+    CHECK_EQ(prep->handle, 0);
+    CHECK_EQ(prep_write_add(prep, HANDLE, 10, value + 10, 10), ESP_GATT_OK);
+    CHECK_EQ(prep_write_check(prep), ESP_GATT_INVALID_OFFSET);
+    prep_write_release(prep);
+}
+
+static void test_connections(void) {
+    // every connection has its own long write, interleaved fragments don't mix
+    prep_write_t* preps[CONN_MAX];
+    for (int c = 0; c < CONN_MAX; c++) {
+        preps[c] = prep_write_get(c, GATTS_IF, true);
+        CHECK(preps[c] != NULL);
+    }
+    CHECK(prep_write_get(CONN_MAX, GATTS_IF, true) == NULL);
+    for (uint16_t offset = 0; offset < 100; offset += 20) {
+        for (int c = 0; c < CONN_MAX; c++) {
+            CHECK(prep_write_get(c, GATTS_IF, false) == preps[c]);
+            CHECK_EQ(prep_write_add(preps[c], HANDLE, offset, value + offset + c, 20), ESP_GATT_OK);
+        }
+    }
+    for (int c = 0; c < CONN_MAX; c++) {
+        CHECK_EQ(prep_write_check(preps[c]), ESP_GATT_OK);
+        CHECK(memcmp(preps[c]->buf->data, value + c, 100) == 0);
+    }
+    // a disconnect drops the long write of that connection only
+    prep_write_release_conn(1);
+    CHECK(prep_write_get(1, GATTS_IF, false) == NULL);
+    CHECK(prep_write_get(0, GATTS_IF, false) == preps[0]);
+    prep_write_release_conn(0);
+    prep_write_release_conn(2);
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+static void test_pool_exhausted(void) {
+    msg_buf_t* taken[MSG_POOL_SIZE];
+    for (int i = 0; i < MSG_POOL_SIZE; i++) {
+        taken[i] = msg_pool_alloc();
+    }
+    CHECK(prep_write_get(1, GATTS_IF, true) == NULL);
+    msg_buf_unref(taken[0]);
+    CHECK(prep_write_get(1, GATTS_IF, true) != NULL);
+    prep_write_release_conn(1);
+    for (int i = 1; i < MSG_POOL_SIZE; i++) {
+        msg_buf_unref(taken[i]);
+    }
+    CHECK_EQ(msg_pool_in_use(), 0);
+}
+
+int main(void) {
+    make_value();
+    test_in_order();
+    test_out_of_order();
+    test_overlapping();
+    test_gap();
+    test_oversize();
+    test_other_handle();
+    test_after_error();
+    test_cancel();
+    test_connections();
+    test_pool_exhausted();
+    return test_result("prep_write");
+}
@@ -0,0 +1,277 @@
+// Spool on a simulated flash: partial drains, wraparound, power cuts during writes and remounts
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "test.h"
+#include "spool.h"
+
+#define FLASH_SECTORS 4
+#define FLASH_SIZE (FLASH_SECTORS * SPOOL_SECTOR_SIZE)
+
+// NOR flash in ram: writes can only clear bits, erasing sets a whole sector back to 0xFF
+typedef struct {
+    uint8_t data[FLASH_SIZE];
+    // bytes that can still be written before the power is cut, -1 for no limit
+    long write_budget;
+    int erases;
+} ram_flash_t;
+
+static esp_err_t ram_read(void* ctx, uint32_t offset, void* dst, size_t len) {
+    ram_flash_t* ram = ctx;
+    if (offset + len > FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(dst, ram->data + offset, len);
+    return ESP_OK;
+}
+
+static esp_err_t ram_write(void* ctx, uint32_t offset, const void* src, size_t len) {
+    ram_flash_t* ram = ctx;
+    if (offset + len > FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const uint8_t* bytes = src;
+    for (size_t i = 0; i < len; i++) {
+        if (ram->write_budget == 0) {
+            return ESP_FAIL;
+        }
+        if (ram->write_budget > 0) {
+            ram->write_budget--;
+        }
+        ram->data[offset + i] &= bytes[i];
+    }
+    return ESP_OK;
+}
+
+static esp_err_t ram_erase(void* ctx, uint32_t offset) {
+    ram_flash_t* ram = ctx;
+    if (offset % SPOOL_SECTOR_SIZE != 0 || offset >= FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(ram->data + offset, 0xFF, SPOOL_SECTOR_SIZE);
+    ram->erases++;
+    return ESP_OK;
+}
+
+static ram_flash_t ram;
+static const spool_flash_t flash = {
+    .read = ram_read,
+    .write = ram_write,
+    .erase_sector = ram_erase,
+    .ctx = &ram,
+    .size = FLASH_SIZE,
+};
+
+static void format(void) {
+    memset(ram.data, 0xFF, sizeof(ram.data));
+    ram.write_budget = -1;
+    ram.erases = 0;
+}
+
+// Payload of record n, its length varies with n unless len is given
+static uint16_t make_record(uint32_t n, uint16_t len, uint8_t* out) {
+    for (uint16_t i = 0; i < len; i++) {
+        out[i] = (uint8_t) (n * 31 + i);
+    }
+    memcpy(out, &n, sizeof(n));
+    return len;
+}
+
+static uint32_t record_number(const uint8_t* data) {
+    uint32_t n;
+    memcpy(&n, data, sizeof(n));
+    return n;
+}
+
+// Drain up to max records like drain_spool does, returns how many were read; the numbers are
+// checked to continue at *expected
+static int drain(spool_t* spool, int max, uint32_t* expected) {
+    static uint8_t buf[SPOOL_SECTOR_SIZE];
+    spool_pos_t cursor = spool->tail;
+    spool_pos_t next;
+    uint16_t len;
+    int read = 0;
+    while (read < max && spool_read(spool, &cursor, buf, sizeof(buf), &len, &next) == ESP_OK) {
+        CHECK_EQ(record_number(buf), *expected);
+        (*expected)++;
+        cursor = next;
+        read++;
+    }
+    CHECK_EQ(spool_consume(spool, &cursor), ESP_OK);
+    return read;
+}
+
+static void test_partial_drain(void) {
+    uint8_t buf[1500];
+    spool_t spool;
+    format();
+    CHECK_EQ(spool_init(&spool, &flash), ESP_OK);
+    for (uint32_t n = 1; n <= 5; n++) {
+        CHECK_EQ(spool_append(&spool, buf, make_record(n, sizeof(buf), buf)), ESP_OK);
+    }
+    CHECK_EQ(spool.pending, 5);
+    // two records per sector, so the drain stops at the unused end of the first one
+    uint32_t expected = 1;
+    CHECK_EQ(drain(&spool, 2, &expected), 2);
+    CHECK_EQ(spool.pending, 3);
+
+    spool_t remounted;
+    CHECK_EQ(spool_init(&remounted, &flash), ESP_OK);
+    CHECK_EQ(remounted.pending, 3);
+    CHECK_EQ(drain(&remounted, 10, &expected), 3);
+    CHECK_EQ(expected, 6);
+    CHECK(spool_empty(&remounted));
+}
+
+static void test_wraparound(void) {
+    uint8_t buf[1000];
+    spool_t spool;
+    format();
+    CHECK_EQ(spool_init(&spool, &flash), ESP_OK);
+    // many times the flash size, drained unevenly, records of varying length
+    uint32_t appended = 0;
+    uint32_t expected = 1;
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < 3; i++) {
+            appended++;
+            CHECK_EQ(spool_append(&spool, buf, make_record(appended, 200 + appended * 37 % 800, buf)), ESP_OK);
+        }
+        drain(&spool, 2 + round % 4, &expected);
+        CHECK_EQ(spool.pending, appended - (expected - 1));
+    }
+    drain(&spool, 1000, &expected);
+    CHECK_EQ(expected, appended + 1);
+    CHECK(spool_empty(&spool));
+    CHECK_EQ(spool.dropped, 0);
+}
+
+static void test_sector_exactly_full(void) {
+    // header of 16 bytes, so two of these fill a sector to the byte
+    uint8_t buf[SPOOL_SECTOR_SIZE / 2 - 16];
+    spool_t spool;
+    format();
+    CHECK_EQ(spool_init(&spool, &flash), ESP_OK);
+    uint32_t expected = 1;
+    for (uint32_t n = 1; n <= 20; n++) {
+        CHECK_EQ(spool_append(&spool, buf, make_record(n, sizeof(buf), buf)), ESP_OK);
+        if (n % 3 == 0) {
+            drain(&spool, 3, &expected);
+        }
+    }
+    spool_t remounted;
+    CHECK_EQ(spool_init(&remounted, &flash), ESP_OK);
+    CHECK_EQ(remounted.pending, 20 - (expected - 1));
+    drain(&remounted, 100, &expected);
+    CHECK_EQ(expected, 21);
+}
+
+static void test_full(void) {
+    uint8_t buf[1500];
+    spool_t spool;
+    format();
+    CHECK_EQ(spool_init(&spool, &flash), ESP_OK);
+    // the log holds three sectors of two records, the fourth one is where we write
+    for (uint32_t n = 1; n <= 12; n++) {
+        CHECK_EQ(spool_append(&spool, buf, make_record(n, sizeof(buf), buf)), ESP_OK);
+    }
+    CHECK(spool.dropped > 0);
+    CHECK_EQ(spool.pending + spool.dropped, 12);
+    // the oldest records are gone, the rest comes in order
+    uint32_t expected = spool.dropped + 1;
+    drain(&spool, 100, &expected);
+    CHECK_EQ(expected, 13);
+}
+
+static void test_power_cut(void) {
+    uint8_t buf[600];
+    spool_t spool;
+    // cut at every byte of the third record: in its payload and in its header
+    for (long budget = 0; budget < (long) sizeof(buf) + 16; budget += 7) {
+        format();
+        CHECK_EQ(spool_init(&spool, &flash), ESP_OK);
+        CHECK_EQ(spool_append(&spool, buf, make_record(1, sizeof(buf), buf)), ESP_OK);
+        CHECK_EQ(spool_append(&spool, buf, make_record(2, sizeof(buf), buf)), ESP_OK);
+        ram.write_budget = budget;
+        spool_append(&spool, buf, make_record(3, sizeof(buf), buf));
+        ram.write_budget = -1;
+
+        // reboot: the torn record is gone, the ones before it are kept and appending works again
+        spool_t remounted;
+        CHECK_EQ(spool_init(&remounted, &flash), ESP_OK);
+        CHECK_EQ(remounted.pending, 2);
+        CHECK_EQ(spool_append(&remounted, buf, make_record(3, sizeof(buf), buf)), ESP_OK);
+        CHECK_EQ(spool_append(&remounted, buf, make_record(4, sizeof(buf), buf)), ESP_OK);
+        spool_t again;
+        CHECK_EQ(spool_init(&again, &flash), ESP_OK);
+        uint32_t expected = 1;
+        CHECK_EQ(drain(&again, 100, &expected), 4);
+    }
+}
+
+static void test_power_cut_consume(void) {
+    uint8_t buf[100];
+    spool_t spool;
+    format();
+    CHECK_EQ(spool_init(&spool, &flash), ESP_OK);
+    for (uint32_t n = 1; n <= 4; n++) {
+        CHECK_EQ(spool_append(&spool, buf, make_record(n, sizeof(buf), buf)), ESP_OK);
+    }
+    spool_pos_t cursor = spool.tail;
+    spool_pos_t next;
+    uint16_t len;
+    for (int i = 0; i < 2; i++) {
+        CHECK_EQ(spool_read(&spool, &cursor, buf, sizeof(buf), &len, &next), ESP_OK);
+        cursor = next;
+    }
+    // the mark of the first record makes it, the second one doesn't
+    ram.write_budget = 4;
+    CHECK(spool_consume(&spool, &cursor) != ESP_OK);
+    ram.write_budget = -1;
+    spool_t remounted;
+    CHECK_EQ(spool_init(&remounted, &flash), ESP_OK);
+    CHECK_EQ(remounted.pending, 3);
+    uint32_t expected = 2;
+    CHECK_EQ(drain(&remounted, 100, &expected), 3);
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Drain speed of the spool code itself (crc and bookkeeping), the flash adds its own time on the device
+static void test_drain_throughput(void) {
+    uint8_t buf[1000];
+    spool_t spool;
+    uint32_t records = 0;
+    uint64_t bytes = 0;
+    double spent = 0;
+    for (int round = 0; round < 50; round++) {
+        format();
+        CHECK_EQ(spool_init(&spool, &flash), ESP_OK);
+        uint32_t appended = 0;
+        while (spool.dropped == 0 && appended < 11) {
+            appended++;
+            CHECK_EQ(spool_append(&spool, buf, make_record(appended, sizeof(buf), buf)), ESP_OK);
+        }
+        uint32_t expected = 1;
+        double started = seconds();
+        records += drain(&spool, 100, &expected);
+        spent += seconds() - started;
+        bytes += (uint64_t) (expected - 1) * sizeof(buf);
+    }
+    printf("drained %u records in order, %.0f records/s, %.1f MB/s\n", records, records / spent, bytes / spent / 1e6);
+}
+
+int main(void) {
+    test_partial_drain();
+    test_wraparound();
+    test_sector_exactly_full();
+    test_full();
+    test_power_cut();
+    test_power_cut_consume();
+    test_drain_throughput();
+    return test_result("spool");
+}
@@ -0,0 +1,212 @@
+// WiFi state machine driven by scripted event sequences: no redundant starts, fast connect with the
+// cached bssid first, backoff with jitter, rotation through the stored networks, parking, and the
+// boot-to-ip and reconnect-to-ip metrics
+#include <string.h>
+
+#include "test.h"
+#include "wifi_sm.h"
+
+#define ANY -1
+
+// An event the driver (wifi_event_handler, the backoff timer, the uplink task) feeds in at at_ms, and
+// the action the state machine has to answer with; rank and fast are only checked for CONNECT
+typedef struct {
+    uint32_t at_ms;
+    wifi_sm_event_t event;
+    wifi_sm_action_kind_t kind;
+    int rank;
+    int fast;
+} step_t;
+
+static void run_script(wifi_sm_t* sm, const step_t* steps, size_t count, const char* name) {
+    for (size_t i = 0; i < count; i++) {
+        const step_t* step = &steps[i];
+        wifi_sm_action_t action = wifi_sm_handle(sm, step->event, (int64_t) step->at_ms * 1000);
+        if (action.kind != step->kind
+                || (action.kind == WIFI_SM_ACT_CONNECT && step->rank != ANY && action.rank != step->rank)
+                || (action.kind == WIFI_SM_ACT_CONNECT && step->fast != ANY && action.fast != step->fast)) {
+            printf("%s, step %zu: action %d rank %d fast %d, expected %d rank %d fast %d\n", name, i,
+                   action.kind, action.rank, action.fast, step->kind, step->rank, step->fast);
+            test_failures++;
+        }
+    }
+}
+
+#define RUN(sm, steps) run_script(sm, steps, sizeof(steps) / sizeof(steps[0]), #steps)
+
+static void test_boot(void) {
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, 1);
+    sm.network_count = 1;
+    // nothing cached yet: started once, then a full scan; further requests change nothing
+    static const step_t boot[] = {
+        {100, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_START, ANY, ANY},
+        {110, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_NONE, ANY, ANY},
+        {150, WIFI_SM_EV_STARTED, WIFI_SM_ACT_CONNECT, 0, false},
+        {160, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_NONE, ANY, ANY},
+        {900, WIFI_SM_EV_ASSOCIATED, WIFI_SM_ACT_NONE, ANY, ANY},
+        {1200, WIFI_SM_EV_GOT_IP, WIFI_SM_ACT_NONE, ANY, ANY},
+        {1300, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_NONE, ANY, ANY},
+    };
+    RUN(&sm, boot);
+    CHECK_EQ(sm.state, WIFI_SM_GOT_IP);
+    CHECK_EQ(sm.boot_to_ip, 1200000);
+    CHECK_EQ(sm.last_reconnect_to_ip, -1);
+    CHECK_EQ(sm.reconnects, 0);
+}
+
+static void test_fast_reconnect(void) {
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, 1);
+    sm.network_count = 1;
+    sm.fast_available = true;
+    // the cached ap answers: fast connect right after the loss, 300 ms to the ip
+    static const step_t reconnect[] = {
+        {0, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_START, ANY, ANY},
+        {40, WIFI_SM_EV_STARTED, WIFI_SM_ACT_CONNECT, 0, true},
+        {200, WIFI_SM_EV_GOT_IP, WIFI_SM_ACT_NONE, ANY, ANY},
+        {5000, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_CONNECT, 0, true},
+        {5200, WIFI_SM_EV_ASSOCIATED, WIFI_SM_ACT_NONE, ANY, ANY},
+        {5300, WIFI_SM_EV_GOT_IP, WIFI_SM_ACT_NONE, ANY, ANY},
+    };
+    RUN(&sm, reconnect);
+    CHECK_EQ(sm.boot_to_ip, 200000);
+    CHECK_EQ(sm.last_reconnect_to_ip, 300000);
+    CHECK_EQ(sm.reconnects, 1);
+}
+
+// The ap moved: the fast connect fails and is followed by a scan at once, further failures back off
+static void test_backoff(void) {
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, 12345);
+    sm.network_count = 1;
+    sm.fast_available = true;
+    static const step_t moved[] = {
+        {0, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_START, ANY, ANY},
+        {40, WIFI_SM_EV_STARTED, WIFI_SM_ACT_CONNECT, 0, true},
+        {100, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_CONNECT, 0, false},
+        {2000, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_WAIT, ANY, ANY},
+    };
+    RUN(&sm, moved);
+
+    // every failure doubles the delay up to the maximum, each one within the jitter around it
+    // (the fast connect counted as the first failure, the scan as the second)
+    uint32_t nominal = WIFI_BACKOFF_MIN_MS * 2;
+    uint32_t now = 2000;
+    for (int failure = 2; failure <= 12; failure++) {
+        wifi_sm_action_t action = wifi_sm_handle(&sm, WIFI_SM_EV_BACKOFF_EXPIRED, (int64_t) now * 1000);
+        CHECK_EQ(action.kind, WIFI_SM_ACT_CONNECT);
+        CHECK(!action.fast);
+        now += 2000;
+        action = wifi_sm_handle(&sm, WIFI_SM_EV_DISCONNECTED, (int64_t) now * 1000);
+        CHECK_EQ(action.kind, WIFI_SM_ACT_WAIT);
+        nominal = nominal * 2 > WIFI_BACKOFF_MAX_MS ? WIFI_BACKOFF_MAX_MS : nominal * 2;
+        uint32_t jitter = nominal * WIFI_BACKOFF_JITTER_PERCENT / 100;
+        CHECK(action.delay_ms >= nominal - jitter && action.delay_ms <= nominal + jitter);
+        now += action.delay_ms;
+    }
+    CHECK_EQ(nominal, WIFI_BACKOFF_MAX_MS);
+    CHECK_EQ(wifi_sm_handle(&sm, WIFI_SM_EV_BACKOFF_EXPIRED, (int64_t) now * 1000).kind, WIFI_SM_ACT_CONNECT);
+    CHECK_EQ(wifi_sm_handle(&sm, WIFI_SM_EV_GOT_IP, (int64_t) (now + 900) * 1000).kind, WIFI_SM_ACT_NONE);
+    CHECK_EQ(sm.failures, 0);
+    // a stray timer once connected does nothing
+    CHECK_EQ(wifi_sm_handle(&sm, WIFI_SM_EV_BACKOFF_EXPIRED, (int64_t) (now + 1000) * 1000).kind, WIFI_SM_ACT_NONE);
+    CHECK_EQ(sm.state, WIFI_SM_GOT_IP);
+}
+
+// Devices that lost the same ap at the same time come back spread out, not in a reconnect storm
+static void test_jitter_spread(void) {
+    uint32_t delays[8];
+    int distinct = 0;
+    for (uint32_t seed = 1; seed <= 8; seed++) {
+        wifi_sm_t sm;
+        wifi_sm_init(&sm, seed * 2654435761u);
+        sm.network_count = 1;
+        wifi_sm_handle(&sm, WIFI_SM_EV_CONNECT_REQUEST, 0);
+        wifi_sm_handle(&sm, WIFI_SM_EV_STARTED, 0);
+        delays[seed - 1] = wifi_sm_handle(&sm, WIFI_SM_EV_DISCONNECTED, 0).delay_ms;
+        bool seen = false;
+        for (uint32_t i = 0; i + 1 < seed; i++) {
+            seen |= delays[i] == delays[seed - 1];
+        }
+        distinct += !seen;
+    }
+    CHECK(distinct >= 6);
+}
+
+static void test_networks(void) {
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, 7);
+    sm.network_count = 3;
+    // the first two stored networks are out of reach, the third one connects and ranks first afterwards
+    static const step_t rotate[] = {
+        {0, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_START, ANY, ANY},
+        {40, WIFI_SM_EV_STARTED, WIFI_SM_ACT_CONNECT, 0, false},
+        {2000, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_WAIT, ANY, ANY},
+        {2600, WIFI_SM_EV_BACKOFF_EXPIRED, WIFI_SM_ACT_CONNECT, 1, false},
+        {4600, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_WAIT, ANY, ANY},
+        {5900, WIFI_SM_EV_BACKOFF_EXPIRED, WIFI_SM_ACT_CONNECT, 2, false},
+        {6500, WIFI_SM_EV_GOT_IP, WIFI_SM_ACT_NONE, ANY, ANY},
+    };
+    RUN(&sm, rotate);
+    CHECK_EQ(sm.rank, 0);
+    CHECK_EQ(sm.boot_to_ip, 6500000);
+
+    // new credentials while connected: disconnect, then connect to the newest network at once
+    static const step_t credentials[] = {
+        {10000, WIFI_SM_EV_CREDENTIALS_CHANGED, WIFI_SM_ACT_DISCONNECT, ANY, ANY},
+        {10050, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_CONNECT, 0, false},
+        {10800, WIFI_SM_EV_GOT_IP, WIFI_SM_ACT_NONE, ANY, ANY},
+    };
+    RUN(&sm, credentials);
+    CHECK_EQ(sm.state, WIFI_SM_GOT_IP);
+    // that wasn't a lost connection
+    CHECK_EQ(sm.reconnects, 0);
+
+    // and during a backoff they cut it short
+    static const step_t during_backoff[] = {
+        {20000, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_CONNECT, 0, false},
+        {22000, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_WAIT, ANY, ANY},
+        {22100, WIFI_SM_EV_CREDENTIALS_CHANGED, WIFI_SM_ACT_CONNECT, 0, false},
+    };
+    RUN(&sm, during_backoff);
+}
+
+// The link policy parks wifi while there is nothing to send, the next request reconnects without a restart
+static void test_park(void) {
+    wifi_sm_t sm;
+    wifi_sm_init(&sm, 1);
+    sm.network_count = 1;
+    static const step_t park[] = {
+        {0, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_START, ANY, ANY},
+        {40, WIFI_SM_EV_STARTED, WIFI_SM_ACT_CONNECT, 0, false},
+        {800, WIFI_SM_EV_GOT_IP, WIFI_SM_ACT_NONE, ANY, ANY},
+        {60000, WIFI_SM_EV_PARK_REQUEST, WIFI_SM_ACT_DISCONNECT, ANY, ANY},
+        {60020, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_NONE, ANY, ANY},
+        {90000, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_CONNECT, 0, false},
+        {90500, WIFI_SM_EV_GOT_IP, WIFI_SM_ACT_NONE, ANY, ANY},
+        // wanted again before the disconnect went through: reconnect once it did
+        {120000, WIFI_SM_EV_PARK_REQUEST, WIFI_SM_ACT_DISCONNECT, ANY, ANY},
+        {120005, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_NONE, ANY, ANY},
+        {120020, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_CONNECT, 0, false},
+        // parked during a backoff there is nothing to disconnect
+        {122000, WIFI_SM_EV_DISCONNECTED, WIFI_SM_ACT_WAIT, ANY, ANY},
+        {122100, WIFI_SM_EV_PARK_REQUEST, WIFI_SM_ACT_NONE, ANY, ANY},
+        {122600, WIFI_SM_EV_BACKOFF_EXPIRED, WIFI_SM_ACT_NONE, ANY, ANY},
+        {130000, WIFI_SM_EV_CONNECT_REQUEST, WIFI_SM_ACT_CONNECT, 0, false},
+    };
+    RUN(&sm, park);
+    CHECK_EQ(sm.state, WIFI_SM_CONNECTING);
+    // parking isn't a lost connection either
+    CHECK_EQ(sm.reconnects, 0);
+}
+
+int main(void) {
+    test_boot();
+    test_fast_reconnect();
+    test_backoff();
+    test_jitter_spread();
+    test_networks();
+    test_park();
+    return test_result("wifi_sm");
+}
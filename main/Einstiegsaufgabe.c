@@ -1,10 +1,18 @@
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include "esp_netif.h"
 #include "esp_wifi.h"
 #include "nvs_flash.h"
 #include "esp_log.h"
 #include "freertos/event_groups.h"
-#include "esp_http_client.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_mac.h"
+#include "esp_pm.h"
 
 #include "esp_bt.h"
 #include "esp_bt_main.h"
@@ -13,70 +21,139 @@
 #include "esp_gatt_common_api.h"
 #include "esp_gatt_defs.h"
 
-#define WIFI_READ_INFO BIT0
-#define WIFI_GOT_IP_BIT BIT1
-
-#define POST_URL "https://europe-west3-einstiegsaufgabe.cloudfunctions.net/receive_data"
-#define POST_PORT 80
+#include "uplink.h"
+#include "batch.h"
+#include "spool.h"
+#include "prep_write.h"
+#include "msg_pool.h"
+#include "credentials.h"
+#include "wifi_sm.h"
+#include "frame.h"
+#include "status.h"
+#include "conn.h"
+#include "bulk.h"
+#include "latency.h"
+#include "memstat.h"
+#include "dlog.h"
+#include "ready.h"
+#include "link_policy.h"
+#include "aggregate.h"
 
 #define BLUETOOTH_NAME "esp32-noah"
-// every service requests the following handles: service, char, char value, char desc
-#define GATTS_NUM_HANDLES 4
-#define NUM_SERVICES 4
-#define PREPARE_BUF_MAX_SIZE 1024
+#define GATTS_APP_ID 0
 #define MAX_WRITE_LENGTH 1024
 
-#define SSID_SERVICE_ID 0
-#define SERVICE_UUID_SSID 0x0AA
-#define SERVICE_CHAR_UUID_SSID 0xAA01
-#define SERVICE_DESC_UUID_SSID 0x1111
-
-#define PASS_SERVICE_ID 1
-#define SERVICE_UUID_PASS 0x0BB
-#define SERVICE_CHAR_UUID_PASS 0xBB01
-#define SERVICE_DESC_UUID_PASS 0x2222
-
-#define MSG_SERVICE_ID 2
-#define SERVICE_UUID_MSG 0x0CC
-#define SERVICE_CHAR_UUID_MSG 0xCC01
-#define SERVICE_DESC_UUID_MSG 0x3333
-
-#define CONN_SERVICE_ID 3
-#define SERVICE_UUID_CONN 0x0DD
-#define SERVICE_CHAR_UUID_CONN 0xDD01
-#define SERVICE_DESC_UUID_CONN 0x4444
-
-void write_wifi_ssid(uint8_t* msg, uint16_t len);
-void write_wifi_password(uint8_t* msg, uint16_t len);
-void post_http();
-void connect_to_wifi();
-void read_wifi();
-
-static EventGroupHandle_t wifi_event_group;
-
-char wifi_ssid[32];
-char wifi_password[64];
+// every queued message holds a pool buffer, so the pool limits the queue anyway
+#define UPLINK_QUEUE_LENGTH MSG_POOL_SIZE
+#define UPLINK_TASK_STACK_SIZE 8192
+#define UPLINK_TASK_PRIORITY 5
+// how long a batch waits for wifi before it is spooled to flash (or reported failed without a spool)
+#define WIFI_WAIT_MS 10000
+// interval in which the uplink task checks whether spooled batches can be sent
+#define SPOOL_RETRY_MS 1000
+#define SPOOL_DRAIN_BYTES 4096
+// runs of spooled messages (see seq_run.h) we keep to report them as sent, 16 bytes each
+#define SPOOL_TRACKED_RUNS 64
+// wifi is started on its own task at boot, in parallel to bluetooth
+#define BOOT_WIFI_STACK_SIZE 4096
+#define BOOT_WIFI_PRIORITY 5
+#define BOOT_WIFI_CORE 1
+// the uplink task updates the link policy at least this often
+#define LINK_TICK_MS 1000
+// frequency scaling goes down to this while nothing is running, the radios keep the apb at 80 MHz anyway
+#define PM_MIN_FREQ_MHZ 80
+
+// all characteristics live in a single service, created from attr_table in one step
+#define SERVICE_UUID 0x0FF
+#define CHAR_UUID_SSID 0xAA01
+#define CHAR_UUID_PASS 0xBB01
+#define CHAR_UUID_MSG 0xCC01
+// messages streamed with writes without response, see bulk.h
+#define CHAR_UUID_BULK 0xCC02
+#define CHAR_UUID_CONN 0xDD01
+// selects the uplink transport, see uplink.h
+#define CHAR_UUID_TRANSPORT 0xDD02
+// notifies the delivery state of messages and the server responses, see status.h
+#define CHAR_UUID_STATUS 0xEE01
+// latency histograms of the message pipeline, see latency.h
+#define CHAR_UUID_LATENCY 0xEE02
+// heap and stack minima per pipeline stage, see memstat.h
+#define CHAR_UUID_MEMORY 0xEE03
+
+// attributes of the service in the order of attr_table, attribute i gets handle attr_base_handle + i
+enum {
+    ATTR_SERVICE,
+    ATTR_SSID_DECL,
+    ATTR_SSID_VALUE,
+    ATTR_PASS_DECL,
+    ATTR_PASS_VALUE,
+    ATTR_MSG_DECL,
+    ATTR_MSG_VALUE,
+    ATTR_BULK_DECL,
+    ATTR_BULK_VALUE,
+    ATTR_CONN_DECL,
+    ATTR_CONN_VALUE,
+    ATTR_TRANSPORT_DECL,
+    ATTR_TRANSPORT_VALUE,
+    ATTR_STATUS_DECL,
+    ATTR_STATUS_VALUE,
+    ATTR_STATUS_CONFIG,
+    ATTR_LATENCY_DECL,
+    ATTR_LATENCY_VALUE,
+    ATTR_MEMORY_DECL,
+    ATTR_MEMORY_VALUE,
+    ATTR_NUM,
+};
 
-char post_message[128] = "default";
+esp_gatt_status_t write_wifi_ssid(uint16_t conn_id, msg_buf_t* buf);
+esp_gatt_status_t write_wifi_password(uint16_t conn_id, msg_buf_t* buf);
+esp_err_t post_uplink(const char* msg, size_t len);
+void connect_to_wifi();
+void reconnect_to_wifi();
+int uplink_queue_depth();
+uint32_t uplink_drop_count();
+
+// ssid of the network we are connecting to, ranked first once we get an ip
+static char wifi_ssid[CRED_SSID_LEN + 1];
+
+// connection state machine, fed from the wifi events, the backoff timer and connect requests
+static wifi_sm_t wifi_sm;
+static SemaphoreHandle_t wifi_sm_lock;
+static esp_timer_handle_t wifi_backoff_timer;
+
+// msg_buf_t pointers, one queue per connection slot (see conn.h), filled by the gatts handler
+// and served round-robin by uplink_task, so a busy client can't hold up the others
+static QueueHandle_t uplink_queues[CONN_MAX];
+// counts the messages in all queues, uplink_task waits on it
+static SemaphoreHandle_t uplink_pending;
+// slot served next, only used by uplink_task
+static int uplink_next_slot = 0;
+// connections whose messages the current post carries, they get the server response
+static uint32_t uplink_post_conns = 0;
+// counted on the bluetooth and the uplink task
+static uint32_t uplink_dropped = 0;
+static portMUX_TYPE uplink_drop_lock = portMUX_INITIALIZER_UNLOCKED;
+// messages posted since the link policy was last updated, only used by uplink_task
+static uint32_t uplink_delivered = 0;
+
+// identify our records, so the receiver can put them in order and drop duplicates
+static uint8_t device_id[FRAME_DEVICE_ID_LEN];
+static uint32_t boot_id;
+static uint32_t uplink_seq = 0;
+
+// batches that couldn't be posted, only used by uplink_task
+static spool_t spool;
+static bool spool_ok = false;
+// messages spooled since the spool was last empty, reported as sent once it is drained;
+// runs beyond these stay reported as spooled
+static seq_run_t spool_run_storage[SPOOL_TRACKED_RUNS];
+static seq_runs_t spool_runs;
+
+static esp_gatt_if_t gatts_app_if = ESP_GATT_IF_NONE;
+// handle of the service, 0 until the attribute table is created
+static uint16_t attr_base_handle = 0;
 
 // COPY-PASTE examples/bluedroid/ble/gatt_server/main.c
-struct gatts_profile_inst {
-    int service_uuid;
-    int service_char_uuid;
-    int service_desc_uuid;
-    // added above
-    uint16_t gatts_if;
-    uint16_t app_id;
-    uint16_t conn_id;
-    uint16_t service_handle;
-    esp_gatt_srvc_id_t service_id;
-    uint16_t char_handle;
-    esp_bt_uuid_t char_uuid;
-    esp_gatt_perm_t perm;
-    esp_gatt_char_prop_t property;
-    uint16_t descr_handle;
-    esp_bt_uuid_t descr_uuid;
-};
 static uint8_t adv_service_uuid128[32] = {
     /* LSB <--------------------------------------------------------------------------------> MSB */
     //first uuid, 16bit, [12],[13] is the value
@@ -117,70 +194,132 @@ static esp_ble_adv_data_t scan_rsp_data = {
     .flag = (ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT),
 };
 static esp_ble_adv_params_t adv_params = {
-    .adv_int_min        = 0x20,
-    .adv_int_max        = 0x40,
+    .adv_int_min        = LINK_ADV_ACTIVE_MIN_INT,
+    .adv_int_max        = LINK_ADV_ACTIVE_MAX_INT,
     .adv_type           = ADV_TYPE_IND,
     .own_addr_type      = BLE_ADDR_TYPE_PUBLIC,
     .channel_map        = ADV_CHNL_ALL,
     .adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY,
 };
-typedef struct {
-    uint8_t                 *prepare_buf;
-    int                     prepare_len;
-} prepare_type_env_t;
 // End Copy-Paste
 
-static struct gatts_profile_inst services_array[NUM_SERVICES] = {
-    [SSID_SERVICE_ID] = {
-        .gatts_if = ESP_GATT_IF_NONE,
-        .service_uuid = SERVICE_UUID_SSID,
-        .service_char_uuid = SERVICE_CHAR_UUID_SSID,
-        .service_desc_uuid = SERVICE_DESC_UUID_SSID,
-    },
-    [PASS_SERVICE_ID] = {
-        .gatts_if = ESP_GATT_IF_NONE,
-        .service_uuid = SERVICE_UUID_PASS,
-        .service_char_uuid = SERVICE_CHAR_UUID_PASS,
-        .service_desc_uuid = SERVICE_DESC_UUID_PASS,
-    },
-    [MSG_SERVICE_ID] = {
-        .gatts_if = ESP_GATT_IF_NONE,
-        .service_uuid = SERVICE_UUID_MSG,
-        .service_char_uuid = SERVICE_CHAR_UUID_MSG,
-        .service_desc_uuid = SERVICE_DESC_UUID_MSG,
-    },
-    [CONN_SERVICE_ID] = {
-        .gatts_if = ESP_GATT_IF_NONE,
-        .service_uuid = SERVICE_UUID_CONN,
-        .service_char_uuid = SERVICE_CHAR_UUID_CONN,
-        .service_desc_uuid = SERVICE_DESC_UUID_CONN,
-    }
-};
-
+static const uint16_t primary_service_uuid = ESP_GATT_UUID_PRI_SERVICE;
+static const uint16_t char_declaration_uuid = ESP_GATT_UUID_CHAR_DECLARE;
+static const uint16_t char_client_config_uuid = ESP_GATT_UUID_CHAR_CLIENT_CONFIG;
+static const uint16_t service_uuid = SERVICE_UUID;
+static const uint16_t char_uuid_ssid = CHAR_UUID_SSID;
+static const uint16_t char_uuid_pass = CHAR_UUID_PASS;
+static const uint16_t char_uuid_msg = CHAR_UUID_MSG;
+static const uint16_t char_uuid_bulk = CHAR_UUID_BULK;
+static const uint16_t char_uuid_conn = CHAR_UUID_CONN;
+static const uint16_t char_uuid_transport = CHAR_UUID_TRANSPORT;
+static const uint16_t char_uuid_status = CHAR_UUID_STATUS;
+static const uint16_t char_uuid_latency = CHAR_UUID_LATENCY;
+static const uint16_t char_uuid_memory = CHAR_UUID_MEMORY;
+static const uint8_t char_prop_write = ESP_GATT_CHAR_PROP_BIT_WRITE;
+// results are notified on the status characteristic, so clients can write without waiting for a response
+static const uint8_t char_prop_write_nr = ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_WRITE_NR;
+static const uint8_t char_prop_write_only_nr = ESP_GATT_CHAR_PROP_BIT_WRITE_NR;
+static const uint8_t char_prop_notify = ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+static const uint8_t char_prop_read = ESP_GATT_CHAR_PROP_BIT_READ;
 static uint8_t attr_val[] = {0x11, 0x22, 0x33};
-static esp_attr_value_t service_char_value = {
-    .attr_max_len = 64,
-    .attr_value = attr_val,
-    .attr_len = sizeof(attr_val)
+
+#define ATTR_DECL(prop) \
+    {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t*) &char_declaration_uuid, ESP_GATT_PERM_READ, sizeof(uint8_t), sizeof(uint8_t), (uint8_t*) &(prop)}}
+// written values are checked and answered by us (see gatts_event_handler)
+#define ATTR_WRITE_VALUE(uuid) \
+    {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t*) &(uuid), ESP_GATT_PERM_WRITE, 64, sizeof(attr_val), attr_val}}
+
+static const esp_gatts_attr_db_t attr_table[ATTR_NUM] = {
+    [ATTR_SERVICE] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t*) &primary_service_uuid, ESP_GATT_PERM_READ, sizeof(uint16_t), sizeof(service_uuid), (uint8_t*) &service_uuid}},
+    [ATTR_SSID_DECL] = ATTR_DECL(char_prop_write),
+    [ATTR_SSID_VALUE] = ATTR_WRITE_VALUE(char_uuid_ssid),
+    [ATTR_PASS_DECL] = ATTR_DECL(char_prop_write),
+    [ATTR_PASS_VALUE] = ATTR_WRITE_VALUE(char_uuid_pass),
+    [ATTR_MSG_DECL] = ATTR_DECL(char_prop_write_nr),
+    [ATTR_MSG_VALUE] = ATTR_WRITE_VALUE(char_uuid_msg),
+    [ATTR_BULK_DECL] = ATTR_DECL(char_prop_write_only_nr),
+    [ATTR_BULK_VALUE] = ATTR_WRITE_VALUE(char_uuid_bulk),
+    [ATTR_CONN_DECL] = ATTR_DECL(char_prop_write),
+    [ATTR_CONN_VALUE] = ATTR_WRITE_VALUE(char_uuid_conn),
+    [ATTR_TRANSPORT_DECL] = ATTR_DECL(char_prop_write),
+    [ATTR_TRANSPORT_VALUE] = ATTR_WRITE_VALUE(char_uuid_transport),
+    [ATTR_STATUS_DECL] = ATTR_DECL(char_prop_notify),
+    [ATTR_STATUS_VALUE] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t*) &char_uuid_status, ESP_GATT_PERM_READ, 0, 0, NULL}},
+    // the client configuration is kept per connection (see status_subscribe), the stack would share one
+    // value between all of them, so we answer reads and writes
+    [ATTR_STATUS_CONFIG] = {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t*) &char_client_config_uuid, ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, sizeof(uint16_t), 0, NULL}},
+    [ATTR_LATENCY_DECL] = ATTR_DECL(char_prop_read),
+    // encoded on every read (see handle_read)
+    [ATTR_LATENCY_VALUE] = {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t*) &char_uuid_latency, ESP_GATT_PERM_READ, ESP_GATT_MAX_ATTR_LEN, 0, NULL}},
+    [ATTR_MEMORY_DECL] = ATTR_DECL(char_prop_read),
+    [ATTR_MEMORY_VALUE] = {{ESP_GATT_RSP_BY_APP}, {ESP_UUID_LEN_16, (uint8_t*) &char_uuid_memory, ESP_GATT_PERM_READ, ESP_GATT_MAX_ATTR_LEN, 0, NULL}},
 };
 
-static prepare_type_env_t write_prep_env;
+// Count a message that had to be dropped, returns how many were so far
+static uint32_t count_dropped() {
+    portENTER_CRITICAL(&uplink_drop_lock);
+    uint32_t dropped = ++uplink_dropped;
+    portEXIT_CRITICAL(&uplink_drop_lock);
+    return dropped;
+}
 
-void write_post_message(uint8_t* msg, uint16_t len) {
-    if (len >= 128) {
-        printf("Couldn't write post_message\n");
-        return;
+// Hand a message to the uplink task without blocking or copying, returns false if it had to be dropped
+bool enqueue_post_message(msg_buf_t* buf) {
+    if (!(ready_get() & READY_UPLINK_BIT)) {
+        DLOG(DLOG_WARN, "Uplink isn't ready yet\n");
+        return false;
     }
-    post_message[len] = '\0';
-    memcpy(post_message, msg, len);
-    printf("New post_message: %s\n", post_message);
+    int slot = conn_slot(buf->conn_id);
+    if (slot < 0) {
+        DLOG(DLOG_WARN, "Message from unknown connection %d\n", buf->conn_id);
+        return false;
+    }
+    // each connection may fill its share of the pool, the rest stays free for the others
+    int connections = conn_count();
+    UBaseType_t share = MSG_POOL_SIZE / (connections > 0 ? connections : 1);
+    msg_buf_ref(buf);
+    // only called on the bluetooth task, the number is taken once the message is queued
+    buf->seq = uplink_seq + 1;
+    if (uxQueueMessagesWaiting(uplink_queues[slot]) >= share) {
+        msg_buf_unref(buf);
+        uint32_t dropped = count_dropped();
+        DLOG(DLOG_WARN, "Uplink queue of connection %d full, dropped %" PRIu32 " messages so far\n", buf->conn_id, dropped);
+        status_message(buf->conn_id, STATUS_DROPPED, 0);
+        return false;
+    }
+    uplink_seq++;
+    // notified before the uplink task can see the message, otherwise its STATUS_SENT could come first
+    status_message(buf->conn_id, STATUS_QUEUED, buf->seq);
+    // can't fail: only this task sends, and the queue is as long as the pool
+    xQueueSend(uplink_queues[slot], &buf, 0);
+    xSemaphoreGive(uplink_pending);
+    DLOG(DLOG_DEBUG, "Queued message, %d waiting, %d/%d buffers in use\n", uplink_queue_depth(), msg_pool_in_use(), MSG_POOL_SIZE);
+    return true;
 }
 
-void print_uint8_as_char(uint8_t* msg, uint16_t len) {
-    char str[len + 1];
-    str[len] = '\0';
-    memcpy(str, msg, len);
-    printf("Message received: %s\n", str);
+int uplink_queue_depth() {
+    int depth = 0;
+    for (int i = 0; i < CONN_MAX; i++) {
+        depth += uxQueueMessagesWaiting(uplink_queues[i]);
+    }
+    return depth;
+}
+
+uint32_t uplink_drop_count() {
+    portENTER_CRITICAL(&uplink_drop_lock);
+    uint32_t dropped = uplink_dropped;
+    portEXIT_CRITICAL(&uplink_drop_lock);
+    return dropped;
+}
+
+// Log a written value, the wifi password only by its length
+static void log_write_value(uint16_t handle, const uint8_t* value, uint16_t len) {
+    if (attr_base_handle != 0 && handle == attr_base_handle + ATTR_PASS_VALUE) {
+        DLOG_SECRET(DLOG_INFO, "Password received", len);
+        return;
+    }
+    DLOG_STR(DLOG_INFO, "Message received: %.*s (%d bytes)\n", (const char*) value, len, len);
 }
 
 static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
@@ -194,205 +333,459 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
             break;
         case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
             if (param -> adv_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
-                printf("Some error occured during advertising start\n");
+                DLOG(DLOG_ERROR, "Some error occured during advertising start\n");
+            } else {
+                ready_set(READY_ADVERTISING_BIT);
             }
             break;
+        case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+            DLOG(DLOG_DEBUG, "Connection interval is %d * 1.25 ms\n", param->update_conn_params.conn_int);
+            break;
+        case ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT:
+            DLOG(DLOG_DEBUG, "Data length is %d bytes\n", param->pkt_data_length_cmpl.params.tx_len);
+            break;
         default:
             break;
     }
 }
 
-// Register given service (called on ESP_GATTS_REG_EVT)
-static void register_service(uint8_t id) {
-    printf("Registering service with id %d\n", id);
-    services_array[id].service_id.is_primary = true;
-    services_array[id].service_id.id.inst_id = 0x00;
-    services_array[id].service_id.id.uuid.len = ESP_UUID_LEN_16;
-    services_array[id].service_id.id.uuid.uuid.uuid16 = services_array[id].service_uuid;
+// Check the handles of the attribute table and start the service (called on ESP_GATTS_CREAT_ATTR_TAB_EVT)
+static void start_service(esp_ble_gatts_cb_param_t* param) {
+    if (param->add_attr_tab.status != ESP_GATT_OK || param->add_attr_tab.num_handle != ATTR_NUM) {
+        DLOG(DLOG_ERROR, "Couldn't create attribute table: %d\n", param->add_attr_tab.status);
+        return;
+    }
+    // writes are dispatched by the offset of their handle, so the handles have to be consecutive
+    for (int i = 0; i < ATTR_NUM; i++) {
+        if (param->add_attr_tab.handles[i] != param->add_attr_tab.handles[0] + i) {
+            DLOG(DLOG_ERROR, "Attribute handles aren't consecutive\n");
+            return;
+        }
+    }
+    attr_base_handle = param->add_attr_tab.handles[ATTR_SERVICE];
+    status_set_attr(gatts_app_if, attr_base_handle + ATTR_STATUS_VALUE);
+    esp_ble_gatts_start_service(attr_base_handle);
+    ready_set(READY_BLUETOOTH_BIT);
 }
 
-// Start given service (called on ESP_GATTS_CREATE_EVT)
-static void start_service(uint8_t id, esp_ble_gatts_cb_param_t* param) {
-    services_array[id].service_handle = param -> create.service_handle;
-    services_array[id].char_uuid.len = ESP_UUID_LEN_16;
-    services_array[id].char_uuid.uuid.uuid16 = services_array[id].service_char_uuid;
+// Queue a message for the uplink, the uplink task posts it and we only tell the client whether there was room
+static esp_gatt_status_t write_message(uint16_t conn_id, msg_buf_t* buf) {
+    frame_t frame;
+    if (buf->len > 0 && buf->data[0] == FRAME_MAGIC && !frame_decode(buf->data + 1, buf->len - 1, &frame)) {
+        DLOG(DLOG_ERROR, "Malformed binary message\n");
+        return ESP_GATT_INVALID_PDU;
+    }
+    buf->received_ms = esp_timer_get_time() / 1000;
+    buf->conn_id = conn_id;
+    if (!enqueue_post_message(buf)) {
+        return ESP_GATT_NO_RESOURCES;
+    }
+    return ESP_GATT_OK;
+}
 
-    // start service
-    esp_ble_gatts_start_service(services_array[id].service_handle);
-    esp_gatt_char_prop_t service_properties = ESP_GATT_CHAR_PROP_BIT_WRITE;
-    esp_ble_gatts_add_char(services_array[id].service_handle, &services_array[id].char_uuid, ESP_GATT_PERM_WRITE, service_properties, &service_char_value, ESP_GATT_RSP_BY_APP);
-    esp_ble_gatts_add_char_descr(services_array[id].service_handle, &services_array[id].descr_uuid, ESP_GATT_PERM_WRITE, NULL, NULL);
+// Connect with the staged (or remembered) credentials
+static esp_gatt_status_t write_connect(uint16_t conn_id, msg_buf_t* buf) {
+    // an ssid without password means an open network
+    credentials_commit();
+    reconnect_to_wifi();
+    return ESP_GATT_OK;
 }
 
-// Add characteristics to given service (called on ESP_GATTS_ADD_CHAR_EVT)
-static void add_characteristic(uint8_t id, esp_ble_gatts_cb_param_t* param) {
-    services_array[id].char_handle = param -> add_char.attr_handle;
-    services_array[id].descr_uuid.len = ESP_UUID_LEN_16;
-    services_array[id].descr_uuid.uuid.uuid16 = ESP_GATT_UUID_CHAR_CLIENT_CONFIG;
+// Select the uplink transport with a single byte (uplink_transport_id_t), used from the next post on
+static esp_gatt_status_t write_transport(uint16_t conn_id, msg_buf_t* buf) {
+    if (buf->len != 1 || !uplink_set_transport(buf->data[0])) {
+        return ESP_GATT_OUT_OF_RANGE;
+    }
+    return ESP_GATT_OK;
+}
 
-    esp_ble_gatts_add_char_descr(services_array[id].service_handle, &services_array[id].descr_uuid, ESP_GATT_PERM_WRITE, NULL, NULL);
+static esp_gatt_status_t write_status_config(uint16_t conn_id, msg_buf_t* buf) {
+    return status_subscribe(conn_id, buf->data, buf->len);
+}
+
+// Handles a (complete) value written to an attribute, buf stays owned by the caller
+typedef esp_gatt_status_t (*attr_write_handler_t)(uint16_t conn_id, msg_buf_t* buf);
+
+// indexed like attr_table, NULL for attributes that can't be written
+static const attr_write_handler_t attr_write_handlers[ATTR_NUM] = {
+    [ATTR_SSID_VALUE] = write_wifi_ssid,
+    [ATTR_PASS_VALUE] = write_wifi_password,
+    [ATTR_MSG_VALUE] = write_message,
+    [ATTR_CONN_VALUE] = write_connect,
+    [ATTR_TRANSPORT_VALUE] = write_transport,
+    [ATTR_STATUS_CONFIG] = write_status_config,
+};
+
+// Look up what to do with a write to handle, NULL if the attribute isn't writable
+static attr_write_handler_t attr_write_handler(uint16_t handle) {
+    // handles below the service wrap around to large offsets
+    uint16_t index = handle - attr_base_handle;
+    if (attr_base_handle == 0 || index >= ATTR_NUM) {
+        return NULL;
+    }
+    return attr_write_handlers[index];
+}
+
+// Perform the action of the attribute a (complete) value was written to, buf stays owned by the caller
+static esp_gatt_status_t handle_write(uint16_t conn_id, uint16_t handle, msg_buf_t* buf) {
+    attr_write_handler_t handler = attr_write_handler(handle);
+    if (handler == NULL) {
+        return ESP_GATT_WRITE_NOT_PERMIT;
+    }
+    esp_gatt_status_t status = handler(conn_id, buf);
+    memstat_sample(MEMSTAT_BLE_WRITE);
+    return status;
+}
+
+// Move a single write into a pool buffer and handle it
+static esp_gatt_status_t handle_single_write(esp_ble_gatts_cb_param_t* param) {
+    if (attr_write_handler(param->write.handle) == NULL) {
+        return ESP_GATT_WRITE_NOT_PERMIT;
+    }
+    if (param->write.len > MSG_BUF_SIZE) {
+        return ESP_GATT_INVALID_ATTR_LEN;
+    }
+    msg_buf_t* buf = msg_pool_alloc();
+    if (buf == NULL) {
+        DLOG(DLOG_WARN, "No message buffer left\n");
+        if (param->write.handle == attr_base_handle + ATTR_MSG_VALUE) {
+            count_dropped();
+            status_message(param->write.conn_id, STATUS_DROPPED, 0);
+        }
+        return ESP_GATT_NO_RESOURCES;
+    }
+    memcpy(buf->data, param->write.value, param->write.len);
+    buf->len = param->write.len;
+    esp_gatt_status_t status = handle_write(param->write.conn_id, param->write.handle, buf);
+    msg_buf_unref(buf);
+    return status;
+}
+
+// Reassemble a packet of a bulk stream, completed messages are queued like single writes
+static esp_gatt_status_t handle_bulk_write(esp_ble_gatts_cb_param_t* param) {
+    msg_buf_t* complete;
+    uint16_t lost;
+    conn_stream_activity(param->write.conn_id);
+    esp_gatt_status_t status = bulk_receive(param->write.conn_id, param->write.value, param->write.len, &complete, &lost);
+    if (lost > 0) {
+        uint16_t seq = param->write.value[0] | (param->write.value[1] << 8);
+        DLOG(DLOG_WARN, "Lost %d bulk packets before %d\n", lost, seq);
+        status_lost(param->write.conn_id, seq - lost, seq);
+    }
+    if (status == ESP_GATT_NO_RESOURCES || status == ESP_GATT_INVALID_ATTR_LEN) {
+        // writes without response, so this is the only way the client learns about it
+        DLOG(DLOG_WARN, "Bulk message dropped\n");
+        count_dropped();
+        status_message(param->write.conn_id, STATUS_DROPPED, 0);
+    }
+    if (complete != NULL) {
+        status = write_message(param->write.conn_id, complete);
+        msg_buf_unref(complete);
+        // once per message, not per packet
+        memstat_sample(MEMSTAT_BLE_WRITE);
+    }
+    return status;
+}
+
+// Encodes the value of a readable attribute for the connection into out, returns its length
+typedef size_t (*attr_read_handler_t)(uint16_t conn_id, uint8_t* out, size_t size);
+
+static size_t read_latency(uint16_t conn_id, uint8_t* out, size_t size) {
+    return latency_encode(out, size);
+}
+
+static size_t read_memory(uint16_t conn_id, uint8_t* out, size_t size) {
+    return memstat_encode(out, size);
+}
+
+// indexed like attr_table, NULL for attributes we don't answer reads of
+static const attr_read_handler_t attr_read_handlers[ATTR_NUM] = {
+    [ATTR_STATUS_CONFIG] = status_config_encode,
+    [ATTR_LATENCY_VALUE] = read_latency,
+    [ATTR_MEMORY_VALUE] = read_memory,
+};
+
+// a long read can't go past the largest attribute value
+_Static_assert(LATENCY_ENCODED_MAX <= ESP_GATT_MAX_ATTR_LEN, "latency snapshot too long for a read");
+_Static_assert(MEMSTAT_ENCODED_MAX <= ESP_GATT_MAX_ATTR_LEN, "memory snapshot too long for a read");
+
+// Answer a read of an encoded snapshot, long reads continue in the snapshot taken at offset 0
+static void handle_read(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
+    static uint8_t snapshot[LATENCY_ENCODED_MAX > MEMSTAT_ENCODED_MAX ? LATENCY_ENCODED_MAX : MEMSTAT_ENCODED_MAX];
+    static size_t snapshot_len = 0;
+    static uint16_t snapshot_handle = 0;
+    static uint16_t snapshot_conn_id = 0;
+    // all gatts callbacks run on the bluetooth task, so one response is enough
+    static esp_gatt_rsp_t gatt_rsp;
+    if (!param->read.need_rsp) {
+        return;
+    }
+    esp_gatt_status_t status = ESP_GATT_OK;
+    memset(&gatt_rsp, 0, sizeof(gatt_rsp));
+    gatt_rsp.attr_value.handle = param->read.handle;
+    gatt_rsp.attr_value.offset = param->read.offset;
+    // handles below the service wrap around to large offsets
+    uint16_t index = param->read.handle - attr_base_handle;
+    if (attr_base_handle == 0 || index >= ATTR_NUM || attr_read_handlers[index] == NULL) {
+        status = ESP_GATT_READ_NOT_PERMIT;
+    } else {
+        // a long read of another attribute or connection in between starts over
+        if (param->read.offset == 0 || snapshot_handle != param->read.handle || snapshot_conn_id != param->read.conn_id) {
+            snapshot_len = attr_read_handlers[index](param->read.conn_id, snapshot, sizeof(snapshot));
+            snapshot_handle = param->read.handle;
+            snapshot_conn_id = param->read.conn_id;
+        }
+        if (param->read.offset > snapshot_len) {
+            status = ESP_GATT_INVALID_OFFSET;
+        } else {
+            // one byte of the mtu is taken by the opcode
+            size_t len = snapshot_len - param->read.offset;
+            size_t max = conn_get_mtu(param->read.conn_id) - 1;
+            gatt_rsp.attr_value.len = len < max ? len : max;
+            memcpy(gatt_rsp.attr_value.value, snapshot + param->read.offset, gatt_rsp.attr_value.len);
+        }
+    }
+    esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id, status, &gatt_rsp);
+}
+
+// Store a fragment of a long write and echo it back to the client
+static void handle_prepare_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
+    esp_gatt_status_t status = ESP_GATT_NO_RESOURCES;
+    prep_write_t* prep = prep_write_get(param->write.conn_id, gatts_if, true);
+    if (prep != NULL) {
+        status = prep_write_add(prep, param->write.handle, param->write.offset, param->write.value, param->write.len);
+    }
+    if (!param->write.need_rsp) {
+        return;
+    }
+
+    // all gatts callbacks run on the bluetooth task, so one response is enough
+    static esp_gatt_rsp_t gatt_rsp;
+    uint16_t len = param->write.len < ESP_GATT_MAX_ATTR_LEN ? param->write.len : ESP_GATT_MAX_ATTR_LEN;
+    memcpy(gatt_rsp.attr_value.value, param->write.value, len);
+    gatt_rsp.attr_value.handle = param -> write.handle;
+    gatt_rsp.attr_value.offset = param -> write.offset;
+    gatt_rsp.attr_value.len = len;
+    gatt_rsp.attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
+
+    esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, &gatt_rsp);
+}
+
+// Commit (or cancel) the long write of the connection
+static void handle_exec_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
+    esp_gatt_status_t status = ESP_GATT_OK;
+    prep_write_t* prep = prep_write_get(param->exec_write.conn_id, gatts_if, false);
+    if (prep != NULL) {
+        if (param->exec_write.exec_write_flag == ESP_GATT_PREP_WRITE_EXEC) {
+            status = prep_write_check(prep);
+            if (status == ESP_GATT_OK) {
+                DLOG(DLOG_INFO, "Executing long write of %d bytes\n", prep->buf->len);
+                status = handle_write(prep->conn_id, prep->handle, prep->buf);
+            }
+        } else {
+            DLOG(DLOG_WARN, "Long write cancelled\n");
+        }
+        prep_write_release(prep);
+    }
+    esp_ble_gatts_send_response(gatts_if, param->exec_write.conn_id, param->exec_write.trans_id, status, NULL);
 }
 
 static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
     switch (event) {
         // TODO: in what case would gatts_if == ESP_GATT_IF_NONE ?
         case ESP_GATTS_REG_EVT:
-            services_array[param->reg.app_id].gatts_if = gatts_if;
-            register_service(param->reg.app_id);
-
+            gatts_app_if = gatts_if;
             esp_ble_gap_set_device_name(BLUETOOTH_NAME);
             esp_ble_gap_config_adv_data(&adv_data);
             // ?
             esp_ble_gap_config_adv_data(&scan_rsp_data);
-            esp_ble_gatts_create_service(gatts_if, &services_array[param->reg.app_id].service_id, GATTS_NUM_HANDLES);
-            break;
-        case ESP_GATTS_CREATE_EVT:
-            for (int i=0; i<NUM_SERVICES; i++) {
-                if (services_array[i].gatts_if == gatts_if) {
-                    start_service(i, param);
-                    break;
-                }
-            }
+            // the whole service in a single round trip
+            esp_ble_gatts_create_attr_tab(attr_table, gatts_if, ATTR_NUM, 0);
             break;
-        case ESP_GATTS_ADD_CHAR_EVT:
-            for (int i=0; i<NUM_SERVICES; i++) {
-                if (services_array[i].gatts_if == gatts_if) {
-                    add_characteristic(i, param);
-                    break;
-                }
-            }
+        case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+            start_service(param);
             break;
         case ESP_GATTS_CONNECT_EVT:
-            printf("Device connected \n");
-            esp_ble_conn_update_params_t conn_params = {0};
-            memcpy(conn_params.bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
-            // values copied from example
-            conn_params.latency = 0;
-            conn_params.min_int = 0x10;
-            conn_params.max_int = 0x20;
-            conn_params.timeout = 400;
-            for (int i=0; i<NUM_SERVICES; i++) {
-                services_array[i].conn_id = param -> connect.conn_id;
+            DLOG(DLOG_INFO, "Device connected \n");
+            conn_open(param->connect.conn_id, param->connect.remote_bda);
+            // advertising stops with every connection, more centrals are welcome until the controller is full
+            if (conn_count() < CONN_MAX) {
+                esp_ble_gap_start_advertising(&adv_params);
             }
-            esp_ble_gap_update_conn_params(&conn_params);
             break;
         case ESP_GATTS_DISCONNECT_EVT:
-            printf("Device disconnected \n");
-            // need to advertise once again
-            esp_ble_gap_start_advertising(&adv_params);
+            DLOG(DLOG_INFO, "Device disconnected \n");
+            prep_write_release_conn(param->disconnect.conn_id);
+            const bulk_stream_t* stream = bulk_stream(param->disconnect.conn_id);
+            if (stream != NULL) {
+                DLOG(DLOG_INFO, "Bulk stream: %" PRIu32 " packets, %" PRIu32 " bytes, %" PRIu32 " messages, %" PRIu32 " dropped\n",
+                     stream->packets, stream->bytes, stream->messages, stream->dropped_messages);
+                DLOG(DLOG_INFO, "Bulk stream: %" PRIu32 " packets lost, %" PRIu32 " duplicates\n",
+                     stream->lost_packets, stream->duplicate_packets);
+            }
+            bulk_release_conn(param->disconnect.conn_id);
+            bool was_full = conn_count() >= CONN_MAX;
+            conn_close(param->disconnect.conn_id);
+            // otherwise we are still advertising
+            if (was_full) {
+                esp_ble_gap_start_advertising(&adv_params);
+            }
             break;
         case ESP_GATTS_WRITE_EVT:
-            print_uint8_as_char(param->write.value, param->write.len);
-            // first, we perform the action depending on the service, then we respond (or don't)
-            if (gatts_if == services_array[SSID_SERVICE_ID].gatts_if) {
-                write_wifi_ssid(param->write.value, param->write.len);
-            } else if (gatts_if == services_array[PASS_SERVICE_ID].gatts_if) {
-                write_wifi_password(param->write.value, param->write.len);
-            } else if (gatts_if == services_array[CONN_SERVICE_ID].gatts_if) {
-                connect_to_wifi();
-            } else if (gatts_if == services_array[MSG_SERVICE_ID].gatts_if) {
-                EventBits_t wifi_bits = xEventGroupGetBits(wifi_event_group);
-                if (!(wifi_bits & WIFI_GOT_IP_BIT)) {
-                    connect_to_wifi();
+            esp_gatt_status_t status;
+            if (param->write.handle == attr_base_handle + ATTR_BULK_VALUE && !param->write.is_prep) {
+                // far too many packets to log each of them
+                status = handle_bulk_write(param);
+            } else if (param->write.handle == attr_base_handle + ATTR_STATUS_CONFIG && !param->write.is_prep) {
+                // a descriptor, not a message: it needs no pool buffer and status_subscribe logs it
+                status = status_subscribe(param->write.conn_id, param->write.value, param->write.len);
+            } else {
+                log_write_value(param->write.handle, param->write.value, param->write.len);
+                if (param->write.is_prep) {
+                    // fragment of a long write, it is handled once the client executes the write
+                    handle_prepare_write(gatts_if, param);
+                    break;
                 }
-                write_post_message(param->write.value, param->write.len);
-                xEventGroupWaitBits(wifi_event_group, WIFI_GOT_IP_BIT, pdFALSE, pdFALSE, portMAX_DELAY);
-                post_http();
+                status = handle_single_write(param);
             }
 
             if (!param->write.need_rsp) {
                 // if no response i needed, we do not respond
-                printf("No response needed\n");
-                break;
-            }
-            // Client needs a response
-            printf("Response needed\n");
-            if (!param->write.is_prep) {
-                /* only need to handle write prep seperately, this doubles one line of code, 
-                * but keeps it unnested*/
-                printf("no prepare write\n");
-                esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, ESP_GATT_OK, NULL);
+                DLOG(DLOG_DEBUG, "No response needed\n");
                 break;
             }
-
-            esp_gatt_status_t status = ESP_GATT_OK;
-            if (write_prep_env.prepare_buf == NULL) {
-                // no need to free prepare_buf (?), as it needs to be used the whole time
-                write_prep_env.prepare_buf = (uint8_t*) malloc(PREPARE_BUF_MAX_SIZE*sizeof(uint8_t));
-                // yes, you should check prepafe_buf == NULL
-                write_prep_env.prepare_len = 0;
-            } else {
-                if((param->write.offset + param->write.len) > PREPARE_BUF_MAX_SIZE) {
-                    // this is not 100% correct, but good enough
-                    status = ESP_GATT_INVALID_ATTR_LEN;
-                }
-            }
-
-            esp_gatt_rsp_t* gatt_rsp = (esp_gatt_rsp_t *)malloc(sizeof(esp_gatt_rsp_t));
-            // again - you should check whether gatt_rsp == NULL
-
-            // create response
-            memcpy(gatt_rsp->attr_value.value, param->write.value, param->write.len);
-            gatt_rsp -> attr_value.handle = param -> write.handle;
-            gatt_rsp -> attr_value.offset = param -> write.offset;
-            gatt_rsp -> attr_value.len = param -> write.len;
-            gatt_rsp -> attr_value.auth_req = ESP_GATT_AUTH_REQ_NONE;
-            
-            esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, gatt_rsp);
-            free(gatt_rsp);
-
-            // copy data into buffer
-            memcpy(write_prep_env.prepare_buf+param->write.offset, param->write.value, param->write.len);
-            write_prep_env.prepare_len += param->write.len;
+            esp_ble_gatts_send_response(gatts_if, param->write.conn_id, param->write.trans_id, status, NULL);
             break;
         case ESP_GATTS_EXEC_WRITE_EVT:
-            printf("Unhandled exec write event\n");
+            handle_exec_write(gatts_if, param);
+            break;
+        case ESP_GATTS_READ_EVT:
+            handle_read(gatts_if, param);
+            break;
+        case ESP_GATTS_MTU_EVT:
+            conn_set_mtu(param->mtu.conn_id, param->mtu.mtu);
+            break;
+        case ESP_GATTS_CONGEST_EVT:
+            conn_set_congested(param->congest.conn_id, param->congest.congested);
             break;
         default:
             break;
     }
 }
 
-static void http_event_handler(esp_http_client_event_handle_t event) {
-    switch (event->event_id) {
-        case HTTP_EVENT_ON_CONNECTED:
-            printf("Successfully connected\n");
+// Configure the network at rank (with its cached access point if fast) and connect to it
+static esp_err_t wifi_connect(int rank, bool fast) {
+    // served from ram, no flash access needed
+    cred_network_t network;
+    if (!credentials_get(rank, &network)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    strcpy(wifi_ssid, network.ssid);
+    wifi_config_t config = {0};
+    // workaround because of some weird error
+    memcpy(config.sta.ssid, network.ssid, strlen(network.ssid));
+    memcpy(config.sta.password, network.password, strlen(network.password));
+    if (fast && credentials_get_fast_connect(network.ssid, config.sta.bssid, &config.sta.channel)) {
+        DLOG_STR(DLOG_INFO, "Fast connect to %.*s on channel %d\n", network.ssid, strlen(network.ssid), config.sta.channel);
+        config.sta.bssid_set = true;
+        config.sta.scan_method = WIFI_FAST_SCAN;
+    } else {
+        DLOG_STR(DLOG_INFO, "Scanning for %.*s\n", network.ssid, strlen(network.ssid));
+        config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    }
+
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        DLOG(DLOG_ERROR, "Some error occured whilst connecting: %s\n", esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Feed an event into the connection state machine and carry out what it decides
+static void wifi_dispatch(wifi_sm_event_t event) {
+    if (wifi_sm_lock == NULL) {
+        // boot_wifi_task connects with the newest credentials once it is done
+        DLOG(DLOG_INFO, "Wifi isn't initialized yet\n");
+        return;
+    }
+    xSemaphoreTake(wifi_sm_lock, portMAX_DELAY);
+    cred_network_t network;
+    wifi_sm.network_count = credentials_count();
+    wifi_sm.fast_available = credentials_get(0, &network) && credentials_get_fast_connect(network.ssid, NULL, NULL);
+    wifi_sm_action_t action = wifi_sm_handle(&wifi_sm, event, esp_timer_get_time());
+    if (event == WIFI_SM_EV_PARK_REQUEST) {
+        // a retry would be ignored anyway
+        esp_timer_stop(wifi_backoff_timer);
+    }
+
+    // a connect that can't even be issued counts as failed attempt
+    while (action.kind == WIFI_SM_ACT_CONNECT && wifi_connect(action.rank, action.fast) != ESP_OK) {
+        action = wifi_sm_handle(&wifi_sm, WIFI_SM_EV_DISCONNECTED, esp_timer_get_time());
+    }
+    esp_err_t err = ESP_OK;
+    switch (action.kind) {
+        case WIFI_SM_ACT_START:
+            err = esp_wifi_start();
             break;
-        case HTTP_EVENT_DISCONNECTED:
-            printf("Disconnected\n");
+        case WIFI_SM_ACT_DISCONNECT:
+            err = esp_wifi_disconnect();
             break;
-        case HTTP_EVENT_ON_DATA:
-            printf("HTTP_EVENT_ON_DATA: %.*s\n", event->data_len, (char *)event->data);
+        case WIFI_SM_ACT_WAIT:
+            DLOG(DLOG_INFO, "Retrying wifi in %" PRIu32 " ms\n", action.delay_ms);
+            esp_timer_stop(wifi_backoff_timer);
+            err = esp_timer_start_once(wifi_backoff_timer, (uint64_t) action.delay_ms * 1000);
             break;
         default:
             break;
     }
+    if (err != ESP_OK) {
+        DLOG(DLOG_ERROR, "Some error occured whilst handling wifi event: %s\n", esp_err_to_name(err));
+    }
+    xSemaphoreGive(wifi_sm_lock);
+}
+
+static void wifi_backoff_expired(void* arg) {
+    wifi_dispatch(WIFI_SM_EV_BACKOFF_EXPIRED);
 }
 
 static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data) {
     switch (event_id){
         case WIFI_EVENT_STA_START:
-            printf("Started wifi\n");
+            ready_set(READY_WIFI_BIT);
+            wifi_dispatch(WIFI_SM_EV_STARTED);
             break;
         case WIFI_EVENT_STA_CONNECTED:
-            printf("Connected to wifi!\n");
+            DLOG(DLOG_INFO, "Connected to wifi!\n");
+            wifi_event_sta_connected_t* connected = (wifi_event_sta_connected_t*) event_data;
+            credentials_set_fast_connect(wifi_ssid, connected->bssid, connected->channel);
+            memstat_sample(MEMSTAT_WIFI_CONNECT);
+            wifi_dispatch(WIFI_SM_EV_ASSOCIATED);
             break;
         case WIFI_EVENT_STA_DISCONNECTED:
             wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*) event_data;
-            printf("Lost connection/unable to find wifi, reason %d\n", event->reason);
-            xEventGroupClearBits(wifi_event_group, WIFI_GOT_IP_BIT);
-            for (int i=0; i<10; i++) {
-                esp_err_t err = esp_wifi_connect();
-                if (err == ESP_OK) {
-                    printf("Connecting to wifi! - after disconnect\n");
-                    return;
-                }
+            if (wifi_sm.state == WIFI_SM_PARKING) {
+                DLOG(DLOG_INFO, "Disconnected from idle wifi\n");
+            } else {
+                DLOG(DLOG_WARN, "Lost connection/unable to find wifi, reason %d\n", event->reason);
             }
-            printf("failed to re-establish wifi connection\n");
+            ready_clear(READY_IP_BIT);
+            // the uplink socket will not survive this
+            uplink_invalidate();
+            wifi_dispatch(WIFI_SM_EV_DISCONNECTED);
             break;
         case IP_EVENT_STA_GOT_IP:
-            printf("Got IP\n");
-            xEventGroupSetBits(wifi_event_group, WIFI_GOT_IP_BIT);
+            DLOG(DLOG_INFO, "Got IP\n");
+            credentials_mark_success(wifi_ssid);
+            memstat_sample(MEMSTAT_WIFI_CONNECT);
+            wifi_dispatch(WIFI_SM_EV_GOT_IP);
+            if (wifi_sm.reconnects == 0) {
+                DLOG(DLOG_INFO, "boot to ip: %" PRIu32 " ms\n", (uint32_t) (wifi_sm.boot_to_ip / 1000));
+            } else {
+                DLOG(DLOG_INFO, "reconnect to ip: %" PRIu32 " ms (%" PRIu32 " reconnects)\n", (uint32_t) (wifi_sm.last_reconnect_to_ip / 1000), wifi_sm.reconnects);
+            }
+            ready_set(READY_IP_BIT);
             break;
         default:
             break;
@@ -414,6 +807,13 @@ void start_wifi() {
     }
     esp_netif_create_default_wifi_sta();
 
+    wifi_sm_init(&wifi_sm, esp_random());
+    esp_timer_create_args_t timer_args = {
+        .callback = wifi_backoff_expired,
+        .name = "wifi_backoff",
+    };
+    esp_timer_create(&timer_args, &wifi_backoff_timer);
+
     wifi_init_config_t default_config = WIFI_INIT_CONFIG_DEFAULT();
     esp_wifi_init(&default_config);
 
@@ -423,138 +823,407 @@ void start_wifi() {
 
     // Configuration Phase
     esp_wifi_set_mode(WIFI_MODE_STA);
+    // sleep between beacons while connected, the default with bluetooth anyway
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+    // created last, wifi_dispatch ignores requests (from bluetooth) until wifi is initialized
+    wifi_sm_lock = xSemaphoreCreateMutex();
 }
 
+// Connect to the best stored network, unless a connection is already there or on its way
 void connect_to_wifi() {
-    read_wifi();
-    xEventGroupWaitBits(wifi_event_group, WIFI_READ_INFO, pdFALSE, pdFALSE, portMAX_DELAY);
-    wifi_config_t config = {0};
-    // workaround because of some weird error
-    memcpy(config.sta.ssid, wifi_ssid, strlen(wifi_ssid));
-    memcpy(config.sta.password, wifi_password, strlen(wifi_password));
-
-    esp_wifi_set_config(WIFI_IF_STA, &config);
+    if (credentials_count() == 0) {
+        DLOG(DLOG_INFO, "No wifi credentials stored\n");
+        return;
+    }
+    wifi_dispatch(WIFI_SM_EV_CONNECT_REQUEST);
+}
 
-    // Start/Connect Phase
-    esp_err_t err = esp_wifi_start();
-    if (err != ESP_OK) {
-        printf("Some error occured whilst starting: %s\n", esp_err_to_name(err));
+// (Re-)connect with the most recently stored credentials
+void reconnect_to_wifi() {
+    if (credentials_count() == 0) {
+        DLOG(DLOG_INFO, "No wifi credentials stored\n");
         return;
     }
-    err = esp_wifi_connect();
+    wifi_dispatch(WIFI_SM_EV_CREDENTIALS_CHANGED);
+}
+
+// Disconnect until wifi is wanted again, connect_to_wifi brings it back (with the cached access point)
+static void park_wifi() {
+    wifi_dispatch(WIFI_SM_EV_PARK_REQUEST);
+}
+
+// Post msg with the selected uplink transport
+esp_err_t post_uplink(const char* msg, size_t len) {
+    esp_err_t err = uplink_post(msg, len);
     if (err != ESP_OK) {
-        printf("Some error occured whilst connecting: %s\n", esp_err_to_name(err));
-        return;
+        printf("Couldn't post message: %s\n", esp_err_to_name(err));
     }
+    return err;
 }
 
-// Post HTTP request to POST_URL and initialize http_event_handler
-void post_http() {
-    printf("posting http\n");
-    esp_http_client_config_t http_config = {
-        .url = POST_URL,
-        .port = POST_PORT,
-        .method = HTTP_METHOD_POST,
-        .event_handler = http_event_handler
-    };
+// Connect to wifi if we aren't already, returns whether we got an ip within timeout
+static bool wait_for_wifi(TickType_t timeout) {
+    uint32_t started_ms = latency_now_ms();
+    if (!(ready_get() & READY_IP_BIT)) {
+        connect_to_wifi();
+    }
+    bool connected = ready_wait(READY_IP_BIT, timeout);
+    latency_record_since(LATENCY_WIFI, started_ms);
+    return connected;
+}
 
-    esp_http_client_handle_t client = esp_http_client_init(&http_config);
-    if (client == NULL) {
-        printf("Error during client-creation\n");
+// Notify every connection of the runs about its messages
+static void status_runs(const seq_runs_t* runs, status_type_t type, uint16_t http_status) {
+    for (int i = 0; i < runs->count; i++) {
+        const seq_run_t* run = &runs->runs[i];
+        status_range(1u << run->slot, type, run->first, run->last, http_status);
     }
+}
 
-    esp_http_client_set_post_field(client, post_message, strlen(post_message));
-    esp_http_client_set_header(client, "Content-Type", "plain/text");
+static bool spool_pending() {
+    return spool_ok && !spool_empty(&spool);
+}
 
-    printf("posting...\n");
-    esp_err_t err = esp_http_client_perform(client);
-    if (err != ESP_OK) {
-        printf("Post failed: %s\n", esp_err_to_name(err));
+// Post spooled batches in order, as many per request as fit into the drain buffer, while wifi is up
+static void drain_spool() {
+    static char drain_buf[SPOOL_DRAIN_BYTES];
+    while (spool_pending() && (ready_get() & READY_IP_BIT)) {
+        spool_pos_t cursor = spool.tail;
+        spool_pos_t next;
+        size_t used = 0;
+        uint16_t len;
+        // batches of the same format can simply be concatenated
+        while (spool_read(&spool, &cursor, drain_buf + used, sizeof(drain_buf) - used, &len, &next) == ESP_OK) {
+            used += len;
+            cursor = next;
+        }
+        if (used == 0) {
+            printf("Couldn't read from spool\n");
+            return;
+        }
+        printf("Draining %zu bytes from spool, %" PRIu32 " records pending\n", used, spool.pending);
+        uplink_post_conns = seq_runs_conns(&spool_runs);
+        if (post_uplink(drain_buf, used) != ESP_OK) {
+            return;
+        }
+        uint32_t pending = spool.pending;
+        spool_consume(&spool, &cursor);
+        uplink_delivered += pending - spool.pending;
+        if (spool_empty(&spool)) {
+            status_runs(&spool_runs, STATUS_SENT, uplink_status_code());
+            seq_runs_reset(&spool_runs);
+        }
     }
+}
 
-    esp_http_client_cleanup(client);
+// Post the batch in a single request and record how long its messages took
+static bool post_batch(batch_t* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        latency_record_since(LATENCY_DEVICE, batch->received_ms[i]);
+    }
+    uplink_post_conns = seq_runs_conns(&batch->runs);
+    if (post_uplink(batch->buf, batch->len) != ESP_OK) {
+        return false;
+    }
+    for (int i = 0; i < batch->count; i++) {
+        latency_record_since(LATENCY_TOTAL, batch->received_ms[i]);
+    }
+    uplink_delivered += batch->count;
+    return true;
 }
 
-// Read wifi ssid and password from nvs
-void read_wifi() {
-    printf("reading wifi\n");
-    nvs_handle_t wifi_handle;
-    esp_err_t err = nvs_open("wifi_storage", NVS_READWRITE, &wifi_handle);
-    if (err != ESP_OK) {
-        printf("Error opening storage: %s \n", esp_err_to_name(err));
-        nvs_close(wifi_handle);
+// Post the batch in a single request and empty it, the batch is spooled if that isn't possible
+static void flush_batch(batch_t* batch) {
+    if (batch->count == 0) {
         return;
-    } 
-    size_t ssid_size = sizeof(wifi_ssid);
-    err = nvs_get_str(wifi_handle, "ssid", wifi_ssid, &ssid_size);
-    if (err != ESP_OK) {
-        printf("Error getting ssid: %s \n", esp_err_to_name(err));
-        nvs_close(wifi_handle);
+    }
+    printf("Flushing batch of %d messages (%zu bytes)\n", batch->count, batch->len);
+    if (!spool_ok) {
+        // nowhere to keep it, but waiting for wifi any longer would stop the queues from draining
+        if (!wait_for_wifi(pdMS_TO_TICKS(WIFI_WAIT_MS))) {
+            printf("No wifi and no spool, dropping batch\n");
+            status_runs(&batch->runs, STATUS_FAILED, 0);
+        } else if (post_batch(batch)) {
+            status_runs(&batch->runs, STATUS_SENT, uplink_status_code());
+        } else {
+            // with the status the server rejected it with, if it answered at all
+            status_runs(&batch->runs, STATUS_FAILED, uplink_status_code());
+        }
+        batch_reset(batch);
         return;
-    } 
-    printf("read wifi_ssid: %s\n", wifi_ssid);
+    }
 
-    size_t password_size = sizeof(wifi_password);
-    err = nvs_get_str(wifi_handle, "password", wifi_password, &password_size);
-    if (err != ESP_OK) {
-        printf("Error getting password: %s \n", esp_err_to_name(err));
-        nvs_close(wifi_handle);
-        return;
+    bool sent = false;
+    if (wait_for_wifi(pdMS_TO_TICKS(WIFI_WAIT_MS))) {
+        // anything spooled earlier has to go out first
+        drain_spool();
+        sent = !spool_pending() && post_batch(batch);
     }
-    printf("read wifi_password: %s\n", wifi_password);
+    if (sent) {
+        status_runs(&batch->runs, STATUS_SENT, uplink_status_code());
+    } else {
+        printf("Spooling batch\n");
+        esp_err_t err = spool_append(&spool, batch->buf, batch->len);
+        if (err != ESP_OK) {
+            printf("Couldn't spool batch: %s\n", esp_err_to_name(err));
+            status_runs(&batch->runs, STATUS_FAILED, 0);
+        } else {
+            if (!seq_runs_merge(&spool_runs, &batch->runs)) {
+                printf("Too many spooled runs, some messages won't be reported as sent\n");
+            }
+            status_runs(&batch->runs, STATUS_SPOOLED, 0);
+        }
+    }
+    batch_reset(batch);
+}
 
-    // set event bit
-    xEventGroupSetBits(wifi_event_group, WIFI_READ_INFO);
+// Describe a queued message as uplink record, the payload still points into buf
+static void message_frame(msg_buf_t* buf, frame_t* frame) {
+    if (buf->len > 0 && buf->data[0] == FRAME_MAGIC) {
+        // binary record from the client (already checked on receipt), we only take over its payload
+        frame_decode(buf->data + 1, buf->len - 1, frame);
+    } else {
+        frame->payload = buf->data;
+        frame->payload_len = buf->len;
+    }
+    frame->device_id = device_id;
+    frame->device_id_len = sizeof(device_id);
+    frame->boot = boot_id;
+    frame->seq = buf->seq;
+    frame->timestamp_ms = buf->received_ms;
+}
 
-    nvs_close(wifi_handle);
+// Take the next message, round-robin over the connection slots, returns the slot or -1 if none came within wait
+static int uplink_receive(msg_buf_t** item, TickType_t wait) {
+    if (xSemaphoreTake(uplink_pending, wait) != pdTRUE) {
+        return -1;
+    }
+    for (int i = 0; i < CONN_MAX; i++) {
+        int slot = (uplink_next_slot + i) % CONN_MAX;
+        if (xQueueReceive(uplink_queues[slot], item, 0) == pdTRUE) {
+            uplink_next_slot = (slot + 1) % CONN_MAX;
+            return slot;
+        }
+    }
+    // every message is counted after it was queued, so there is one
+    return -1;
 }
 
-// Write wifi ssid to nvs
-void write_wifi_ssid(uint8_t* msg, uint16_t len) {
-    nvs_handle_t wifi_handle;
-    esp_err_t err = nvs_open("wifi_storage", NVS_READWRITE, &wifi_handle);
-    if (err != ESP_OK) {
-        printf("Error opening storage: %s \n", esp_err_to_name(err));
-        return;
+// Pass the server response on to the clients whose messages were posted
+static void forward_response(const char* data, size_t len) {
+    status_response(uplink_post_conns, data, len);
+}
+
+// Switch advertising to the intervals of profile, restarting it if it is running
+static void set_adv_profile(link_profile_t profile) {
+    bool active = profile == LINK_PROFILE_ACTIVE;
+    // only written here, the gap and gatts handlers restart advertising with them as well
+    adv_params.adv_int_min = active ? LINK_ADV_ACTIVE_MIN_INT : LINK_ADV_IDLE_MIN_INT;
+    adv_params.adv_int_max = active ? LINK_ADV_ACTIVE_MAX_INT : LINK_ADV_IDLE_MAX_INT;
+    DLOG(DLOG_INFO, "Advertising every %d-%d ms\n", adv_params.adv_int_min * 5 / 8, adv_params.adv_int_max * 5 / 8);
+    if ((ready_get() & READY_ADVERTISING_BIT) && conn_count() < CONN_MAX) {
+        esp_ble_gap_stop_advertising();
+        esp_ble_gap_start_advertising(&adv_params);
     }
+}
 
-    char ssid[len + 1];
-    ssid[len] = '\0';
-    memcpy(ssid, msg, len);
+// Feed the link policy with what the uplink task sees and carry out its decision
+static void update_link(link_policy_t* policy, const batch_t* batch) {
+    uint32_t now = latency_now_ms();
+    EventBits_t ready = ready_get();
+    int centrals = conn_count();
+    link_inputs_t in = {
+        .now_ms = now,
+        // queued messages are taken right away, so the batch holds the oldest ones
+        .waiting = uplink_queue_depth() + batch->count,
+        .oldest_ms = batch->count > 0 ? now - batch->received_ms[0] : 0,
+        .spooled = spool_pending(),
+        .delivered = uplink_delivered,
+        .ip = ready & READY_IP_BIT,
+        .centrals = centrals,
+        .advertising = (ready & READY_ADVERTISING_BIT) && centrals < CONN_MAX,
+    };
+    uplink_delivered = 0;
+    link_decision_t decision = link_policy_update(policy, &in);
+    if (decision.wifi_changed) {
+        if (decision.wifi) {
+            DLOG(DLOG_INFO, "Waking wifi for %d messages\n", in.waiting);
+            connect_to_wifi();
+        } else {
+            DLOG(DLOG_INFO, "Wifi idle, disconnecting (about %" PRIu32 " uJ per message, %" PRIu32 " wakes so far)\n",
+                 link_policy_energy_per_message(policy), policy->wakes);
+            park_wifi();
+        }
+    }
+    if (decision.adv_changed) {
+        set_adv_profile(decision.adv);
+    }
+    if (decision.conn_changed) {
+        DLOG(DLOG_INFO, "Connections %s\n", decision.conn == LINK_PROFILE_ACTIVE ? "active" : "idle");
+        conn_set_idle(decision.conn == LINK_PROFILE_IDLE);
+    }
+}
 
-    err = nvs_set_str(wifi_handle, "ssid", ssid);
-    if (err != ESP_OK) {
-        printf("Error writing ssid: %s \n", esp_err_to_name(err));
-        nvs_close(wifi_handle);
-        return;
+// Add a record to the batch, flushing it when it is full; the status of the batch goes to the messages
+// of runs (NULL for none): the message of the record, or the samples of a pane with its last summary
+static void add_to_batch(batch_t* batch, const frame_t* frame, const seq_runs_t* runs, TickType_t* batch_started) {
+    if (runs != NULL && batch->runs.max - batch->runs.count < runs->count) {
+        flush_batch(batch);
+    }
+    if (!batch_add(batch, frame)) {
+        flush_batch(batch);
+        if (!batch_add(batch, frame)) {
+            printf("Record doesn't fit into a batch, dropping it\n");
+            count_dropped();
+            if (runs != NULL) {
+                status_runs(runs, STATUS_FAILED, 0);
+            }
+            return;
+        }
+    }
+    if (runs != NULL) {
+        // an empty batch has room for the runs of a pane (AGG_RUNS <= BATCH_MAX_MESSAGES)
+        seq_runs_merge(&batch->runs, runs);
+    }
+    if (batch->count == 1) {
+        *batch_started = xTaskGetTickCount();
+    }
+    if (batch_full(batch)) {
+        flush_batch(batch);
+    }
+}
+
+// Once a window step is over, batch a summary for every stream that got samples in it, posted as the
+// last of them; the samples get the status of the last summary
+static void emit_summaries(agg_t* aggregator, batch_t* batch, TickType_t* batch_started) {
+    static char text[AGG_SUMMARY_MAX];
+    agg_summary_t summary;
+    uint32_t now = latency_now_ms();
+    while (agg_next_summary(aggregator, now, &summary)) {
+        frame_t frame = {
+            .device_id = device_id,
+            .device_id_len = sizeof(device_id),
+            .boot = boot_id,
+            .seq = summary.last_seq,
+            .timestamp_ms = now,
+            .payload = (const uint8_t*) text,
+            .payload_len = agg_format(&summary, text, sizeof(text)),
+        };
+        add_to_batch(batch, &frame, summary.runs, batch_started);
     }
+}
 
-    nvs_commit(wifi_handle);
-    nvs_close(wifi_handle);
+// Collect queued messages into batches and post them once they are full or have waited long enough,
+// numeric samples are folded into window summaries (see aggregate.h) and only those are batched;
+// while the link policy holds wifi down they wait until it wakes it up
+static void uplink_task(void* arg) {
+    static batch_t batch;
+    static link_policy_t policy;
+    static agg_t aggregator;
+    // sequence number of the message taken last from each slot
+    static uint32_t slot_last_seq[CONN_MAX];
+    msg_buf_t* item;
+    int slot;
+    TickType_t batch_started = 0;
+    TickType_t linger = pdMS_TO_TICKS(BATCH_LINGER_MS);
+    batch_reset(&batch);
+    link_policy_init(&policy, LINK_WIFI_IDLE_MS, latency_now_ms());
+    agg_init(&aggregator, AGG_WINDOW_MS, AGG_PANES, latency_now_ms(), esp_random());
+    while (true) {
+        TickType_t wait = pdMS_TO_TICKS(LINK_TICK_MS);
+        if (batch.count > 0 && !link_policy_holding(&policy)) {
+            TickType_t waited = xTaskGetTickCount() - batch_started;
+            if (waited >= linger) {
+                wait = 0;
+            } else if (linger - waited < wait) {
+                wait = linger - waited;
+            }
+        }
+        if (spool_pending() && wait > pdMS_TO_TICKS(SPOOL_RETRY_MS)) {
+            // check regularly whether wifi is back
+            wait = pdMS_TO_TICKS(SPOOL_RETRY_MS);
+        }
+        uint32_t due_ms = agg_due_in(&aggregator, latency_now_ms());
+        if (due_ms < LINK_TICK_MS && pdMS_TO_TICKS(due_ms) < wait) {
+            wait = pdMS_TO_TICKS(due_ms);
+        }
+        if ((slot = uplink_receive(&item, wait)) >= 0) {
+            latency_record_since(LATENCY_QUEUE, item->received_ms);
+            uint32_t prev = slot_last_seq[slot];
+            slot_last_seq[slot] = item->seq;
+            // binary records were made by the client on purpose, they always pass through
+            bool binary = item->len > 0 && item->data[0] == FRAME_MAGIC;
+            if (binary || !agg_add(&aggregator, slot, item->data, item->len, prev, item->seq)) {
+                frame_t frame;
+                seq_run_t run;
+                seq_runs_t runs;
+                message_frame(item, &frame);
+                seq_runs_init(&runs, &run, 1);
+                seq_runs_add(&runs, slot, prev, item->seq);
+                add_to_batch(&batch, &frame, &runs, &batch_started);
+            }
+            msg_buf_unref(item);
+        }
+        emit_summaries(&aggregator, &batch, &batch_started);
+        if (batch.count > 0 && !link_policy_holding(&policy) && xTaskGetTickCount() - batch_started >= linger) {
+            flush_batch(&batch);
+        }
+        drain_spool();
+        update_link(&policy, &batch);
+    }
 }
 
-// Write wifi password to nvs
-void write_wifi_password(uint8_t* msg, uint16_t len) {
-    nvs_handle_t wifi_handle;
-    esp_err_t err = nvs_open("wifi_storage", NVS_READWRITE, &wifi_handle);
-    if (err != ESP_OK) {
-        printf("Error opening storage: %s \n", esp_err_to_name(err));
+// Create the uplink queues and the task draining them
+void start_uplink() {
+    esp_read_mac(device_id, ESP_MAC_WIFI_STA);
+    boot_id = esp_random();
+    spool_ok = spool_open_partition(&spool) == ESP_OK;
+    seq_runs_init(&spool_runs, spool_run_storage, SPOOL_TRACKED_RUNS);
+    // server responses are passed on to the subscribed clients
+    uplink_set_response_handler(forward_response);
+    uplink_pending = xSemaphoreCreateCounting(CONN_MAX * UPLINK_QUEUE_LENGTH, 0);
+    if (uplink_pending == NULL) {
+        printf("Couldn't create uplink queue\n");
         return;
     }
+    for (int i = 0; i < CONN_MAX; i++) {
+        uplink_queues[i] = xQueueCreate(UPLINK_QUEUE_LENGTH, sizeof(msg_buf_t*));
+        if (uplink_queues[i] == NULL) {
+            printf("Couldn't create uplink queue\n");
+            return;
+        }
+    }
+    xTaskCreate(uplink_task, "uplink", UPLINK_TASK_STACK_SIZE, NULL, UPLINK_TASK_PRIORITY, NULL);
+    ready_set(READY_UPLINK_BIT);
+}
 
-    char password[len + 1];
-    password[len] = '\0';
-    memcpy(password, msg, len);
+static esp_gatt_status_t credentials_status(esp_err_t err) {
+    switch (err) {
+        case ESP_OK:
+            return ESP_GATT_OK;
+        case ESP_ERR_INVALID_SIZE:
+            return ESP_GATT_INVALID_ATTR_LEN;
+        default:
+            return ESP_GATT_INTERNAL_ERROR;
+    }
+}
 
-    err = nvs_set_str(wifi_handle, "password", password);
+// Stage a new wifi ssid, it is stored once the password is written (or on connect)
+esp_gatt_status_t write_wifi_ssid(uint16_t conn_id, msg_buf_t* buf) {
+    esp_err_t err = credentials_stage_ssid(msg_buf_str(buf));
     if (err != ESP_OK) {
-        printf("Error writing password: %s \n", esp_err_to_name(err));
-        nvs_close(wifi_handle);
-        return;
+        DLOG(DLOG_ERROR, "Error writing ssid: %s \n", esp_err_to_name(err));
     }
+    return credentials_status(err);
+}
 
-    nvs_commit(wifi_handle);
-    nvs_close(wifi_handle);
+// Store the wifi password together with the staged ssid
+esp_gatt_status_t write_wifi_password(uint16_t conn_id, msg_buf_t* buf) {
+    esp_err_t err = credentials_stage_password(msg_buf_str(buf));
+    if (err != ESP_OK) {
+        DLOG(DLOG_ERROR, "Error writing password: %s \n", esp_err_to_name(err));
+    }
+    return credentials_status(err);
 }
 
 // Start the bluetooth module and advertise
@@ -574,21 +1243,44 @@ void start_bluetooth() {
     err = esp_bluedroid_init_with_cfg(&bluedroid_cfg);
     err = esp_bluedroid_enable();
 
+    conn_init();
+
     // event handler
     err = esp_ble_gatts_register_callback(gatts_event_handler);
     err = esp_ble_gap_register_callback(gap_event_handler);
 
-    // Application Profile(s)
-    esp_ble_gatts_app_register(SSID_SERVICE_ID);
-    esp_ble_gatts_app_register(PASS_SERVICE_ID);
-    esp_ble_gatts_app_register(MSG_SERVICE_ID);
-    esp_ble_gatts_app_register(CONN_SERVICE_ID);
+    // Application Profile, its service is created once it is registered
+    esp_ble_gatts_app_register(GATTS_APP_ID);
+
+    // the central picks the smaller one of both mtus
+    esp_ble_gatt_set_local_mtu(ESP_GATT_MAX_MTU_SIZE);
+}
+
+// Bring wifi up and connect to the stored networks right away, runs while start_bluetooth does its part
+static void boot_wifi_task(void* arg) {
+    start_wifi();
+    connect_to_wifi();
+    vTaskDelete(NULL);
+}
 
-    // ?
-    esp_ble_gatt_set_local_mtu(500);
+// Scale the cpu frequency down while nothing is running, wifi and bluetooth take locks while they need it
+static void start_power_management() {
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = PM_MIN_FREQ_MHZ,
+        // would need the 32 kHz crystal to keep bluetooth connections
+        .light_sleep_enable = false,
+    };
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK) {
+        printf("Couldn't configure power management: %s\n", esp_err_to_name(err));
+    }
 }
 
 void app_main(void) {
+    ready_init();
+    dlog_start();
+    start_power_management();
     // copy-paste from station_example_main.c
     // Initialize NVS
     esp_err_t err = nvs_flash_init();
@@ -597,8 +1289,12 @@ void app_main(void) {
       err = nvs_flash_init();
     }
     ESP_ERROR_CHECK(err);
+    ESP_ERROR_CHECK(credentials_init());
+    ready_set(READY_NVS_BIT);
 
-    wifi_event_group = xEventGroupCreate();
-    start_wifi();
+    // bluedroid runs on core 0, so wifi is brought up on the other one meanwhile
+    xTaskCreatePinnedToCore(boot_wifi_task, "boot_wifi", BOOT_WIFI_STACK_SIZE, NULL, BOOT_WIFI_PRIORITY, NULL, BOOT_WIFI_CORE);
     start_bluetooth();
+    // messages written before the uplink is ready are refused (see enqueue_post_message)
+    start_uplink();
 }
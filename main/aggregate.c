@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include "aggregate.h"
+
+// longest number we parse, more digits than a float holds anyway
+#define AGG_NUMBER_LEN 31
+
+void agg_init(agg_t* agg, uint32_t window_ms, int panes, uint32_t now_ms, uint32_t seed) {
+    memset(agg, 0, sizeof(*agg));
+    if (panes < 1) {
+        panes = 1;
+    } else if (panes > AGG_MAX_PANES) {
+        panes = AGG_MAX_PANES;
+    }
+    agg->panes = panes;
+    agg->pane_ms = window_ms / panes;
+    agg->pane_started_ms = now_ms;
+    agg->emitting = -1;
+    seq_runs_init(&agg->runs, agg->run_storage, AGG_RUNS);
+    agg->random = seed != 0 ? seed : 1;
+}
+
+bool agg_enabled(const agg_t* agg) {
+    return agg->pane_ms > 0;
+}
+
+// xorshift32, good enough to pick samples
+static uint32_t next_random(agg_t* agg) {
+    uint32_t x = agg->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    agg->random = x;
+    return x;
+}
+
+// names end up in the summary json, so only a few characters are allowed
+static bool name_char(char c) {
+    return isalnum((unsigned char) c) || c == '_' || c == '-' || c == '.';
+}
+
+bool agg_parse(const uint8_t* data, size_t len, char* name, float* value) {
+    const char* start = (const char*) data;
+    const char* end = start + len;
+    while (start < end && isspace((unsigned char) *start)) {
+        start++;
+    }
+    while (end > start && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    const char* number = start;
+    name[0] = '\0';
+    for (const char* pos = start; pos < end; pos++) {
+        if (*pos == '=' || *pos == ':') {
+            size_t name_len = pos - start;
+            if (name_len == 0 || name_len > AGG_NAME_LEN) {
+                return false;
+            }
+            memcpy(name, start, name_len);
+            name[name_len] = '\0';
+            number = pos + 1;
+            break;
+        }
+    }
+    for (const char* pos = name; *pos != '\0'; pos++) {
+        if (!name_char(*pos)) {
+            return false;
+        }
+    }
+    while (number < end && isspace((unsigned char) *number)) {
+        number++;
+    }
+    size_t number_len = end - number;
+    if (number_len == 0 || number_len > AGG_NUMBER_LEN) {
+        return false;
+    }
+    // the message isn't terminated, so the number is copied
+    char buf[AGG_NUMBER_LEN + 1];
+    memcpy(buf, number, number_len);
+    buf[number_len] = '\0';
+    char* parsed_end;
+    float parsed = strtof(buf, &parsed_end);
+    if (parsed_end != buf + number_len || !isfinite(parsed)) {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+// Stream of slot and name, a free one is taken for a new stream; NULL if all are in use
+static agg_stream_t* find_stream(agg_t* agg, int slot, const char* name) {
+    agg_stream_t* free_stream = NULL;
+    for (int i = 0; i < AGG_STREAMS; i++) {
+        agg_stream_t* stream = &agg->streams[i];
+        if (!stream->in_use) {
+            if (free_stream == NULL) {
+                free_stream = stream;
+            }
+        } else if (stream->slot == slot && strcmp(stream->name, name) == 0) {
+            return stream;
+        }
+    }
+    if (free_stream != NULL) {
+        memset(free_stream, 0, sizeof(*free_stream));
+        free_stream->in_use = true;
+        free_stream->slot = slot;
+        strcpy(free_stream->name, name);
+    }
+    return free_stream;
+}
+
+bool agg_add(agg_t* agg, int slot, const uint8_t* data, size_t len, uint32_t prev, uint32_t seq) {
+    char name[AGG_NAME_LEN + 1];
+    float value;
+    if (!agg_enabled(agg) || !agg_parse(data, len, name, &value)) {
+        return false;
+    }
+    agg_stream_t* stream = find_stream(agg, slot, name);
+    if (stream == NULL || !seq_runs_add(&agg->runs, slot, prev, seq)) {
+        return false;
+    }
+    agg_pane_t* pane = &stream->panes[agg->current];
+    if (pane->count == 0) {
+        pane->min = value;
+        pane->max = value;
+        pane->sum = 0;
+    }
+#if AGG_QUANTILE_SAMPLES
+    // reservoir sampling, every sample of the pane is kept with the same probability
+    if (pane->count < AGG_QUANTILE_SAMPLES) {
+        pane->samples[pane->count] = value;
+    } else {
+        uint32_t i = next_random(agg) % (pane->count + 1);
+        if (i < AGG_QUANTILE_SAMPLES) {
+            pane->samples[i] = value;
+        }
+    }
+#endif
+    pane->count++;
+    if (value < pane->min) {
+        pane->min = value;
+    }
+    if (value > pane->max) {
+        pane->max = value;
+    }
+    pane->sum += value;
+    pane->last = value;
+    pane->last_seq = seq;
+    agg->samples++;
+    return true;
+}
+
+uint32_t agg_due_in(const agg_t* agg, uint32_t now_ms) {
+    if (!agg_enabled(agg)) {
+        return UINT32_MAX;
+    }
+    uint32_t elapsed = now_ms - agg->pane_started_ms;
+    return elapsed >= agg->pane_ms ? 0 : agg->pane_ms - elapsed;
+}
+
+#if AGG_QUANTILE_SAMPLES
+typedef struct {
+    float value;
+    // samples of the pane this one stands for
+    float weight;
+} agg_weighted_t;
+
+// Estimate the quantiles of the window from the samples kept per pane
+static void quantiles(const agg_t* agg, const agg_stream_t* stream, agg_summary_t* summary) {
+    agg_weighted_t samples[AGG_MAX_PANES * AGG_QUANTILE_SAMPLES];
+    int n = 0;
+    for (int p = 0; p < agg->panes; p++) {
+        const agg_pane_t* pane = &stream->panes[p];
+        uint32_t kept = pane->count < AGG_QUANTILE_SAMPLES ? pane->count : AGG_QUANTILE_SAMPLES;
+        for (uint32_t i = 0; i < kept; i++) {
+            // insertion sort, there are only a few
+            agg_weighted_t sample = {pane->samples[i], (float) pane->count / kept};
+            int j = n++;
+            while (j > 0 && samples[j - 1].value > sample.value) {
+                samples[j] = samples[j - 1];
+                j--;
+            }
+            samples[j] = sample;
+        }
+    }
+    float p50 = 0.5f * summary->count;
+    float p90 = 0.9f * summary->count;
+    float seen = 0;
+    summary->p50 = NAN;
+    summary->p90 = NAN;
+    for (int i = 0; i < n; i++) {
+        seen += samples[i].weight;
+        if (isnan(summary->p50) && seen >= p50) {
+            summary->p50 = samples[i].value;
+        }
+        if (isnan(summary->p90) && seen >= p90) {
+            summary->p90 = samples[i].value;
+        }
+    }
+    // rounding can leave the weights a little short of the count
+    if (n > 0 && isnan(summary->p90)) {
+        summary->p90 = samples[n - 1].value;
+    }
+    if (n > 0 && isnan(summary->p50)) {
+        summary->p50 = samples[n - 1].value;
+    }
+}
+#endif
+
+// Summarize all panes of stream, the current one is the newest
+static void summarize(const agg_t* agg, const agg_stream_t* stream, agg_summary_t* summary) {
+    const agg_pane_t* newest = &stream->panes[agg->current];
+    double sum = 0;
+    memset(summary, 0, sizeof(*summary));
+    summary->slot = stream->slot;
+    summary->name = stream->name;
+    summary->min = newest->min;
+    summary->max = newest->max;
+    for (int p = 0; p < agg->panes; p++) {
+        const agg_pane_t* pane = &stream->panes[p];
+        if (pane->count == 0) {
+            continue;
+        }
+        summary->count += pane->count;
+        sum += pane->sum;
+        if (pane->min < summary->min) {
+            summary->min = pane->min;
+        }
+        if (pane->max > summary->max) {
+            summary->max = pane->max;
+        }
+    }
+    summary->mean = sum / summary->count;
+    summary->last = newest->last;
+    summary->window_ms = agg->pane_ms * agg->panes;
+    summary->last_seq = newest->last_seq;
+#if AGG_QUANTILE_SAMPLES
+    quantiles(agg, stream, summary);
+#endif
+}
+
+// Start the next pane, it replaces the oldest one; streams without samples left are given up
+static void next_pane(agg_t* agg, uint32_t now_ms) {
+    agg->current = (agg->current + 1) % agg->panes;
+    for (int i = 0; i < AGG_STREAMS; i++) {
+        agg_stream_t* stream = &agg->streams[i];
+        stream->panes[agg->current].count = 0;
+        bool empty = true;
+        for (int p = 0; p < agg->panes; p++) {
+            empty = empty && stream->panes[p].count == 0;
+        }
+        if (empty) {
+            stream->in_use = false;
+        }
+    }
+    seq_runs_reset(&agg->runs);
+    agg->pane_started_ms += agg->pane_ms;
+    // we may have been busy for longer than a pane, the cadence starts over then
+    if (now_ms - agg->pane_started_ms >= agg->pane_ms) {
+        agg->pane_started_ms = now_ms;
+    }
+}
+
+// Whether stream got samples in the current pane, without them the last summary still holds
+static bool has_samples(const agg_t* agg, const agg_stream_t* stream) {
+    return stream->in_use && stream->panes[agg->current].count > 0;
+}
+
+bool agg_next_summary(agg_t* agg, uint32_t now_ms, agg_summary_t* summary) {
+    if (agg->emitting < 0) {
+        if (agg_due_in(agg, now_ms) > 0) {
+            return false;
+        }
+        agg->emitting = 0;
+    }
+    while (agg->emitting < AGG_STREAMS) {
+        const agg_stream_t* stream = &agg->streams[agg->emitting++];
+        if (has_samples(agg, stream)) {
+            summarize(agg, stream, summary);
+            agg->summaries++;
+            // the samples are reported once all summaries of the pane are out
+            bool last = true;
+            for (int i = agg->emitting; i < AGG_STREAMS; i++) {
+                last = last && !has_samples(agg, &agg->streams[i]);
+            }
+            summary->runs = last ? &agg->runs : NULL;
+            return true;
+        }
+    }
+    next_pane(agg, now_ms);
+    agg->emitting = -1;
+    return false;
+}
+
+size_t agg_format(const agg_summary_t* summary, char* out, size_t size) {
+    int len = snprintf(out, size, "{\"agg\":\"%s\",\"n\":%" PRIu32 ",\"min\":%g,\"max\":%g,\"mean\":%g,\"last\":%g",
+                       summary->name, summary->count, summary->min, summary->max, summary->mean, summary->last);
+#if AGG_QUANTILE_SAMPLES
+    if (len > 0 && (size_t) len < size) {
+        len += snprintf(out + len, size - len, ",\"p50\":%g,\"p90\":%g", summary->p50, summary->p90);
+    }
+#endif
+    if (len > 0 && (size_t) len < size) {
+        len += snprintf(out + len, size - len, ",\"ms\":%" PRIu32 "}", summary->window_ms);
+    }
+    if (len <= 0 || (size_t) len >= size) {
+        return 0;
+    }
+    return len;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#include "seq_run.h"
+
+// numeric text messages ("21.5" or "temp=21.5") are folded into a summary per window and stream,
+// 0 (the default) passes them through like any other message
+#define AGG_WINDOW_MS CONFIG_AGGREGATE_WINDOW_MS
+// the window slides in this many steps, a summary is emitted after each of them (1: tumbling windows)
+#define AGG_PANES CONFIG_AGGREGATE_PANES
+#define AGG_MAX_PANES 4
+// streams by connection slot and name, messages of further streams pass through
+#define AGG_STREAMS 8
+#define AGG_NAME_LEN 15
+// samples kept per pane (uniformly chosen) for the quantiles of a summary, 0 leaves them out
+#define AGG_QUANTILE_SAMPLES 16
+// longest summary text, see agg_format
+#define AGG_SUMMARY_MAX 192
+// runs of the samples of a pane (see seq_run.h), further samples that would need a run of their own pass through
+#define AGG_RUNS 32
+
+// Samples of one step of the window
+typedef struct {
+    uint32_t count;
+    float min;
+    float max;
+    double sum;
+    float last;
+    // sequence number of the last sample
+    uint32_t last_seq;
+#if AGG_QUANTILE_SAMPLES
+    float samples[AGG_QUANTILE_SAMPLES];
+#endif
+} agg_pane_t;
+
+typedef struct {
+    bool in_use;
+    int slot;
+    char name[AGG_NAME_LEN + 1];
+    agg_pane_t panes[AGG_MAX_PANES];
+} agg_stream_t;
+
+// Windowed aggregation with fixed memory, it only needs to be told the time
+typedef struct {
+    int panes;
+    uint32_t pane_ms;
+    // pane samples are currently added to, the same for all streams
+    int current;
+    uint32_t pane_started_ms;
+    // stream the next summary is looked for at, -1 while the pane isn't over
+    int emitting;
+    agg_stream_t streams[AGG_STREAMS];
+    // samples of the current pane by connection, reported with the last summary of the pane
+    seq_runs_t runs;
+    seq_run_t run_storage[AGG_RUNS];
+    uint32_t random;
+    // totals since boot
+    uint32_t samples;
+    uint32_t summaries;
+} agg_t;
+
+// Summary of the window of a stream, the strings point into the aggregator
+typedef struct {
+    int slot;
+    const char* name;
+    uint32_t count;
+    float min;
+    float max;
+    float mean;
+    float last;
+    float p50;
+    float p90;
+    uint32_t window_ms;
+    // sequence number of the last sample, the summary is posted as it
+    uint32_t last_seq;
+    // with the last summary of a pane: the samples of the pane, of all streams; their status is that of
+    // this summary. NULL for the others
+    const seq_runs_t* runs;
+} agg_summary_t;
+
+// window_ms 0 disables aggregation, panes is clamped to 1..AGG_MAX_PANES
+void agg_init(agg_t* agg, uint32_t window_ms, int panes, uint32_t now_ms, uint32_t seed);
+bool agg_enabled(const agg_t* agg);
+// Parse a numeric sample, an optional name (ended by '=' or ':') and a number, nothing else
+bool agg_parse(const uint8_t* data, size_t len, char* name, float* value);
+// Add a message of the connection in slot, prev is the message the slot queued before it (see seq_run.h);
+// returns false if it has to pass through (aggregation is off, it isn't numeric, all streams or runs are taken)
+bool agg_add(agg_t* agg, int slot, const uint8_t* data, size_t len, uint32_t prev, uint32_t seq);
+// ms until the current pane is over
+uint32_t agg_due_in(const agg_t* agg, uint32_t now_ms);
+// Once the pane is over, fill summary for the next stream that got samples in it; returns false
+// when there is none left, the next pane starts then
+bool agg_next_summary(agg_t* agg, uint32_t now_ms, agg_summary_t* summary);
+// Write summary as json object, returns its length (0 if it doesn't fit)
+size_t agg_format(const agg_summary_t* summary, char* out, size_t size);
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "batch.h"
+
+void batch_reset(batch_t* batch) {
+    batch->len = 0;
+    batch->count = 0;
+    seq_runs_init(&batch->runs, batch->run_storage, BATCH_MAX_MESSAGES);
+}
+
+// Account for a record that was appended
+static void batch_count(batch_t* batch, const frame_t* frame) {
+    batch->received_ms[batch->count] = frame->timestamp_ms;
+    batch->count++;
+}
+
+#if !BATCH_BINARY
+#define RECORD_PREFIX ",\"msg\":\""
+#define RECORD_SUFFIX "\"}\n"
+
+// Write c json escaped to dst, returns the number of bytes written (0 if there is no room)
+static size_t escape_char(char* dst, size_t room, char c) {
+    const char* escaped = NULL;
+    switch (c) {
+        case '"':  escaped = "\\\""; break;
+        case '\\': escaped = "\\\\"; break;
+        case '\n': escaped = "\\n"; break;
+        case '\r': escaped = "\\r"; break;
+        case '\t': escaped = "\\t"; break;
+        default: break;
+    }
+    if (escaped != NULL) {
+        if (room < 2) {
+            return 0;
+        }
+        memcpy(dst, escaped, 2);
+        return 2;
+    }
+    if ((unsigned char) c < 0x20) {
+        // remaining control characters as \u00XX
+        if (room < 6) {
+            return 0;
+        }
+        snprintf(dst, 7, "\\u%04x", (unsigned char) c);
+        return 6;
+    }
+    if (room < 1) {
+        return 0;
+    }
+    *dst = c;
+    return 1;
+}
+#endif
+
+#if BATCH_BINARY
+
+bool batch_add(batch_t* batch, const frame_t* frame) {
+    if (batch->count >= BATCH_MAX_MESSAGES) {
+        return false;
+    }
+    // encode behind room for a two byte length prefix, then move it down if one byte is enough
+    uint8_t* out = (uint8_t*) batch->buf + batch->len;
+    size_t room = BATCH_MAX_BYTES - batch->len;
+    if (room <= 2) {
+        return false;
+    }
+    size_t len = frame_encode(frame, out + 2, room - 2);
+    if (len == 0) {
+        return false;
+    }
+    size_t prefix = frame_put_varint(out, 2, len);
+    if (prefix == 1) {
+        memmove(out + 1, out + 2, len);
+    }
+    batch->len += prefix + len;
+    batch_count(batch, frame);
+    return true;
+}
+
+#else
+
+// Append str at *pos, false if there is no room left before limit
+static bool append_str(batch_t* batch, size_t* pos, size_t limit, const char* str) {
+    size_t len = strlen(str);
+    if (*pos + len > limit) {
+        return false;
+    }
+    memcpy(batch->buf + *pos, str, len);
+    *pos += len;
+    return true;
+}
+
+bool batch_add(batch_t* batch, const frame_t* frame) {
+    if (batch->count >= BATCH_MAX_MESSAGES) {
+        return false;
+    }
+    size_t pos = batch->len;
+    size_t suffix_len = strlen(RECORD_SUFFIX);
+    size_t limit = BATCH_MAX_BYTES - suffix_len;
+    char field[32];
+
+    if (!append_str(batch, &pos, limit, "{\"dev\":\"")) {
+        return false;
+    }
+    for (int i = 0; i < frame->device_id_len; i++) {
+        snprintf(field, sizeof(field), "%02x", frame->device_id[i]);
+        if (!append_str(batch, &pos, limit, field)) {
+            return false;
+        }
+    }
+    snprintf(field, sizeof(field), "\",\"boot\":%lu", (unsigned long) frame->boot);
+    if (!append_str(batch, &pos, limit, field)) {
+        return false;
+    }
+    snprintf(field, sizeof(field), ",\"seq\":%lu", (unsigned long) frame->seq);
+    if (!append_str(batch, &pos, limit, field)) {
+        return false;
+    }
+    snprintf(field, sizeof(field), ",\"ts\":%llu", (unsigned long long) frame->timestamp_ms);
+    if (!append_str(batch, &pos, limit, field) || !append_str(batch, &pos, limit, RECORD_PREFIX)) {
+        return false;
+    }
+    for (size_t i = 0; i < frame->payload_len; i++) {
+        size_t written = escape_char(batch->buf + pos, limit - pos, frame->payload[i]);
+        if (written == 0) {
+            // doesn't fit, the partially written record is simply cut off again
+            return false;
+        }
+        pos += written;
+    }
+    memcpy(batch->buf + pos, RECORD_SUFFIX, suffix_len);
+    batch->len = pos + suffix_len;
+    batch_count(batch, frame);
+    return true;
+}
+
+#endif
+
+bool batch_full(const batch_t* batch) {
+    return batch->count >= BATCH_MAX_MESSAGES || batch->len >= BATCH_FLUSH_BYTES;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "seq_run.h"
+
+// a batch is flushed as soon as one of these limits is reached
+// (-DBATCH_FLUSH_BYTES=1 posts every message on its own, host_test builds sim_run with several sizes)
+#ifndef BATCH_FLUSH_BYTES
+#define BATCH_FLUSH_BYTES 1536
+#endif
+#define BATCH_MAX_MESSAGES 32
+#define BATCH_LINGER_MS 500
+// hard capacity, leaves room for one more record once BATCH_FLUSH_BYTES is almost reached
+#define BATCH_MAX_BYTES 2048
+
+// 1: records are binary frames (see frame.h), each prefixed with its length as varint
+// 0: records are NDJSON, one {"dev":"..","boot":..,"seq":..,"ts":..,"msg":".."} object per line
+#ifndef BATCH_BINARY
+#define BATCH_BINARY 1
+#endif
+
+#if BATCH_BINARY
+#define BATCH_CONTENT_TYPE "application/x-esp-frames"
+#else
+#define BATCH_CONTENT_TYPE "application/x-ndjson"
+#endif
+
+// Framed messages, batches of the same format can simply be concatenated
+typedef struct {
+    char buf[BATCH_MAX_BYTES];
+    size_t len;
+    int count;
+    // when each message was received (ms since boot)
+    uint32_t received_ms[BATCH_MAX_MESSAGES];
+    // the records by connection, kept up to date by the caller; at most one run per record
+    seq_runs_t runs;
+    seq_run_t run_storage[BATCH_MAX_MESSAGES];
+} batch_t;
+
+void batch_reset(batch_t* batch);
+// Append a record to the batch, returns false (and leaves the batch untouched) if it doesn't fit
+bool batch_add(batch_t* batch, const frame_t* frame);
+bool batch_full(const batch_t* batch);
@@ -0,0 +1,113 @@
+#include <string.h>
+
+#include "bulk.h"
+#include "dlog.h"
+
+static bulk_stream_t bulk_streams[BULK_MAX_STREAMS];
+
+static bulk_stream_t* bulk_get(uint16_t conn_id, bool create) {
+    bulk_stream_t* free_entry = NULL;
+    for (int i = 0; i < BULK_MAX_STREAMS; i++) {
+        bulk_stream_t* stream = &bulk_streams[i];
+        if (stream->in_use && stream->conn_id == conn_id) {
+            return stream;
+        }
+        if (!stream->in_use && free_entry == NULL) {
+            free_entry = stream;
+        }
+    }
+    if (!create || free_entry == NULL) {
+        return NULL;
+    }
+    memset(free_entry, 0, sizeof(*free_entry));
+    free_entry->in_use = true;
+    free_entry->conn_id = conn_id;
+    return free_entry;
+}
+
+// Throw away the message being reassembled
+static void bulk_discard(bulk_stream_t* stream) {
+    if (stream->buf != NULL) {
+        msg_buf_unref(stream->buf);
+        stream->buf = NULL;
+    }
+}
+
+esp_gatt_status_t bulk_receive(uint16_t conn_id, const uint8_t* data, uint16_t len, msg_buf_t** complete, uint16_t* lost) {
+    *complete = NULL;
+    *lost = 0;
+    if (len < BULK_HEADER_LEN) {
+        return ESP_GATT_INVALID_PDU;
+    }
+    bulk_stream_t* stream = bulk_get(conn_id, true);
+    if (stream == NULL) {
+        return ESP_GATT_NO_RESOURCES;
+    }
+    uint16_t seq = data[0] | (data[1] << 8);
+    uint8_t flags = data[2];
+    const uint8_t* fragment = data + BULK_HEADER_LEN;
+    uint16_t fragment_len = len - BULK_HEADER_LEN;
+
+    if (stream->synced) {
+        // compared in 16 bit, so the distance stays right when the sequence number wraps around
+        int16_t delta = (int16_t) (seq - stream->next_seq);
+        if (delta < 0) {
+            // a retransmission of the client or a packet that was overtaken, we already moved on
+            stream->duplicate_packets++;
+            return ESP_GATT_OK;
+        }
+        if (delta > 0) {
+            // the link layer doesn't lose packets, but the client may have dropped some it couldn't queue
+            *lost = delta;
+            stream->lost_packets += delta;
+            // the message in progress is missing a fragment
+            bulk_discard(stream);
+        }
+    }
+    stream->synced = true;
+    stream->next_seq = seq + 1;
+    stream->packets++;
+    stream->bytes += len;
+
+    if (flags & BULK_FLAG_START) {
+        if (stream->buf != NULL) {
+            DLOG(DLOG_WARN, "Bulk message without end, dropping it\n");
+            bulk_discard(stream);
+        }
+        stream->buf = msg_pool_alloc();
+        if (stream->buf == NULL) {
+            // the rest of the message is skipped
+            stream->dropped_messages++;
+            return ESP_GATT_NO_RESOURCES;
+        }
+    }
+    if (stream->buf == NULL) {
+        // rest of a message we couldn't take
+        return ESP_GATT_OK;
+    }
+    if (stream->buf->len + fragment_len > MSG_BUF_SIZE) {
+        bulk_discard(stream);
+        stream->dropped_messages++;
+        return ESP_GATT_INVALID_ATTR_LEN;
+    }
+    memcpy(stream->buf->data + stream->buf->len, fragment, fragment_len);
+    stream->buf->len += fragment_len;
+    if (flags & BULK_FLAG_END) {
+        *complete = stream->buf;
+        stream->buf = NULL;
+        stream->messages++;
+    }
+    return ESP_GATT_OK;
+}
+
+const bulk_stream_t* bulk_stream(uint16_t conn_id) {
+    return bulk_get(conn_id, false);
+}
+
+void bulk_release_conn(uint16_t conn_id) {
+    bulk_stream_t* stream = bulk_get(conn_id, false);
+    if (stream != NULL) {
+        bulk_discard(stream);
+        stream->in_use = false;
+    }
+}
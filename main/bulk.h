@@ -0,0 +1,46 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_gatt_defs.h"
+
+#include "conn.h"
+#include "msg_pool.h"
+
+// one stream per connection
+#define BULK_MAX_STREAMS CONN_MAX
+
+// Every packet written to the bulk characteristic starts with a header:
+// sequence number (16 bit, little endian, +1 per packet) and flags, the rest is a fragment of a message
+#define BULK_HEADER_LEN 3
+// first fragment of a message
+#define BULK_FLAG_START 0x01
+// last fragment of a message, a message that fits into a single packet has both flags
+#define BULK_FLAG_END 0x02
+
+// Messages being reassembled from a stream of writes without response
+typedef struct {
+    bool in_use;
+    uint16_t conn_id;
+    // the first packet sets the expected sequence number
+    bool synced;
+    uint16_t next_seq;
+    // message being reassembled, NULL while fragments of a broken message are skipped
+    msg_buf_t* buf;
+    uint32_t packets;
+    uint32_t bytes;
+    uint32_t lost_packets;
+    // packets that came again or too late, they are ignored
+    uint32_t duplicate_packets;
+    uint32_t messages;
+    // messages we had no buffer for or that got too long
+    uint32_t dropped_messages;
+} bulk_stream_t;
+
+// Add a packet to the stream of the connection. A completed message is handed over in *complete
+// (with the reference of the caller), *lost is the number of packets missing in front of this one.
+// ESP_GATT_NO_RESOURCES and ESP_GATT_INVALID_ATTR_LEN mean the message of the packet was dropped
+esp_gatt_status_t bulk_receive(uint16_t conn_id, const uint8_t* data, uint16_t len, msg_buf_t** complete, uint16_t* lost);
+// Statistics of the stream of the connection, NULL if there is none
+const bulk_stream_t* bulk_stream(uint16_t conn_id);
+// Drop the stream of a connection (on disconnect)
+void bulk_release_conn(uint16_t conn_id);
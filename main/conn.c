@@ -0,0 +1,207 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatt_defs.h"
+
+#include "conn.h"
+#include "dlog.h"
+
+static conn_t conns[CONN_MAX];
+// updated on the bluetooth task, also read when notifying from other tasks
+static portMUX_TYPE conn_lock = portMUX_INITIALIZER_UNLOCKED;
+// slows idle streams down again, only runs while a connection is streaming
+static esp_timer_handle_t conn_idle_timer;
+// the interval outside streams, set by the uplink task
+static volatile bool conn_idle = false;
+
+static conn_t* conn_find(uint16_t conn_id) {
+    for (int i = 0; i < CONN_MAX; i++) {
+        if (conns[i].in_use && conns[i].conn_id == conn_id) {
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+static void conn_request_params(conn_t* conn, bool fast) {
+    esp_ble_conn_update_params_t params = {0};
+    memcpy(params.bda, conn->bda, sizeof(esp_bd_addr_t));
+    if (fast) {
+        params.min_int = CONN_FAST_MIN_INT;
+        params.max_int = CONN_FAST_MAX_INT;
+    } else {
+        params.min_int = conn_idle ? CONN_IDLE_MIN_INT : CONN_ACTIVE_MIN_INT;
+        params.max_int = conn_idle ? CONN_IDLE_MAX_INT : CONN_ACTIVE_MAX_INT;
+    }
+    params.latency = 0;
+    params.timeout = CONN_TIMEOUT;
+    // the central decides, the result arrives as ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT
+    esp_ble_gap_update_conn_params(&params);
+}
+
+static void conn_idle_check(void* arg) {
+    int64_t now = esp_timer_get_time() / 1000;
+    bool streaming = false;
+    for (int i = 0; i < CONN_MAX; i++) {
+        conn_t* conn = &conns[i];
+        portENTER_CRITICAL(&conn_lock);
+        bool idle = conn->in_use && conn->streaming && now - conn->last_stream_ms >= CONN_STREAM_IDLE_MS;
+        if (idle) {
+            conn->streaming = false;
+        } else if (conn->in_use && conn->streaming) {
+            streaming = true;
+        }
+        portEXIT_CRITICAL(&conn_lock);
+        if (idle) {
+            DLOG(DLOG_INFO, "Stream on connection %d is idle\n", conn->conn_id);
+            conn_request_params(conn, false);
+        }
+    }
+    if (streaming) {
+        esp_timer_start_once(conn_idle_timer, CONN_STREAM_IDLE_MS * 1000);
+    }
+}
+
+void conn_init(void) {
+    esp_timer_create_args_t timer_args = {
+        .callback = conn_idle_check,
+        .name = "conn_idle",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &conn_idle_timer));
+}
+
+void conn_open(uint16_t conn_id, const esp_bd_addr_t bda) {
+    conn_t* conn = conn_find(conn_id);
+    for (int i = 0; i < CONN_MAX && conn == NULL; i++) {
+        if (!conns[i].in_use) {
+            conn = &conns[i];
+        }
+    }
+    if (conn == NULL) {
+        DLOG(DLOG_WARN, "No room to track connection %d\n", conn_id);
+        return;
+    }
+    portENTER_CRITICAL(&conn_lock);
+    memset(conn, 0, sizeof(*conn));
+    conn->in_use = true;
+    conn->conn_id = conn_id;
+    memcpy(conn->bda, bda, sizeof(esp_bd_addr_t));
+    conn->mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+    portEXIT_CRITICAL(&conn_lock);
+    conn_request_params(conn, false);
+}
+
+void conn_close(uint16_t conn_id) {
+    conn_t* conn = conn_find(conn_id);
+    if (conn != NULL) {
+        portENTER_CRITICAL(&conn_lock);
+        conn->in_use = false;
+        portEXIT_CRITICAL(&conn_lock);
+    }
+}
+
+int conn_count(void) {
+    int count = 0;
+    for (int i = 0; i < CONN_MAX; i++) {
+        if (conns[i].in_use) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int conn_slot(uint16_t conn_id) {
+    conn_t* conn = conn_find(conn_id);
+    return conn == NULL ? -1 : conn - conns;
+}
+
+bool conn_get(int slot, conn_t* conn) {
+    portENTER_CRITICAL(&conn_lock);
+    bool in_use = conns[slot].in_use;
+    if (in_use) {
+        *conn = conns[slot];
+    }
+    portEXIT_CRITICAL(&conn_lock);
+    return in_use;
+}
+
+void conn_set_subscribed(uint16_t conn_id, bool subscribed) {
+    conn_t* conn = conn_find(conn_id);
+    if (conn != NULL) {
+        portENTER_CRITICAL(&conn_lock);
+        conn->subscribed = subscribed;
+        conn->congested = false;
+        portEXIT_CRITICAL(&conn_lock);
+    }
+}
+
+void conn_set_congested(uint16_t conn_id, bool congested) {
+    conn_t* conn = conn_find(conn_id);
+    if (conn != NULL) {
+        portENTER_CRITICAL(&conn_lock);
+        conn->congested = congested;
+        portEXIT_CRITICAL(&conn_lock);
+    }
+}
+
+void conn_set_mtu(uint16_t conn_id, uint16_t mtu) {
+    conn_t* conn = conn_find(conn_id);
+    if (conn != NULL) {
+        DLOG(DLOG_INFO, "MTU of connection %d is %d\n", conn_id, mtu);
+        portENTER_CRITICAL(&conn_lock);
+        conn->mtu = mtu;
+        portEXIT_CRITICAL(&conn_lock);
+    }
+}
+
+uint16_t conn_get_mtu(uint16_t conn_id) {
+    uint16_t mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+    portENTER_CRITICAL(&conn_lock);
+    conn_t* conn = conn_find(conn_id);
+    if (conn != NULL) {
+        mtu = conn->mtu;
+    }
+    portEXIT_CRITICAL(&conn_lock);
+    return mtu;
+}
+
+void conn_stream_activity(uint16_t conn_id) {
+    conn_t* conn = conn_find(conn_id);
+    if (conn == NULL) {
+        return;
+    }
+    // the idle check runs on the timer task
+    portENTER_CRITICAL(&conn_lock);
+    conn->last_stream_ms = esp_timer_get_time() / 1000;
+    bool started = !conn->streaming;
+    conn->streaming = true;
+    portEXIT_CRITICAL(&conn_lock);
+    if (!started) {
+        return;
+    }
+    DLOG(DLOG_INFO, "Stream started on connection %d\n", conn_id);
+    if (!conn->data_len_requested) {
+        // fill a whole mtu into fewer link layer packets
+        conn->data_len_requested = true;
+        esp_ble_gap_set_pkt_data_len(conn->bda, CONN_DATA_LEN);
+    }
+    conn_request_params(conn, true);
+    if (!esp_timer_is_active(conn_idle_timer)) {
+        esp_timer_start_once(conn_idle_timer, CONN_STREAM_IDLE_MS * 1000);
+    }
+}
+
+void conn_set_idle(bool idle) {
+    if (idle == conn_idle) {
+        return;
+    }
+    conn_idle = idle;
+    for (int i = 0; i < CONN_MAX; i++) {
+        conn_t conn;
+        // a streaming connection gets the new interval once its stream is idle
+        if (conn_get(i, &conn) && !conn.streaming) {
+            conn_request_params(&conn, false);
+        }
+    }
+}
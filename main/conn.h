@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_bt_defs.h"
+
+// centrals that can be connected at once, we keep advertising until this many are
+#define CONN_MAX CONFIG_BTDM_CTRL_BLE_MAX_CONN
+// every connection has a slot, CONN_ALL selects all of them
+#define CONN_ALL ((1u << CONN_MAX) - 1)
+
+// connection interval (units of 1.25 ms) outside bulk streams: active while the centrals send
+// messages, idle once the link policy found them quiet, which saves power on both sides
+#define CONN_ACTIVE_MIN_INT 0x18
+#define CONN_ACTIVE_MAX_INT 0x30
+#define CONN_IDLE_MIN_INT 0x50
+#define CONN_IDLE_MAX_INT 0xA0
+// and while a bulk stream is running, as many connection events as possible
+#define CONN_FAST_MIN_INT 0x06
+#define CONN_FAST_MAX_INT 0x0C
+// supervision timeout (units of 10 ms)
+#define CONN_TIMEOUT 400
+// a stream is over once nothing arrived for this long
+#define CONN_STREAM_IDLE_MS 2000
+// largest link layer payload, requested with the first stream (data length extension)
+#define CONN_DATA_LEN 251
+
+// Link state of a connected central
+typedef struct {
+    bool in_use;
+    uint16_t conn_id;
+    esp_bd_addr_t bda;
+    // negotiated in ESP_GATTS_MTU_EVT, the default until then
+    uint16_t mtu;
+    // fast connection parameters were requested
+    bool streaming;
+    bool data_len_requested;
+    int64_t last_stream_ms;
+    // status notifications are enabled
+    bool subscribed;
+    // the stack ran out of buffers for notifications
+    bool congested;
+} conn_t;
+
+void conn_init(void);
+// Track a new connection and ask for the connection parameters outside streams
+void conn_open(uint16_t conn_id, const esp_bd_addr_t bda);
+void conn_close(uint16_t conn_id);
+int conn_count(void);
+// Slot of the connection (stable while it is connected), -1 if it isn't tracked
+int conn_slot(uint16_t conn_id);
+// Copy the state of the connection in slot, returns false if there is none
+bool conn_get(int slot, conn_t* conn);
+void conn_set_mtu(uint16_t conn_id, uint16_t mtu);
+// Negotiated mtu of the connection, can be called from any task
+uint16_t conn_get_mtu(uint16_t conn_id);
+void conn_set_subscribed(uint16_t conn_id, bool subscribed);
+void conn_set_congested(uint16_t conn_id, bool congested);
+// Note traffic of a bulk stream, the link is switched to the fast parameters until it is idle again
+void conn_stream_activity(uint16_t conn_id);
+// Switch the connections that aren't streaming (and new ones) to the idle or the active interval
+void conn_set_idle(bool idle);
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "credentials.h"
+
+#define CRED_NAMESPACE "wifi_storage"
+#define CRED_KEY "networks"
+#define CRED_FAST_KEY "fast_conn"
+#define CRED_BLOB_VERSION 1
+// wpa passphrases, from 8 characters up to 64 hex digits (wep hex keys of 10, 26 and 32 digits are in there)
+#define CRED_MIN_PASSPHRASE_LEN 8
+
+// layout of the nvs blob, networks are kept sorted by last_success
+typedef struct {
+    uint8_t version;
+    uint8_t count;
+    uint32_t success_counter;
+    cred_network_t networks[CRED_MAX_NETWORKS];
+} cred_store_t;
+
+// access point the last connection went to, lets the next connect skip the scan
+typedef struct {
+    char ssid[CRED_SSID_LEN + 1];
+    uint8_t bssid[6];
+    uint8_t channel;
+} cred_fast_connect_t;
+
+static cred_store_t store;
+static cred_fast_connect_t fast_connect;
+static cred_network_t staged;
+static bool ssid_staged = false;
+// credentials are written from the bluetooth task and read from the uplink task and event loop
+static SemaphoreHandle_t cred_lock;
+
+static esp_err_t save_store() {
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(CRED_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        printf("Error opening storage: %s \n", esp_err_to_name(err));
+        return err;
+    }
+    err = nvs_set_blob(handle, CRED_KEY, &store, sizeof(store));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    if (err != ESP_OK) {
+        printf("Error writing networks: %s \n", esp_err_to_name(err));
+    }
+    nvs_close(handle);
+    return err;
+}
+
+// Insert or update network, it becomes the first one; the least recently used network is dropped if all slots are taken
+static void put_first(const cred_network_t* network) {
+    int index = store.count < CRED_MAX_NETWORKS ? store.count : CRED_MAX_NETWORKS - 1;
+    for (int i = 0; i < store.count; i++) {
+        if (strcmp(store.networks[i].ssid, network->ssid) == 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index == store.count) {
+        store.count++;
+    }
+    memmove(&store.networks[1], &store.networks[0], index * sizeof(cred_network_t));
+    store.networks[0] = *network;
+}
+
+// Move over the single ssid/password strings older firmware stored
+static void migrate_legacy(nvs_handle_t handle) {
+    cred_network_t network = {0};
+    size_t ssid_size = sizeof(network.ssid);
+    size_t password_size = sizeof(network.password);
+    if (nvs_get_str(handle, "ssid", network.ssid, &ssid_size) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_str(handle, "password", network.password, &password_size) != ESP_OK) {
+        network.password[0] = '\0';
+    }
+    printf("Migrating stored wifi %s\n", network.ssid);
+    put_first(&network);
+    save_store();
+}
+
+esp_err_t credentials_init(void) {
+    cred_lock = xSemaphoreCreateMutex();
+    if (cred_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(&store, 0, sizeof(store));
+    memset(&fast_connect, 0, sizeof(fast_connect));
+    store.version = CRED_BLOB_VERSION;
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(CRED_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        // nothing stored yet
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        printf("Error opening storage: %s \n", esp_err_to_name(err));
+        return err;
+    }
+
+    size_t fast_size = sizeof(fast_connect);
+    if (nvs_get_blob(handle, CRED_FAST_KEY, &fast_connect, &fast_size) != ESP_OK || fast_size != sizeof(fast_connect)) {
+        memset(&fast_connect, 0, sizeof(fast_connect));
+    }
+
+    cred_store_t loaded;
+    size_t size = sizeof(loaded);
+    err = nvs_get_blob(handle, CRED_KEY, &loaded, &size);
+    if (err == ESP_OK && size == sizeof(loaded) && loaded.version == CRED_BLOB_VERSION && loaded.count <= CRED_MAX_NETWORKS) {
+        store = loaded;
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        migrate_legacy(handle);
+    } else {
+        printf("Ignoring invalid stored networks\n");
+    }
+    nvs_close(handle);
+    printf("Loaded %d wifi networks\n", store.count);
+    return ESP_OK;
+}
+
+esp_err_t credentials_stage_ssid(const char* ssid) {
+    size_t len = strlen(ssid);
+    if (len == 0 || len > CRED_SSID_LEN) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    xSemaphoreTake(cred_lock, portMAX_DELAY);
+    memset(&staged, 0, sizeof(staged));
+    memcpy(staged.ssid, ssid, len);
+    ssid_staged = true;
+    xSemaphoreGive(cred_lock);
+    return ESP_OK;
+}
+
+// Whether some network could use a password of len characters, the auth mode is left to the driver
+static bool credentials_password_len_ok(size_t len) {
+    // open networks, and wep keys as 5, 13 or 16 characters
+    if (len == 0 || len == 5 || len == 13 || len == 16) {
+        return true;
+    }
+    return len >= CRED_MIN_PASSPHRASE_LEN && len <= CRED_PASSWORD_LEN;
+}
+
+esp_err_t credentials_stage_password(const char* password) {
+    size_t len = strlen(password);
+    if (!credentials_password_len_ok(len)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    xSemaphoreTake(cred_lock, portMAX_DELAY);
+    if (!ssid_staged) {
+        // a new password for the current network
+        if (store.count == 0) {
+            xSemaphoreGive(cred_lock);
+            return ESP_ERR_INVALID_STATE;
+        }
+        staged = store.networks[0];
+        ssid_staged = true;
+    }
+    memset(staged.password, 0, sizeof(staged.password));
+    memcpy(staged.password, password, len);
+    xSemaphoreGive(cred_lock);
+    return credentials_commit();
+}
+
+esp_err_t credentials_commit(void) {
+    xSemaphoreTake(cred_lock, portMAX_DELAY);
+    if (!ssid_staged) {
+        xSemaphoreGive(cred_lock);
+        return ESP_OK;
+    }
+    // new credentials are tried first
+    staged.last_success = ++store.success_counter;
+    put_first(&staged);
+    ssid_staged = false;
+    esp_err_t err = save_store();
+    xSemaphoreGive(cred_lock);
+    return err;
+}
+
+bool credentials_get(int rank, cred_network_t* network) {
+    xSemaphoreTake(cred_lock, portMAX_DELAY);
+    bool found = rank < store.count;
+    if (found) {
+        *network = store.networks[rank];
+    }
+    xSemaphoreGive(cred_lock);
+    return found;
+}
+
+int credentials_count(void) {
+    return store.count;
+}
+
+void credentials_mark_success(const char* ssid) {
+    xSemaphoreTake(cred_lock, portMAX_DELAY);
+    for (int i = 0; i < store.count; i++) {
+        if (strcmp(store.networks[i].ssid, ssid) != 0) {
+            continue;
+        }
+        if (i > 0) {
+            // only a change in ranking is worth a flash write
+            cred_network_t network = store.networks[i];
+            network.last_success = ++store.success_counter;
+            put_first(&network);
+            save_store();
+        }
+        break;
+    }
+    xSemaphoreGive(cred_lock);
+}
+
+void credentials_set_fast_connect(const char* ssid, const uint8_t bssid[6], uint8_t channel) {
+    cred_fast_connect_t updated = {0};
+    strncpy(updated.ssid, ssid, CRED_SSID_LEN);
+    memcpy(updated.bssid, bssid, sizeof(updated.bssid));
+    updated.channel = channel;
+
+    xSemaphoreTake(cred_lock, portMAX_DELAY);
+    if (memcmp(&updated, &fast_connect, sizeof(updated)) != 0) {
+        fast_connect = updated;
+        nvs_handle_t handle;
+        if (nvs_open(CRED_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+            if (nvs_set_blob(handle, CRED_FAST_KEY, &fast_connect, sizeof(fast_connect)) == ESP_OK) {
+                nvs_commit(handle);
+            }
+            nvs_close(handle);
+        }
+    }
+    xSemaphoreGive(cred_lock);
+}
+
+bool credentials_get_fast_connect(const char* ssid, uint8_t bssid[6], uint8_t* channel) {
+    xSemaphoreTake(cred_lock, portMAX_DELAY);
+    bool found = fast_connect.channel != 0 && strcmp(fast_connect.ssid, ssid) == 0;
+    if (found && bssid != NULL) {
+        memcpy(bssid, fast_connect.bssid, sizeof(fast_connect.bssid));
+    }
+    if (found && channel != NULL) {
+        *channel = fast_connect.channel;
+    }
+    xSemaphoreGive(cred_lock);
+    return found;
+}
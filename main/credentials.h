@@ -0,0 +1,33 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define CRED_MAX_NETWORKS 4
+#define CRED_SSID_LEN 32
+#define CRED_PASSWORD_LEN 64
+
+typedef struct {
+    char ssid[CRED_SSID_LEN + 1];
+    char password[CRED_PASSWORD_LEN + 1];
+    // value of a counter at the last successful connection, higher is more recent
+    uint32_t last_success;
+} cred_network_t;
+
+// Load the stored networks into RAM (migrating the old single ssid/password entries)
+esp_err_t credentials_init(void);
+// Stage a new ssid, it is stored together with the password that follows it
+esp_err_t credentials_stage_ssid(const char* ssid);
+// Stage the password for the staged ssid and commit both in one nvs write
+esp_err_t credentials_stage_password(const char* password);
+// Commit a staged ssid without password (open network), nothing happens if nothing is staged
+esp_err_t credentials_commit(void);
+// Copy the network at rank (0 is the most recently successful one), false if there is none
+bool credentials_get(int rank, cred_network_t* network);
+int credentials_count(void);
+// Rank the network first after a successful connection
+void credentials_mark_success(const char* ssid);
+// Remember the access point of ssid for a fast reconnect (only written to flash if it changed)
+void credentials_set_fast_connect(const char* ssid, const uint8_t bssid[6], uint8_t channel);
+// Look up the cached access point of ssid, bssid and channel may be NULL
+bool credentials_get_fast_connect(const char* ssid, uint8_t bssid[6], uint8_t* channel);
@@ -0,0 +1,164 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "deflate.h"
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define END_OF_BLOCK 256
+
+typedef struct {
+    uint8_t* out;
+    size_t room;
+    size_t pos;
+    uint32_t bits;
+    int bit_count;
+    bool overflow;
+} bit_writer_t;
+
+static const uint16_t length_base[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t length_extra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t dist_extra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// position + 1 of the last occurrence of each 3 byte hash, 0 if none
+static uint16_t hash_head[DEFLATE_HASH_SIZE];
+
+// Write count bits of value, least significant bit first
+static void put_bits(bit_writer_t* w, uint32_t value, int count) {
+    w->bits |= value << w->bit_count;
+    w->bit_count += count;
+    while (w->bit_count >= 8) {
+        if (w->pos < w->room) {
+            w->out[w->pos++] = w->bits & 0xFF;
+        } else {
+            w->overflow = true;
+        }
+        w->bits >>= 8;
+        w->bit_count -= 8;
+    }
+}
+
+// Huffman codes are stored most significant bit first
+static void put_code(bit_writer_t* w, uint32_t code, int count) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < count; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    put_bits(w, reversed, count);
+}
+
+// Fixed literal/length code of symbol (RFC 1951, 3.2.6)
+static void put_symbol(bit_writer_t* w, int symbol) {
+    if (symbol < 144) {
+        put_code(w, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(w, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(w, symbol - 256, 7);
+    } else {
+        put_code(w, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void put_match(bit_writer_t* w, int length, int distance) {
+    int code = 0;
+    while (code < 28 && length_base[code + 1] <= length) {
+        code++;
+    }
+    put_symbol(w, 257 + code);
+    put_bits(w, length - length_base[code], length_extra[code]);
+
+    code = 0;
+    while (code < 29 && dist_base[code + 1] <= distance) {
+        code++;
+    }
+    put_code(w, code, 5);
+    put_bits(w, distance - dist_base[code], dist_extra[code]);
+}
+
+static uint32_t hash3(const uint8_t* p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static uint32_t adler32(const uint8_t* data, size_t len) {
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+size_t deflate_compress(const uint8_t* in, size_t len, uint8_t* out, size_t room) {
+    // positions are kept in 16 bits
+    if (len > UINT16_MAX || room < 6) {
+        return 0;
+    }
+    bit_writer_t w = { .out = out, .room = room - 4 };
+    memset(hash_head, 0, sizeof(hash_head));
+
+    // zlib header: deflate with 32K window, no dictionary, fastest compression
+    put_bits(&w, 0x78, 8);
+    put_bits(&w, 0x01, 8);
+    // single final block with fixed codes
+    put_bits(&w, 1, 1);
+    put_bits(&w, 1, 2);
+
+    size_t i = 0;
+    while (i < len && !w.overflow) {
+        int match_len = 0;
+        size_t match_pos = 0;
+        if (i + MIN_MATCH <= len) {
+            uint32_t h = hash3(in + i);
+            if (hash_head[h] != 0) {
+                match_pos = hash_head[h] - 1;
+                size_t max = len - i < MAX_MATCH ? len - i : MAX_MATCH;
+                if (i - match_pos <= DEFLATE_WINDOW) {
+                    while (match_len < (int) max && in[match_pos + match_len] == in[i + match_len]) {
+                        match_len++;
+                    }
+                }
+            }
+            hash_head[h] = i + 1;
+        }
+        if (match_len >= MIN_MATCH) {
+            put_match(&w, match_len, i - match_pos);
+            // keep the hash table up to date inside the match (cheap, improves later matches)
+            for (size_t j = i + 1; j < i + match_len && j + MIN_MATCH <= len; j++) {
+                hash_head[hash3(in + j)] = j + 1;
+            }
+            i += match_len;
+        } else {
+            put_symbol(&w, in[i]);
+            i++;
+        }
+    }
+    put_symbol(&w, END_OF_BLOCK);
+    // flush the last partial byte
+    put_bits(&w, 0, 7);
+    if (w.overflow) {
+        return 0;
+    }
+
+    uint32_t checksum = adler32(in, len);
+    out[w.pos++] = checksum >> 24;
+    out[w.pos++] = checksum >> 16;
+    out[w.pos++] = checksum >> 8;
+    out[w.pos++] = checksum;
+    return w.pos;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Compress in into a zlib stream (Content-Encoding: deflate) using fixed huffman codes.
+// Needs no heap and about DEFLATE_HASH_SIZE * 2 bytes of static state, matches reach back
+// at most DEFLATE_WINDOW bytes. Returns the compressed size, or 0 if it doesn't fit into room.
+// Not reentrant.
+size_t deflate_compress(const uint8_t* in, size_t len, uint8_t* out, size_t room);
+
+#define DEFLATE_HASH_BITS 10
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_WINDOW 32768
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "dlog.h"
+
+#define DLOG_TASK_STACK_SIZE 3072
+// below everything else, printing is what we want to keep out of the way
+#define DLOG_TASK_PRIORITY 1
+
+typedef struct {
+    const char* fmt;
+    uint32_t time_ms;
+    uint8_t level;
+    // -1 without a string
+    int8_t str_len;
+    // 32 bit on the chip, wide enough for the static strings on a 64 bit host too
+    uintptr_t args[DLOG_MAX_ARGS];
+    char str[DLOG_STR_MAX];
+} dlog_record_t;
+
+// written by the tasks on one core, so its lock is (almost) never contended by the other core;
+// the lock only keeps preempting writers on the same core and the log task apart
+typedef struct {
+    dlog_record_t slots[DLOG_RING_SLOTS];
+    // free running, head - tail records are waiting
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+    portMUX_TYPE lock;
+} dlog_ring_t;
+
+static dlog_ring_t dlog_rings[portNUM_PROCESSORS] = {
+    [0 ... portNUM_PROCESSORS - 1] = {.lock = portMUX_INITIALIZER_UNLOCKED},
+};
+
+static const char dlog_level_chars[] = {'?', 'E', 'W', 'I', 'D'};
+
+void dlog_write(int level, const char* fmt, const char* str, size_t str_len, int nargs, ...) {
+    uintptr_t args[DLOG_MAX_ARGS] = {0};
+    va_list ap;
+    va_start(ap, nargs);
+    for (int i = 0; i < nargs && i < DLOG_MAX_ARGS; i++) {
+        args[i] = va_arg(ap, uintptr_t);
+    }
+    va_end(ap);
+    uint32_t time_ms = esp_timer_get_time() / 1000;
+    if (str != NULL && str_len > DLOG_STR_MAX) {
+        str_len = DLOG_STR_MAX;
+    }
+
+    // a task moved to the other core meanwhile just writes into the ring of its old core
+    dlog_ring_t* ring = &dlog_rings[xPortGetCoreID()];
+    portENTER_CRITICAL(&ring->lock);
+    if (ring->head - ring->tail >= DLOG_RING_SLOTS) {
+        ring->dropped++;
+    } else {
+        dlog_record_t* record = &ring->slots[ring->head % DLOG_RING_SLOTS];
+        record->fmt = fmt;
+        record->time_ms = time_ms;
+        record->level = level;
+        record->str_len = str != NULL ? (int8_t) str_len : -1;
+        memcpy(record->args, args, sizeof(args));
+        if (str != NULL) {
+            memcpy(record->str, str, str_len);
+        }
+        ring->head++;
+    }
+    portEXIT_CRITICAL(&ring->lock);
+}
+
+uint32_t dlog_dropped(void) {
+    uint32_t dropped = 0;
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        dropped += dlog_rings[i].dropped;
+    }
+    return dropped;
+}
+
+// Take the oldest waiting record of all rings, returns false if there is none
+static bool dlog_take(dlog_record_t* out) {
+    dlog_ring_t* oldest = NULL;
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        dlog_ring_t* ring = &dlog_rings[i];
+        portENTER_CRITICAL(&ring->lock);
+        bool waiting = ring->head != ring->tail;
+        uint32_t time_ms = ring->slots[ring->tail % DLOG_RING_SLOTS].time_ms;
+        portEXIT_CRITICAL(&ring->lock);
+        // only the log task moves tail, so the record stays where it is
+        if (waiting && (oldest == NULL || (int32_t) (time_ms - oldest->slots[oldest->tail % DLOG_RING_SLOTS].time_ms) < 0)) {
+            oldest = ring;
+        }
+    }
+    if (oldest == NULL) {
+        return false;
+    }
+    portENTER_CRITICAL(&oldest->lock);
+    *out = oldest->slots[oldest->tail % DLOG_RING_SLOTS];
+    oldest->tail++;
+    portEXIT_CRITICAL(&oldest->lock);
+    return true;
+}
+
+static void dlog_print(const dlog_record_t* record) {
+    int level = record->level < sizeof(dlog_level_chars) ? record->level : 0;
+    printf("%c (%" PRIu32 ") ", dlog_level_chars[level], record->time_ms);
+    const uintptr_t* a = record->args;
+    if (record->str_len >= 0) {
+        printf(record->fmt, (int) record->str_len, record->str, a[0], a[1], a[2], a[3]);
+    } else {
+        printf(record->fmt, a[0], a[1], a[2], a[3]);
+    }
+}
+
+static void dlog_task(void* arg) {
+    uint32_t reported_dropped = 0;
+    dlog_record_t record;
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(DLOG_DRAIN_MS));
+        while (dlog_take(&record)) {
+            dlog_print(&record);
+        }
+        uint32_t dropped = dlog_dropped();
+        if (dropped != reported_dropped) {
+            printf("W (%" PRIu32 ") %" PRIu32 " log records dropped\n", (uint32_t) (esp_timer_get_time() / 1000), dropped - reported_dropped);
+            reported_dropped = dropped;
+        }
+    }
+}
+
+void dlog_start(void) {
+    xTaskCreate(dlog_task, "dlog", DLOG_TASK_STACK_SIZE, NULL, DLOG_TASK_PRIORITY, NULL);
+}
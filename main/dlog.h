@@ -0,0 +1,78 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Deferred logging for the bluetooth, wifi and http callbacks: a record is just the format, a time and
+// its args, written into a ring of the current core and formatted on a low priority task later
+
+#define DLOG_ERROR 1
+#define DLOG_WARN 2
+#define DLOG_INFO 3
+#define DLOG_DEBUG 4
+// records above this level are compiled out (e.g. -DDLOG_LEVEL=DLOG_WARN)
+#ifndef DLOG_LEVEL
+#define DLOG_LEVEL DLOG_INFO
+#endif
+#ifndef DLOG_PRINTF
+#define DLOG_PRINTF 0
+#endif
+
+// records per core, if a ring is full new records are dropped (and counted)
+#define DLOG_RING_SLOTS 32
+#define DLOG_MAX_ARGS 4
+// bytes of a string a record can carry a copy of, enough for an ssid
+#define DLOG_STR_MAX 32
+// how often the log task prints what was written
+#define DLOG_DRAIN_MS 50
+
+// number of (at most DLOG_MAX_ARGS) macro args
+#define DLOG_NARGS(...) DLOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define DLOG_NARGS_(_0, _1, _2, _3, _4, n, ...) n
+// the macro args, each with a comma in front and as the uintptr_t dlog_write takes it with va_arg
+#define DLOG_ARGS(...) DLOG_ARGS_N(DLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+#define DLOG_ARGS_N(n, ...) DLOG_ARGS_N_(n, ##__VA_ARGS__)
+#define DLOG_ARGS_N_(n, ...) DLOG_ARGS_##n(__VA_ARGS__)
+#define DLOG_ARGS_0()
+#define DLOG_ARGS_1(a) , (uintptr_t) (a)
+#define DLOG_ARGS_2(a, b) , (uintptr_t) (a), (uintptr_t) (b)
+#define DLOG_ARGS_3(a, b, c) , (uintptr_t) (a), (uintptr_t) (b), (uintptr_t) (c)
+#define DLOG_ARGS_4(a, b, c, d) , (uintptr_t) (a), (uintptr_t) (b), (uintptr_t) (c), (uintptr_t) (d)
+
+// the nargs args have to be uintptr_t, use the macros below
+void dlog_write(int level, const char* fmt, const char* str, size_t str_len, int nargs, ...);
+
+#if DLOG_PRINTF
+// -DDLOG_PRINTF=1 prints every record right away on the calling task, like ESP_LOGx did, to measure
+// what the callbacks save by deferring (sim_run_printf, see README)
+#include <stdio.h>
+#include <inttypes.h>
+#include "esp_timer.h"
+#define DLOG(level, fmt, ...) do { \
+        if ((level) <= DLOG_LEVEL) { \
+            printf("%c (%" PRIu32 ") " fmt, "?EWID"[level], (uint32_t) (esp_timer_get_time() / 1000), ##__VA_ARGS__); \
+        } \
+    } while (0)
+#define DLOG_STR(level, fmt, str, len, ...) DLOG(level, fmt, (int) (len), str, ##__VA_ARGS__)
+#else
+// Log fmt with up to DLOG_MAX_ARGS int or pointer args; strings only if they are static (like esp_err_to_name),
+// the args are formatted later
+#define DLOG(level, fmt, ...) do { \
+        if ((level) <= DLOG_LEVEL) { \
+            dlog_write(level, fmt, NULL, 0, DLOG_NARGS(__VA_ARGS__) DLOG_ARGS(__VA_ARGS__)); \
+        } \
+    } while (0)
+// Like DLOG, but copies (the first DLOG_STR_MAX bytes of) str, fmt has to start its args with %.*s for it
+#define DLOG_STR(level, fmt, str, len, ...) do { \
+        if ((level) <= DLOG_LEVEL) { \
+            dlog_write(level, fmt, str, len, DLOG_NARGS(__VA_ARGS__) DLOG_ARGS(__VA_ARGS__)); \
+        } \
+    } while (0)
+#endif
+
+// Log that a secret of len bytes was received, never its value
+#define DLOG_SECRET(level, what, len) DLOG(level, "%s: <%d bytes redacted>\n", what, (int) (len))
+
+// records dropped so far because their ring was full
+uint32_t dlog_dropped(void);
+// Start the task printing the records, records written before are kept until then
+void dlog_start(void);
@@ -0,0 +1,128 @@
+#include <string.h>
+
+#include "frame.h"
+
+#define WIRE_VARINT 0
+#define WIRE_BYTES 2
+
+#define FIELD_DEVICE_ID 1
+#define FIELD_BOOT 2
+#define FIELD_SEQ 3
+#define FIELD_TIMESTAMP 4
+#define FIELD_PAYLOAD 5
+
+#define KEY(field, wire) (((field) << 3) | (wire))
+
+size_t frame_put_varint(uint8_t* out, size_t room, uint64_t value) {
+    size_t n = 0;
+    do {
+        if (n == room) {
+            return 0;
+        }
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out[n++] = value ? byte | 0x80 : byte;
+    } while (value);
+    return n;
+}
+
+bool frame_get_varint(const uint8_t* in, size_t len, size_t* pos, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len) {
+            return false;
+        }
+        uint8_t byte = in[(*pos)++];
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t put_varint_field(uint8_t* out, size_t room, int field, uint64_t value) {
+    size_t key = frame_put_varint(out, room, KEY(field, WIRE_VARINT));
+    size_t val = key ? frame_put_varint(out + key, room - key, value) : 0;
+    return val ? key + val : 0;
+}
+
+static size_t put_bytes_field(uint8_t* out, size_t room, int field, const uint8_t* data, size_t len) {
+    size_t key = frame_put_varint(out, room, KEY(field, WIRE_BYTES));
+    size_t prefix = key ? frame_put_varint(out + key, room - key, len) : 0;
+    if (!prefix || key + prefix + len > room) {
+        return 0;
+    }
+    memcpy(out + key + prefix, data, len);
+    return key + prefix + len;
+}
+
+size_t frame_encode(const frame_t* frame, uint8_t* out, size_t room) {
+    size_t pos = 0;
+    size_t n;
+    if (frame->device_id_len > 0) {
+        if (!(n = put_bytes_field(out + pos, room - pos, FIELD_DEVICE_ID, frame->device_id, frame->device_id_len))) {
+            return 0;
+        }
+        pos += n;
+    }
+    if (!(n = put_varint_field(out + pos, room - pos, FIELD_BOOT, frame->boot))) {
+        return 0;
+    }
+    pos += n;
+    if (!(n = put_varint_field(out + pos, room - pos, FIELD_SEQ, frame->seq))) {
+        return 0;
+    }
+    pos += n;
+    if (!(n = put_varint_field(out + pos, room - pos, FIELD_TIMESTAMP, frame->timestamp_ms))) {
+        return 0;
+    }
+    pos += n;
+    if (!(n = put_bytes_field(out + pos, room - pos, FIELD_PAYLOAD, frame->payload, frame->payload_len))) {
+        return 0;
+    }
+    return pos + n;
+}
+
+bool frame_decode(const uint8_t* in, size_t len, frame_t* frame) {
+    memset(frame, 0, sizeof(*frame));
+    size_t pos = 0;
+    bool has_payload = false;
+    while (pos < len) {
+        uint64_t key;
+        uint64_t value;
+        if (!frame_get_varint(in, len, &pos, &key) || !frame_get_varint(in, len, &pos, &value)) {
+            return false;
+        }
+        int field = key >> 3;
+        switch (key & 0x7) {
+            case WIRE_VARINT:
+                if (field == FIELD_BOOT) {
+                    frame->boot = value;
+                } else if (field == FIELD_SEQ) {
+                    frame->seq = value;
+                } else if (field == FIELD_TIMESTAMP) {
+                    frame->timestamp_ms = value;
+                }
+                break;
+            case WIRE_BYTES:
+                if (value > len - pos) {
+                    return false;
+                }
+                if (field == FIELD_DEVICE_ID && value <= UINT8_MAX) {
+                    frame->device_id = in + pos;
+                    frame->device_id_len = value;
+                } else if (field == FIELD_PAYLOAD && value <= UINT16_MAX) {
+                    frame->payload = in + pos;
+                    frame->payload_len = value;
+                    has_payload = true;
+                }
+                pos += value;
+                break;
+            default:
+                return false;
+        }
+    }
+    return has_payload;
+}
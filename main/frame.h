@@ -0,0 +1,30 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// first byte of a binary record written to the message characteristic, never valid in utf-8 text
+#define FRAME_MAGIC 0xF5
+#define FRAME_DEVICE_ID_LEN 6
+
+// Binary message record, encoded as protobuf-compatible varint TLV:
+//   1: device id (bytes), 2: boot id (varint), 3: sequence number (varint),
+//   4: timestamp in ms (varint), 5: payload (bytes)
+// Fields may be missing (a client only needs to send the payload) and unknown fields are skipped.
+typedef struct {
+    const uint8_t* device_id;
+    uint8_t device_id_len;
+    uint32_t boot;
+    uint32_t seq;
+    uint64_t timestamp_ms;
+    const uint8_t* payload;
+    uint16_t payload_len;
+} frame_t;
+
+// Encode frame into out, returns the number of bytes written or 0 if it doesn't fit
+size_t frame_encode(const frame_t* frame, uint8_t* out, size_t room);
+// Decode a record, the pointers in frame point into in; returns false for malformed records
+bool frame_decode(const uint8_t* in, size_t len, frame_t* frame);
+size_t frame_put_varint(uint8_t* out, size_t room, uint64_t value);
+// Read a varint at *pos, advancing it; returns false if it is truncated or too long
+bool frame_get_varint(const uint8_t* in, size_t len, size_t* pos, uint64_t* value);
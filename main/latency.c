@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "latency.h"
+#include "frame.h"
+
+static latency_hist_t latency_hists[LATENCY_STAGES];
+// recorded on the uplink task, read on the bluetooth task
+static portMUX_TYPE latency_lock = portMUX_INITIALIZER_UNLOCKED;
+
+uint32_t latency_now_ms(void) {
+    return esp_timer_get_time() / 1000;
+}
+
+static int latency_bucket(uint32_t ms) {
+    // number of significant bits, so 2^(i-1) <= ms < 2^i lands in bucket i
+    int bucket = ms == 0 ? 0 : 32 - __builtin_clz(ms);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+void latency_record(latency_stage_t stage, uint32_t ms) {
+    int bucket = latency_bucket(ms);
+    portENTER_CRITICAL(&latency_lock);
+    latency_hist_t* hist = &latency_hists[stage];
+    hist->count++;
+    hist->buckets[bucket]++;
+    if (ms > hist->max_ms) {
+        hist->max_ms = ms;
+    }
+    portEXIT_CRITICAL(&latency_lock);
+}
+
+void latency_record_since(latency_stage_t stage, uint32_t start_ms) {
+    latency_record(stage, latency_now_ms() - start_ms);
+}
+
+static size_t put_saturated(uint8_t* out, size_t room, uint32_t value) {
+    return frame_put_varint(out, room, value < LATENCY_ENCODED_LIMIT ? value : LATENCY_ENCODED_LIMIT);
+}
+
+size_t latency_encode(uint8_t* out, size_t size) {
+    size_t pos = 0;
+    // a few hundred bytes of varints, short enough to encode under the lock
+    portENTER_CRITICAL(&latency_lock);
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        const latency_hist_t* hist = &latency_hists[i];
+        if (size - pos < (LATENCY_BUCKETS + 2) * LATENCY_VARINT_MAX) {
+            break;
+        }
+        pos += put_saturated(out + pos, size - pos, hist->count);
+        pos += put_saturated(out + pos, size - pos, hist->max_ms);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            pos += put_saturated(out + pos, size - pos, hist->buckets[b]);
+        }
+    }
+    portEXIT_CRITICAL(&latency_lock);
+    return pos;
+}
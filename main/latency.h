@@ -0,0 +1,44 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Stages a message (or the post carrying it) goes through, each with its own histogram
+typedef enum {
+    // write received -> taken from the uplink queue
+    LATENCY_QUEUE,
+    // write received -> post of its batch starts (queue, batching and waiting for wifi)
+    LATENCY_DEVICE,
+    // waiting for wifi before a post
+    LATENCY_WIFI,
+    // setting up the (tls) connection of a post, only if it wasn't kept alive
+    LATENCY_CONNECT,
+    // post started -> request headers sent
+    LATENCY_REQUEST,
+    // request headers sent -> response complete
+    LATENCY_RESPONSE,
+    // write received -> batch posted, spooled messages aren't counted
+    LATENCY_TOTAL,
+    LATENCY_STAGES,
+} latency_stage_t;
+
+// bucket 0 counts latencies below 1 ms, bucket i those from 2^(i-1) up to 2^i ms, the last one everything above
+#define LATENCY_BUCKETS 16
+// per stage: count, max and the buckets as varints of at most 4 bytes, larger values are reported as
+// LATENCY_ENCODED_LIMIT, so the snapshot stays within the 512 bytes an attribute can have
+#define LATENCY_VARINT_MAX 4
+#define LATENCY_ENCODED_LIMIT ((1u << (7 * LATENCY_VARINT_MAX)) - 1)
+#define LATENCY_ENCODED_MAX (LATENCY_STAGES * (LATENCY_BUCKETS + 2) * LATENCY_VARINT_MAX)
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_ms;
+    uint32_t buckets[LATENCY_BUCKETS];
+} latency_hist_t;
+
+// ms since boot, the unit of every timestamp passed in here
+uint32_t latency_now_ms(void);
+void latency_record(latency_stage_t stage, uint32_t ms);
+// Record the time from start_ms (ms since boot) until now
+void latency_record_since(latency_stage_t stage, uint32_t start_ms);
+// Encode a snapshot of all histograms into out, returns its length
+size_t latency_encode(uint8_t* out, size_t size);
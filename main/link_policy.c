@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include "link_policy.h"
+
+void link_policy_init(link_policy_t* policy, uint32_t idle_ms, uint32_t now_ms) {
+    memset(policy, 0, sizeof(*policy));
+    policy->idle_ms = idle_ms;
+    policy->wifi = true;
+    policy->adv = LINK_PROFILE_ACTIVE;
+    policy->conn = LINK_PROFILE_ACTIVE;
+    policy->last_activity_ms = now_ms;
+    policy->adv_active_since_ms = now_ms;
+    policy->conn_active_ms = now_ms;
+    policy->last_ms = now_ms;
+}
+
+// Add the energy of the time since the last update, in the state the link was in meanwhile
+static void account(link_policy_t* policy, const link_inputs_t* in) {
+    uint32_t ma = LINK_MA_BASE + in->centrals * (policy->conn == LINK_PROFILE_ACTIVE ? LINK_MA_CENTRAL_ACTIVE : LINK_MA_CENTRAL_IDLE);
+    if (in->ip) {
+        ma += LINK_MA_WIFI;
+    }
+    if (in->advertising) {
+        ma += policy->adv == LINK_PROFILE_ACTIVE ? LINK_MA_ADV_ACTIVE : LINK_MA_ADV_IDLE;
+    }
+    // mA * V * ms = uJ
+    policy->energy_uj += (uint64_t) ma * (in->now_ms - policy->last_ms) * 33 / 10;
+    policy->last_ms = in->now_ms;
+    policy->delivered += in->delivered;
+}
+
+static bool wake_due(const link_policy_t* policy, const link_inputs_t* in) {
+    if (in->waiting >= LINK_WAKE_DEPTH) {
+        return true;
+    }
+    if (in->waiting > 0 && in->oldest_ms >= LINK_WAKE_HOLD_MS) {
+        return true;
+    }
+    return in->spooled && in->now_ms - policy->parked_ms >= LINK_WAKE_HOLD_MS;
+}
+
+static void decide_wifi(link_policy_t* policy, const link_inputs_t* in, link_decision_t* decision) {
+    if (in->delivered > 0 || in->waiting > 0) {
+        policy->last_activity_ms = in->now_ms;
+    }
+    if (!policy->wifi) {
+        if (in->ip) {
+            // connected without us (new credentials from bluetooth), it is torn down again once idle
+            policy->wifi = true;
+            policy->last_activity_ms = in->now_ms;
+        } else if (wake_due(policy, in)) {
+            policy->wifi = true;
+            policy->last_activity_ms = in->now_ms;
+            policy->wakes++;
+            policy->energy_uj += LINK_WAKE_UJ;
+            decision->wifi_changed = true;
+        }
+        return;
+    }
+    if (policy->idle_ms > 0 && in->waiting == 0 && !in->spooled
+        && in->now_ms - policy->last_activity_ms >= policy->idle_ms) {
+        policy->wifi = false;
+        policy->parked_ms = in->now_ms;
+        policy->parks++;
+        decision->wifi_changed = true;
+    }
+}
+
+static void decide_conn(link_policy_t* policy, const link_inputs_t* in, link_decision_t* decision) {
+    // a central that just connected or sends messages gets short intervals, quiet ones save power on both sides
+    if (in->centrals > policy->centrals || in->delivered > 0 || in->waiting > 0) {
+        policy->conn_active_ms = in->now_ms;
+        if (policy->conn != LINK_PROFILE_ACTIVE) {
+            policy->conn = LINK_PROFILE_ACTIVE;
+            decision->conn_changed = true;
+        }
+    } else if (policy->conn == LINK_PROFILE_ACTIVE && in->now_ms - policy->conn_active_ms >= LINK_CONN_ACTIVE_MS) {
+        policy->conn = LINK_PROFILE_IDLE;
+        decision->conn_changed = true;
+    }
+}
+
+static void decide_adv(link_policy_t* policy, const link_inputs_t* in, link_decision_t* decision) {
+    // a central that left may come back soon, so it should find us quickly
+    if (in->centrals < policy->centrals) {
+        policy->adv_active_since_ms = in->now_ms;
+        if (policy->adv != LINK_PROFILE_ACTIVE) {
+            policy->adv = LINK_PROFILE_ACTIVE;
+            decision->adv_changed = true;
+        }
+    }
+    policy->centrals = in->centrals;
+    if (policy->adv == LINK_PROFILE_ACTIVE && in->now_ms - policy->adv_active_since_ms >= LINK_ADV_ACTIVE_MS) {
+        policy->adv = LINK_PROFILE_IDLE;
+        decision->adv_changed = true;
+    }
+}
+
+link_decision_t link_policy_update(link_policy_t* policy, const link_inputs_t* in) {
+    link_decision_t decision = {0};
+    account(policy, in);
+    decide_wifi(policy, in, &decision);
+    // before decide_adv, which takes the new number of centrals
+    decide_conn(policy, in, &decision);
+    decide_adv(policy, in, &decision);
+    decision.wifi = policy->wifi;
+    decision.adv = policy->adv;
+    decision.conn = policy->conn;
+    return decision;
+}
+
+bool link_policy_holding(const link_policy_t* policy) {
+    return !policy->wifi;
+}
+
+uint32_t link_policy_energy_per_message(const link_policy_t* policy) {
+    if (policy->delivered == 0) {
+        return 0;
+    }
+    return policy->energy_uj / policy->delivered;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// wifi is disconnected once nothing was sent for this long (and nothing waits), 0 keeps it up
+#define LINK_WIFI_IDLE_MS CONFIG_LINK_WIFI_IDLE_MS
+// while wifi is down, messages are held until this many wait
+#define LINK_WAKE_DEPTH 8
+// or the oldest of them (or spooled batches) waited this long
+#define LINK_WAKE_HOLD_MS 5000
+// advertise fast for this long after boot and after a central left, slowly afterwards
+#define LINK_ADV_ACTIVE_MS 30000
+// connections keep the active interval this long after a central connected or sent a message, then
+// they get the idle one (see conn.h for the intervals)
+#define LINK_CONN_ACTIVE_MS 10000
+
+// advertising intervals (units of 0.625 ms) of both profiles
+#define LINK_ADV_ACTIVE_MIN_INT 0x20
+#define LINK_ADV_ACTIVE_MAX_INT 0x40
+#define LINK_ADV_IDLE_MIN_INT 0x640
+#define LINK_ADV_IDLE_MAX_INT 0x780
+
+// rough average currents (mA at 3.3 V) for the energy estimate, good for comparing policies,
+// not for absolute numbers: cpu with frequency scaling, wifi connected in modem sleep, advertising
+#define LINK_MA_BASE 20
+#define LINK_MA_WIFI 25
+#define LINK_MA_ADV_ACTIVE 8
+#define LINK_MA_ADV_IDLE 1
+// connected centrals on the active and the idle connection interval (a third of the connection events)
+#define LINK_MA_CENTRAL_ACTIVE 2
+#define LINK_MA_CENTRAL_IDLE 1
+// a wake up: scan (or fast connect), association, dhcp and the first tls handshake
+#define LINK_WAKE_UJ 250000
+
+typedef enum {
+    LINK_PROFILE_ACTIVE,
+    LINK_PROFILE_IDLE,
+} link_profile_t;
+
+// What the uplink task sees in one round
+typedef struct {
+    uint32_t now_ms;
+    // messages queued or batched, not posted yet
+    int waiting;
+    // how long the oldest of them waits
+    uint32_t oldest_ms;
+    bool spooled;
+    // messages posted since the last update
+    uint32_t delivered;
+    bool ip;
+    int centrals;
+    // still advertising, i.e. not all connection slots are taken
+    bool advertising;
+} link_inputs_t;
+
+// Link policy, it only decides; the caller brings wifi up or down and applies the advertising and
+// connection profiles
+typedef struct {
+    uint32_t idle_ms;
+    bool wifi;
+    link_profile_t adv;
+    link_profile_t conn;
+    uint32_t last_activity_ms;
+    // when advertising went active, boot or the last central leaving
+    uint32_t adv_active_since_ms;
+    // the last central connecting or message, the connections go idle LINK_CONN_ACTIVE_MS after it
+    uint32_t conn_active_ms;
+    // when wifi went down, spooled batches are held at most LINK_WAKE_HOLD_MS from there
+    uint32_t parked_ms;
+    int centrals;
+    // energy estimate since boot
+    uint32_t last_ms;
+    uint64_t energy_uj;
+    uint32_t delivered;
+    uint32_t wakes;
+    uint32_t parks;
+} link_policy_t;
+
+typedef struct {
+    // wifi wanted, and whether that changed with this update
+    bool wifi;
+    bool wifi_changed;
+    link_profile_t adv;
+    bool adv_changed;
+    link_profile_t conn;
+    bool conn_changed;
+} link_decision_t;
+
+// Start with wifi wanted (it is connected at boot), advertising and connections active
+void link_policy_init(link_policy_t* policy, uint32_t idle_ms, uint32_t now_ms);
+link_decision_t link_policy_update(link_policy_t* policy, const link_inputs_t* in);
+// Whether messages are held back instead of waking wifi for them
+bool link_policy_holding(const link_policy_t* policy);
+// Estimated energy per delivered message (in microjoules), 0 before the first one
+uint32_t link_policy_energy_per_message(const link_policy_t* policy);
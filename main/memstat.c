@@ -0,0 +1,69 @@
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+
+#include "memstat.h"
+#include "frame.h"
+
+static memstat_t memstats[MEMSTAT_STAGES];
+// lowest free heap since boot at the last sample
+static uint32_t memstat_low = UINT32_MAX;
+// sampled on the bluetooth, event and uplink tasks, read on the bluetooth and uplink tasks
+static portMUX_TYPE memstat_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void memstat_sample(memstat_stage_t stage) {
+    // the heap functions take their own locks, so they are called before ours
+    uint32_t free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    uint32_t low = esp_get_minimum_free_heap_size();
+    // in bytes on the esp32, despite the name
+    uint32_t stack = uxTaskGetStackHighWaterMark(NULL);
+
+    portENTER_CRITICAL(&memstat_lock);
+    memstat_t* stat = &memstats[stage];
+    if (stat->samples == 0) {
+        stat->free_min = free;
+        stat->largest_min = largest;
+        stat->stack_min = stack;
+    }
+    stat->samples++;
+    if (free < stat->free_min) {
+        stat->free_min = free;
+    }
+    if (largest < stat->largest_min) {
+        stat->largest_min = largest;
+    }
+    if (stack < stat->stack_min) {
+        stat->stack_min = stack;
+    }
+    if (low < memstat_low) {
+        // the first sample only finds the low of the boot
+        if (memstat_low != UINT32_MAX) {
+            stat->new_lows++;
+        }
+        memstat_low = low;
+    }
+    portEXIT_CRITICAL(&memstat_lock);
+}
+
+size_t memstat_encode(uint8_t* out, size_t size) {
+    uint32_t low = esp_get_minimum_free_heap_size();
+    size_t pos = 0;
+    if (size < MEMSTAT_ENCODED_MAX) {
+        return 0;
+    }
+    portENTER_CRITICAL(&memstat_lock);
+    for (int i = 0; i < MEMSTAT_STAGES; i++) {
+        const memstat_t* stat = &memstats[i];
+        pos += frame_put_varint(out + pos, size - pos, stat->samples);
+        pos += frame_put_varint(out + pos, size - pos, stat->free_min);
+        pos += frame_put_varint(out + pos, size - pos, stat->largest_min);
+        pos += frame_put_varint(out + pos, size - pos, stat->stack_min);
+        pos += frame_put_varint(out + pos, size - pos, stat->new_lows);
+    }
+    portEXIT_CRITICAL(&memstat_lock);
+    pos += frame_put_varint(out + pos, size - pos, low);
+    return pos;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Points in the pipeline at which memory is sampled, each keeps its own minima
+typedef enum {
+    // a write was handled (bluetooth task)
+    MEMSTAT_BLE_WRITE,
+    // wifi associated / got an ip (event task)
+    MEMSTAT_WIFI_CONNECT,
+    // the (tls) connection of a post was set up (uplink task)
+    MEMSTAT_TLS_HANDSHAKE,
+    // a post finished (uplink task)
+    MEMSTAT_POST,
+    MEMSTAT_STAGES,
+} memstat_stage_t;
+
+// per stage: samples, free heap, largest free block, stack high-water mark and new lows as varints,
+// followed by the lowest free heap since boot
+#define MEMSTAT_ENCODED_MAX (MEMSTAT_STAGES * 5 * 5 + 5)
+
+typedef struct {
+    uint32_t samples;
+    // lowest free heap and largest free block (bytes) seen at the end of the stage
+    uint32_t free_min;
+    uint32_t largest_min;
+    // least unused stack (bytes) of the task running the stage
+    uint32_t stack_min;
+    // how often the lowest free heap since boot dropped since the sample before, so the stage was
+    // (most likely) the one that took the heap to a new low
+    uint32_t new_lows;
+} memstat_t;
+
+// Sample heap and the stack of the calling task at the end of stage
+void memstat_sample(memstat_stage_t stage);
+// Encode a snapshot of all stages into out, returns its length
+size_t memstat_encode(uint8_t* out, size_t size);
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+
+#include "msg_pool.h"
+
+static msg_buf_t msg_pool[MSG_POOL_SIZE];
+static int msg_pool_used = 0;
+static int msg_pool_max_used = 0;
+// buffers are taken on the bluetooth task and returned on the uplink task
+static portMUX_TYPE msg_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+msg_buf_t* msg_pool_alloc(void) {
+    msg_buf_t* buf = NULL;
+    portENTER_CRITICAL(&msg_pool_lock);
+    for (int i = 0; i < MSG_POOL_SIZE; i++) {
+        if (msg_pool[i].refs == 0) {
+            buf = &msg_pool[i];
+            buf->refs = 1;
+            buf->len = 0;
+            msg_pool_used++;
+            if (msg_pool_used > msg_pool_max_used) {
+                msg_pool_max_used = msg_pool_used;
+            }
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&msg_pool_lock);
+    return buf;
+}
+
+void msg_buf_ref(msg_buf_t* buf) {
+    portENTER_CRITICAL(&msg_pool_lock);
+    buf->refs++;
+    portEXIT_CRITICAL(&msg_pool_lock);
+}
+
+void msg_buf_unref(msg_buf_t* buf) {
+    portENTER_CRITICAL(&msg_pool_lock);
+    buf->refs--;
+    if (buf->refs == 0) {
+        msg_pool_used--;
+    }
+    portEXIT_CRITICAL(&msg_pool_lock);
+}
+
+char* msg_buf_str(msg_buf_t* buf) {
+    buf->data[buf->len] = '\0';
+    return (char*) buf->data;
+}
+
+int msg_pool_in_use(void) {
+    return msg_pool_used;
+}
+
+int msg_pool_peak(void) {
+    return msg_pool_max_used;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+
+// buffers shared by incoming writes, pending long writes and the uplink queue
+#define MSG_POOL_SIZE 12
+// largest message (or other value) a client can write
+#define MSG_BUF_SIZE 1024
+
+// Refcounted message buffer, handed around by pointer from the gatts handler to the uplink task
+typedef struct {
+    uint16_t len;
+    uint8_t refs;
+    // ms since boot when the value was complete
+    uint32_t received_ms;
+    // uplink sequence number, assigned when the message is queued
+    uint32_t seq;
+    // connection the message was written on
+    uint16_t conn_id;
+    // one spare byte, so the value can be terminated in place
+    uint8_t data[MSG_BUF_SIZE + 1];
+} msg_buf_t;
+
+// Take a buffer from the pool with a single reference, NULL if all are in use
+msg_buf_t* msg_pool_alloc(void);
+void msg_buf_ref(msg_buf_t* buf);
+// Drop a reference, the buffer goes back to the pool with the last one
+void msg_buf_unref(msg_buf_t* buf);
+// Terminate the value and return it as string
+char* msg_buf_str(msg_buf_t* buf);
+int msg_pool_in_use(void);
+// highest number of buffers in use at once
+int msg_pool_peak(void);
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "prep_write.h"
+
+static prep_write_t prep_writes[PREP_WRITE_MAX_ENTRIES];
+
+prep_write_t* prep_write_get(uint16_t conn_id, esp_gatt_if_t gatts_if, bool create) {
+    prep_write_t* free_entry = NULL;
+    for (int i = 0; i < PREP_WRITE_MAX_ENTRIES; i++) {
+        prep_write_t* prep = &prep_writes[i];
+        if (prep->in_use && prep->conn_id == conn_id && prep->gatts_if == gatts_if) {
+            return prep;
+        }
+        if (!prep->in_use && free_entry == NULL) {
+            free_entry = prep;
+        }
+    }
+    if (!create || free_entry == NULL) {
+        return NULL;
+    }
+    free_entry->buf = msg_pool_alloc();
+    if (free_entry->buf == NULL) {
+        printf("No buffer left for long write\n");
+        return NULL;
+    }
+    free_entry->in_use = true;
+    free_entry->conn_id = conn_id;
+    free_entry->gatts_if = gatts_if;
+    free_entry->handle = 0;
+    memset(free_entry->received, 0, sizeof(free_entry->received));
+    return free_entry;
+}
+
+// Check a fragment against the pending long write
+static esp_gatt_status_t prep_write_validate(const prep_write_t* prep, uint16_t handle, uint16_t offset, uint16_t len) {
+    if (offset > PREPARE_BUF_MAX_SIZE) {
+        return ESP_GATT_INVALID_OFFSET;
+    }
+    if (offset + len > PREPARE_BUF_MAX_SIZE) {
+        return ESP_GATT_INVALID_ATTR_LEN;
+    }
+    // we only queue fragments of a single attribute at a time
+    if (prep->handle != 0 && prep->handle != handle) {
+        return ESP_GATT_PREPARE_Q_FULL;
+    }
+    return ESP_GATT_OK;
+}
+
+esp_gatt_status_t prep_write_add(prep_write_t* prep, uint16_t handle, uint16_t offset, const uint8_t* value, uint16_t len) {
+    esp_gatt_status_t status = prep_write_validate(prep, handle, offset, len);
+    if (status != ESP_GATT_OK) {
+        // the client gets an error for it, the next long write mustn't run into its fragments
+        prep_write_release(prep);
+        return status;
+    }
+    prep->handle = handle;
+
+    memcpy(prep->buf->data + offset, value, len);
+    for (uint16_t i = offset; i < offset + len; i++) {
+        prep->received[i / 8] |= 1 << (i % 8);
+    }
+    if (offset + len > prep->buf->len) {
+        prep->buf->len = offset + len;
+    }
+    return ESP_GATT_OK;
+}
+
+esp_gatt_status_t prep_write_check(const prep_write_t* prep) {
+    for (uint16_t i = 0; i < prep->buf->len; i++) {
+        if (!(prep->received[i / 8] & (1 << (i % 8)))) {
+            printf("Long write is missing byte %d\n", i);
+            return ESP_GATT_INVALID_OFFSET;
+        }
+    }
+    return ESP_GATT_OK;
+}
+
+void prep_write_release(prep_write_t* prep) {
+    msg_buf_unref(prep->buf);
+    prep->buf = NULL;
+    prep->in_use = false;
+}
+
+void prep_write_release_conn(uint16_t conn_id) {
+    for (int i = 0; i < PREP_WRITE_MAX_ENTRIES; i++) {
+        if (prep_writes[i].in_use && prep_writes[i].conn_id == conn_id) {
+            prep_write_release(&prep_writes[i]);
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_gatt_defs.h"
+
+#include "conn.h"
+#include "msg_pool.h"
+
+// largest value a client can write with a long (queued) write
+#define PREPARE_BUF_MAX_SIZE MSG_BUF_SIZE
+// one pending long write per connection, we register a single gatt interface
+#define PREP_WRITE_MAX_ENTRIES CONN_MAX
+
+// Fragments of a long write that are waiting for ESP_GATTS_EXEC_WRITE_EVT
+typedef struct {
+    bool in_use;
+    uint16_t conn_id;
+    esp_gatt_if_t gatts_if;
+    uint16_t handle;
+    // pooled buffer, its len is the end of the furthest fragment
+    msg_buf_t* buf;
+    // one bit per byte received, fragments may come in any order
+    uint8_t received[PREPARE_BUF_MAX_SIZE / 8];
+} prep_write_t;
+
+// Find the pending long write of the connection, a new one is started if create is set
+prep_write_t* prep_write_get(uint16_t conn_id, esp_gatt_if_t gatts_if, bool create);
+// Store a fragment; one that doesn't fit drops the whole long write (prep is released)
+esp_gatt_status_t prep_write_add(prep_write_t* prep, uint16_t handle, uint16_t offset, const uint8_t* value, uint16_t len);
+// Check that the fragments cover the whole value without gaps
+esp_gatt_status_t prep_write_check(const prep_write_t* prep);
+void prep_write_release(prep_write_t* prep);
+// Drop all pending long writes of a connection (on disconnect)
+void prep_write_release_conn(uint16_t conn_id);
@@ -0,0 +1,45 @@
+#include <inttypes.h>
+#include "esp_timer.h"
+
+#include "ready.h"
+#include "dlog.h"
+
+static EventGroupHandle_t ready_group;
+// bits that were set at least once, only changed under ready_lock
+static EventBits_t ready_seen = 0;
+static portMUX_TYPE ready_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// indexed by bit number
+static const char* const ready_phase_names[READY_PHASES] = {
+    "nvs", "wifi started", "ip", "bluetooth", "advertising", "uplink",
+};
+
+void ready_init(void) {
+    ready_group = xEventGroupCreate();
+}
+
+void ready_set(EventBits_t bits) {
+    uint32_t now_ms = esp_timer_get_time() / 1000;
+    portENTER_CRITICAL(&ready_lock);
+    EventBits_t first = bits & ~ready_seen;
+    ready_seen |= bits;
+    portEXIT_CRITICAL(&ready_lock);
+    xEventGroupSetBits(ready_group, bits);
+    for (int i = 0; i < READY_PHASES; i++) {
+        if (first & (1 << i)) {
+            DLOG(DLOG_INFO, "Boot phase %s: %" PRIu32 " ms\n", ready_phase_names[i], now_ms);
+        }
+    }
+}
+
+void ready_clear(EventBits_t bits) {
+    xEventGroupClearBits(ready_group, bits);
+}
+
+EventBits_t ready_get(void) {
+    return xEventGroupGetBits(ready_group);
+}
+
+bool ready_wait(EventBits_t bits, TickType_t timeout) {
+    return (xEventGroupWaitBits(ready_group, bits, pdFALSE, pdTRUE, timeout) & bits) == bits;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_bit_defs.h"
+
+// Readiness of the subsystems, all but READY_IP_BIT stay set once they are
+// credentials loaded from nvs
+#define READY_NVS_BIT BIT0
+// wifi driver started (WIFI_EVENT_STA_START)
+#define READY_WIFI_BIT BIT1
+// got an ip, cleared again when the connection is lost
+#define READY_IP_BIT BIT2
+// gatt service created and started
+#define READY_BLUETOOTH_BIT BIT3
+// advertising, so centrals can connect
+#define READY_ADVERTISING_BIT BIT4
+// uplink task running
+#define READY_UPLINK_BIT BIT5
+#define READY_PHASES 6
+
+// Create the event group, before any other ready_ call
+void ready_init(void);
+// Set bits, the first time a bit is set its time since boot is logged as boot phase
+void ready_set(EventBits_t bits);
+void ready_clear(EventBits_t bits);
+EventBits_t ready_get(void);
+// Wait until all of bits are set, returns whether they were within timeout
+bool ready_wait(EventBits_t bits, TickType_t timeout);
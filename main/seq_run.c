@@ -0,0 +1,71 @@
+#include <stddef.h>
+
+#include "seq_run.h"
+
+void seq_runs_init(seq_runs_t* runs, seq_run_t* storage, int max) {
+    runs->runs = storage;
+    runs->max = max;
+    runs->count = 0;
+}
+
+void seq_runs_reset(seq_runs_t* runs) {
+    runs->count = 0;
+}
+
+static bool add_run(seq_runs_t* runs, const seq_run_t* run) {
+    // runs of the slot this one continues and that continue it, messages of the slot can be added
+    // out of order (samples come with their summary), so it may close the gap between two runs
+    seq_run_t* before = NULL;
+    seq_run_t* after = NULL;
+    for (int i = 0; i < runs->count; i++) {
+        seq_run_t* other = &runs->runs[i];
+        if (other->slot != run->slot) {
+            continue;
+        }
+        if (other->last == run->prev) {
+            before = other;
+        } else if (other->prev == run->last) {
+            after = other;
+        }
+    }
+    if (before != NULL && after != NULL) {
+        before->last = after->last;
+        *after = runs->runs[--runs->count];
+    } else if (before != NULL) {
+        before->last = run->last;
+    } else if (after != NULL) {
+        after->first = run->first;
+        after->prev = run->prev;
+    } else if (runs->count < runs->max) {
+        runs->runs[runs->count++] = *run;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool seq_runs_add(seq_runs_t* runs, int slot, uint32_t prev, uint32_t seq) {
+    seq_run_t run = {
+        .slot = slot,
+        .prev = prev,
+        .first = seq,
+        .last = seq,
+    };
+    return add_run(runs, &run);
+}
+
+bool seq_runs_merge(seq_runs_t* runs, const seq_runs_t* from) {
+    bool all = true;
+    for (int i = 0; i < from->count; i++) {
+        all = add_run(runs, &from->runs[i]) && all;
+    }
+    return all;
+}
+
+uint32_t seq_runs_conns(const seq_runs_t* runs) {
+    uint32_t conns = 0;
+    for (int i = 0; i < runs->count; i++) {
+        conns |= 1u << runs->runs[i].slot;
+    }
+    return conns;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Messages of one connection slot (see conn.h) whose sequence numbers follow each other in the order
+// the slot queued them. Sequence numbers are shared by all slots, so first..last also spans messages
+// of other connections; a status for the run covers exactly the messages of its own slot in there
+typedef struct {
+    uint8_t slot;
+    // sequence number of the message the slot queued before first, a message queued after last continues the run
+    uint32_t prev;
+    uint32_t first;
+    uint32_t last;
+} seq_run_t;
+
+// Runs of the messages of a batch (or of the spool), in fixed storage of the owner
+typedef struct {
+    seq_run_t* runs;
+    int max;
+    int count;
+} seq_runs_t;
+
+void seq_runs_init(seq_runs_t* runs, seq_run_t* storage, int max);
+void seq_runs_reset(seq_runs_t* runs);
+// Add message seq of slot, prev is the sequence number of the message the slot queued before it;
+// returns false if it neither continues nor precedes a run and there is no room for a new one
+bool seq_runs_add(seq_runs_t* runs, int slot, uint32_t prev, uint32_t seq);
+// Add all runs of from, returns false if some of them didn't fit (the others are kept)
+bool seq_runs_merge(seq_runs_t* runs, const seq_runs_t* from);
+// Bitmask of the slots that have runs
+uint32_t seq_runs_conns(const seq_runs_t* runs);
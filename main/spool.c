@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "spool.h"
+
+#define SPOOL_MAGIC 0x5350
+#define SPOOL_ERASED_MAGIC 0xFFFF
+#define SPOOL_NOT_CONSUMED 0xFFFFFFFF
+#define SPOOL_MAX_RECORD (SPOOL_SECTOR_SIZE - sizeof(spool_hdr_t))
+
+// Records never span sectors and are padded to 4 bytes
+typedef struct {
+    uint16_t magic;
+    uint16_t len;
+    uint32_t seq;
+    // crc32 over seq, len and the payload
+    uint32_t crc;
+    // written as 0 (without erasing) once the record was delivered
+    uint32_t consumed;
+} spool_hdr_t;
+
+typedef enum {
+    RECORD_VALID,
+    RECORD_ERASED,
+    RECORD_INVALID,
+} record_state_t;
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t record_size(uint16_t len) {
+    return sizeof(spool_hdr_t) + ((len + 3) & ~3u);
+}
+
+static uint32_t sector_of(uint32_t offset) {
+    return offset - offset % SPOOL_SECTOR_SIZE;
+}
+
+static uint32_t next_sector(const spool_t* spool, uint32_t offset) {
+    return (sector_of(offset) + SPOOL_SECTOR_SIZE) % spool->flash->size;
+}
+
+// Offset behind the record of len bytes at offset, the end of the last sector wraps to 0
+static uint32_t after_record(const spool_t* spool, uint32_t offset, uint16_t len) {
+    return (offset + record_size(len)) % spool->flash->size;
+}
+
+// Check that offset up to the end of its sector was never written, a record can only go there then
+static bool erased_to_sector_end(const spool_t* spool, uint32_t offset) {
+    uint8_t chunk[64];
+    uint32_t end = sector_of(offset) + SPOOL_SECTOR_SIZE;
+    while (offset < end) {
+        uint32_t n = end - offset < sizeof(chunk) ? end - offset : sizeof(chunk);
+        if (spool->flash->read(spool->flash->ctx, offset, chunk, n) != ESP_OK) {
+            return false;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (chunk[i] != 0xFF) {
+                return false;
+            }
+        }
+        offset += n;
+    }
+    return true;
+}
+
+// Read and check the header at offset, payload (if not NULL) has to hold at least hdr->len bytes
+static record_state_t read_record(const spool_t* spool, uint32_t offset, spool_hdr_t* hdr, uint8_t* payload) {
+    if (offset % SPOOL_SECTOR_SIZE + sizeof(spool_hdr_t) > SPOOL_SECTOR_SIZE) {
+        return RECORD_ERASED;
+    }
+    const spool_flash_t* flash = spool->flash;
+    if (flash->read(flash->ctx, offset, hdr, sizeof(*hdr)) != ESP_OK) {
+        return RECORD_INVALID;
+    }
+    if (hdr->magic == SPOOL_ERASED_MAGIC) {
+        return RECORD_ERASED;
+    }
+    if (hdr->magic != SPOOL_MAGIC || hdr->len > SPOOL_MAX_RECORD
+            || offset % SPOOL_SECTOR_SIZE + record_size(hdr->len) > SPOOL_SECTOR_SIZE) {
+        return RECORD_INVALID;
+    }
+
+    // the payload is checked in chunks, so the scan at boot doesn't need a sector sized buffer
+    uint8_t chunk[64];
+    uint32_t crc = crc32_update(0, (const uint8_t*) &hdr->seq, sizeof(hdr->seq));
+    crc = crc32_update(crc, (const uint8_t*) &hdr->len, sizeof(hdr->len));
+    for (uint16_t done = 0; done < hdr->len; ) {
+        uint16_t n = hdr->len - done;
+        if (n > sizeof(chunk)) {
+            n = sizeof(chunk);
+        }
+        uint8_t* dst = payload != NULL ? payload + done : chunk;
+        if (flash->read(flash->ctx, offset + sizeof(*hdr) + done, dst, n) != ESP_OK) {
+            return RECORD_INVALID;
+        }
+        crc = crc32_update(crc, dst, n);
+        done += n;
+    }
+    return crc == hdr->crc ? RECORD_VALID : RECORD_INVALID;
+}
+
+// Move pos forward to the next valid record (or head), skipping the unused end of sectors
+static void normalize(const spool_t* spool, spool_pos_t* pos) {
+    spool_hdr_t hdr;
+    for (uint32_t i = 0; i <= spool->flash->size / SPOOL_SECTOR_SIZE; i++) {
+        if (pos->offset == spool->head.offset || read_record(spool, pos->offset, &hdr, NULL) == RECORD_VALID) {
+            return;
+        }
+        pos->offset = next_sector(spool, pos->offset);
+    }
+    // only possible if the flash got corrupted underneath us
+    pos->offset = spool->head.offset;
+}
+
+esp_err_t spool_init(spool_t* spool, const spool_flash_t* flash) {
+    if (flash->size < 2 * SPOOL_SECTOR_SIZE || flash->size % SPOOL_SECTOR_SIZE != 0) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    spool->flash = flash;
+    spool->pending = 0;
+    spool->dropped = 0;
+    spool->next_seq = 1;
+
+    // the sector holding the newest record is where we continue writing
+    spool_hdr_t hdr;
+    bool found = false;
+    uint32_t head_sector = 0;
+    for (uint32_t sector = 0; sector < flash->size; sector += SPOOL_SECTOR_SIZE) {
+        uint32_t offset = sector;
+        while (offset < sector + SPOOL_SECTOR_SIZE && read_record(spool, offset, &hdr, NULL) == RECORD_VALID) {
+            if (!found || hdr.seq >= spool->next_seq) {
+                spool->next_seq = hdr.seq + 1;
+                head_sector = sector;
+                found = true;
+            }
+            offset += record_size(hdr.len);
+        }
+    }
+    if (!found) {
+        printf("Spool is empty, formatting first sector\n");
+        spool->head.offset = 0;
+        spool->tail.offset = 0;
+        return flash->erase_sector(flash->ctx, 0);
+    }
+
+    uint32_t offset = head_sector;
+    record_state_t state = RECORD_VALID;
+    while (offset < head_sector + SPOOL_SECTOR_SIZE && (state = read_record(spool, offset, &hdr, NULL)) == RECORD_VALID) {
+        offset += record_size(hdr.len);
+    }
+    // a full sector, or garbage after the last record (e.g. a torn write, whose payload made it
+    // to flash without its header) can't be written over, we continue in the next sector then
+    bool writable = offset < head_sector + SPOOL_SECTOR_SIZE && state == RECORD_ERASED && erased_to_sector_end(spool, offset);
+    spool->head.offset = writable ? offset : next_sector(spool, head_sector);
+    if (!writable) {
+        esp_err_t err = flash->erase_sector(flash->ctx, spool->head.offset);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    // the oldest sectors follow the head sector, the first record that wasn't consumed is the tail
+    bool tail_found = false;
+    uint32_t sector = next_sector(spool, head_sector);
+    for (uint32_t i = 0; i < flash->size / SPOOL_SECTOR_SIZE; i++) {
+        offset = sector;
+        while (offset < sector + SPOOL_SECTOR_SIZE && offset != spool->head.offset
+                && read_record(spool, offset, &hdr, NULL) == RECORD_VALID) {
+            if (hdr.consumed == SPOOL_NOT_CONSUMED) {
+                if (!tail_found) {
+                    spool->tail.offset = offset;
+                    tail_found = true;
+                }
+                spool->pending++;
+            }
+            offset += record_size(hdr.len);
+        }
+        sector = next_sector(spool, sector);
+    }
+    if (!tail_found) {
+        spool->tail = spool->head;
+    }
+    printf("Spool recovered, %lu records pending\n", (unsigned long) spool->pending);
+    return ESP_OK;
+}
+
+// Start writing in the next sector, dropping its records if the log is full
+static esp_err_t advance_head(spool_t* spool) {
+    uint32_t sector = next_sector(spool, spool->head.offset);
+    if (spool->pending > 0 && sector_of(spool->tail.offset) == sector) {
+        spool_hdr_t hdr;
+        uint32_t offset = spool->tail.offset;
+        while (offset < sector + SPOOL_SECTOR_SIZE && read_record(spool, offset, &hdr, NULL) == RECORD_VALID) {
+            spool->pending--;
+            spool->dropped++;
+            offset += record_size(hdr.len);
+        }
+        printf("Spool full, dropped oldest records (%lu so far)\n", (unsigned long) spool->dropped);
+        spool->tail.offset = next_sector(spool, sector);
+    }
+    esp_err_t err = spool->flash->erase_sector(spool->flash->ctx, sector);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (spool->pending == 0) {
+        spool->tail.offset = sector;
+    }
+    spool->head.offset = sector;
+    return ESP_OK;
+}
+
+esp_err_t spool_append(spool_t* spool, const void* data, uint16_t len) {
+    if (len > SPOOL_MAX_RECORD) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (spool->head.offset % SPOOL_SECTOR_SIZE + record_size(len) > SPOOL_SECTOR_SIZE) {
+        esp_err_t err = advance_head(spool);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    spool_hdr_t hdr = {
+        .magic = SPOOL_MAGIC,
+        .len = len,
+        .seq = spool->next_seq,
+        .consumed = SPOOL_NOT_CONSUMED,
+    };
+    hdr.crc = crc32_update(0, (const uint8_t*) &hdr.seq, sizeof(hdr.seq));
+    hdr.crc = crc32_update(hdr.crc, (const uint8_t*) &hdr.len, sizeof(hdr.len));
+    hdr.crc = crc32_update(hdr.crc, data, len);
+
+    // payload first, so a record whose header made it to flash is complete
+    const spool_flash_t* flash = spool->flash;
+    uint32_t offset = spool->head.offset;
+    esp_err_t err = flash->write(flash->ctx, offset + sizeof(hdr), data, len);
+    if (err == ESP_OK) {
+        err = flash->write(flash->ctx, offset, &hdr, sizeof(hdr));
+    }
+    if (err != ESP_OK) {
+        // continue in a fresh sector rather than writing over the broken record
+        advance_head(spool);
+        return err;
+    }
+    spool->next_seq++;
+    spool->pending++;
+    if ((offset + record_size(len)) % SPOOL_SECTOR_SIZE == 0) {
+        // the sector is full, the head must not point into the next one before it was erased
+        return advance_head(spool);
+    }
+    spool->head.offset = offset + record_size(len);
+    return ESP_OK;
+}
+
+esp_err_t spool_read(const spool_t* spool, const spool_pos_t* pos, void* buf, size_t size, uint16_t* len, spool_pos_t* next) {
+    spool_pos_t at = *pos;
+    normalize(spool, &at);
+    if (at.offset == spool->head.offset) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    spool_hdr_t hdr;
+    if (read_record(spool, at.offset, &hdr, NULL) != RECORD_VALID) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    if (hdr.len > size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (read_record(spool, at.offset, &hdr, buf) != RECORD_VALID) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    *len = hdr.len;
+    next->offset = after_record(spool, at.offset, hdr.len);
+    return ESP_OK;
+}
+
+esp_err_t spool_consume(spool_t* spool, const spool_pos_t* pos) {
+    const uint32_t consumed = 0;
+    spool_hdr_t hdr;
+    // pos is usually the next of spool_read, which may point to the unused end of a sector
+    spool_pos_t end = *pos;
+    normalize(spool, &end);
+    normalize(spool, &spool->tail);
+    while (spool->tail.offset != end.offset && spool->tail.offset != spool->head.offset) {
+        if (read_record(spool, spool->tail.offset, &hdr, NULL) != RECORD_VALID) {
+            // normalize only stops at valid records, so the flash changed underneath us
+            spool->tail.offset = next_sector(spool, spool->tail.offset);
+        } else {
+            // clearing bits doesn't need an erase
+            esp_err_t err = spool->flash->write(spool->flash->ctx, spool->tail.offset + offsetof(spool_hdr_t, consumed), &consumed, sizeof(consumed));
+            if (err != ESP_OK) {
+                return err;
+            }
+            spool->pending--;
+            spool->tail.offset = after_record(spool, spool->tail.offset, hdr.len);
+        }
+        normalize(spool, &spool->tail);
+    }
+    return ESP_OK;
+}
+
+bool spool_empty(const spool_t* spool) {
+    return spool->pending == 0;
+}
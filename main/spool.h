@@ -0,0 +1,44 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define SPOOL_SECTOR_SIZE 4096
+
+// Flash access used by the spool, offsets are relative to the start of the spool area
+typedef struct {
+    esp_err_t (*read)(void* ctx, uint32_t offset, void* dst, size_t len);
+    esp_err_t (*write)(void* ctx, uint32_t offset, const void* src, size_t len);
+    esp_err_t (*erase_sector)(void* ctx, uint32_t offset);
+    void* ctx;
+    // multiple of SPOOL_SECTOR_SIZE, at least two sectors
+    uint32_t size;
+} spool_flash_t;
+
+// Position of a record in the log
+typedef struct {
+    uint32_t offset;
+} spool_pos_t;
+
+// Append-only ring log of records, the oldest sector is overwritten once the log is full
+typedef struct {
+    const spool_flash_t* flash;
+    spool_pos_t head;
+    spool_pos_t tail;
+    uint32_t next_seq;
+    uint32_t pending;
+    uint32_t dropped;
+} spool_t;
+
+// Recover head and tail from flash, records that were not consumed before the reboot are kept
+esp_err_t spool_init(spool_t* spool, const spool_flash_t* flash);
+esp_err_t spool_append(spool_t* spool, const void* data, uint16_t len);
+// Read the record at pos, next is set to the record after it; ESP_ERR_NOT_FOUND at the end of the log
+esp_err_t spool_read(const spool_t* spool, const spool_pos_t* pos, void* buf, size_t size, uint16_t* len, spool_pos_t* next);
+// Mark every record before pos as delivered
+esp_err_t spool_consume(spool_t* spool, const spool_pos_t* pos);
+bool spool_empty(const spool_t* spool);
+
+// Open the spool on the "spool" data partition (see partitions.csv)
+esp_err_t spool_open_partition(spool_t* spool);
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include "esp_partition.h"
+
+#include "spool.h"
+
+#define SPOOL_PARTITION_LABEL "spool"
+#define SPOOL_PARTITION_SUBTYPE 0x40
+
+static esp_err_t partition_read(void* ctx, uint32_t offset, void* dst, size_t len) {
+    return esp_partition_read((const esp_partition_t*) ctx, offset, dst, len);
+}
+
+static esp_err_t partition_write(void* ctx, uint32_t offset, const void* src, size_t len) {
+    return esp_partition_write((const esp_partition_t*) ctx, offset, src, len);
+}
+
+static esp_err_t partition_erase_sector(void* ctx, uint32_t offset) {
+    return esp_partition_erase_range((const esp_partition_t*) ctx, offset, SPOOL_SECTOR_SIZE);
+}
+
+static spool_flash_t spool_flash = {
+    .read = partition_read,
+    .write = partition_write,
+    .erase_sector = partition_erase_sector,
+};
+
+esp_err_t spool_open_partition(spool_t* spool) {
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, SPOOL_PARTITION_SUBTYPE, SPOOL_PARTITION_LABEL);
+    if (partition == NULL) {
+        printf("No spool partition found\n");
+        return ESP_ERR_NOT_FOUND;
+    }
+    spool_flash.ctx = (void*) partition;
+    spool_flash.size = partition->size - partition->size % SPOOL_SECTOR_SIZE;
+    return spool_init(spool, &spool_flash);
+}
@@ -0,0 +1,141 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_gatts_api.h"
+
+#include "status.h"
+#include "dlog.h"
+#include "conn.h"
+
+// notification header: type
+#define STATUS_HEADER_LEN 1
+// opcode and handle of the notification take 3 bytes of the mtu
+#define STATUS_ATT_OVERHEAD 3
+#define STATUS_MAX_LEN (ESP_GATT_MAX_MTU_SIZE - STATUS_ATT_OVERHEAD)
+// how long a response chunk waits for a congested connection before it is dropped
+#define STATUS_CONGEST_WAIT_MS 200
+#define STATUS_CONGEST_POLL_MS 10
+
+#define CCCD_NOTIFY 0x0001
+
+// set once on the bluetooth task before anybody can subscribe
+static esp_gatt_if_t status_gatts_if = ESP_GATT_IF_NONE;
+static uint16_t status_char_handle;
+
+void status_set_attr(esp_gatt_if_t gatts_if, uint16_t char_handle) {
+    status_gatts_if = gatts_if;
+    status_char_handle = char_handle;
+}
+
+esp_gatt_status_t status_subscribe(uint16_t conn_id, const uint8_t* value, uint16_t len) {
+    if (len != 2) {
+        return ESP_GATT_INVALID_ATTR_LEN;
+    }
+    uint16_t config = value[0] | (value[1] << 8);
+    conn_set_subscribed(conn_id, config & CCCD_NOTIFY);
+    DLOG(DLOG_INFO, "Status notifications %s for connection %d\n", (config & CCCD_NOTIFY) ? "enabled" : "disabled", conn_id);
+    return ESP_GATT_OK;
+}
+
+size_t status_config_encode(uint16_t conn_id, uint8_t* out, size_t size) {
+    conn_t conn;
+    int slot = conn_slot(conn_id);
+    uint16_t config = slot >= 0 && conn_get(slot, &conn) && conn.subscribed ? CCCD_NOTIFY : 0;
+    if (size < 2) {
+        return 0;
+    }
+    out[0] = config & 0xFF;
+    out[1] = config >> 8;
+    return 2;
+}
+
+// Send a notification to a connection, returns false if it isn't subscribed or it couldn't be sent
+static bool status_notify(const conn_t* conn, uint8_t* value, uint16_t len) {
+    if (!conn->subscribed || status_gatts_if == ESP_GATT_IF_NONE) {
+        return false;
+    }
+    // the value is copied by the stack, so it can live on the stack of the caller
+    return esp_ble_gatts_send_indicate(status_gatts_if, conn->conn_id, status_char_handle, len, value, false) == ESP_OK;
+}
+
+static void status_notify_conn(uint16_t conn_id, uint8_t* value, uint16_t len) {
+    conn_t conn;
+    int slot = conn_slot(conn_id);
+    if (slot >= 0 && conn_get(slot, &conn)) {
+        status_notify(&conn, value, len);
+    }
+}
+
+static void status_notify_all(uint32_t conns, uint8_t* value, uint16_t len) {
+    conn_t conn;
+    for (int slot = 0; slot < CONN_MAX; slot++) {
+        if ((conns & (1u << slot)) && conn_get(slot, &conn)) {
+            status_notify(&conn, value, len);
+        }
+    }
+}
+
+static void put_le(uint8_t* out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+void status_message(uint16_t conn_id, status_type_t type, uint32_t seq) {
+    uint8_t value[STATUS_HEADER_LEN + 4];
+    value[0] = type;
+    put_le(value + STATUS_HEADER_LEN, seq, 4);
+    status_notify_conn(conn_id, value, type == STATUS_DROPPED ? STATUS_HEADER_LEN : sizeof(value));
+}
+
+void status_range(uint32_t conns, status_type_t type, uint32_t first_seq, uint32_t last_seq, uint16_t http_status) {
+    uint8_t value[STATUS_HEADER_LEN + 10];
+    value[0] = type;
+    put_le(value + STATUS_HEADER_LEN, first_seq, 4);
+    put_le(value + STATUS_HEADER_LEN + 4, last_seq, 4);
+    put_le(value + STATUS_HEADER_LEN + 8, http_status, 2);
+    status_notify_all(conns, value, type == STATUS_SENT || type == STATUS_FAILED ? sizeof(value) : sizeof(value) - 2);
+}
+
+void status_lost(uint16_t conn_id, uint16_t expected_seq, uint16_t seq) {
+    uint8_t value[STATUS_HEADER_LEN + 4];
+    value[0] = STATUS_LOST;
+    put_le(value + STATUS_HEADER_LEN, expected_seq, 2);
+    put_le(value + STATUS_HEADER_LEN + 2, seq, 2);
+    status_notify_conn(conn_id, value, sizeof(value));
+}
+
+// Stream data to one connection in notifications of its mtu
+static void status_response_conn(int slot, const char* data, size_t len) {
+    static uint8_t value[STATUS_MAX_LEN];
+    conn_t conn;
+    value[0] = STATUS_RESPONSE;
+    while (len > 0 && conn_get(slot, &conn) && conn.subscribed) {
+        // a notification has to fit into a single packet of the negotiated mtu
+        size_t chunk = conn.mtu - STATUS_ATT_OVERHEAD - STATUS_HEADER_LEN;
+        if (chunk > len) {
+            chunk = len;
+        }
+        for (int waited = 0; conn.congested && waited < STATUS_CONGEST_WAIT_MS; waited += STATUS_CONGEST_POLL_MS) {
+            vTaskDelay(pdMS_TO_TICKS(STATUS_CONGEST_POLL_MS));
+            if (!conn_get(slot, &conn)) {
+                return;
+            }
+        }
+        memcpy(value + STATUS_HEADER_LEN, data, chunk);
+        if (!status_notify(&conn, value, STATUS_HEADER_LEN + chunk)) {
+            DLOG(DLOG_WARN, "Couldn't notify response chunk\n");
+            return;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+void status_response(uint32_t conns, const char* data, size_t len) {
+    for (int slot = 0; slot < CONN_MAX; slot++) {
+        if (conns & (1u << slot)) {
+            status_response_conn(slot, data, len);
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_gatt_defs.h"
+
+// Every notification of the status characteristic starts with its type, sequence numbers are
+// the (32 bit, little endian) uplink sequence numbers of the messages, see frame.h
+typedef enum {
+    // seq: message was queued for the uplink
+    STATUS_QUEUED = 1,
+    // no seq: message couldn't be queued and was dropped
+    STATUS_DROPPED = 2,
+    // first seq, last seq, http status (16 bit): messages were posted; numeric messages folded into
+    // window summaries (see aggregate.h) once the last summary of their window step was
+    STATUS_SENT = 3,
+    // first seq, last seq: messages are kept in flash until they can be posted
+    STATUS_SPOOLED = 4,
+    // first seq, last seq, http status (16 bit, 0 without answer): messages could neither be posted nor spooled
+    STATUS_FAILED = 5,
+    // chunk of the server response, sent as it arrives and before the STATUS_SENT of the request
+    STATUS_RESPONSE = 6,
+    // expected and received bulk packet number (16 bit each): packets of a bulk stream went missing
+    STATUS_LOST = 7,
+} status_type_t;
+
+// Set the characteristic notifications are sent on (called once it is added)
+void status_set_attr(esp_gatt_if_t gatts_if, uint16_t char_handle);
+// Handle a write to the client configuration descriptor of the characteristic
+esp_gatt_status_t status_subscribe(uint16_t conn_id, const uint8_t* value, uint16_t len);
+// Encode the client configuration of the connection for a read of the descriptor, returns its length
+size_t status_config_encode(uint16_t conn_id, uint8_t* out, size_t size);
+
+// Notify subscribed clients, these can be called from any task. Results of a batch are sent per run
+// (see seq_run.h) to its connection: they hold for all of its messages from first to last seq
+void status_message(uint16_t conn_id, status_type_t type, uint32_t seq);
+void status_range(uint32_t conns, status_type_t type, uint32_t first_seq, uint32_t last_seq, uint16_t http_status);
+void status_lost(uint16_t conn_id, uint16_t expected_seq, uint16_t seq);
+// Stream data in chunks that fit into a notification
+void status_response(uint32_t conns, const char* data, size_t len);
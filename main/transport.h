@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Called with every chunk of the response body as it arrives
+typedef void (*transport_response_cb_t)(const char* data, size_t len);
+
+// One way of getting a batch to the server, selected with uplink_set_transport (see uplink.h)
+typedef struct {
+    const char* name;
+    // Send body, called on the posting task only; returns ESP_OK once the server answered, with its
+    // (http style) status code in *status
+    esp_err_t (*post)(const char* body, size_t len, transport_response_cb_t on_response, int* status);
+    // Mark the connection as dead (called on wifi loss from any task), it is torn down before the next post
+    void (*invalidate)(void);
+    // false while the transport can't be used (not configured), NULL for always available
+    bool (*available)(void);
+} transport_t;
+
+// https POST to CONFIG_UPLINK_POST_URL over a kept-alive connection, see transport_http.c
+extern const transport_t transport_http;
+// confirmable CoAP POST over udp to CONFIG_UPLINK_COAP_HOST, see transport_coap.c
+extern const transport_t transport_coap;
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "sdkconfig.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+
+#include "transport.h"
+#include "batch.h"
+#include "latency.h"
+#include "memstat.h"
+
+// a single confirmable POST per batch (RFC 7252), the piggybacked (or separate) response is
+// handed on like the body of an http response
+#define COAP_HOST CONFIG_UPLINK_COAP_HOST
+#define COAP_PORT CONFIG_UPLINK_COAP_PORT
+// the batch format picks the resource, both are octet streams to CoAP
+#if BATCH_BINARY
+#define COAP_PATH "frames"
+#else
+#define COAP_PATH "ndjson"
+#endif
+
+#define COAP_VERSION 1
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_NON 1
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+#define COAP_CODE_EMPTY 0x00
+#define COAP_CODE_POST 0x02
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_FORMAT_OCTET_STREAM 42
+#define COAP_PAYLOAD_MARKER 0xFF
+#define COAP_TOKEN_LEN 4
+#define COAP_HEADER_LEN 4
+
+// retransmission timing of RFC 7252 without the random factor: 2, 4, 8, 16 s
+#define COAP_ACK_TIMEOUT_MS 2000
+#define COAP_MAX_RETRANSMIT 3
+// how long we wait for a separate response once the request was acknowledged
+#define COAP_RESPONSE_TIMEOUT_MS 10000
+// spool drains are the largest bodies, bigger datagrams than the mtu are fragmented by ip
+#define COAP_MAX_PAYLOAD 4096
+#define COAP_MAX_MESSAGE (COAP_HEADER_LEN + COAP_TOKEN_LEN + 16 + 1 + COAP_MAX_PAYLOAD)
+// responses are short acknowledgements, longer ones are cut off
+#define COAP_MAX_RESPONSE 1024
+
+// only used from the posting task, the wifi event handler just sets coap_stale
+static int coap_socket = -1;
+static volatile bool coap_stale = false;
+static uint16_t coap_message_id;
+static uint8_t coap_buf[COAP_MAX_MESSAGE];
+static uint8_t coap_rx_buf[COAP_MAX_RESPONSE];
+
+// Return the socket connected to the server, (re-)creating it if there is none or the old one is stale
+static int coap_get_socket() {
+    if (coap_stale) {
+        coap_stale = false;
+        if (coap_socket >= 0) {
+            printf("Closing stale coap socket\n");
+            close(coap_socket);
+            coap_socket = -1;
+        }
+    }
+    if (coap_socket >= 0) {
+        return coap_socket;
+    }
+    if (strlen(COAP_HOST) == 0) {
+        printf("No coap host configured\n");
+        return -1;
+    }
+
+    char port[8];
+    snprintf(port, sizeof(port), "%d", COAP_PORT);
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo* addr = NULL;
+    if (getaddrinfo(COAP_HOST, port, &hints, &addr) != 0 || addr == NULL) {
+        printf("Couldn't resolve %s\n", COAP_HOST);
+        return -1;
+    }
+    int sock = socket(addr->ai_family, addr->ai_socktype, 0);
+    // a connected udp socket only receives datagrams from the server
+    if (sock >= 0 && connect(sock, addr->ai_addr, addr->ai_addrlen) != 0) {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addr);
+    if (sock < 0) {
+        printf("Error during socket-creation\n");
+        return -1;
+    }
+    // a fresh random start makes it unlikely that the server takes our first message for a duplicate
+    coap_message_id = esp_random();
+    coap_socket = sock;
+    return coap_socket;
+}
+
+// Write an option following the one numbered *last, only deltas and lengths below 13 are needed here
+static size_t coap_put_option(uint8_t* out, uint16_t* last, uint16_t number, const void* value, size_t len) {
+    out[0] = ((number - *last) << 4) | len;
+    memcpy(out + 1, value, len);
+    *last = number;
+    return 1 + len;
+}
+
+// Encode a confirmable POST of body into coap_buf, returns its size or 0 if body is too large
+static size_t coap_encode(uint16_t id, uint32_t token, const char* body, size_t len) {
+    if (len > COAP_MAX_PAYLOAD) {
+        return 0;
+    }
+    uint8_t* out = coap_buf;
+    *out++ = (COAP_VERSION << 6) | (COAP_TYPE_CON << 4) | COAP_TOKEN_LEN;
+    *out++ = COAP_CODE_POST;
+    *out++ = id >> 8;
+    *out++ = id & 0xFF;
+    memcpy(out, &token, COAP_TOKEN_LEN);
+    out += COAP_TOKEN_LEN;
+    uint16_t last = 0;
+    out += coap_put_option(out, &last, COAP_OPTION_URI_PATH, COAP_PATH, strlen(COAP_PATH));
+    uint8_t format = COAP_FORMAT_OCTET_STREAM;
+    out += coap_put_option(out, &last, COAP_OPTION_CONTENT_FORMAT, &format, 1);
+    if (len > 0) {
+        *out++ = COAP_PAYLOAD_MARKER;
+        memcpy(out, body, len);
+        out += len;
+    }
+    return out - coap_buf;
+}
+
+// Read the 0, 1 or 2 extra bytes of an option delta or length nibble, returns false if msg ends early
+static bool coap_option_value(uint8_t nibble, const uint8_t** pos, const uint8_t* end, uint32_t* value) {
+    if (nibble < 13) {
+        *value = nibble;
+    } else if (nibble == 13 && *pos < end) {
+        *value = 13 + *(*pos)++;
+    } else if (nibble == 14 && *pos + 1 < end) {
+        *value = 269 + ((*pos)[0] << 8 | (*pos)[1]);
+        *pos += 2;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Find the payload of a received message behind its options, returns false if it is malformed
+static bool coap_payload(const uint8_t* msg, size_t len, const uint8_t** payload, size_t* payload_len) {
+    const uint8_t* pos = msg + COAP_HEADER_LEN + (msg[0] & 0x0F);
+    const uint8_t* end = msg + len;
+    while (pos < end && *pos != COAP_PAYLOAD_MARKER) {
+        uint8_t head = *pos++;
+        uint32_t delta, option_len;
+        if (!coap_option_value(head >> 4, &pos, end, &delta) || !coap_option_value(head & 0x0F, &pos, end, &option_len)) {
+            return false;
+        }
+        if (option_len > (size_t) (end - pos)) {
+            return false;
+        }
+        pos += option_len;
+    }
+    // a marker has to be followed by a payload
+    if (pos < end) {
+        pos++;
+        if (pos == end) {
+            return false;
+        }
+    }
+    *payload = pos;
+    *payload_len = end - pos;
+    return true;
+}
+
+// Acknowledge a confirmable separate response, it isn't resent then
+static void coap_send_ack(int sock, uint16_t id) {
+    uint8_t ack[COAP_HEADER_LEN] = {(COAP_VERSION << 6) | (COAP_TYPE_ACK << 4), COAP_CODE_EMPTY, id >> 8, id & 0xFF};
+    send(sock, ack, sizeof(ack), 0);
+}
+
+// Hand on a response (code c.dd is reported as status c*100+dd), returns false if it is malformed
+static bool coap_handle_response(const uint8_t* msg, size_t len, transport_response_cb_t on_response, int* status) {
+    const uint8_t* payload;
+    size_t payload_len;
+    if (!coap_payload(msg, len, &payload, &payload_len)) {
+        return false;
+    }
+    *status = (msg[1] >> 5) * 100 + (msg[1] & 0x1F);
+    printf("Coap post finished with %d.%02d\n", msg[1] >> 5, msg[1] & 0x1F);
+    if (payload_len > 0 && on_response != NULL) {
+        on_response((const char*) payload, payload_len);
+    }
+    return true;
+}
+
+static esp_err_t coap_post(const char* body, size_t len, transport_response_cb_t on_response, int* status) {
+    int sock = coap_get_socket();
+    if (sock < 0) {
+        return ESP_FAIL;
+    }
+    uint16_t id = ++coap_message_id;
+    uint32_t token = esp_random();
+    size_t message_len = coap_encode(id, token, body, len);
+    if (message_len == 0) {
+        printf("Body of %zu bytes is too large for coap\n", len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint32_t started_ms = latency_now_ms();
+    uint32_t sent_ms = started_ms;
+    uint32_t timeout_ms = COAP_ACK_TIMEOUT_MS;
+    bool acked = false;
+    for (int attempt = 0; attempt <= COAP_MAX_RETRANSMIT; attempt++) {
+        if (!acked) {
+            if (send(sock, coap_buf, message_len, 0) < 0) {
+                printf("Coap send failed: %d\n", errno);
+                coap_stale = true;
+                return ESP_FAIL;
+            }
+            sent_ms = latency_now_ms();
+            if (attempt == 0) {
+                latency_record_since(LATENCY_REQUEST, started_ms);
+            }
+        }
+        uint32_t waiting_since = latency_now_ms();
+        while (latency_now_ms() - waiting_since < timeout_ms) {
+            uint32_t left_ms = timeout_ms - (latency_now_ms() - waiting_since);
+            struct timeval tv = {.tv_sec = left_ms / 1000, .tv_usec = (left_ms % 1000) * 1000};
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            int received = recv(sock, coap_rx_buf, sizeof(coap_rx_buf), 0);
+            if (received < 0) {
+                break;
+            }
+            if (received < COAP_HEADER_LEN || (coap_rx_buf[0] >> 6) != COAP_VERSION || (coap_rx_buf[0] & 0x0F) > 8
+                || received < COAP_HEADER_LEN + (coap_rx_buf[0] & 0x0F)) {
+                continue;
+            }
+            uint8_t type = (coap_rx_buf[0] >> 4) & 0x03;
+            uint16_t received_id = coap_rx_buf[2] << 8 | coap_rx_buf[3];
+            bool own_token = (coap_rx_buf[0] & 0x0F) == COAP_TOKEN_LEN && memcmp(coap_rx_buf + COAP_HEADER_LEN, &token, COAP_TOKEN_LEN) == 0;
+
+            if ((type == COAP_TYPE_ACK || type == COAP_TYPE_RST) && received_id != id) {
+                // late answer to an earlier request
+                continue;
+            }
+            if (type == COAP_TYPE_RST) {
+                printf("Coap post was rejected\n");
+                return ESP_FAIL;
+            }
+            if (type == COAP_TYPE_ACK && coap_rx_buf[1] == COAP_CODE_EMPTY) {
+                // the server answers later in a message of its own
+                acked = true;
+                timeout_ms = COAP_RESPONSE_TIMEOUT_MS;
+                waiting_since = latency_now_ms();
+                continue;
+            }
+            if (type == COAP_TYPE_CON && own_token) {
+                coap_send_ack(sock, received_id);
+            }
+            if ((type == COAP_TYPE_ACK || own_token) && coap_handle_response(coap_rx_buf, received, on_response, status)) {
+                latency_record_since(LATENCY_RESPONSE, sent_ms);
+                memstat_sample(MEMSTAT_POST);
+                return ESP_OK;
+            }
+        }
+        if (acked) {
+            break;
+        }
+        printf("No coap ack after %" PRIu32 " ms\n", timeout_ms);
+        timeout_ms *= 2;
+    }
+    return ESP_ERR_TIMEOUT;
+}
+
+static void coap_invalidate(void) {
+    coap_stale = true;
+}
+
+// without a host every post would fail, so the transport can't be selected
+static bool coap_available(void) {
+    return strlen(COAP_HOST) > 0;
+}
+
+const transport_t transport_coap = {
+    .name = "coap",
+    .post = coap_post,
+    .invalidate = coap_invalidate,
+    .available = coap_available,
+};
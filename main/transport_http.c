@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "esp_http_client.h"
+
+#include "transport.h"
+#include "dlog.h"
+#include "batch.h"
+#include "deflate.h"
+#include "latency.h"
+#include "memstat.h"
+
+#define POST_URL CONFIG_UPLINK_POST_URL
+#define POST_PORT 80
+#define UPLINK_TIMEOUT_MS 10000
+// seconds of idle time before tcp keep-alive probes are sent
+#define UPLINK_KEEP_ALIVE_IDLE 5
+// a kept-alive connection might have been closed by the server, so we retry once on a fresh one
+#define UPLINK_MAX_ATTEMPTS 2
+// bodies of at least this size are sent deflate compressed (0 disables compression)
+#define UPLINK_COMPRESS_MIN_BYTES 256
+// largest body we compress, bigger ones (and ones that don't shrink) are sent as they are
+#define UPLINK_COMPRESS_MAX_BYTES 4096
+// the latency histograms and memory minima ride along (as hex in X-Latency and X-Memory headers) at most this often (0 disables)
+#define UPLINK_LATENCY_REPORT_MS 60000
+
+// only used from the posting task, the wifi event handler just sets uplink_stale
+static esp_http_client_handle_t uplink_client = NULL;
+static volatile bool uplink_stale = false;
+// handler of the request in flight, set by http_post
+static transport_response_cb_t uplink_response_handler = NULL;
+// when the current request was started and its headers were sent, for the latency histograms
+static uint32_t uplink_started_ms;
+static uint32_t uplink_sent_ms;
+static uint32_t uplink_reported_ms = 0;
+static bool uplink_reported = false;
+
+static esp_err_t http_event_handler(esp_http_client_event_handle_t event) {
+    switch (event->event_id) {
+        case HTTP_EVENT_ON_CONNECTED:
+            DLOG(DLOG_INFO, "Successfully connected\n");
+            latency_record_since(LATENCY_CONNECT, uplink_started_ms);
+            memstat_sample(MEMSTAT_TLS_HANDSHAKE);
+            break;
+        case HTTP_EVENT_HEADERS_SENT:
+            latency_record_since(LATENCY_REQUEST, uplink_started_ms);
+            uplink_sent_ms = latency_now_ms();
+            break;
+        case HTTP_EVENT_ON_FINISH:
+            latency_record_since(LATENCY_RESPONSE, uplink_sent_ms);
+            break;
+        case HTTP_EVENT_DISCONNECTED:
+            DLOG(DLOG_INFO, "Disconnected\n");
+            break;
+        case HTTP_EVENT_ON_DATA:
+            DLOG_STR(DLOG_DEBUG, "HTTP_EVENT_ON_DATA: %.*s\n", (char *)event->data, event->data_len);
+            if (uplink_response_handler != NULL) {
+                uplink_response_handler(event->data, event->data_len);
+            }
+            break;
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+// Return the long-lived client, (re-)creating it if there is none or the old one is stale
+static esp_http_client_handle_t uplink_get_client() {
+    if (uplink_stale) {
+        uplink_stale = false;
+        if (uplink_client != NULL) {
+            printf("Tearing down stale uplink client\n");
+            esp_http_client_cleanup(uplink_client);
+            uplink_client = NULL;
+        }
+    }
+    if (uplink_client != NULL) {
+        return uplink_client;
+    }
+
+    esp_http_client_config_t http_config = {
+        .url = POST_URL,
+        .port = POST_PORT,
+        .method = HTTP_METHOD_POST,
+        .timeout_ms = UPLINK_TIMEOUT_MS,
+        .event_handler = http_event_handler,
+        .keep_alive_enable = true,
+        .keep_alive_idle = UPLINK_KEEP_ALIVE_IDLE,
+        // keep the tls session ticket, so a reconnect only needs an abbreviated handshake
+        .save_client_session = true,
+    };
+    uplink_client = esp_http_client_init(&http_config);
+    if (uplink_client == NULL) {
+        printf("Error during client-creation\n");
+        return NULL;
+    }
+    // headers are kept across requests, so they only need to be set once
+    esp_http_client_set_header(uplink_client, "Content-Type", BATCH_CONTENT_TYPE);
+    return uplink_client;
+}
+
+// Compress body into a static buffer, returns the compressed size or 0 if it is sent uncompressed
+static size_t uplink_compress(const char* body, size_t len, const uint8_t** compressed) {
+    static uint8_t compress_buf[UPLINK_COMPRESS_MAX_BYTES];
+    if (UPLINK_COMPRESS_MIN_BYTES == 0 || len < UPLINK_COMPRESS_MIN_BYTES || len > UPLINK_COMPRESS_MAX_BYTES) {
+        return 0;
+    }
+    // anything that doesn't save space isn't worth the decompression on the other side
+    size_t compressed_len = deflate_compress((const uint8_t*) body, len, compress_buf, len - 1);
+    if (compressed_len == 0) {
+        return 0;
+    }
+    printf("Compressed body from %zu to %zu bytes\n", len, compressed_len);
+    *compressed = compress_buf;
+    return compressed_len;
+}
+
+// Set header to the hex of what encode writes (at most max bytes)
+static void uplink_set_hex_header(esp_http_client_handle_t client, const char* header, size_t (*encode)(uint8_t*, size_t), size_t max) {
+    static char report[(LATENCY_ENCODED_MAX > MEMSTAT_ENCODED_MAX ? LATENCY_ENCODED_MAX : MEMSTAT_ENCODED_MAX) * 2 + 1];
+    uint8_t encoded[sizeof(report) / 2];
+    size_t len = encode(encoded, max);
+    for (size_t i = 0; i < len; i++) {
+        sprintf(report + 2 * i, "%02x", encoded[i]);
+    }
+    report[2 * len] = '\0';
+    // the client copies the value
+    esp_http_client_set_header(client, header, report);
+}
+
+// Attach the latency histograms and memory minima to the request if the last report is long enough ago, returns whether it did
+static bool uplink_add_reports(esp_http_client_handle_t client) {
+    if (UPLINK_LATENCY_REPORT_MS == 0 || (uplink_reported && latency_now_ms() - uplink_reported_ms < UPLINK_LATENCY_REPORT_MS)) {
+        esp_http_client_delete_header(client, "X-Latency");
+        esp_http_client_delete_header(client, "X-Memory");
+        return false;
+    }
+    uplink_set_hex_header(client, "X-Latency", latency_encode, LATENCY_ENCODED_MAX);
+    uplink_set_hex_header(client, "X-Memory", memstat_encode, MEMSTAT_ENCODED_MAX);
+    return true;
+}
+
+// Post body (deflate compressed if it is large enough), reusing the kept-alive connection (and tls session) where possible
+static esp_err_t http_post(const char* body, size_t len, transport_response_cb_t on_response, int* status) {
+    esp_err_t err = ESP_FAIL;
+    uplink_response_handler = on_response;
+    const uint8_t* compressed = NULL;
+    size_t compressed_len = uplink_compress(body, len, &compressed);
+    for (int attempt = 0; attempt < UPLINK_MAX_ATTEMPTS; attempt++) {
+        esp_http_client_handle_t client = uplink_get_client();
+        if (client == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+        // the client keeps its headers, so the encoding has to be set (or removed) on every request
+        if (compressed_len > 0) {
+            esp_http_client_set_header(client, "Content-Encoding", "deflate");
+            esp_http_client_set_post_field(client, (const char*) compressed, compressed_len);
+        } else {
+            esp_http_client_delete_header(client, "Content-Encoding");
+            esp_http_client_set_post_field(client, body, len);
+        }
+
+        bool reporting = uplink_add_reports(client);
+
+        printf("posting...\n");
+        uplink_started_ms = latency_now_ms();
+        err = esp_http_client_perform(client);
+        memstat_sample(MEMSTAT_POST);
+        if (err == ESP_OK) {
+            *status = esp_http_client_get_status_code(client);
+            printf("Post finished with status %d\n", *status);
+            if (reporting) {
+                uplink_reported = true;
+                uplink_reported_ms = latency_now_ms();
+            }
+            return ESP_OK;
+        }
+        printf("Post failed: %s\n", esp_err_to_name(err));
+        // drop the (probably closed) connection, the next perform reconnects and resumes the tls session
+        esp_http_client_close(client);
+    }
+    return err;
+}
+
+static void http_invalidate(void) {
+    uplink_stale = true;
+}
+
+const transport_t transport_http = {
+    .name = "http",
+    .post = http_post,
+    .invalidate = http_invalidate,
+};
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "uplink.h"
+
+// indexed by uplink_transport_id_t
+static const transport_t* const uplink_transports[UPLINK_TRANSPORT_COUNT] = {
+    [UPLINK_TRANSPORT_HTTP] = &transport_http,
+    [UPLINK_TRANSPORT_COAP] = &transport_coap,
+};
+
+// written by the bluetooth task, read once per post by the posting task
+static volatile uplink_transport_id_t uplink_transport = UPLINK_TRANSPORT_HTTP;
+static uplink_response_cb_t uplink_response_handler = NULL;
+static int uplink_last_status = 0;
+
+esp_err_t uplink_post(const char* body, size_t len) {
+    const transport_t* transport = uplink_transports[uplink_transport];
+    printf("Posting %zu bytes via %s\n", len, transport->name);
+    int status = 0;
+    esp_err_t err = transport->post(body, len, uplink_response_handler, &status);
+    // no answer, no status
+    uplink_last_status = err == ESP_OK ? status : 0;
+    if (err != ESP_OK) {
+        return err;
+    }
+    // an answer alone doesn't mean the batch arrived, a rejected one has to stay (spooled)
+    if (status < 200 || status > 299) {
+        printf("Server rejected the post with status %d\n", status);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_OK;
+}
+
+void uplink_invalidate(void) {
+    for (int i = 0; i < UPLINK_TRANSPORT_COUNT; i++) {
+        uplink_transports[i]->invalidate();
+    }
+}
+
+void uplink_set_response_handler(uplink_response_cb_t handler) {
+    uplink_response_handler = handler;
+}
+
+int uplink_status_code(void) {
+    return uplink_last_status;
+}
+
+bool uplink_set_transport(uplink_transport_id_t id) {
+    if (id >= UPLINK_TRANSPORT_COUNT) {
+        return false;
+    }
+    if (uplink_transports[id]->available != NULL && !uplink_transports[id]->available()) {
+        printf("Uplink %s isn't configured\n", uplink_transports[id]->name);
+        return false;
+    }
+    if (id != uplink_transport) {
+        printf("Switching uplink to %s\n", uplink_transports[id]->name);
+        // the connection of the old transport isn't needed anymore, drop it before its next use
+        uplink_transports[uplink_transport]->invalidate();
+        uplink_transport = id;
+    }
+    return true;
+}
+
+uplink_transport_id_t uplink_get_transport(void) {
+    return uplink_transport;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "transport.h"
+
+// transports the batches can be sent with, the value written to the transport characteristic
+typedef enum {
+    UPLINK_TRANSPORT_HTTP = 0,
+    UPLINK_TRANSPORT_COAP = 1,
+    UPLINK_TRANSPORT_COUNT,
+} uplink_transport_id_t;
+
+// Post body with the selected transport, ESP_OK only if the server took it (a 2xx status);
+// ESP_ERR_INVALID_RESPONSE if it answered with any other status
+esp_err_t uplink_post(const char* body, size_t len);
+// Mark the uplink connections as dead (called on wifi loss), they are torn down before the next post
+void uplink_invalidate(void);
+// Called (on the posting task) with every chunk of the response body as it arrives
+typedef transport_response_cb_t uplink_response_cb_t;
+void uplink_set_response_handler(uplink_response_cb_t handler);
+// (http style) status the last post was answered with, 0 if it got no answer
+int uplink_status_code(void);
+// Select the transport used from the next post on (may be called from any task), false for unknown ids
+// and transports that aren't configured (CoAP without CONFIG_UPLINK_COAP_HOST)
+bool uplink_set_transport(uplink_transport_id_t id);
+uplink_transport_id_t uplink_get_transport(void);
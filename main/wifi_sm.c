@@ -0,0 +1,166 @@
+#include <string.h>
+
+#include "wifi_sm.h"
+
+void wifi_sm_init(wifi_sm_t* sm, uint32_t seed) {
+    memset(sm, 0, sizeof(*sm));
+    sm->state = WIFI_SM_IDLE;
+    sm->random = seed != 0 ? seed : 1;
+    sm->boot_to_ip = -1;
+    sm->last_reconnect_to_ip = -1;
+}
+
+// xorshift32, good enough for jitter
+static uint32_t next_random(wifi_sm_t* sm) {
+    uint32_t x = sm->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sm->random = x;
+    return x;
+}
+
+static uint32_t backoff_delay(wifi_sm_t* sm) {
+    uint32_t delay = WIFI_BACKOFF_MIN_MS;
+    for (int i = 1; i < sm->failures && delay < WIFI_BACKOFF_MAX_MS; i++) {
+        delay *= 2;
+    }
+    if (delay > WIFI_BACKOFF_MAX_MS) {
+        delay = WIFI_BACKOFF_MAX_MS;
+    }
+    uint32_t jitter = delay * WIFI_BACKOFF_JITTER_PERCENT / 100;
+    return delay - jitter + next_random(sm) % (2 * jitter + 1);
+}
+
+static wifi_sm_action_t connect_attempt(wifi_sm_t* sm) {
+    // the cached bssid/channel is only tried first, a failure falls back to a full scan
+    bool fast = sm->fast_available && sm->failures == 0;
+    sm->state = WIFI_SM_CONNECTING;
+    sm->last_attempt_fast = fast;
+    return (wifi_sm_action_t) { .kind = WIFI_SM_ACT_CONNECT, .rank = sm->rank, .fast = fast };
+}
+
+static wifi_sm_action_t start_or_connect(wifi_sm_t* sm) {
+    if (!sm->started) {
+        sm->state = WIFI_SM_STARTING;
+        return (wifi_sm_action_t) { .kind = WIFI_SM_ACT_START };
+    }
+    return connect_attempt(sm);
+}
+
+static wifi_sm_action_t handle_disconnect(wifi_sm_t* sm, int64_t now) {
+    switch (sm->state) {
+        case WIFI_SM_GOT_IP:
+        case WIFI_SM_ASSOCIATED:
+            // lost a working connection, try again right away
+            sm->disconnected_at = now;
+            sm->failures = 0;
+            return connect_attempt(sm);
+        case WIFI_SM_DISCONNECTING:
+            return connect_attempt(sm);
+        case WIFI_SM_PARKING:
+            sm->state = WIFI_SM_IDLE;
+            return (wifi_sm_action_t) { .kind = WIFI_SM_ACT_NONE };
+        case WIFI_SM_CONNECTING:
+            sm->failures++;
+            if (sm->last_attempt_fast) {
+                // the cached ap is gone or moved, scan immediately instead of waiting
+                return connect_attempt(sm);
+            }
+            if (sm->network_count > 1) {
+                sm->rank = (sm->rank + 1) % sm->network_count;
+            }
+            sm->state = WIFI_SM_BACKOFF;
+            return (wifi_sm_action_t) { .kind = WIFI_SM_ACT_WAIT, .delay_ms = backoff_delay(sm) };
+        default:
+            return (wifi_sm_action_t) { .kind = WIFI_SM_ACT_NONE };
+    }
+}
+
+wifi_sm_action_t wifi_sm_handle(wifi_sm_t* sm, wifi_sm_event_t event, int64_t now) {
+    wifi_sm_action_t none = { .kind = WIFI_SM_ACT_NONE };
+    switch (event) {
+        case WIFI_SM_EV_CONNECT_REQUEST:
+            if (sm->state == WIFI_SM_PARKING) {
+                // wanted again before the disconnect went through, reconnect once it did
+                sm->state = WIFI_SM_DISCONNECTING;
+                return none;
+            }
+            // anything but idle means a connection is there or on its way
+            if (sm->state != WIFI_SM_IDLE) {
+                return none;
+            }
+            return start_or_connect(sm);
+        case WIFI_SM_EV_CREDENTIALS_CHANGED:
+            sm->rank = 0;
+            sm->failures = 0;
+            switch (sm->state) {
+                case WIFI_SM_CONNECTING:
+                case WIFI_SM_ASSOCIATED:
+                case WIFI_SM_GOT_IP:
+                    sm->state = WIFI_SM_DISCONNECTING;
+                    return (wifi_sm_action_t) { .kind = WIFI_SM_ACT_DISCONNECT };
+                case WIFI_SM_PARKING:
+                    sm->state = WIFI_SM_DISCONNECTING;
+                    return none;
+                case WIFI_SM_BACKOFF:
+                case WIFI_SM_IDLE:
+                    return start_or_connect(sm);
+                default:
+                    return none;
+            }
+        case WIFI_SM_EV_STARTED:
+            sm->started = true;
+            if (sm->state == WIFI_SM_STARTING) {
+                return connect_attempt(sm);
+            }
+            return none;
+        case WIFI_SM_EV_ASSOCIATED:
+            if (sm->state == WIFI_SM_CONNECTING) {
+                sm->state = WIFI_SM_ASSOCIATED;
+            }
+            return none;
+        case WIFI_SM_EV_GOT_IP:
+            if (sm->state == WIFI_SM_PARKING) {
+                // the disconnect is already on its way
+                return none;
+            }
+            sm->state = WIFI_SM_GOT_IP;
+            sm->failures = 0;
+            // the connected network is ranked first from now on
+            sm->rank = 0;
+            if (sm->boot_to_ip < 0) {
+                sm->boot_to_ip = now;
+            } else if (sm->disconnected_at > 0) {
+                sm->last_reconnect_to_ip = now - sm->disconnected_at;
+                sm->reconnects++;
+                sm->disconnected_at = 0;
+            }
+            return none;
+        case WIFI_SM_EV_DISCONNECTED:
+            return handle_disconnect(sm, now);
+        case WIFI_SM_EV_BACKOFF_EXPIRED:
+            if (sm->state == WIFI_SM_BACKOFF) {
+                return connect_attempt(sm);
+            }
+            return none;
+        case WIFI_SM_EV_PARK_REQUEST:
+            sm->failures = 0;
+            switch (sm->state) {
+                case WIFI_SM_CONNECTING:
+                case WIFI_SM_ASSOCIATED:
+                case WIFI_SM_GOT_IP:
+                case WIFI_SM_DISCONNECTING:
+                    sm->state = WIFI_SM_PARKING;
+                    return (wifi_sm_action_t) { .kind = WIFI_SM_ACT_DISCONNECT };
+                case WIFI_SM_STARTING:
+                case WIFI_SM_BACKOFF:
+                    // nothing to disconnect, the caller stops the backoff timer (it would be ignored anyway)
+                    sm->state = WIFI_SM_IDLE;
+                    return none;
+                default:
+                    return none;
+            }
+    }
+    return none;
+}
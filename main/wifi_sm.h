@@ -0,0 +1,73 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// first retry after this long, doubled (with jitter) for every further failure
+#define WIFI_BACKOFF_MIN_MS 500
+#define WIFI_BACKOFF_MAX_MS 60000
+// the delay is randomized by up to this percentage in both directions
+#define WIFI_BACKOFF_JITTER_PERCENT 25
+
+typedef enum {
+    WIFI_SM_IDLE,
+    WIFI_SM_STARTING,
+    WIFI_SM_CONNECTING,
+    // associated, waiting for an ip
+    WIFI_SM_ASSOCIATED,
+    WIFI_SM_GOT_IP,
+    WIFI_SM_DISCONNECTING,
+    WIFI_SM_BACKOFF,
+    // disconnecting on purpose, idle afterwards
+    WIFI_SM_PARKING,
+} wifi_sm_state_t;
+
+typedef enum {
+    WIFI_SM_EV_CONNECT_REQUEST,
+    // reconnect with the most recent credentials, even if we are connected
+    WIFI_SM_EV_CREDENTIALS_CHANGED,
+    WIFI_SM_EV_STARTED,
+    WIFI_SM_EV_ASSOCIATED,
+    WIFI_SM_EV_GOT_IP,
+    WIFI_SM_EV_DISCONNECTED,
+    WIFI_SM_EV_BACKOFF_EXPIRED,
+    // wifi isn't needed for now (see link_policy.h), the next connect request brings it back
+    WIFI_SM_EV_PARK_REQUEST,
+} wifi_sm_event_t;
+
+typedef enum {
+    WIFI_SM_ACT_NONE,
+    WIFI_SM_ACT_START,
+    WIFI_SM_ACT_CONNECT,
+    WIFI_SM_ACT_DISCONNECT,
+    // call back with WIFI_SM_EV_BACKOFF_EXPIRED after delay_ms
+    WIFI_SM_ACT_WAIT,
+} wifi_sm_action_kind_t;
+
+typedef struct {
+    wifi_sm_action_kind_t kind;
+    // CONNECT: rank of the stored network, and whether the cached bssid/channel should be used
+    int rank;
+    bool fast;
+    uint32_t delay_ms;
+} wifi_sm_action_t;
+
+// Connection state machine, it only decides; the caller executes the returned actions
+typedef struct {
+    wifi_sm_state_t state;
+    bool started;
+    // set by the caller if a bssid/channel is cached for the network at rank
+    bool fast_available;
+    bool last_attempt_fast;
+    int network_count;
+    int rank;
+    int failures;
+    uint32_t random;
+    // metrics, times in microseconds since boot
+    int64_t disconnected_at;
+    int64_t boot_to_ip;
+    int64_t last_reconnect_to_ip;
+    uint32_t reconnects;
+} wifi_sm_t;
+
+void wifi_sm_init(wifi_sm_t* sm, uint32_t seed);
+wifi_sm_action_t wifi_sm_handle(wifi_sm_t* sm, wifi_sm_event_t event, int64_t now);